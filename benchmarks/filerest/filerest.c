@@ -0,0 +1,286 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/procctl.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sls.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Restore throughput benchmark for the file backend. A child process maps
+ * and dirties a region of anonymous memory, which we checkpoint into a
+ * directory and then restore repeatedly, timing each restore. Without a
+ * directory the checkpoint goes to the SLOS instead, optionally compressed,
+ * and -c controls how compressible the dirtied pages are.
+ */
+
+#define OID (1000)
+#define RUNS (5)
+
+static void
+usage(void)
+{
+	printf("Usage: ./filerest [-d <directory>] [-s size in MB] "
+	       "[-p percent of pages dirtied] [-r restores] "
+	       "[-c percent of compressible pages] [-z]\n");
+	exit(0);
+}
+
+static long
+us_elapsed(struct timeval *start, struct timeval *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000L * 1000 +
+	    (end->tv_usec - start->tv_usec));
+}
+
+static uint64_t
+filerest_counter(const char *name)
+{
+	uint64_t val = 0;
+	size_t len = sizeof(val);
+
+	if (sysctlbyname(name, &val, &len, NULL, 0) != 0)
+		perror(name);
+
+	return (val);
+}
+
+/*
+ * Compressible pages hold text-like data with some noise in it, the rest
+ * hold random bytes. Either way no page is all zeroes.
+ */
+static void
+filerest_fill(char *page, size_t pagesize, bool compressible)
+{
+	static const char text[] = "struct vm_object *obj = bp->b_pages[i];\n";
+	size_t len = sizeof(text) - 1;
+	size_t i;
+
+	for (i = 0; i < pagesize; i++) {
+		if (compressible && (random() % 16) != 0)
+			page[i] = text[(i + (random() % 2)) % len];
+		else
+			page[i] = (char)random() | 1;
+	}
+}
+
+/* Dirty the requested fraction of the pages in the region, then wait. */
+static void
+filerest_child(int fd, size_t size, int percent, int cmppercent)
+{
+	size_t pagesize = getpagesize();
+	char ready = 1;
+	char *region;
+	size_t i;
+
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	for (i = 0; i < size / pagesize; i++) {
+		if ((random() % 100) >= percent)
+			continue;
+		filerest_fill(&region[i * pagesize], pagesize,
+		    (random() % 100) < cmppercent);
+	}
+
+	if (write(fd, &ready, sizeof(ready)) != sizeof(ready)) {
+		perror("write");
+		exit(1);
+	}
+
+	for (;;)
+		pause();
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct procctl_reaper_kill rk;
+	struct timeval start, end;
+	uint64_t cmpin = 0, cmpout = 0;
+	struct sls_attr attr;
+	bool compress = false;
+	int cmppercent = 100;
+	int percent = 100;
+	int runs = RUNS;
+	char *dir = NULL;
+	size_t size = 1024;
+	int fds[2];
+	int dirfd = -1;
+	char ready;
+	pid_t pid;
+	long us;
+	int error;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "c:d:p:r:s:z")) != -1) {
+		switch (opt) {
+		case 'c':
+			cmppercent = strtol(optarg, NULL, 10);
+			break;
+
+		case 'd':
+			dir = optarg;
+			break;
+
+		case 'p':
+			percent = strtol(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			runs = strtol(optarg, NULL, 10);
+			break;
+
+		case 's':
+			size = strtol(optarg, NULL, 10);
+			break;
+
+		case 'z':
+			compress = true;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (size == 0 || percent <= 0 || percent > 100)
+		usage();
+
+	if (cmppercent < 0 || cmppercent > 100)
+		usage();
+
+	/* Only the SLOS compresses checkpoints. */
+	if (dir != NULL && compress)
+		usage();
+
+	size *= 1024 * 1024;
+
+	if (dir != NULL) {
+		dirfd = open(dir, O_DIRECTORY);
+		if (dirfd < 0) {
+			perror("open");
+			exit(1);
+		}
+	}
+
+	/* Restored processes are our descendants, kill them through reaping. */
+	if (procctl(P_PID, getpid(), PROC_REAP_ACQUIRE, NULL) != 0) {
+		perror("procctl");
+		exit(1);
+	}
+
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		filerest_child(fds[1], size, percent, cmppercent);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &ready, sizeof(ready)) != sizeof(ready)) {
+		fprintf(stderr, "child failed to set up its memory\n");
+		exit(1);
+	}
+
+	attr = (struct sls_attr) {
+		.attr_target = (dir != NULL) ? SLS_FILE : SLS_OSD,
+		.attr_mode = SLS_FULL,
+		.attr_period = 0,
+		.attr_flags = SLSATTR_IGNUNLINKED,
+		.attr_amplification = 1,
+	};
+	if (compress)
+		attr.attr_flags |= SLSATTR_COMPRESS;
+
+	error = sls_partadd(OID, attr, dirfd);
+	if (error != 0) {
+		fprintf(stderr, "sls_partadd returned %d\n", error);
+		exit(1);
+	}
+
+	error = sls_attach(OID, pid);
+	if (error != 0) {
+		fprintf(stderr, "sls_attach returned %d\n", error);
+		exit(1);
+	}
+
+	if (compress) {
+		cmpin = filerest_counter("aurora_slos.io_cmpin");
+		cmpout = filerest_counter("aurora_slos.io_cmpout");
+	}
+
+	gettimeofday(&start, NULL);
+	error = sls_checkpoint(OID, true);
+	gettimeofday(&end, NULL);
+	if (error != 0) {
+		fprintf(stderr, "sls_checkpoint returned %d\n", error);
+		exit(1);
+	}
+
+	printf("Checkpoint: %ldus\n", us_elapsed(&start, &end));
+
+	if (compress) {
+		cmpin = filerest_counter("aurora_slos.io_cmpin") - cmpin;
+		cmpout = filerest_counter("aurora_slos.io_cmpout") - cmpout;
+		if (cmpout > 0)
+			printf("Compression: %lu bytes to %lu bytes (%.2fx)\n",
+			    cmpin, cmpout, (double)cmpin / cmpout);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	for (i = 0; i < runs; i++) {
+		gettimeofday(&start, NULL);
+		error = sls_restore(OID, true);
+		gettimeofday(&end, NULL);
+		if (error != 0) {
+			fprintf(stderr, "sls_restore returned %d\n", error);
+			exit(1);
+		}
+
+		us = us_elapsed(&start, &end);
+		printf("Restore (%d): %ldus, %.1f MB/s\n", i, us,
+		    (double)(size * percent / 100) / us);
+
+		/* Get rid of the restored instance before the next run. */
+		bzero(&rk, sizeof(rk));
+		rk.rk_sig = SIGKILL;
+		if (procctl(P_PID, getpid(), PROC_REAP_KILL, &rk) != 0) {
+			perror("procctl");
+			exit(1);
+		}
+
+		while (waitpid(-1, NULL, 0) > 0)
+			continue;
+	}
+
+	error = sls_partdel(OID);
+	if (error != 0)
+		fprintf(stderr, "sls_partdel returned %d\n", error);
+
+	return (0);
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+
+SLSDIR="/root/sls"
+BIN="$SLSDIR/benchmarks/filerest/filerest"
+CKPTDIR="/ckptdir"
+
+. aurora
+
+# Keep the checkpoints on an FFS memory disk.
+ffssetup()
+{
+	MD=`mdconfig -a -t malloc -s 20g`
+	newfs "/dev/$MD" > /dev/null
+	mkdir -p $CKPTDIR
+	mount -t ufs "/dev/$MD" $CKPTDIR
+}
+
+ffsteardown()
+{
+	umount $CKPTDIR
+	mdconfig -d -u $MD
+	rm -r $CKPTDIR
+}
+
+filerest () {
+	SIZEMB=$1
+	PERCENT=$2
+	RUNNO=$3
+
+	ffssetup
+	aursetup
+	"$BIN" -d "$CKPTDIR" -s "$SIZEMB" -p "$PERCENT" > \
+	    "filerest-$SIZEMB-$PERCENT-$RUNNO"
+	aurteardown
+	ffsteardown
+}
+
+# Dense regions from 64MB to 4GB.
+for SIZEMB in 64 256 1024 4096;
+do
+	for RUNNO in $(seq 1 2);
+	do
+		filerest "$SIZEMB" 100 "$RUNNO"
+	done
+done
+
+# Sparse 1GB regions, to see the cost of many short runs.
+for PERCENT in 10 50;
+do
+	for RUNNO in $(seq 1 2);
+	do
+		filerest 1024 "$PERCENT" "$RUNNO"
+	done
+done
+
+# Checkpoint into the SLOS instead, with and without compression.
+slosrest () {
+	CMPPERCENT=$1
+	RUNNO=$2
+	FLAGS=$3
+	MODE=${FLAGS:-"plain"}
+
+	aursetup
+	"$BIN" -s 1024 -c "$CMPPERCENT" $FLAGS > \
+	    "slosrest-${MODE#-}-$CMPPERCENT-$RUNNO"
+	aurteardown
+}
+
+# From random to mostly compressible data.
+for CMPPERCENT in 0 50 100;
+do
+	for FLAGS in "" "-z";
+	do
+		for RUNNO in $(seq 1 2);
+		do
+			slosrest "$CMPPERCENT" "$RUNNO" "$FLAGS"
+		done
+	done
+done
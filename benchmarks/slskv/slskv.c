@@ -0,0 +1,143 @@
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sls_kv.h"
+
+/*
+ * Microbenchmark for the slskv hashtable, built in userspace directly from
+ * the kernel sources. Keys are spaced like kernel object pointers, which is
+ * the common case for the tables used during checkpointing.
+ */
+
+#define KEYBASE (0xfffff80001000000ULL)
+#define KEYSTRIDE (256)
+#define MINENTRIES (1000)
+#define MAXENTRIES (1000 * 1000)
+
+static void
+usage(void)
+{
+	printf("Usage: ./slskv [max # of entries]\n");
+	exit(0);
+}
+
+static uint64_t
+key_for(size_t i)
+{
+	return (KEYBASE + (uint64_t)i * KEYSTRIDE);
+}
+
+static long
+ns_elapsed(struct timespec *start, struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000L * 1000 * 1000 +
+	    (end->tv_nsec - start->tv_nsec));
+}
+
+static void
+slskv_bench(size_t entries)
+{
+	struct timespec tstart, tend;
+	struct slskv_table *table;
+	long ins_ns, hit_ns, miss_ns, pop_ns;
+	uintptr_t value;
+	uint64_t key;
+	size_t popped;
+	size_t i;
+	int error;
+
+	error = slskv_create(&table);
+	if (error != 0) {
+		fprintf(stderr, "slskv_create returned %d\n", error);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	for (i = 0; i < entries; i++) {
+		error = slskv_add(table, key_for(i), (uintptr_t)i);
+		if (error != 0) {
+			fprintf(stderr, "slskv_add returned %d\n", error);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tend);
+	ins_ns = ns_elapsed(&tstart, &tend);
+
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	for (i = 0; i < entries; i++) {
+		error = slskv_find(table, key_for(i), &value);
+		if (error != 0 || value != (uintptr_t)i) {
+			fprintf(stderr, "lookup for entry %zu failed\n", i);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tend);
+	hit_ns = ns_elapsed(&tstart, &tend);
+
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	for (i = 0; i < entries; i++) {
+		/* Keys between the inserted ones are never present. */
+		error = slskv_find(table, key_for(i) + KEYSTRIDE / 2, &value);
+		if (error == 0) {
+			fprintf(stderr, "found nonexistent entry %zu\n", i);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tend);
+	miss_ns = ns_elapsed(&tstart, &tend);
+
+	popped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	while (slskv_pop(table, &key, &value) == 0)
+		popped += 1;
+	clock_gettime(CLOCK_MONOTONIC, &tend);
+	pop_ns = ns_elapsed(&tstart, &tend);
+
+	if (popped != entries) {
+		fprintf(stderr, "popped %zu entries, expected %zu\n", popped,
+		    entries);
+		exit(1);
+	}
+
+	printf("%zu entries, %lu buckets: insert %.1fns lookup %.1fns "
+	       "miss %.1fns pop %.1fns\n",
+	    entries, table->mask + 1, (double)ins_ns / entries,
+	    (double)hit_ns / entries, (double)miss_ns / entries,
+	    (double)pop_ns / entries);
+
+	slskv_destroy(table);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t maxentries = MAXENTRIES;
+	size_t entries;
+	int error;
+
+	if (argc > 2)
+		usage();
+
+	if (argc == 2) {
+		maxentries = strtol(argv[1], NULL, 10);
+		if (maxentries == 0)
+			usage();
+	}
+
+	error = slskv_init();
+	if (error != 0) {
+		fprintf(stderr, "slskv_init returned %d\n", error);
+		exit(1);
+	}
+
+	for (entries = MINENTRIES; entries <= maxentries; entries *= 10)
+		slskv_bench(entries);
+
+	slskv_fini();
+
+	return (0);
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+SLSDIR="/root/sls"
+BIN="$SLSDIR/benchmarks/slskv/slskv"
+
+# The benchmark runs in userspace, no need to load the module.
+for RUNNO in $(seq 1 3);
+do
+	"$BIN" 1000000 > "slskv-$RUNNO"
+done
@@ -0,0 +1,197 @@
+#ifndef _SLSKV_COMPAT_H_
+#define _SLSKV_COMPAT_H_
+
+/*
+ * Userspace stand-ins for the kernel primitives used by sls/sls_kv.c, so that
+ * the hashtable can be built and measured outside of the kernel.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar)          \
+	for ((var) = LIST_FIRST((head));                   \
+	     (var) && ((tvar) = LIST_NEXT((var), field), 1); \
+	     (var) = (tvar))
+#endif
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+#ifndef __inline
+#define __inline inline
+#endif
+
+#define KASSERT(exp, msg) assert(exp)
+
+/* Locking. */
+struct mtx_padalign {
+	pthread_spinlock_t lock;
+} __attribute__((aligned(64)));
+
+#define MTX_SPIN 0
+#define MTX_DUPOK 0
+#define MA_OWNED 0
+
+#define mtx_init(m, name, type, opts) \
+	pthread_spin_init(&(m)->lock, PTHREAD_PROCESS_PRIVATE)
+#define mtx_destroy(m) pthread_spin_destroy(&(m)->lock)
+#define mtx_lock_spin(m) pthread_spin_lock(&(m)->lock)
+#define mtx_lock_spin_flags(m, flags) pthread_spin_lock(&(m)->lock)
+#define mtx_unlock_spin(m) pthread_spin_unlock(&(m)->lock)
+#define mtx_assert(m, what) ((void)0)
+
+/* Atomics. */
+#define atomic_add_int(p, v) ((void)__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST))
+#define atomic_subtract_int(p, v) \
+	((void)__atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST))
+#define atomic_subtract_long(p, v) \
+	((void)__atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST))
+#define atomic_fetchadd_int(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fetchadd_long(p, v) \
+	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_load_acq_int(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_rel_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Memory allocation. */
+#define M_SLSMM NULL
+#define M_NOWAIT 0
+#define M_WAITOK 0
+#define HASH_NOWAIT 0
+
+struct uma_zone {
+	size_t size;
+	int (*ctor)(void *, int, void *, int);
+	void (*dtor)(void *, int, void *);
+	int (*init)(void *, int, int);
+	void (*fini)(void *, int);
+};
+
+typedef struct uma_zone *uma_zone_t;
+typedef int (*uma_ctor)(void *, int, void *, int);
+typedef void (*uma_dtor)(void *, int, void *);
+typedef int (*uma_init)(void *, int, int);
+typedef void (*uma_fini)(void *, int);
+
+#define UMA_ALIGNOF(type) (_Alignof(type) - 1)
+
+static inline uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init init, uma_fini fini, int align __unused, uint32_t flags __unused)
+{
+	uma_zone_t zone;
+
+	zone = malloc(sizeof(*zone));
+	if (zone == NULL)
+		return (NULL);
+
+	*zone = (struct uma_zone) {
+		.size = size,
+		.ctor = ctor,
+		.dtor = dtor,
+		.init = init,
+		.fini = fini,
+	};
+
+	return (zone);
+}
+
+static inline void
+uma_zdestroy(uma_zone_t zone)
+{
+	free(zone);
+}
+
+static inline void
+uma_prealloc(uma_zone_t zone __unused, int items __unused)
+{
+}
+
+/* There is no caching, so run the init/fini routines on every allocation. */
+static inline void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	void *mem;
+
+	if (posix_memalign(&mem, 64, zone->size) != 0)
+		return (NULL);
+
+	if (zone->init != NULL && zone->init(mem, zone->size, flags) != 0) {
+		free(mem);
+		return (NULL);
+	}
+
+	if (zone->ctor != NULL && zone->ctor(mem, zone->size, NULL, flags) != 0) {
+		if (zone->fini != NULL)
+			zone->fini(mem, zone->size);
+		free(mem);
+		return (NULL);
+	}
+
+	return (mem);
+}
+
+static inline void
+uma_zfree(uma_zone_t zone, void *mem)
+{
+	if (mem == NULL)
+		return;
+
+	if (zone->dtor != NULL)
+		zone->dtor(mem, zone->size, NULL);
+	if (zone->fini != NULL)
+		zone->fini(mem, zone->size);
+	free(mem);
+}
+
+/* Same semantics as the kernel: round down to a power of two. */
+static inline void *
+hashinit_flags(int elements, void *type __unused, u_long *hashmask,
+    int flags __unused)
+{
+	LIST_HEAD(generic, generic) * hashtbl;
+	long hashsize;
+	int i;
+
+	for (hashsize = 1; hashsize <= elements; hashsize <<= 1)
+		continue;
+	hashsize >>= 1;
+
+	hashtbl = malloc((u_long)hashsize * sizeof(*hashtbl));
+	if (hashtbl == NULL)
+		return (NULL);
+
+	for (i = 0; i < hashsize; i++)
+		LIST_INIT(&hashtbl[i]);
+	*hashmask = hashsize - 1;
+
+	return (hashtbl);
+}
+
+#define hashinit(elements, type, hashmask) \
+	hashinit_flags((elements), (type), (hashmask), 0)
+
+static inline void
+hashdestroy(void *vhashtbl, void *type __unused, u_long hashmask)
+{
+	LIST_HEAD(generic, generic) *hashtbl = vhashtbl;
+	u_long i;
+
+	for (i = 0; i <= hashmask; i++)
+		assert(LIST_EMPTY(&hashtbl[i]));
+
+	free(hashtbl);
+}
+
+#endif /* _SLSKV_COMPAT_H_ */
@@ -0,0 +1,46 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "sls_stub.h"
+
+useconds_t sls_stub_delay = 0;
+uint64_t sls_stub_memsnaps = 0;
+uint64_t sls_stub_untilepochs = 0;
+
+static atomic_uint_fast64_t sls_stub_epoch = 0;
+
+int
+sls_attach(uint64_t oid, uint64_t pid)
+{
+	return (0);
+}
+
+int
+sls_checkpoint_epoch(uint64_t oid, bool recurse, uint64_t *epoch)
+{
+	*epoch = atomic_fetch_add(&sls_stub_epoch, 1) + 1;
+	return (0);
+}
+
+int
+sls_memsnap_epoch(uint64_t oid, void *addr, uint64_t *epoch)
+{
+	if (sls_stub_delay > 0)
+		usleep(sls_stub_delay);
+
+	__atomic_add_fetch(&sls_stub_memsnaps, 1, __ATOMIC_RELAXED);
+	*epoch = atomic_fetch_add(&sls_stub_epoch, 1) + 1;
+	return (0);
+}
+
+int
+sls_untilepoch(uint64_t oid, uint64_t epoch)
+{
+	if (sls_stub_delay > 0)
+		usleep(sls_stub_delay);
+
+	__atomic_add_fetch(&sls_stub_untilepochs, 1, __ATOMIC_RELAXED);
+	return (0);
+}
@@ -0,0 +1,17 @@
+#ifndef _SLS_STUB_H_
+#define _SLS_STUB_H_
+
+/*
+ * Userspace stand-ins for the libsls calls used by libsls/sls_wal.c, so
+ * that the write-ahead log can be built and measured without the kernel
+ * module. Snapshots and checkpoints complete after a configurable delay.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+extern useconds_t sls_stub_delay; /* Time each snapshot takes */
+extern uint64_t sls_stub_memsnaps;
+extern uint64_t sls_stub_untilepochs;
+
+#endif /* _SLS_STUB_H_ */
@@ -0,0 +1,174 @@
+#include <sys/time.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sls_wal.h>
+
+#include "sls_stub.h"
+
+/*
+ * Multithreaded throughput benchmark for the libsls write-ahead log, built in
+ * userspace with the SLS calls stubbed. Each thread logs fixed-size writes
+ * into its own region and periodically syncs the log.
+ */
+
+#define WALSIZE (1024 * 1024)
+#define OPS (1000 * 1000)
+#define RECSIZE (64)
+#define SYNCEVERY (64)
+#define REGIONSIZE (64 * 1024)
+
+struct slswal_thread {
+	pthread_t tid;
+	struct sls_wal *wal;
+	char *region;
+	size_t ops;
+	size_t recsize;
+	size_t syncevery;
+	uint64_t syncs;
+};
+
+static void
+usage(void)
+{
+	printf("Usage: ./slswal [-t threads] [-n ops per thread] "
+	       "[-s record size] [-y ops between syncs] [-d snapshot us] "
+	       "[-w log size]\n");
+	exit(0);
+}
+
+static long
+ns_elapsed(struct timespec *start, struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000L * 1000 * 1000 +
+	    (end->tv_nsec - start->tv_nsec));
+}
+
+static void *
+slswal_worker(void *arg)
+{
+	struct slswal_thread *st = (struct slswal_thread *)arg;
+	char record[REGIONSIZE];
+	size_t off = 0;
+	size_t i;
+
+	memset(record, 0xa5, sizeof(record));
+
+	for (i = 0; i < st->ops; i++) {
+		sls_wal_memcpy(st->wal, &st->region[off], record, st->recsize);
+		off = (off + st->recsize) % (REGIONSIZE - st->recsize);
+
+		if (st->syncevery > 0 && (i + 1) % st->syncevery == 0) {
+			if (sls_wal_sync(st->wal) != 0) {
+				fprintf(stderr, "sls_wal_sync failed\n");
+				exit(1);
+			}
+			st->syncs += 1;
+		}
+	}
+
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec tstart, tend;
+	struct slswal_thread *threads;
+	struct sls_wal wal;
+	size_t nthreads = 1, ops = OPS, recsize = RECSIZE;
+	size_t syncevery = SYNCEVERY, walsize = WALSIZE;
+	uint64_t syncs = 0;
+	long elapsed;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:s:y:d:w:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			recsize = strtol(optarg, NULL, 10);
+			break;
+		case 'y':
+			syncevery = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			sls_stub_delay = strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			walsize = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (nthreads == 0 || recsize == 0 || recsize >= REGIONSIZE)
+		usage();
+
+	if (sls_wal_open(&wal, 1, walsize) != 0) {
+		perror("sls_wal_open");
+		exit(1);
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].wal = &wal;
+		threads[i].region = malloc(REGIONSIZE);
+		threads[i].ops = ops;
+		threads[i].recsize = recsize;
+		threads[i].syncevery = syncevery;
+		if (threads[i].region == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, slswal_worker,
+			&threads[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		syncs += threads[i].syncs;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tend);
+	elapsed = ns_elapsed(&tstart, &tend);
+
+	printf("%zu threads, %zu byte records: %.0f writes/s, %lu syncs, "
+	       "%lu snapshots, %lu segment clears\n",
+	    nthreads, recsize,
+	    (double)(nthreads * ops) * 1000 * 1000 * 1000 / elapsed, syncs,
+	    sls_stub_memsnaps, sls_stub_untilepochs);
+
+	for (i = 0; i < nthreads; i++)
+		free(threads[i].region);
+	free(threads);
+
+	if (sls_wal_close(&wal) != 0) {
+		perror("sls_wal_close");
+		exit(1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+SLSDIR="/root/sls"
+BIN="$SLSDIR/benchmarks/slswal/slswal"
+
+# The benchmark runs in userspace with the SLS calls stubbed out, no need to
+# load the module. Snapshots take 1ms.
+for THREADS in 1 2 4 8 16;
+do
+	for RUNNO in $(seq 1 3);
+	do
+		"$BIN" -t "$THREADS" -d 1000 > "slswal-$THREADS-$RUNNO"
+	done
+done
@@ -0,0 +1,462 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sls_message.h>
+
+/*
+ * Ingest throughput benchmark for the checkpoint server. We replay a
+ * checkpoint stream recorded by the server (server -r) from many clients
+ * at once, each of them pretending to be a different partition, and
+ * report the aggregate rate at which the server absorbs the data.
+ */
+
+#define PORT (5040)
+#define CLIENTS (16)
+#define ROUNDS (10)
+#define OIDBASE (10000)
+#define CHUNK (1024 * 1024)
+
+/* Pieces of the recorded stream, some of which we rewrite per client. */
+enum srvload_segtype {
+	SEG_DATA,      /* Sent as is */
+	SEG_CKPTSTART, /* Sent with the client's partition and epoch */
+	SEG_SKIP,      /* Not sent */
+};
+
+struct srvload_seg {
+	enum srvload_segtype type;
+	size_t off;
+	size_t len;
+};
+
+struct srvload_client {
+	pthread_t thread;
+	uint64_t oid;
+	uint64_t bytes;
+	int error;
+};
+
+static char *stream;
+static struct srvload_seg *segs;
+static size_t nsegs;
+static struct sockaddr_in srvaddr;
+static pthread_barrier_t barrier;
+static int rounds = ROUNDS;
+
+static void
+usage(void)
+{
+	printf("Usage: ./srvload -f <stream> [-a address] [-c clients] "
+	       "[-r rounds]\n");
+	exit(0);
+}
+
+static long
+us_elapsed(struct timeval *start, struct timeval *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000L * 1000 +
+	    (end->tv_usec - start->tv_usec));
+}
+
+static void
+srvload_addseg(enum srvload_segtype type, size_t off, size_t len)
+{
+	struct srvload_seg *seg;
+
+	/* Merge with the previous segment if possible. */
+	if (nsegs > 0 && type == SEG_DATA && segs[nsegs - 1].type == SEG_DATA) {
+		segs[nsegs - 1].len += len;
+		return;
+	}
+
+	segs = realloc(segs, (nsegs + 1) * sizeof(*segs));
+	if (segs == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+
+	seg = &segs[nsegs++];
+	*seg = (struct srvload_seg) {
+		.type = type,
+		.off = off,
+		.len = len,
+	};
+}
+
+/* Split the stream into segments, checking that it is well formed. */
+static void
+srvload_parse(size_t size)
+{
+	struct slsmsg_recruns *runmsg;
+	struct slsmsg_recpages *pagemsg;
+	struct slsmsg_recmeta *metamsg;
+	enum slsmsgtype msgtype;
+	bool done = false;
+	size_t off = 0;
+	size_t len;
+
+	while (off < size) {
+		if (size - off < sizeof(union slsmsg))
+			goto truncated;
+
+		msgtype = *(enum slsmsgtype *)&stream[off];
+		len = sizeof(union slsmsg);
+
+		switch (msgtype) {
+		case SLSMSG_REGISTER:
+		case SLSMSG_DONE:
+		case SLSMSG_CKPTACK:
+			srvload_addseg(SEG_SKIP, off, len);
+			off += len;
+			continue;
+
+		case SLSMSG_CKPTSTART:
+			srvload_addseg(SEG_CKPTSTART, off, len);
+			off += len;
+			continue;
+
+		case SLSMSG_RECMETA:
+			metamsg = (struct slsmsg_recmeta *)&stream[off];
+			len += metamsg->slsmsg_metalen;
+			break;
+
+		case SLSMSG_RECPAGES:
+			pagemsg = (struct slsmsg_recpages *)&stream[off];
+			len += pagemsg->slsmsg_len;
+			break;
+
+		case SLSMSG_RECRUNS:
+			runmsg = (struct slsmsg_recruns *)&stream[off];
+			len += runmsg->slsmsg_nruns *
+			    sizeof(struct slsmsg_pagerun);
+			len += runmsg->slsmsg_len;
+			break;
+
+		case SLSMSG_CKPTDONE:
+			done = true;
+			break;
+
+		default:
+			fprintf(stderr, "invalid message type %d at %zu\n",
+			    msgtype, off);
+			exit(1);
+		}
+
+		if (len > size - off)
+			goto truncated;
+
+		srvload_addseg(SEG_DATA, off, len);
+		off += len;
+	}
+
+	if (!done) {
+		fprintf(stderr, "stream has no complete checkpoint\n");
+		exit(1);
+	}
+
+	return;
+
+truncated:
+	fprintf(stderr, "stream truncated at %zu\n", off);
+	exit(1);
+}
+
+static int
+srvload_write(int fd, char *buf, size_t len)
+{
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, buf, (len < CHUNK) ? len : CHUNK);
+		if (written < 0)
+			return (-1);
+
+		buf += written;
+		len -= written;
+	}
+
+	return (0);
+}
+
+static int
+srvload_connect(void)
+{
+	int option = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+	if (connect(fd, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* Wait for the server to be done with the connection. */
+static void
+srvload_drain(int fd)
+{
+	char buf[64];
+
+	shutdown(fd, SHUT_WR);
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+	close(fd);
+}
+
+/* Wait for the server to store the checkpoint. */
+static int
+srvload_ack(int fd, uint64_t epoch)
+{
+	struct slsmsg_ckptack *ackmsg;
+	union slsmsg msg;
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < sizeof(msg)) {
+		ret = read(fd, (char *)&msg + len, sizeof(msg) - len);
+		if (ret <= 0)
+			goto error;
+		len += ret;
+	}
+
+	ackmsg = (struct slsmsg_ckptack *)&msg;
+	if (ackmsg->slsmsg_type != SLSMSG_CKPTACK ||
+	    ackmsg->slsmsg_epoch != epoch || ackmsg->slsmsg_error != 0)
+		goto error;
+
+	srvload_drain(fd);
+
+	return (0);
+
+error:
+	close(fd);
+	return (-1);
+}
+
+static int
+srvload_register(struct srvload_client *client)
+{
+	struct slsmsg_register *regmsg;
+	union slsmsg msg;
+	int fd;
+
+	fd = srvload_connect();
+	if (fd < 0)
+		return (-1);
+
+	memset(&msg, 0, sizeof(msg));
+	regmsg = (struct slsmsg_register *)&msg;
+	*regmsg = (struct slsmsg_register) {
+		.slsmsg_type = SLSMSG_REGISTER,
+		.slsmsg_oid = client->oid,
+	};
+
+	if (srvload_write(fd, (char *)&msg, sizeof(msg)) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	srvload_drain(fd);
+
+	return (0);
+}
+
+/* Send the whole stream as a checkpoint of the given epoch. */
+static int
+srvload_send(struct srvload_client *client, uint64_t epoch)
+{
+	struct slsmsg_ckptstart *ckptmsg;
+	struct srvload_seg *seg;
+	union slsmsg msg;
+	size_t i;
+	int fd;
+
+	fd = srvload_connect();
+	if (fd < 0)
+		return (-1);
+
+	for (i = 0; i < nsegs; i++) {
+		seg = &segs[i];
+		switch (seg->type) {
+		case SEG_DATA:
+			if (srvload_write(fd, &stream[seg->off], seg->len) != 0)
+				goto error;
+			client->bytes += seg->len;
+			break;
+
+		case SEG_CKPTSTART:
+			memcpy(&msg, &stream[seg->off], sizeof(msg));
+			ckptmsg = (struct slsmsg_ckptstart *)&msg;
+			ckptmsg->slsmsg_oid = client->oid;
+			ckptmsg->slsmsg_epoch = epoch;
+
+			if (srvload_write(fd, (char *)&msg, sizeof(msg)) != 0)
+				goto error;
+			client->bytes += sizeof(msg);
+			break;
+
+		case SEG_SKIP:
+			break;
+		}
+	}
+
+	return (srvload_ack(fd, epoch));
+
+error:
+	close(fd);
+	return (-1);
+}
+
+static void *
+srvload_client(void *arg)
+{
+	struct srvload_client *client = arg;
+	int i;
+
+	client->error = srvload_register(client);
+	pthread_barrier_wait(&barrier);
+	if (client->error != 0)
+		return (NULL);
+
+	for (i = 0; i < rounds; i++) {
+		client->error = srvload_send(client, i + 1);
+		if (client->error != 0)
+			break;
+	}
+
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct srvload_client *clients;
+	struct timeval start, end;
+	char *addr = "127.0.0.1";
+	int nclients = CLIENTS;
+	char *file = NULL;
+	uint64_t bytes;
+	struct stat st;
+	int failed;
+	long us;
+	int opt;
+	int fd;
+	int i;
+
+	while ((opt = getopt(argc, argv, "a:c:f:r:")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+
+		case 'c':
+			nclients = strtol(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			file = optarg;
+			break;
+
+		case 'r':
+			rounds = strtol(optarg, NULL, 10);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (file == NULL || nclients <= 0 || rounds <= 0)
+		usage();
+
+	memset(&srvaddr, 0, sizeof(srvaddr));
+	srvaddr.sin_family = AF_INET;
+	srvaddr.sin_port = htons(PORT);
+	if (inet_pton(AF_INET, addr, &srvaddr.sin_addr) != 1) {
+		fprintf(stderr, "invalid address %s\n", addr);
+		exit(1);
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(file);
+		exit(1);
+	}
+
+	stream = malloc(st.st_size);
+	if (stream == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if (read(fd, stream, st.st_size) != st.st_size) {
+		perror("read");
+		exit(1);
+	}
+
+	close(fd);
+
+	srvload_parse(st.st_size);
+
+	clients = calloc(nclients, sizeof(*clients));
+	if (clients == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* Registration is not part of the measurement. */
+	pthread_barrier_init(&barrier, NULL, nclients + 1);
+	for (i = 0; i < nclients; i++) {
+		clients[i].oid = OIDBASE + i;
+		if (pthread_create(&clients[i].thread, NULL, srvload_client,
+			&clients[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+	gettimeofday(&start, NULL);
+
+	bytes = 0;
+	failed = 0;
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		bytes += clients[i].bytes;
+		if (clients[i].error != 0)
+			failed += 1;
+	}
+
+	gettimeofday(&end, NULL);
+	us = us_elapsed(&start, &end);
+
+	printf("Clients: %d, rounds: %d, failed: %d\n", nclients, rounds,
+	    failed);
+	printf("Ingest: %lu bytes in %ldus, %.1f MB/s\n",
+	    (unsigned long)bytes, us, (double)bytes / us);
+
+	return (failed != 0);
+}
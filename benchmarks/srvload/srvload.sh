@@ -0,0 +1,33 @@
+#!/bin/sh
+
+SLSDIR="/root/sls"
+BIN="$SLSDIR/benchmarks/srvload/srvload"
+SERVER="$SLSDIR/tools/server/server"
+SRVDIR="/srvdir"
+
+# A stream recorded with "server -r", e.g. from a socket checkpoint test.
+STREAM=${1:-"$SLSDIR/benchmarks/srvload/stream"}
+
+srvload () {
+	CLIENTS=$1
+	RUNNO=$2
+
+	mkdir -p $SRVDIR
+	"$SERVER" "$SRVDIR" &
+	SRVPID=$!
+	sleep 1
+
+	"$BIN" -f "$STREAM" -c "$CLIENTS" > "srvload-$CLIENTS-$RUNNO"
+
+	kill $SRVPID
+	wait $SRVPID
+	rm -r $SRVDIR
+}
+
+for CLIENTS in 1 4 16 64;
+do
+	for RUNNO in $(seq 1 3);
+	do
+		srvload "$CLIENTS" "$RUNNO"
+	done
+done
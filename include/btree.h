@@ -213,6 +213,7 @@ int fnode_keymax(struct fnode *root, void *key, void *value);
 int fbtree_insert(struct fbtree *tree, void *key, void *value);
 int fbtree_remove(struct fbtree *tree, void *key, void *value);
 int fbtree_replace(struct fbtree *tree, void *key, void *value);
+int fbtree_bulkinsert(struct fbtree *tree, void *keys, void *values, int n);
 int fbtree_sync(struct fbtree *tree);
 int fbtree_sync_withalloc(struct fbtree *tree, diskptr_t *pre);
 int fbtree_rangeinsert(struct fbtree *tree, uint64_t lbn, uint64_t size);
@@ -3,6 +3,7 @@
 #define _SLOS_H_
 
 #include <sys/param.h>
+#include <sys/_task.h>
 #include <sys/condvar.h>
 #include <sys/kernel.h>
 #include <sys/limits.h>
@@ -10,6 +11,7 @@
 #include <sys/lockmgr.h>
 #include <sys/malloc.h>
 #include <sys/mutex.h>
+#include <sys/queue.h>
 #include <sys/uuid.h>
 
 #include <vm/vm.h>
@@ -25,11 +27,17 @@
  */
 typedef uint64_t bnode_ptr;
 
-/* Physical extent on-disk pointer. */
+/*
+ * Physical extent on-disk pointer. Compressed extents point to a frame of
+ * csize bytes, and hold the data starting coff bytes into it once
+ * decompressed. Their size is that of the data, not of the frame.
+ */
 struct slos_diskptr {
 	uint64_t offset; /* The block of the first extent block. */
 	uint64_t size; /* The size of the region in bytes. */
 	uint64_t epoch;
+	uint32_t csize; /* The size of the compressed frame, 0 if none. */
+	uint32_t coff;	/* The offset of the data in the frame. */
 };
 typedef struct slos_diskptr diskptr_t;
 
@@ -53,8 +61,12 @@ typedef struct slos_diskblk diskblk_t;
 
 #define SLOS_MAXVOLLEN 32
 
+/*
+ * Written into the superblock by newfs. Bump the minor version whenever the
+ * on-disk layout changes, the SLOS refuses to mount other versions.
+ */
 #define SLOS_MAJOR_VERSION 1
-#define SLOS_MINOR_VERSION 4
+#define SLOS_MINOR_VERSION 5
 
 /*
  * Object store flags
@@ -146,7 +158,9 @@ void slos_ptr_trimstart(
 struct slos_blkalloc {
 	struct slos_node *a_offset;
 	struct slos_node *a_size;
-	struct slos_diskptr chunk;
+	struct slos_pcpuchunk *a_pcpu; /* Per-CPU allocation chunks */
+	uint64_t a_fence;              /* Allocations before it are on disk */
+	TAILQ_HEAD(slos_carves, slos_carve) a_carves; /* Recent carves */
 };
 
 /*
@@ -176,6 +190,15 @@ struct slos {
 	struct cv slsfs_sync_cv;
 	struct mtx slsfs_sync_lk;
 	struct mount *slsfs_mount;
+	uint64_t slsfs_commitgen;     /* Checkpoints started by the syncer */
+	uint64_t slsfs_commitdone;    /* Checkpoints completed by the syncer */
+	uint64_t slsfs_commitwaiters; /* Callers waiting for the next one */
+
+	struct mtx slos_dirtylk;	     /* Protects the dirty list */
+	TAILQ_HEAD(, slos_node) slos_dirtyq; /* Nodes the syncer flushes */
+	uint64_t slos_ndirty;		     /* Length of the dirty list */
+	int slos_dirtylost;		     /* Dirty node freed unflushed */
+	struct taskqueue *slos_synctq;	     /* Flushes dirty nodes */
 
 	struct slos_sb *slos_sb; /* The superblock of the filesystem */
 	struct slos_blkalloc slos_alloc;
@@ -186,6 +209,9 @@ struct slos {
 
 	struct lock slos_lock;	   /* Sleepable lock */
 	struct taskqueue *slos_tq; /* Slos taskqueue */
+	struct task slos_gctask;   /* Garbage collection task */
+	uint64_t slos_gcepochs;	   /* Checkpoints since the last collection */
+	int slos_gcstop;	   /* Abort any running collection */
 	enum slos_state slos_state; /* State of the SLS */
 	uint64_t slos_bsize;	    /* Block size */
 };
@@ -210,6 +236,7 @@ extern uint64_t checkpoints;
 extern uint64_t checkpointtime;
 
 int slsfs_wakeup_syncer(int is_exiting);
+int slsfs_group_commit(void);
 
 extern void (*sls_writefault_hook)(vm_offset_t vaddr, vm_map_t map, vm_page_t m,
     int fault_type);
@@ -29,6 +29,11 @@ struct slos_rstat {
 
 #define SLOS_DIRTY (0x1000)
 
+/* Position of a node with respect to the dirty list of the SLOS. */
+#define SLOS_DQ_NONE (0)     /* Not on the list */
+#define SLOS_DQ_QUEUED (1)   /* Waiting for the syncer */
+#define SLOS_DQ_INFLIGHT (2) /* Being flushed by the syncer */
+
 #define IN_ACCESS (0x2)
 #define IN_UPDATE (0x4)
 #define IN_CHANGE (0x8)
@@ -103,6 +108,12 @@ struct slos_node {
 	struct vnode *sn_fdev; /* Fake vnode for btree back */
 	vm_object_t sn_obj;    /* SAS object */
 	vm_offset_t sn_addr;   /* SAS object mapping */
+
+	struct slsfs_dirhash *sn_dirhash; /* Name index of large directories */
+
+	struct vnode *sn_vp;		   /* VFS vnode of the node */
+	TAILQ_ENTRY(slos_node) sn_dirtyq; /* Link in the dirty list */
+	int sn_dqstate;			   /* Dirty list state */
 };
 
 /* Inode flags */
@@ -126,6 +137,10 @@ int slos_iremove(struct slos *slos, uint64_t pid);
 int slos_updatetime(struct slos_inode *ino);
 int slos_update(struct slos_node *svp);
 
+void slos_markdirty(struct slos_node *svp);
+struct slos_node *slos_dirty_pop(struct slos *slos);
+void slos_dirty_done(struct slos *slos, struct slos_node *svp, bool requeue);
+
 int slos_iopen(struct slos *slos, uint64_t slsid, struct slos_node **svpp);
 
 struct slos_node *slos_istat(struct slos *slos, uint64_t inoblk);
@@ -20,6 +20,13 @@ int slos_sbat(struct slos *slos, int index, struct slos_sb *sb);
 
 /* Direct SLOS IO. */
 int slos_iotask_create(struct vnode *vp, struct buf *bp, bool async);
+int slos_iotask_pack(struct vnode *vp, struct buf *bp);
+void slos_io_drain(void);
+int slos_io_bmap(struct vnode *vp, uint64_t lblkno, uint64_t *blkno);
+int slos_io_share(struct vnode *vp, uint64_t lblkno, struct vnode *srcvp,
+    uint64_t srclblkno, uint64_t blkno, const void *data);
+int slos_io_zero(struct vnode *vp, uint64_t lblkno, size_t size);
+bool slos_io_compress(struct buf *bp);
 boolean_t slos_hasblock(
     struct vnode *vp, uint64_t lblkno_req, int *rbehind, int *rahead);
 
@@ -27,8 +34,15 @@ int slos_io_init(void);
 void slos_io_uninit(void);
 
 extern int slos_pbufcnt;
+extern int slos_io_qdepth;
+extern uint64_t slos_io_segsize;
+extern uint64_t slos_io_segments;
 
 extern uint64_t slos_io_initiated;
 extern uint64_t slos_io_done;
+extern uint64_t slos_io_zeroed;
+extern uint64_t slos_io_cmpin;
+extern uint64_t slos_io_cmpout;
+extern uint64_t slos_io_decompressed;
 
 #endif /* _SLOS_IO_H_ */
@@ -4,6 +4,10 @@
 #include <sys/ioccom.h>
 #include <sys/sbuf.h>
 
+#ifdef _KERNEL
+#include <machine/atomic.h>
+#endif /* _KERNEL */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +18,32 @@ extern "C" {
 #define SLS_OIDMAX ((SLS_OIDMIN) + (SLS_OIDRANGE))
 #define SLOS_OBJOFF (64)
 
+/*
+ * Data files of the file backend hold the object record at the beginning,
+ * followed by a header pointing to an array of page runs. Pages are stored
+ * at their index offset by SLOS_OBJOFF, and the run array comes after the
+ * last page.
+ */
+struct sls_filerun {
+	uint64_t pindex; /* First page of the run */
+	uint64_t npages; /* Length of the run */
+	uint64_t flags;	 /* SLSFILERUN_* */
+};
+
+/* The pages of the run are all zero and have no data in the file. */
+#define SLSFILERUN_ZERO (0x1)
+
+/* Bump the version whenever the layout of the data files changes. */
+#define SLSFILE_MAGIC (0x534c5346) /* "SLSF" */
+#define SLSFILE_VERSION (2)
+
+struct sls_filehdr {
+	uint32_t magic;	 /* SLSFILE_MAGIC */
+	uint32_t version; /* SLSFILE_VERSION */
+	uint64_t runoff; /* Offset of the run array */
+	uint64_t nruns;	 /* Number of runs in the array */
+};
+
 /* The attributes of a process in the SLS. */
 struct sls_attr {
 	int attr_target; /* Backend into which the process is checkpointed */
@@ -21,6 +51,9 @@ struct sls_attr {
 	int attr_period; /* Checkpoint Period in ms */
 	int attr_flags;	 /* Control flags */
 	size_t attr_amplification; /* Partition amplification factor */
+	int attr_period_min; /* Shortest adaptive period in ms */
+	int attr_stopbudget; /* Adaptive stop time budget in us */
+	int attr_poolsize;   /* Metropolis instances kept restored */
 };
 
 struct sls_checkpoint_args {
@@ -132,6 +165,10 @@ struct sls_pgresident_args {
 #define SLSATTR_ASYNCSNAP 0x80	/* Do memsnap asynchronously */
 /* Do not restore the PID or process tree. */
 #define SLSATTR_NOPROCFIXUP 0x100
+#define SLSATTR_PIPELINE 0x200	/* Overlap IO with the next checkpoint */
+#define SLSATTR_ADAPTIVE 0x400	/* Adapt the period to the workload */
+#define SLSATTR_DEDUP 0x800	/* Deduplicate pages written to the SLOS */
+#define SLSATTR_COMPRESS 0x1000	/* Compress pages written to the SLOS */
 
 #define SLSATTR_FLAGISSET(attr, flag) (((attr).attr_flags & flag) != 0)
 #define SLSATTR_ISIGNUNLINKED(attr) \
@@ -145,6 +182,53 @@ struct sls_pgresident_args {
 #define SLSATTR_ISASYNCSNAP(attr) (SLSATTR_FLAGISSET((attr), SLSATTR_ASYNCSNAP))
 #define SLSATTR_ISNOPROCFIXUP(attr) \
 	(SLSATTR_FLAGISSET((attr), SLSATTR_NOPROCFIXUP))
+#define SLSATTR_ISPIPELINE(attr) (SLSATTR_FLAGISSET((attr), SLSATTR_PIPELINE))
+#define SLSATTR_ISADAPTIVE(attr) (SLSATTR_FLAGISSET((attr), SLSATTR_ADAPTIVE))
+#define SLSATTR_ISDEDUP(attr) (SLSATTR_FLAGISSET((attr), SLSATTR_DEDUP))
+#define SLSATTR_ISCOMPRESS(attr) (SLSATTR_FLAGISSET((attr), SLSATTR_COMPRESS))
+
+/* Checkpoint and restore phases timed for each partition. */
+#define SLSPHASE_STOP 0	      /* Stopping the processes */
+#define SLSPHASE_METADATA 1   /* Capturing process metadata */
+#define SLSPHASE_SHADOW 2     /* Shadowing the VM objects */
+#define SLSPHASE_CONT 3	      /* Resuming the processes */
+#define SLSPHASE_VNODES 4     /* Serializing vnodes */
+#define SLSPHASE_IOINIT 5     /* Initiating IO to the backend */
+#define SLSPHASE_IODRAIN 6    /* Waiting for IO to complete */
+#define SLSPHASE_COMPACT 7    /* Compacting the in-memory checkpoint */
+#define SLSPHASE_RESTREAD 8   /* Bringing in the checkpoint */
+#define SLSPHASE_RESTFILES 9  /* Restoring files */
+#define SLSPHASE_RESTSHM 10   /* Restoring System V shared memory */
+#define SLSPHASE_RESTPROCS 11 /* Restoring processes */
+#define SLSPHASES 12
+
+#define SLSPHASE_NAMES                                                        \
+	{                                                                     \
+		"stop", "metadata", "shadow", "cont", "vnodes", "ioinit",     \
+		    "iodrain", "compact", "restread", "restfiles", "restshm", \
+		    "restprocs"                                               \
+	}
+
+/* Latency histogram, bucket i counts latencies in [2^(i - 1), 2^i) ns. */
+#define SLSHIST_BUCKETS 64
+struct sls_histogram {
+	uint64_t hist_count; /* Number of samples */
+	uint64_t hist_sum;   /* Sum of all samples in ns */
+	uint64_t hist_buckets[SLSHIST_BUCKETS];
+};
+
+#ifdef _KERNEL
+static __inline void
+sls_histogram_record(struct sls_histogram *hist, uint64_t value)
+{
+	int bucket;
+
+	bucket = imin(flsll(value), SLSHIST_BUCKETS - 1);
+	atomic_add_64(&hist->hist_buckets[bucket], 1);
+	atomic_add_64(&hist->hist_sum, value);
+	atomic_add_64(&hist->hist_count, 1);
+}
+#endif /* _KERNEL */
 
 #ifdef __cplusplus
 }
@@ -8,6 +8,8 @@ enum slsmsgtype {
 	SLSMSG_RECPAGES,
 	SLSMSG_CKPTDONE,
 	SLSMSG_DONE,
+	SLSMSG_RECRUNS,
+	SLSMSG_CKPTACK,
 	SLSMSG_TYPES,
 };
 
@@ -19,6 +21,7 @@ struct slsmsg_register {
 struct slsmsg_ckptstart {
 	enum slsmsgtype slsmsg_type;
 	uint64_t slsmsg_epoch;
+	uint64_t slsmsg_oid; /* Partition on the receiver, 0 if unknown */
 };
 
 struct slsmsg_recmeta {
@@ -35,6 +38,29 @@ struct slsmsg_recpages {
 	uint64_t slsmsg_offset;
 };
 
+/*
+ * A batch of page runs of the current object. The message is followed by
+ * slsmsg_nruns run descriptors, and then by the data of the runs in order.
+ * Zero runs have no data.
+ */
+struct slsmsg_recruns {
+	enum slsmsgtype slsmsg_type;
+	uint64_t slsmsg_nruns; /* Number of run descriptors */
+	uint64_t slsmsg_len;   /* Bytes of page data after the descriptors */
+};
+
+struct slsmsg_pagerun {
+	uint64_t slsmsg_pindex; /* Index of the first page of the run */
+	uint64_t slsmsg_npages; /* Number of pages in the run */
+	uint64_t slsmsg_flags;	/* SLSMSG_RUN* */
+};
+
+/* All pages of the run are zero. */
+#define SLSMSG_RUNZERO (0x1)
+
+/* Upper bound on the pages sent with a single run message. */
+#define SLSMSG_MAXPAGES (256)
+
 struct slsmsg_ckptdone {
 	enum slsmsgtype slsmsg_type;
 };
@@ -43,13 +69,22 @@ struct slsmsg_done {
 	enum slsmsgtype slsmsg_type;
 };
 
+/* Sent back by the receiver once it has stored a checkpoint. */
+struct slsmsg_ckptack {
+	enum slsmsgtype slsmsg_type;
+	uint64_t slsmsg_epoch; /* Epoch of the checkpoint */
+	uint64_t slsmsg_error; /* Nonzero if the checkpoint was not stored */
+};
+
 union slsmsg {
 	struct slsmsg_register slsmsgregister;
 	struct slsmsg_ckptstart slsmsgckpt;
 	struct slsmsg_recmeta slsmsgrecmeta;
 	struct slsmsg_recpages slsmsgrecpages;
+	struct slsmsg_recruns slsmsgrecruns;
 	struct slsmsg_ckptdone slsmsgckptdone;
 	struct slsmsg_done slsmsgrecdone;
+	struct slsmsg_ckptack slsmsgckptack;
 };
 
 #endif /* _SLS_MESSAGE_H_ */
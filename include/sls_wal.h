@@ -14,8 +14,22 @@ struct sls_wal {
 	uint64_t oid;
 	char *mapping;
 	size_t size;
+	size_t segsize; /* Size of each of the log's segments */
 	uint64_t epoch;
 	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t sync_gen;  /* Snapshots started by sls_wal_sync() */
+	uint64_t sync_done; /* Snapshots completed by sls_wal_sync() */
+	int syncing;	    /* A snapshot is in progress */
+	int sync_error;	    /* Result of the last snapshot */
+};
+
+/* A set of writes applied to memory and the log atomically. */
+struct sls_wal_txn {
+	struct sls_wal *wal;
+	char *buf;  /* Staged ranges, in their log format */
+	size_t len; /* Bytes staged */
+	size_t cap; /* Size of the staging buffer */
 };
 
 /* Open a write-ahead log backed by the given file. */
@@ -25,7 +39,26 @@ int sls_wal_open(struct sls_wal *wal, uint64_t oid, size_t size);
 void sls_wal_memcpy(
     struct sls_wal *wal, void *dest, const void *src, size_t size);
 
-/* Make sure the write-ahead log is persisted. */
+/* Start a transaction. */
+void sls_wal_begin(struct sls_wal *wal, struct sls_wal_txn *txn);
+
+/*
+ * Add a write to a transaction. Writes to memory already written by the
+ * transaction are merged into the earlier write.
+ */
+int sls_wal_append(
+    struct sls_wal_txn *txn, void *dest, const void *src, size_t size);
+
+/* Log the writes of a transaction as one block, then apply them. */
+int sls_wal_commit(struct sls_wal_txn *txn);
+
+/* Discard a transaction without applying its writes. */
+void sls_wal_abort(struct sls_wal_txn *txn);
+
+/*
+ * Make sure the write-ahead log is persisted. Concurrent callers are served
+ * by the same snapshot.
+ */
 int sls_wal_sync(struct sls_wal *wal);
 
 /* Replay the operations from a write-ahead log. */
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdalign.h>
 #include <stdatomic.h>
 #include <stdint.h>
@@ -17,16 +18,51 @@
 #include "sls_wal.h"
 #include "slsfs.h"
 
-/* A single block of written memory in the log. */
+/*
+ * The log is split in two segments. Writers append to the active segment
+ * until it fills, at which point the other one becomes active and the full
+ * segment is cleared once a checkpoint covers it. Writers only ever block
+ * if both segments fill before the first one is cleared.
+ */
+#define SLSWAL_SEGMENTS (2)
+
+/*
+ * A single block of written memory in the log. Transactions have no
+ * destination, their data is a series of ranges.
+ */
 struct sls_wal_block {
 	void *dest;
-	atomic_size_t size;
+	size_t len;	    /* Length of the data, set when reserved */
+	atomic_size_t size; /* Set to the length once the block is complete */
 	unsigned char data[];
 };
 
+/* A range written by a transaction. */
+struct sls_wal_range {
+	void *dest;
+	size_t size;
+	unsigned char data[];
+};
+
+enum sls_wal_state {
+	SLSWAL_FREE = 0, /* Empty, can become active */
+	SLSWAL_ACTIVE,	 /* Receiving writes */
+	SLSWAL_SEALED,	 /* Full, needs to be cleared */
+	SLSWAL_RECYCLING /* Being cleared */
+};
+
+/* A segment of the log. */
+struct sls_wal_segment {
+	atomic_size_t offset;	/* Next free byte in the segment */
+	atomic_uint inflight;	/* Writers that may be copying in */
+	_Atomic(enum sls_wal_state) state;
+	uint64_t gen; /* Order in which segments became active, 0 if unused */
+};
+
 /* The write-ahead log header. */
 struct sls_wal_header {
-	atomic_size_t offset;
+	atomic_uint active; /* Index of the active segment */
+	struct sls_wal_segment segs[SLSWAL_SEGMENTS];
 };
 
 /* Get the size of a block including metadata. */
@@ -39,11 +75,14 @@ sls_wal_block_size(size_t size)
 	return ((block_size + align_mask) & ~align_mask);
 }
 
-/* Get the maximum possible size of a block. */
+/* Get the size of a transaction range including metadata. */
 static size_t
-sls_wal_max_size(const struct sls_wal *wal)
+sls_wal_range_size(size_t size)
 {
-	return (wal->size - sizeof(struct sls_wal_header));
+	size_t range_size = sizeof(struct sls_wal_range) + size;
+	size_t align_mask = alignof(struct sls_wal_range) - 1;
+
+	return ((range_size + align_mask) & ~align_mask);
 }
 
 /* Get the header of the log. */
@@ -53,88 +92,199 @@ sls_wal_header(struct sls_wal *wal)
 	return ((struct sls_wal_header *)wal->mapping);
 }
 
-/* Get the first block in the log, if one exists. */
+/* Get the start of a segment's blocks. */
+static char *
+sls_wal_segdata(struct sls_wal *wal, unsigned int idx)
+{
+	return (wal->mapping + sizeof(struct sls_wal_header) +
+	    idx * wal->segsize);
+}
+
+/* Allocate a new block in a segment of the log. */
 static struct sls_wal_block *
-sls_wal_first(struct sls_wal *wal)
+sls_wal_reserve_segment(struct sls_wal *wal, unsigned int idx, size_t size)
 {
-	struct sls_wal_header *header = sls_wal_header(wal);
-	size_t offset = atomic_load_explicit(
-	    &header->offset, memory_order_relaxed);
+	struct sls_wal_segment *seg = &sls_wal_header(wal)->segs[idx];
+	size_t block_size = sls_wal_block_size(size);
+	size_t offset;
 
-	if (offset > sizeof(struct sls_wal_header))
-		return (
-		    (struct sls_wal_block *)(wal->mapping + sizeof(*header)));
+	offset = atomic_fetch_add(&seg->offset, block_size);
+	if (offset + block_size <= wal->segsize)
+		return ((struct sls_wal_block *)(sls_wal_segdata(wal, idx) +
+		    offset));
 	else
 		return (NULL);
 }
 
-/* Get the next block in the log, if one exists. */
-static struct sls_wal_block *
-sls_wal_next(struct sls_wal *wal, struct sls_wal_block *block)
+/* Copy the data of a complete block to its destination. */
+static void
+sls_wal_apply(struct sls_wal_block *block, size_t len)
 {
-	struct sls_wal_header *header = sls_wal_header(wal);
-	size_t limit, offset;
-
-	limit = atomic_load_explicit(&header->offset, memory_order_relaxed);
+	struct sls_wal_range *range;
+	size_t offset;
 
-	offset = (char *)block - wal->mapping;
-	offset += sls_wal_block_size(block->size);
+	if (block->dest != NULL) {
+		memcpy(block->dest, block->data, len);
+		return;
+	}
 
-	if (offset < limit)
-		return ((struct sls_wal_block *)(wal->mapping + offset));
-	else
-		return (NULL);
+	for (offset = 0; offset < len;
+	     offset += sls_wal_range_size(range->size)) {
+		range = (struct sls_wal_range *)&block->data[offset];
+		memcpy(range->dest, range->data, range->size);
+	}
 }
 
-/* Allocate a new block in the log. */
-static struct sls_wal_block *
-sls_wal_reserve(struct sls_wal *wal, size_t size)
+/* Replay the complete blocks of a segment, return where they end. */
+static size_t
+sls_wal_replay_segment(struct sls_wal *wal, unsigned int idx)
 {
-	struct sls_wal_header *header = sls_wal_header(wal);
-	size_t block_size = sls_wal_block_size(size);
-	size_t offset;
+	struct sls_wal_block *block;
+	char *data = sls_wal_segdata(wal, idx);
+	size_t offset = 0, len, size;
+
+	while (offset + sizeof(*block) <= wal->segsize) {
+		block = (struct sls_wal_block *)(data + offset);
+		len = block->len;
+		if (len == 0)
+			// A snapshot was taken before the block was
+			// described, so stop here
+			break;
 
-	if (block_size > sls_wal_max_size(wal))
-		return (NULL);
+		/* Skip blocks, and so transactions, that never completed. */
+		size = atomic_load_explicit(&block->size, memory_order_relaxed);
+		if (size == len)
+			sls_wal_apply(block, len);
 
-	offset = atomic_fetch_add(&header->offset, block_size);
-	if (offset + block_size <= wal->size)
-		return ((struct sls_wal_block *)(wal->mapping + offset));
-	else
-		return (NULL);
+		offset += sls_wal_block_size(len);
+	}
+
+	return (offset);
 }
 
-/* Wait for a complete snapshot to occur, then clear the log. */
+/*
+ * Wait for a complete snapshot to cover a full segment, then clear it.
+ * Called with the mutex held, which is dropped while waiting.
+ */
 static void
-sls_wal_full_checkpoint(struct sls_wal *wal)
+sls_wal_recycle(struct sls_wal *wal, unsigned int idx)
 {
-	struct sls_wal_header *header = sls_wal_header(wal);
-	size_t offset;
+	struct sls_wal_segment *seg = &sls_wal_header(wal)->segs[idx];
+	uint64_t epoch = wal->epoch;
 	int error;
 
-	error = sls_untilepoch(wal->oid, wal->epoch);
+	seg->state = SLSWAL_RECYCLING;
+	pthread_mutex_unlock(&wal->mutex);
+
+	/* Writers that reserved a block before the switch are done soon. */
+	while (atomic_load(&seg->inflight) > 0)
+		sched_yield();
+
+	error = sls_untilepoch(wal->oid, epoch);
 	if (error != 0)
 		abort();
 
+	/* Clear the generation first so replay skips the segment. */
+	seg->gen = 0;
+	memset(sls_wal_segdata(wal, idx), 0, wal->segsize);
+	atomic_store(&seg->offset, 0);
+
+	pthread_mutex_lock(&wal->mutex);
+	seg->state = SLSWAL_FREE;
+	pthread_cond_broadcast(&wal->cond);
+}
+
+/* Make the other segment active after the current one filled up. */
+static void
+sls_wal_switch(struct sls_wal *wal, unsigned int idx)
+{
+	struct sls_wal_header *header = sls_wal_header(wal);
+	struct sls_wal_segment *cur = &header->segs[idx];
+	struct sls_wal_segment *next = &header->segs[idx ^ 1];
+
 	pthread_mutex_lock(&wal->mutex);
+	while (atomic_load(&header->active) == idx &&
+	    next->state != SLSWAL_FREE) {
+		if (next->state == SLSWAL_SEALED)
+			sls_wal_recycle(wal, idx ^ 1);
+		else
+			pthread_cond_wait(&wal->cond, &wal->mutex);
+	}
 
-	offset = atomic_load_explicit(&header->offset, memory_order_relaxed);
-	if (offset >= wal->size) {
-		memset(wal->mapping + sizeof(*header), 0,
-		    wal->size - sizeof(*header));
-		atomic_store(&header->offset, sizeof(*header));
+	/* Someone else already switched. */
+	if (atomic_load(&header->active) != idx) {
+		pthread_mutex_unlock(&wal->mutex);
+		return;
 	}
 
+	/* Fail all further reservations in the full segment. */
+	atomic_fetch_add(&cur->offset, wal->segsize);
+	cur->state = SLSWAL_SEALED;
+
+	next->gen = cur->gen + 1;
+	next->state = SLSWAL_ACTIVE;
+	atomic_store(&header->active, idx ^ 1);
+
+	sls_wal_recycle(wal, idx);
 	pthread_mutex_unlock(&wal->mutex);
 }
 
+/*
+ * Reserve a block in the active segment, switching segments if it is full.
+ * The block is counted as in flight in the segment until the caller is done.
+ */
+static struct sls_wal_block *
+sls_wal_reserve(struct sls_wal *wal, size_t len, struct sls_wal_segment **segp)
+{
+	struct sls_wal_header *header = sls_wal_header(wal);
+	struct sls_wal_block *block;
+	struct sls_wal_segment *seg;
+	unsigned int idx;
+
+	for (;;) {
+		idx = atomic_load(&header->active);
+		seg = &header->segs[idx];
+
+		atomic_fetch_add(&seg->inflight, 1);
+
+		/*
+		 * The segment may have been sealed and recycled before we
+		 * marked ourselves as in flight. Recycling only waits for the
+		 * writers it can see, so check again and retry if we lost.
+		 */
+		if (atomic_load(&header->active) != idx ||
+		    atomic_load(&seg->state) != SLSWAL_ACTIVE) {
+			atomic_fetch_sub(&seg->inflight, 1);
+			continue;
+		}
+
+		block = sls_wal_reserve_segment(wal, idx, len);
+		if (block != NULL)
+			break;
+
+		atomic_fetch_sub(&seg->inflight, 1);
+		sls_wal_switch(wal, idx);
+	}
+
+	block->len = len;
+	*segp = seg;
+
+	return (block);
+}
+
 int
 sls_wal_open(struct sls_wal *wal, uint64_t oid, size_t size)
 {
 	struct sls_wal_header *header;
 	size_t total_size = size + 2 * PAGE_SIZE;
+	size_t align_mask = alignof(struct sls_wal_block) - 1;
 	int error;
 
+	if (size <= sizeof(*header)) {
+		errno = EINVAL;
+		goto err;
+	}
+
 	error = sls_attach(SLS_DEFAULT_PARTITION, getpid());
 	if (error != 0)
 		goto err;
@@ -150,16 +300,25 @@ sls_wal_open(struct sls_wal *wal, uint64_t oid, size_t size)
 		goto err_munmap;
 
 	wal->size = size;
+	wal->segsize = ((size - sizeof(*header)) / SLSWAL_SEGMENTS) &
+	    ~align_mask;
 	wal->oid = oid;
+	wal->sync_gen = 0;
+	wal->sync_done = 0;
+	wal->syncing = 0;
+	wal->sync_error = 0;
 
 	if (pthread_mutex_init(&wal->mutex, NULL) != 0)
 		goto err_munmap;
 
-	header = sls_wal_header(wal);
-	atomic_store_explicit(
-	    &header->offset, sizeof(*header), memory_order_relaxed);
+	if (pthread_cond_init(&wal->cond, NULL) != 0)
+		goto err_mutex;
 
-	memset(wal->mapping + sizeof(*header), 0, size - sizeof(*header));
+	memset(wal->mapping, 0, size);
+	header = sls_wal_header(wal);
+	header->segs[0].state = SLSWAL_ACTIVE;
+	header->segs[0].gen = 1;
+	atomic_store(&header->active, 0);
 
 	error = sls_checkpoint_epoch(oid, true, &wal->epoch);
 	if (error != 0)
@@ -168,11 +327,10 @@ sls_wal_open(struct sls_wal *wal, uint64_t oid, size_t size)
 	return (0);
 
 err_checkpoint:
-	pthread_mutex_destroy(&wal->mutex);
+	pthread_cond_destroy(&wal->cond);
 
-	/* Unmap the guard pages created by overlaying the WAL. */
-	munmap(&wal->mapping, PAGE_SIZE);
-	munmap(&wal->mapping + PAGE_SIZE + size, PAGE_SIZE);
+err_mutex:
+	pthread_mutex_destroy(&wal->mutex);
 
 err_munmap:
 	munmap(mapping, total_size);
@@ -190,48 +348,215 @@ void
 sls_wal_memcpy(struct sls_wal *wal, void *dest, const void *src, size_t size)
 {
 	struct sls_wal_block *block;
+	struct sls_wal_segment *seg;
+	int error;
 
 	memcpy(dest, src, size);
+	if (size == 0)
+		return;
 
-	block = sls_wal_reserve(wal, size);
-	if (block == NULL) {
-		sls_wal_full_checkpoint(wal);
+	/* The write can't be logged, wait for a snapshot to include it. */
+	if (sls_wal_block_size(size) > wal->segsize) {
+		error = sls_untilepoch(wal->oid, wal->epoch);
+		if (error != 0)
+			abort();
 		return;
 	}
 
+	block = sls_wal_reserve(wal, size, &seg);
 	memcpy(block->data, src, size);
 	block->dest = dest;
 	atomic_store(&block->size, size);
+	atomic_fetch_sub(&seg->inflight, 1);
+}
+
+void
+sls_wal_begin(struct sls_wal *wal, struct sls_wal_txn *txn)
+{
+	txn->wal = wal;
+	txn->buf = NULL;
+	txn->len = 0;
+	txn->cap = 0;
 }
 
 int
-sls_wal_sync(struct sls_wal *wal)
+sls_wal_append(
+    struct sls_wal_txn *txn, void *dest, const void *src, size_t size)
 {
-	return (sls_memsnap_epoch(wal->oid, wal->mapping, &wal->epoch));
+	struct sls_wal_range *range, *match = NULL;
+	char *start = dest, *end = start + size;
+	char *rstart, *rend;
+	size_t offset, rsize, cap;
+	char *buf;
+
+	if (size == 0)
+		return (0);
+
+	/*
+	 * Fold the write into the last range that covers it, as long as no
+	 * range after that one overlaps it.
+	 */
+	for (offset = 0; offset < txn->len;
+	     offset += sls_wal_range_size(range->size)) {
+		range = (struct sls_wal_range *)(txn->buf + offset);
+		rstart = range->dest;
+		rend = rstart + range->size;
+		if (rstart <= start && end <= rend)
+			match = range;
+		else if (start < rend && rstart < end)
+			match = NULL;
+	}
+
+	if (match != NULL) {
+		memcpy(&match->data[start - (char *)match->dest], src, size);
+		return (0);
+	}
+
+	rsize = sls_wal_range_size(size);
+	if (txn->len + rsize > txn->cap) {
+		cap = (txn->cap > 0) ? txn->cap : PAGE_SIZE;
+		while (cap < txn->len + rsize)
+			cap *= 2;
+
+		buf = realloc(txn->buf, cap);
+		if (buf == NULL)
+			return (-1);
+
+		txn->buf = buf;
+		txn->cap = cap;
+	}
+
+	range = (struct sls_wal_range *)(txn->buf + txn->len);
+	range->dest = dest;
+	range->size = size;
+	memcpy(range->data, src, size);
+	txn->len += rsize;
+
+	return (0);
+}
+
+/*
+ * The writes only reach memory after the block is marked complete, so a
+ * snapshot sees either none of them or a block that replays all of them.
+ */
+int
+sls_wal_commit(struct sls_wal_txn *txn)
+{
+	struct sls_wal *wal = txn->wal;
+	struct sls_wal_block *block;
+	struct sls_wal_segment *seg;
+
+	if (txn->len == 0) {
+		sls_wal_abort(txn);
+		return (0);
+	}
+
+	if (sls_wal_block_size(txn->len) > wal->segsize) {
+		sls_wal_abort(txn);
+		errno = E2BIG;
+		return (-1);
+	}
+
+	block = sls_wal_reserve(wal, txn->len, &seg);
+	block->dest = NULL;
+	memcpy(block->data, txn->buf, txn->len);
+	atomic_store(&block->size, txn->len);
+
+	sls_wal_apply(block, txn->len);
+	atomic_fetch_sub(&seg->inflight, 1);
+
+	sls_wal_abort(txn);
+
+	return (0);
 }
 
 void
-sls_wal_replay(struct sls_wal *wal)
+sls_wal_abort(struct sls_wal_txn *txn)
 {
-	struct sls_wal_header *header = sls_wal_header(wal);
-	struct sls_wal_block *block = sls_wal_first(wal);
-	size_t offset = sizeof(*header), size;
+	free(txn->buf);
+	txn->buf = NULL;
+	txn->len = 0;
+	txn->cap = 0;
+}
 
-	while (block) {
-		size = atomic_load_explicit(&block->size, memory_order_relaxed);
-		if (size == 0)
-			// A snapshot was taken with an incomplete block, so
-			// stop here
-			break;
+/*
+ * Concurrent callers share a snapshot. A snapshot already in progress may
+ * have missed the caller's writes, so wait for one that starts after the
+ * call.
+ */
+int
+sls_wal_sync(struct sls_wal *wal)
+{
+	uint64_t target, epoch;
+	int error;
 
-		memcpy(block->dest, block->data, size);
-		offset += sls_wal_block_size(size);
-		block = sls_wal_next(wal, block);
+	pthread_mutex_lock(&wal->mutex);
+	target = wal->sync_gen + 1;
+	while (wal->sync_done < target) {
+		if (wal->syncing) {
+			pthread_cond_wait(&wal->cond, &wal->mutex);
+			continue;
+		}
+
+		wal->syncing = 1;
+		wal->sync_gen += 1;
+		pthread_mutex_unlock(&wal->mutex);
+
+		error = sls_memsnap_epoch(wal->oid, wal->mapping, &epoch);
+
+		pthread_mutex_lock(&wal->mutex);
+		if (error == 0)
+			wal->epoch = epoch;
+		wal->sync_error = error;
+		wal->sync_done = wal->sync_gen;
+		wal->syncing = 0;
+		pthread_cond_broadcast(&wal->cond);
 	}
 
-	// Clear any incomplete blocks
-	memset(wal->mapping + offset, 0, wal->size - offset);
-	atomic_store_explicit(&header->offset, offset, memory_order_relaxed);
+	error = wal->sync_error;
+	pthread_mutex_unlock(&wal->mutex);
+
+	return (error);
+}
+
+void
+sls_wal_replay(struct sls_wal *wal)
+{
+	struct sls_wal_header *header = sls_wal_header(wal);
+	struct sls_wal_segment *seg;
+	unsigned int order[SLSWAL_SEGMENTS];
+	size_t offset;
+	int i;
+
+	/* Replay the older segment first. */
+	order[0] = (header->segs[0].gen <= header->segs[1].gen) ? 0 : 1;
+	order[1] = order[0] ^ 1;
+
+	for (i = 0; i < SLSWAL_SEGMENTS; i++) {
+		seg = &header->segs[order[i]];
+		offset = 0;
+		if (seg->gen != 0)
+			offset = sls_wal_replay_segment(wal, order[i]);
+
+		// Clear any incomplete blocks
+		memset(sls_wal_segdata(wal, order[i]) + offset, 0,
+		    wal->segsize - offset);
+		atomic_store_explicit(
+		    &seg->offset, offset, memory_order_relaxed);
+		atomic_store_explicit(&seg->inflight, 0, memory_order_relaxed);
+
+		if (i == SLSWAL_SEGMENTS - 1) {
+			/* The newer segment keeps receiving writes. */
+			if (seg->gen == 0)
+				seg->gen = header->segs[order[0]].gen + 1;
+			seg->state = SLSWAL_ACTIVE;
+			atomic_store(&header->active, order[i]);
+		} else {
+			seg->state = (offset > 0) ? SLSWAL_SEALED : SLSWAL_FREE;
+			if (offset == 0)
+				seg->gen = 0;
+		}
+	}
 }
 
 int
@@ -240,6 +565,11 @@ sls_wal_close(struct sls_wal *wal)
 	int ret = 0, error = 0;
 	size_t total_size = wal->size + 2 * PAGE_SIZE;
 
+	if (pthread_cond_destroy(&wal->cond) != 0) {
+		ret = -1;
+		error = errno;
+	}
+
 	if (pthread_mutex_destroy(&wal->mutex) != 0) {
 		ret = -1;
 		error = errno;
@@ -2,6 +2,9 @@
 #define _METR_INTERNAL_
 
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 
 #include <netinet/in.h>
 #include <netinet/in_pcb.h>
@@ -32,6 +35,41 @@ struct metr_accept {
 #define metac_in metac_sa.in
 
 #define METR_MAXLAMBDAS (65536)
+#define METR_POOLMAX (64)
+
+struct metr_pool;
+
+/* A function instance restored ahead of its invocation. */
+struct metr_instance {
+	TAILQ_ENTRY(metr_instance) mi_next; /* Entry in the idle list */
+	struct metr_pool *mi_pool;	    /* Pool of the instance */
+	struct metr_listen *mi_lsp;	    /* Listen state of the function */
+	struct metr_accept mi_ac;	    /* Socket handed at invocation */
+	struct proc *mi_proc;		    /* Accepting process */
+	int mi_state;			    /* Instance state */
+};
+
+#define METRI_RESTORING (0) /* Restore in progress */
+#define METRI_CLAIMED (1)   /* The accepting process was restored */
+#define METRI_IDLE (2)	    /* Waiting for an invocation */
+#define METRI_INVOKED (3)   /* Handed an accepted socket */
+#define METRI_DRAINED (4)   /* Torn down without being invoked */
+
+/* Instances of a function kept restored and waiting for invocations. */
+struct metr_pool {
+	TAILQ_HEAD(, metr_instance) mp_idle; /* Instances ready to be invoked */
+	uint64_t mp_oid;		     /* Partition of the function */
+	int mp_size;			     /* Target number of instances */
+	int mp_nidle;			     /* Instances in the idle list */
+	int mp_pending;			     /* Instances being restored */
+	bool mp_draining;		     /* The pool is being torn down */
+	uint64_t mp_claims;		     /* Instances fully restored */
+	uint64_t mp_hits;		     /* Invocations served from pool */
+	uint64_t mp_misses;		     /* Invocations restored inline */
+	struct task mp_task;		     /* Refills the pool */
+	struct task mp_draintask;	     /* Destroys a deleted pool */
+	struct sysctl_ctx_list mp_sysctx;    /* Statistics */
+};
 
 struct metr_metadata {
 	struct mtx metrm_mtx;	       /* Structure mutex. */
@@ -42,6 +80,13 @@ struct metr_metadata {
 
 	/* Maximum amount of registered lambdas. */
 	struct metr_listen metrm_listen[METR_MAXLAMBDAS];
+
+	/* Pools of restored instances, created on demand. */
+	struct metr_pool *metrm_pools[METR_MAXLAMBDAS];
+	struct taskqueue *metrm_pooltq; /* Restores pooled instances */
+	uint64_t metrm_pooled;		/* Live pooled instances */
+	struct sysctl_ctx_list metrm_sysctx;
+	struct sysctl_oid *metrm_sysroot;
 };
 
 #define METR_ASSERT_LOCKED() (mtx_assert(&metrm.metrm_mtx, MA_OWNED))
@@ -61,6 +106,15 @@ extern struct metr_metadata metrm;
 
 int metr_restore(uint64_t oid, struct metr_listen *lsp,
     struct metr_accept *acp);
+int metr_restore_pooled(uint64_t oid, struct metr_instance *mi);
+
+int metr_pool_init(void);
+void metr_pool_fini(void);
+void metr_pool_fill(uint64_t oid);
+int metr_pool_invoke(uint64_t oid, struct metr_accept *acp);
+void metr_pool_claim(struct metr_instance *mi, struct proc *p);
+int metr_pool_park(struct metr_instance *mi);
+void metr_pool_release(struct metr_instance *mi);
 
 void metrsys_initsysvec(void);
 void metrsys_finisysvec(void);
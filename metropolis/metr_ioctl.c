@@ -134,6 +134,10 @@ metr_invoke(struct metr_invoke_args *args)
 	if (error != 0)
 		return (error);
 
+	/* Hand the socket off to an already restored instance if possible. */
+	if (metr_pool_invoke(oid, &ac) == 0)
+		return (0);
+
 	error = metr_restore(oid, lsp, &ac);
 	if (error != 0) {
 		fdrop(ac.metac_fp, td);
@@ -192,6 +196,14 @@ MetrHandler(struct module *inModule, int inEvent, void *inArg)
 
 		metrsys_initsysvec();
 
+		error = metr_pool_init();
+		if (error != 0) {
+			metrsys_finisysvec();
+			cv_destroy(&metrm.metrm_exitcv);
+			mtx_destroy(&metrm.metrm_mtx);
+			return (error);
+		}
+
 		error = metr_import();
 		if (error != 0)
 			METR_WARN("Could not import lambdas, error %d\n",
@@ -213,6 +225,9 @@ MetrHandler(struct module *inModule, int inEvent, void *inArg)
 		if (cdev != NULL)
 			destroy_dev(cdev);
 
+		/* Parked instances must exit before we kill the rest. */
+		metr_pool_fini();
+
 		METR_LOCK();
 		sls_kill(metr_kill_always);
 
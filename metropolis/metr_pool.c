@@ -0,0 +1,474 @@
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/condvar.h>
+#include <sys/file.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/priority.h>
+#include <sys/proc.h>
+#include <sys/queue.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+
+#include "../sls/sls_partition.h"
+#include "metr_internal.h"
+
+/*
+ * Invocation pools. Restoring a function is most of the latency of a cold
+ * invocation, so for partitions with a nonzero attr_poolsize we restore
+ * instances in the background and park them in the kernel right before they
+ * would return from accept(). An invocation then only has to hand the
+ * accepted socket to a parked instance and wake it up.
+ */
+
+static void metr_pool_refill(void *ctx, int __unused pending);
+static void metr_pool_drain(void *ctx, int __unused pending);
+
+static int
+metr_pool_size(uint64_t oid)
+{
+	struct slspart *slsp;
+	int size;
+
+	slsp = slsp_find(oid);
+	if (slsp == NULL)
+		return (0);
+
+	size = imin(slsp->slsp_attr.attr_poolsize, METR_POOLMAX);
+	slsp_deref(slsp);
+
+	return (size);
+}
+
+static struct metr_pool *
+metr_pool_create(uint64_t oid)
+{
+	struct sysctl_oid *root;
+	struct metr_pool *mp;
+	char name[32];
+
+	mp = malloc(sizeof(*mp), M_METR, M_WAITOK | M_ZERO);
+	TAILQ_INIT(&mp->mp_idle);
+	mp->mp_oid = oid;
+	TASK_INIT(&mp->mp_task, 0, metr_pool_refill, mp);
+	TASK_INIT(&mp->mp_draintask, 0, metr_pool_drain, mp);
+
+	snprintf(name, sizeof(name), "%lu", oid);
+	sysctl_ctx_init(&mp->mp_sysctx);
+	root = SYSCTL_ADD_NODE(&mp->mp_sysctx,
+	    SYSCTL_CHILDREN(metrm.metrm_sysroot), OID_AUTO, name,
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "Metropolis function pool");
+	if (root == NULL)
+		return (mp);
+
+	(void)SYSCTL_ADD_U64(&mp->mp_sysctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "hits", CTLFLAG_RD, &mp->mp_hits, 0,
+	    "Invocations served by a pooled instance");
+	(void)SYSCTL_ADD_U64(&mp->mp_sysctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "misses", CTLFLAG_RD, &mp->mp_misses, 0,
+	    "Invocations restored on demand");
+	(void)SYSCTL_ADD_INT(&mp->mp_sysctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "idle", CTLFLAG_RD, &mp->mp_nidle, 0,
+	    "Instances waiting for an invocation");
+	(void)SYSCTL_ADD_INT(&mp->mp_sysctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "size", CTLFLAG_RD, &mp->mp_size, 0, "Target pool size");
+
+	return (mp);
+}
+
+static void
+metr_pool_destroy(struct metr_pool *mp)
+{
+	KASSERT(TAILQ_EMPTY(&mp->mp_idle), ("destroying pool with instances"));
+	sysctl_ctx_free(&mp->mp_sysctx);
+	free(mp, M_METR);
+}
+
+/* Get the pool of the function, creating it if necessary. */
+static struct metr_pool *
+metr_pool_get(uint64_t oid)
+{
+	struct metr_pool *mp, *newmp;
+
+	METR_ASSERT_LOCKED();
+
+	mp = metrm.metrm_pools[oid];
+	if (mp != NULL)
+		return (mp);
+
+	METR_UNLOCK();
+	newmp = metr_pool_create(oid);
+	METR_LOCK();
+
+	/* Check if we raced with another invocation. */
+	mp = metrm.metrm_pools[oid];
+	if (mp != NULL) {
+		METR_UNLOCK();
+		metr_pool_destroy(newmp);
+		METR_LOCK();
+		return (mp);
+	}
+
+	metrm.metrm_pools[oid] = newmp;
+
+	return (newmp);
+}
+
+/*
+ * Restore instances until the pool is full. Stop on the first failure, the
+ * next invocation will retry.
+ */
+static void
+metr_pool_refill(void *ctx, int __unused pending)
+{
+	struct metr_pool *mp = (struct metr_pool *)ctx;
+	struct metr_instance *mi;
+	uint64_t claims;
+	int error;
+
+	for (;;) {
+		METR_LOCK();
+		if (mp->mp_draining ||
+		    mp->mp_nidle + mp->mp_pending >= mp->mp_size) {
+			METR_UNLOCK();
+			return;
+		}
+
+		mp->mp_pending += 1;
+		metrm.metrm_pooled += 1;
+		claims = mp->mp_claims;
+		METR_UNLOCK();
+
+		mi = malloc(sizeof(*mi), M_METR, M_WAITOK | M_ZERO);
+		mi->mi_pool = mp;
+		mi->mi_lsp = &metrm.metrm_listen[mp->mp_oid];
+		mi->mi_state = METRI_RESTORING;
+
+		error = metr_restore_pooled(mp->mp_oid, mi);
+
+		/*
+		 * Once claimed, the instance belongs to the restored process
+		 * and may already be gone. The pool task is the only one
+		 * restoring instances, so the counter tells us if it was.
+		 */
+		METR_LOCK();
+		if (mp->mp_claims != claims) {
+			METR_UNLOCK();
+			continue;
+		}
+
+		mp->mp_pending -= 1;
+		METR_UNLOCK();
+
+		METR_WARN("could not restore pooled instance, error %d\n",
+		    error);
+		metr_pool_release(mi);
+		return;
+	}
+}
+
+/* Wake up the idle instances of a draining pool so that they exit. */
+static void
+metr_pool_wakeidle(struct metr_pool *mp)
+{
+	struct metr_instance *mi;
+
+	METR_ASSERT_LOCKED();
+
+	while ((mi = TAILQ_FIRST(&mp->mp_idle)) != NULL) {
+		TAILQ_REMOVE(&mp->mp_idle, mi, mi_next);
+		mp->mp_nidle -= 1;
+		mi->mi_state = METRI_DRAINED;
+		wakeup(mi);
+	}
+}
+
+/*
+ * Destroy a pool removed by metr_pool_delete(). We run in the pool thread,
+ * so no refills are in progress, but instances still being restored use the
+ * pool until they park.
+ */
+static void
+metr_pool_drain(void *ctx, int __unused pending)
+{
+	struct metr_pool *mp = (struct metr_pool *)ctx;
+
+	METR_LOCK();
+	while (mp->mp_pending > 0)
+		mtx_sleep(&mp->mp_pending, &metrm.metrm_mtx, PI_DULL,
+		    "metrdrain", 0);
+	METR_UNLOCK();
+
+	metr_pool_destroy(mp);
+}
+
+/*
+ * The partition of the function is being destroyed, tear down its pool. We
+ * may be called from the pool thread itself, so leave the rest to it.
+ */
+static void
+metr_pool_delete(uint64_t oid)
+{
+	struct metr_pool *mp;
+
+	if (oid >= METR_MAXLAMBDAS)
+		return;
+
+	METR_LOCK();
+	mp = metrm.metrm_pools[oid];
+	if (mp == NULL || metrm.metrm_pooltq == NULL) {
+		METR_UNLOCK();
+		return;
+	}
+
+	metrm.metrm_pools[oid] = NULL;
+	mp->mp_draining = true;
+	metr_pool_wakeidle(mp);
+	taskqueue_enqueue(metrm.metrm_pooltq, &mp->mp_draintask);
+	METR_UNLOCK();
+}
+
+/* Top up the pool of the function in the background. */
+void
+metr_pool_fill(uint64_t oid)
+{
+	struct metr_pool *mp;
+	int size;
+
+	size = metr_pool_size(oid);
+	if (size == 0)
+		return;
+
+	METR_LOCK();
+	mp = metr_pool_get(oid);
+	mp->mp_size = size;
+	if (!mp->mp_draining)
+		taskqueue_enqueue(metrm.metrm_pooltq, &mp->mp_task);
+	METR_UNLOCK();
+}
+
+/*
+ * Hand an accepted socket to a pooled instance of the function. Returns
+ * EAGAIN if no instance is ready, in which case the caller keeps ownership of
+ * the socket and restores the function itself.
+ */
+int
+metr_pool_invoke(uint64_t oid, struct metr_accept *acp)
+{
+	struct metr_instance *mi;
+	struct metr_pool *mp;
+	struct proc *p;
+	int size;
+
+	size = metr_pool_size(oid);
+	if (size == 0)
+		return (EAGAIN);
+
+	METR_LOCK();
+	mp = metr_pool_get(oid);
+	mp->mp_size = size;
+	if (mp->mp_draining) {
+		METR_UNLOCK();
+		return (EAGAIN);
+	}
+
+	mi = TAILQ_FIRST(&mp->mp_idle);
+	if (mi == NULL) {
+		mp->mp_misses += 1;
+		taskqueue_enqueue(metrm.metrm_pooltq, &mp->mp_task);
+		METR_UNLOCK();
+		return (EAGAIN);
+	}
+
+	/* The instance stays parked until we change its state. */
+	TAILQ_REMOVE(&mp->mp_idle, mi, mi_next);
+	mp->mp_nidle -= 1;
+	mp->mp_hits += 1;
+	taskqueue_enqueue(metrm.metrm_pooltq, &mp->mp_task);
+	METR_UNLOCK();
+
+	/*
+	 * The instance was forked by the pool thread. Make it a child of the
+	 * invoker, like it would be if the invoker had restored it.
+	 */
+	p = mi->mi_proc;
+	sx_xlock(&proctree_lock);
+	PROC_LOCK(p);
+	proc_reparent(p, curproc, true);
+	PROC_UNLOCK(p);
+	sx_xunlock(&proctree_lock);
+
+	METR_LOCK();
+	mi->mi_ac = *acp;
+	acp->metac_fp = NULL;
+	mi->mi_state = METRI_INVOKED;
+	wakeup(mi);
+	METR_UNLOCK();
+
+	return (0);
+}
+
+/* The accepting process of the instance has been restored. */
+void
+metr_pool_claim(struct metr_instance *mi, struct proc *p)
+{
+	METR_LOCK();
+	KASSERT(mi->mi_state == METRI_RESTORING,
+	    ("instance in state %d", mi->mi_state));
+	mi->mi_proc = p;
+	mi->mi_state = METRI_CLAIMED;
+	mi->mi_pool->mp_claims += 1;
+	METR_UNLOCK();
+}
+
+/*
+ * Called by the restored process of the instance. Wait until the instance is
+ * either invoked or drained.
+ */
+int
+metr_pool_park(struct metr_instance *mi)
+{
+	struct metr_pool *mp = mi->mi_pool;
+	int error;
+
+	METR_LOCK();
+	KASSERT(mi->mi_state == METRI_CLAIMED,
+	    ("instance in state %d", mi->mi_state));
+	mp->mp_pending -= 1;
+
+	if (mp->mp_draining) {
+		mi->mi_state = METRI_DRAINED;
+		if (mp->mp_pending == 0)
+			wakeup(&mp->mp_pending);
+	} else {
+		mi->mi_state = METRI_IDLE;
+		TAILQ_INSERT_TAIL(&mp->mp_idle, mi, mi_next);
+		mp->mp_nidle += 1;
+	}
+
+	while (mi->mi_state == METRI_IDLE) {
+		error = mtx_sleep(mi, &metrm.metrm_mtx, PI_DULL | PCATCH,
+		    "metrpool", 0);
+		if (error == EINTR || error == ERESTART)
+			break;
+	}
+
+	/* We were killed while idle, leave the pool and get replaced. */
+	if (mi->mi_state == METRI_IDLE) {
+		TAILQ_REMOVE(&mp->mp_idle, mi, mi_next);
+		mp->mp_nidle -= 1;
+		mi->mi_state = METRI_DRAINED;
+		if (!mp->mp_draining)
+			taskqueue_enqueue(metrm.metrm_pooltq, &mp->mp_task);
+	}
+
+	error = (mi->mi_state == METRI_INVOKED) ? 0 : ECANCELED;
+	METR_UNLOCK();
+
+	return (error);
+}
+
+/* Free an instance that is done with the pool. */
+void
+metr_pool_release(struct metr_instance *mi)
+{
+	if (mi->mi_ac.metac_fp != NULL)
+		fdrop(mi->mi_ac.metac_fp, curthread);
+	free(mi, M_METR);
+
+	METR_LOCK();
+	metrm.metrm_pooled -= 1;
+	if (metrm.metrm_pooled == 0)
+		cv_broadcast(&metrm.metrm_exitcv);
+	METR_UNLOCK();
+}
+
+int
+metr_pool_init(void)
+{
+	int error;
+
+	metrm.metrm_pooltq = taskqueue_create("metrpool", M_WAITOK,
+	    taskqueue_thread_enqueue, &metrm.metrm_pooltq);
+	if (metrm.metrm_pooltq == NULL)
+		return (ENOMEM);
+
+	error = taskqueue_start_threads(&metrm.metrm_pooltq, 1, PVM,
+	    "Metropolis pool thread");
+	if (error != 0) {
+		taskqueue_free(metrm.metrm_pooltq);
+		metrm.metrm_pooltq = NULL;
+		return (error);
+	}
+
+	slsp_fini_hook = metr_pool_delete;
+
+	sysctl_ctx_init(&metrm.metrm_sysctx);
+	metrm.metrm_sysroot = SYSCTL_ADD_ROOT_NODE(&metrm.metrm_sysctx,
+	    OID_AUTO, "aurora_metropolis", CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+	    "Metropolis statistics");
+	if (metrm.metrm_sysroot == NULL) {
+		slsp_fini_hook = NULL;
+		taskqueue_free(metrm.metrm_pooltq);
+		metrm.metrm_pooltq = NULL;
+		sysctl_ctx_free(&metrm.metrm_sysctx);
+		return (ENOMEM);
+	}
+
+	return (0);
+}
+
+/*
+ * Tear down all pools. Parked instances are woken up and exit on their own,
+ * so this must be done before killing the remaining Metropolis processes.
+ */
+void
+metr_pool_fini(void)
+{
+	struct metr_pool *mp;
+	int i;
+
+	if (metrm.metrm_pooltq == NULL)
+		return;
+
+	/* Pools of partitions deleted from now on go away with the rest. */
+	slsp_fini_hook = NULL;
+
+	METR_LOCK();
+	for (i = 0; i < METR_MAXLAMBDAS; i++) {
+		if (metrm.metrm_pools[i] != NULL)
+			metrm.metrm_pools[i]->mp_draining = true;
+	}
+	METR_UNLOCK();
+
+	/* No new restores start after this. */
+	taskqueue_drain_all(metrm.metrm_pooltq);
+	taskqueue_free(metrm.metrm_pooltq);
+	metrm.metrm_pooltq = NULL;
+
+	METR_LOCK();
+	for (i = 0; i < METR_MAXLAMBDAS; i++) {
+		mp = metrm.metrm_pools[i];
+		if (mp != NULL)
+			metr_pool_wakeidle(mp);
+	}
+
+	/* Wait for all instances to leave the module. */
+	while (metrm.metrm_pooled > 0)
+		cv_wait(&metrm.metrm_exitcv, &metrm.metrm_mtx);
+	METR_UNLOCK();
+
+	for (i = 0; i < METR_MAXLAMBDAS; i++) {
+		mp = metrm.metrm_pools[i];
+		if (mp == NULL)
+			continue;
+
+		metrm.metrm_pools[i] = NULL;
+		metr_pool_destroy(mp);
+	}
+
+	sysctl_ctx_free(&metrm.metrm_sysctx);
+}
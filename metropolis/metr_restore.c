@@ -4,6 +4,7 @@
 #include <sys/file.h>
 #include <sys/filedesc.h>
 #include <sys/proc.h>
+#include <sys/signalvar.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
 #include <sys/syscallsubr.h>
@@ -186,7 +187,7 @@ metr_restore(uint64_t oid, struct metr_listen *lsp, struct metr_accept *acp)
 		.lsp = lsp,
 	};
 
-	error = sls_rest(slsp, 0, metr_slscb, &cb_args);
+	error = sls_rest(slsp, 0, metr_slscb, NULL, &cb_args);
 
 done:
 	if (slsp != NULL) {
@@ -196,3 +197,82 @@ done:
 
 	return (error);
 }
+
+/* Restore the listening socket of a pooled instance. */
+static void
+metr_poolcb(struct proc *p, void *data)
+{
+	struct metr_instance *mi = (struct metr_instance *)data;
+	int error;
+
+	if (p->p_oldoid != mi->mi_lsp->metls_proc)
+		return;
+
+	error = metr_listen(mi->mi_lsp);
+	if (error != 0)
+		METR_WARN("Did not restore listening socket %d\n", error);
+
+	metr_pool_claim(mi, p);
+}
+
+/*
+ * Park the accepting process of a pooled instance until it gets invoked, then
+ * complete its accept() call. Instances drained before being invoked exit.
+ */
+static void
+metr_poolreadycb(struct proc *p, void *data)
+{
+	struct metr_instance *mi = (struct metr_instance *)data;
+	struct metr_listen *lsp = mi->mi_lsp;
+	struct thread *td;
+	int error;
+
+	if (p->p_oldoid != lsp->metls_proc)
+		return;
+
+	error = metr_pool_park(mi);
+	if (error != 0) {
+		PROC_LOCK(p);
+		kern_psignal(p, SIGKILL);
+		PROC_UNLOCK(p);
+		metr_pool_release(mi);
+		return;
+	}
+
+	FOREACH_THREAD_IN_PROC (p, td) {
+		if (lsp->metls_td != td->td_oldtid)
+			continue;
+
+		error = metr_connect(td, lsp, &mi->mi_ac);
+		if (error != 0)
+			METR_WARN("Did not attach accepted socket %d\n", error);
+
+		break;
+	}
+
+	metr_pool_release(mi);
+}
+
+int
+metr_restore_pooled(uint64_t oid, struct metr_instance *mi)
+{
+	struct slspart *slsp;
+	int error;
+
+	slsp = slsp_find(oid);
+	if (slsp == NULL)
+		return (EINVAL);
+
+	if (!slsp_restorable(slsp)) {
+		error = EINVAL;
+		goto done;
+	}
+
+	error = sls_rest(slsp, 0, metr_poolcb, metr_poolreadycb, mi);
+
+done:
+	slsp_signal(slsp, error);
+	slsp_deref(slsp);
+
+	return (error);
+}
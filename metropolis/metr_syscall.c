@@ -92,6 +92,9 @@ metrsys_checkpoint(struct thread *td, int s)
 	if (error != 0)
 		return (error);
 
+	/* Start restoring instances for the first invocations. */
+	metr_pool_fill(oid);
+
 	/* Have the process exit. This also means exiting Metropolis mode. */
 	exit1(td, 0, 0);
 	panic("Process failed to exit");
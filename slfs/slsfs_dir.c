@@ -3,12 +3,16 @@
 #include <sys/systm.h>
 #include <sys/buf.h>
 #include <sys/dirent.h>
+#include <sys/fnv_hash.h>
+#include <sys/malloc.h>
 #include <sys/namei.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/vnode.h>
 
+#include <machine/atomic.h>
+
 #include <vm/uma.h>
 
 #include <slos.h>
@@ -22,40 +26,441 @@
 #include "slsfs_buf.h"
 #include "slsfs_dir.h"
 
+/*
+ * A directory is a sequence of variable-length dirent records, none of which
+ * straddle a block. The d_reclen of a record is the space it owns, which
+ * grows when the record after it is removed, and a zero d_fileno marks a
+ * record as free. A zero d_reclen ends the block. Directories written before
+ * records were compact hold sizeof(struct dirent) records, which walk the
+ * same way, so they are used in place and only new entries are compact.
+ *
+ * Records never move, so their offsets double as readdir cookies and as the
+ * values of the in-memory name index of large directories. The index is a
+ * cache that is built on first use and dropped when memory is short.
+ */
+
+static MALLOC_DEFINE(M_SLSFS_DIR, "slsfs_dirhash", "SLSFS directory index");
+
+int slsfs_dirhash_minblks = 2;
+uint64_t slsfs_dirhash_maxmem = 32 * 1024 * 1024;
+uint64_t slsfs_dirhash_mem = 0;
+
+#define DIRSLOT_EMPTY (UINT64_MAX)
+#define DIRSLOT_DELETED (UINT64_MAX - 1)
+#define DIRHASH_MINSLOTS (64)
+
+struct slsfs_dirslot {
+	uint64_t ds_off;  /* Offset of the record in the directory */
+	uint32_t ds_hash; /* Hash of the record's name */
+};
+
+struct slsfs_dirhash {
+	struct slsfs_dirslot *dh_slots; /* Open addressed name table */
+	size_t dh_nslots;		/* Table size, a power of 2 */
+	size_t dh_used;			/* Slots not empty */
+	size_t dh_count;		/* Slots holding a record */
+	uint32_t *dh_blkfree;		/* Largest free space per block */
+	size_t dh_nblks;		/* Size of the free space array */
+};
+
+static uint32_t
+slsfs_dirhash_name(const char *name, size_t namelen)
+{
+	return (fnv_32_buf(name, namelen, FNV1_32_INIT));
+}
+
+static bool
+slsfs_dirhash_charge(size_t bytes)
+{
+	if (atomic_fetchadd_64(&slsfs_dirhash_mem, bytes) + bytes >
+	    slsfs_dirhash_maxmem) {
+		atomic_subtract_64(&slsfs_dirhash_mem, bytes);
+		return (false);
+	}
+
+	return (true);
+}
+
+static void
+slsfs_dirhash_uncharge(size_t bytes)
+{
+	atomic_subtract_64(&slsfs_dirhash_mem, bytes);
+}
+
+void
+slsfs_dirhash_free(struct slos_node *svp)
+{
+	struct slsfs_dirhash *dh = svp->sn_dirhash;
+
+	if (dh == NULL)
+		return;
+
+	slsfs_dirhash_uncharge(dh->dh_nslots * sizeof(*dh->dh_slots) +
+	    dh->dh_nblks * sizeof(*dh->dh_blkfree));
+	free(dh->dh_slots, M_SLSFS_DIR);
+	free(dh->dh_blkfree, M_SLSFS_DIR);
+	free(dh, M_SLSFS_DIR);
+	svp->sn_dirhash = NULL;
+}
+
+static void
+slsfs_dirhash_place(struct slsfs_dirhash *dh, uint32_t hash, uint64_t off)
+{
+	struct slsfs_dirslot *slot;
+	size_t mask = dh->dh_nslots - 1;
+	size_t i;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &dh->dh_slots[i];
+		if (slot->ds_off == DIRSLOT_EMPTY) {
+			dh->dh_used += 1;
+			break;
+		}
+
+		if (slot->ds_off == DIRSLOT_DELETED)
+			break;
+	}
+
+	slot->ds_off = off;
+	slot->ds_hash = hash;
+	dh->dh_count += 1;
+}
+
+/*
+ * Rebuild the table with room for the live records to stay at most half the
+ * table. This also clears out deleted slots.
+ */
+static int
+slsfs_dirhash_resize(struct slsfs_dirhash *dh)
+{
+	struct slsfs_dirslot *slots, *oslots = dh->dh_slots;
+	size_t nslots, onslots = dh->dh_nslots;
+	size_t i;
+
+	nslots = MAX(onslots, DIRHASH_MINSLOTS);
+	while ((dh->dh_count + 1) * 2 > nslots)
+		nslots *= 2;
+
+	if (nslots > onslots &&
+	    !slsfs_dirhash_charge((nslots - onslots) * sizeof(*slots)))
+		return (ENOMEM);
+
+	slots = malloc(nslots * sizeof(*slots), M_SLSFS_DIR, M_WAITOK);
+	memset(slots, 0xff, nslots * sizeof(*slots));
+
+	dh->dh_slots = slots;
+	dh->dh_nslots = nslots;
+	dh->dh_used = 0;
+	dh->dh_count = 0;
+
+	for (i = 0; i < onslots; i++) {
+		if (oslots[i].ds_off == DIRSLOT_EMPTY ||
+		    oslots[i].ds_off == DIRSLOT_DELETED)
+			continue;
+		slsfs_dirhash_place(dh, oslots[i].ds_hash, oslots[i].ds_off);
+	}
+
+	if (nslots < onslots)
+		slsfs_dirhash_uncharge((onslots - nslots) * sizeof(*slots));
+	free(oslots, M_SLSFS_DIR);
+
+	return (0);
+}
+
+static int
+slsfs_dirhash_insert(struct slsfs_dirhash *dh, uint32_t hash, uint64_t off)
+{
+	int error;
+
+	/* Keep the table at most 3/4 full so probes always end. */
+	if ((dh->dh_used + 1) * 4 > dh->dh_nslots * 3) {
+		error = slsfs_dirhash_resize(dh);
+		if (error != 0)
+			return (error);
+	}
+
+	slsfs_dirhash_place(dh, hash, off);
+
+	return (0);
+}
+
+static void
+slsfs_dirhash_remove(struct slsfs_dirhash *dh, uint32_t hash, uint64_t off)
+{
+	struct slsfs_dirslot *slot;
+	size_t mask = dh->dh_nslots - 1;
+	size_t i;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &dh->dh_slots[i];
+		KASSERT(slot->ds_off != DIRSLOT_EMPTY,
+		    ("record at %lu missing from the directory index", off));
+		if (slot->ds_off == off) {
+			slot->ds_off = DIRSLOT_DELETED;
+			dh->dh_count -= 1;
+			return;
+		}
+	}
+}
+
+static int
+slsfs_dirhash_setfree(struct slsfs_dirhash *dh, size_t blkno, size_t free)
+{
+	uint32_t *blkfree;
+	size_t nblks;
+
+	if (blkno >= dh->dh_nblks) {
+		nblks = MAX(dh->dh_nblks * 2, blkno + 1);
+		if (!slsfs_dirhash_charge(
+			(nblks - dh->dh_nblks) * sizeof(*blkfree)))
+			return (ENOMEM);
+
+		blkfree = malloc(
+		    nblks * sizeof(*blkfree), M_SLSFS_DIR, M_WAITOK | M_ZERO);
+		if (dh->dh_blkfree != NULL) {
+			memcpy(blkfree, dh->dh_blkfree,
+			    dh->dh_nblks * sizeof(*blkfree));
+			free(dh->dh_blkfree, M_SLSFS_DIR);
+		}
+
+		dh->dh_blkfree = blkfree;
+		dh->dh_nblks = nblks;
+	}
+
+	dh->dh_blkfree[blkno] = free;
+
+	return (0);
+}
+
+/*
+ * Return the record at the given block offset, or NULL if the block ends
+ * there.
+ */
+static struct dirent *
+slsfs_dirent_at(struct buf *bp, size_t off, size_t blksize)
+{
+	struct dirent *dir;
+
+	if (off + __offsetof(struct dirent, d_name) > blksize)
+		return (NULL);
+
+	dir = (struct dirent *)(bp->b_data + off);
+	if (dir->d_reclen == 0 || off + dir->d_reclen > blksize)
+		return (NULL);
+
+	KASSERT(GENERIC_DIRSIZ(dir) <= dir->d_reclen,
+	    ("dirent at %lu overflows its record", off));
+
+	return (dir);
+}
+
+#define DIRBLK_FOREACH(dir, off, bp, blksize)                       \
+	for ((off) = 0;                                             \
+	     ((dir) = slsfs_dirent_at((bp), (off), (blksize))) != NULL; \
+	     (off) += (dir)->d_reclen)
+
+/* The largest record that fits in the block without moving others. */
+static size_t
+slsfs_dirblk_free(struct buf *bp, size_t blksize)
+{
+	struct dirent *dir;
+	size_t largest = 0;
+	size_t off;
+
+	DIRBLK_FOREACH (dir, off, bp, blksize) {
+		if (dir->d_fileno == 0)
+			largest = MAX(largest, dir->d_reclen);
+		else
+			largest = MAX(
+			    largest, dir->d_reclen - GENERIC_DIRSIZ(dir));
+	}
+
+	return (MAX(largest, blksize - off));
+}
+
+/*
+ * Find room for a record of the given size in the block, splitting an
+ * existing record if needed. Returns the length of the new record, or 0 if
+ * there is no room.
+ */
+static size_t
+slsfs_dirblk_alloc(struct buf *bp, size_t blksize, size_t need, size_t *offp)
+{
+	struct dirent *dir;
+	size_t used, reclen;
+	size_t off;
+
+	DIRBLK_FOREACH (dir, off, bp, blksize) {
+		if (dir->d_fileno == 0) {
+			if (dir->d_reclen < need)
+				continue;
+
+			*offp = off;
+			return (dir->d_reclen);
+		}
+
+		used = GENERIC_DIRSIZ(dir);
+		if (dir->d_reclen - used < need)
+			continue;
+
+		reclen = dir->d_reclen - used;
+		dir->d_reclen = used;
+		*offp = off + used;
+		return (reclen);
+	}
+
+	if (off + need > blksize)
+		return (0);
+
+	*offp = off;
+	return (need);
+}
+
+static int
+slsfs_dirhash_build(struct vnode *vp)
+{
+	struct slos_node *svp = SLSVP(vp);
+	size_t blksize = IOSIZE(svp);
+	size_t blks = SLSINO(svp).ino_blocks;
+	struct slsfs_dirhash *dh;
+	struct dirent *dir;
+	struct buf *bp;
+	size_t blkno, off;
+	int error;
+
+	dh = malloc(sizeof(*dh), M_SLSFS_DIR, M_WAITOK | M_ZERO);
+	svp->sn_dirhash = dh;
+
+	error = slsfs_dirhash_resize(dh);
+	if (error != 0)
+		goto error;
+
+	for (blkno = 0; blkno < blks; blkno++) {
+		error = slsfs_bread(
+		    vp, blkno, blksize, curthread->td_ucred, 0, &bp);
+		if (error != 0)
+			goto error;
+
+		DIRBLK_FOREACH (dir, off, bp, blksize) {
+			if (dir->d_fileno == 0)
+				continue;
+
+			error = slsfs_dirhash_insert(dh,
+			    slsfs_dirhash_name(dir->d_name, dir->d_namlen),
+			    (blkno * blksize) + off);
+			if (error != 0) {
+				brelse(bp);
+				goto error;
+			}
+		}
+
+		error = slsfs_dirhash_setfree(
+		    dh, blkno, slsfs_dirblk_free(bp, blksize));
+		brelse(bp);
+		if (error != 0)
+			goto error;
+	}
+
+	return (0);
+
+error:
+	slsfs_dirhash_free(svp);
+	return (error);
+}
+
+/* Get the index of the directory, building it if the directory is large. */
+static struct slsfs_dirhash *
+slsfs_dirhash_get(struct vnode *vp)
+{
+	struct slos_node *svp = SLSVP(vp);
+
+	if (svp->sn_dirhash != NULL)
+		return (svp->sn_dirhash);
+
+	if (slsfs_dirhash_minblks <= 0 ||
+	    SLSINO(svp).ino_blocks < slsfs_dirhash_minblks)
+		return (NULL);
+
+	(void)slsfs_dirhash_build(vp);
+
+	return (svp->sn_dirhash);
+}
+
+static int
+slsfs_dirhash_lookup(struct vnode *vp, struct slsfs_dirhash *dh,
+    struct componentname *name, struct dirent *dir_p)
+{
+	struct slos_node *svp = SLSVP(vp);
+	size_t blksize = IOSIZE(svp);
+	struct slsfs_dirslot *slot;
+	size_t mask = dh->dh_nslots - 1;
+	struct dirent *dir;
+	struct buf *bp;
+	uint32_t hash;
+	size_t i;
+	int error;
+
+	hash = slsfs_dirhash_name(name->cn_nameptr, name->cn_namelen);
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &dh->dh_slots[i];
+		if (slot->ds_off == DIRSLOT_EMPTY)
+			return (EINVAL);
+
+		if (slot->ds_off == DIRSLOT_DELETED || slot->ds_hash != hash)
+			continue;
+
+		error = slsfs_bread(vp, slot->ds_off / blksize, blksize,
+		    curthread->td_ucred, 0, &bp);
+		if (error != 0)
+			return (error);
+
+		dir = (struct dirent *)(bp->b_data + (slot->ds_off % blksize));
+		if ((name->cn_namelen == dir->d_namlen) &&
+		    strncmp(name->cn_nameptr, dir->d_name, name->cn_namelen) ==
+			0) {
+			memcpy(dir_p, dir, GENERIC_DIRSIZ(dir));
+			dir_p->d_reclen = GENERIC_DIRSIZ(dir_p);
+			brelse(bp);
+			return (0);
+		}
+
+		brelse(bp);
+	}
+}
+
 int
 slsfs_add_dirent(
     struct vnode *vp, uint64_t ino, char *nameptr, long namelen, uint8_t type)
 {
+	struct slsfs_dirhash *dh;
 	struct dirent *dir;
-	struct dirent *pdir;
 	struct buf *bp = NULL;
+	size_t blkno, off, reclen = 0;
 	int error;
-	size_t off;
 
 	struct slos_node *svp = SLSVP(vp);
 	size_t blksize = IOSIZE(svp);
 	size_t blks = SLSINO(svp).ino_blocks;
+	size_t need = GENERIC_DIRLEN(namelen);
+
+	/* Reuse space freed by removals before growing the directory. */
+	dh = slsfs_dirhash_get(vp);
+	for (blkno = 0; blkno < blks; blkno++) {
+		if (dh != NULL && dh->dh_blkfree[blkno] < need)
+			continue;
 
-	if (blks) {
 		error = slsfs_bread(
-		    vp, blks - 1, blksize, curthread->td_ucred, 0, &bp);
+		    vp, blkno, blksize, curthread->td_ucred, 0, &bp);
 		if (error) {
 			return (error);
 		}
-		off = 0;
-		while ((off + sizeof(struct dirent)) < blksize) {
-			pdir = (struct dirent *)(bp->b_data + off);
-			if (pdir->d_reclen == 0) {
-				pdir = NULL;
-				break;
-			}
-			off += sizeof(struct dirent);
-		}
 
-		if ((off + sizeof(struct dirent)) > blksize) {
-			brelse(bp);
-			bp = NULL;
-		}
+		reclen = slsfs_dirblk_alloc(bp, blksize, need, &off);
+		if (reclen != 0)
+			break;
+
+		brelse(bp);
+		bp = NULL;
 	}
 
 	if (!bp) {
@@ -67,26 +472,43 @@ slsfs_add_dirent(
 		}
 
 		KASSERT(bp != NULL, ("found sparse directory"));
+		bzero(bp->b_data, bp->b_bcount);
 
-		blks += 1;
-		SLSINO(svp).ino_blocks = blks;
-		// We are pre adding the dirent we will be adding to this
-		// directory Actual size is the full block allocated to it;
+		blkno = blks;
+		SLSINO(svp).ino_blocks = blks + 1;
+		// Actual size is the full block allocated to it;
 		SLSINO(svp).ino_asize = SLSINO(svp).ino_blocks * blksize;
 		off = 0;
+		reclen = need;
 	}
 
 	dir = (struct dirent *)(bp->b_data + off);
 	dir->d_fileno = ino;
-	dir->d_off = ((blks - 1) * blksize) + off;
-	memcpy(dir->d_name, nameptr, namelen);
+	dir->d_off = (blkno * blksize) + off;
+	dir->d_reclen = reclen;
 	dir->d_type = type;
-	dir->d_reclen = sizeof(struct dirent);
+	dir->d_pad0 = 0;
 	dir->d_namlen = namelen;
+	dir->d_pad1 = 0;
+	memcpy(dir->d_name, nameptr, namelen);
+	bzero(&dir->d_name[namelen],
+	    need - __offsetof(struct dirent, d_name) - namelen);
+
+	svp->sn_ino.ino_size = MAX(
+	    svp->sn_ino.ino_size, dir->d_off + dir->d_reclen);
+
+	if (dh != NULL) {
+		error = slsfs_dirhash_insert(
+		    dh, slsfs_dirhash_name(nameptr, namelen), dir->d_off);
+		if (error == 0)
+			error = slsfs_dirhash_setfree(
+			    dh, blkno, slsfs_dirblk_free(bp, blksize));
+		if (error != 0)
+			slsfs_dirhash_free(svp);
+	}
 
 	slsfs_bdirty(bp);
-	svp->sn_ino.ino_size = dir->d_off + sizeof(struct dirent);
-	svp->sn_status |= SLOS_DIRTY;
+	slos_markdirty(svp);
 	// XXX This is actually incorrect -- we are flushing an update to disk
 	// when we havnt actually made the change to directory on disk, this
 	// probably cleans itself up when we make the changes to inodes though
@@ -134,103 +556,65 @@ slsfs_init_dir(struct vnode *dvp, struct vnode *vp, struct componentname *name)
 }
 
 /*
- * Unlink the child file from the parent
+ * Unlink the child file from the parent. The space of the record goes to the
+ * record before it in the block, or is marked free if it is the first.
  */
 int
 slsfs_unlink_dir(
     struct vnode *dvp, struct vnode *vp, struct componentname *name)
 {
 	struct dirent dir;
-	struct dirent *last, *del;
-	struct buf *del_bp, *last_bp;
-	size_t del_off, last_off, final_off;
-	size_t del_bno, last_bno;
+	struct dirent *del, *prev = NULL;
+	struct buf *bp;
+	size_t blkno, delpos, off;
 	int error;
 
-	struct slos_node *svp = SLSVP(vp);
 	struct slos_node *sdvp = SLSVP(dvp);
-	size_t size = SLSVPSIZ(sdvp);
-	size_t blksize = IOSIZE(svp);
+	size_t blksize = IOSIZE(sdvp);
 
 	error = slsfs_lookup_name(dvp, name, &dir);
 	if (error) {
 		return (error);
 	}
 
-	del_bno = dir.d_off / blksize;
-	del_off = dir.d_off % blksize;
-	last_bno = SLSINO(sdvp).ino_blocks - 1;
-	last_off = (size % blksize);
+	blkno = dir.d_off / blksize;
+	delpos = dir.d_off % blksize;
 
-	error = slsfs_bread(
-	    dvp, last_bno, blksize, curthread->td_ucred, 0, &last_bp);
+	error = slsfs_bread(dvp, blkno, blksize, curthread->td_ucred, 0, &bp);
 	if (error) {
-		brelse(last_bp);
 		return (error);
 	}
 
-	KASSERT(last_off != 0, ("We should not be at 0"));
-
-	last_off -= sizeof(struct dirent);
-	last = (struct dirent *)(last_bp->b_data + last_off);
-	// Buffer will be the same, so lets not read in another buffer
-	if (last_bno == del_bno) {
-		del_bp = last_bp;
-	} else {
-		error = slsfs_bread(
-		    dvp, del_bno, blksize, curthread->td_ucred, 0, &del_bp);
-		if (error) {
-			brelse(del_bp);
-			brelse(last_bp);
-			return (error);
-		}
+	DIRBLK_FOREACH (del, off, bp, blksize) {
+		if (off == delpos)
+			break;
+		prev = del;
 	}
 
-	// If we decided to read in a block we assert that there should be
-	KASSERT(last != NULL, ("No way this should happen"));
-	// This means that the last entry IS the one being deleted
-	if (last->d_namlen == name->cn_namelen &&
-	    !strncmp(last->d_name, name->cn_nameptr, name->cn_namelen)) {
-		KASSERT(del_bp == last_bp,
-		    ("If they are the same they should have been in the same block"));
-		KASSERT(strcmp(dir.d_name, last->d_name) == 0,
-		    ("Should be the same Directory"));
-		bzero(last, sizeof(struct dirent));
-	} else {
-		// Turn the deleted dirent into the last dirent;
-		del = (struct dirent *)(del_bp->b_data + del_off);
-		KASSERT(strcmp(dir.d_name, del->d_name) == 0,
-		    ("Should be the same Directory"));
-		final_off = del->d_off;
-		*del = *last;
-		del->d_off = final_off;
-		// Delete the last dirent;
-		bzero(last, sizeof(struct dirent));
-	}
+	KASSERT(del != NULL, ("dirent at %lu not found", dir.d_off));
+	KASSERT(del->d_namlen == name->cn_namelen &&
+		strncmp(del->d_name, name->cn_nameptr, name->cn_namelen) == 0,
+	    ("Should be the same Directory"));
 
-	// Last element in the block so have to move back
-	if (last_off == 0) {
-		// Remove the offset in the file
-		SLSINO(sdvp).ino_blocks--;
-		DEBUG1(
-		    "Last of the block, removing block from tree - %lu blocks left\n",
-		    SLSINO(sdvp).ino_blocks);
-		bundirty(last_bp);
-		brelse(last_bp);
-
-		KASSERT(SLSINO(sdvp).ino_blocks != 0, ("Should never occur"));
-		SLSINO(sdvp).ino_size = ((SLSINO(sdvp).ino_blocks) * blksize) -
-		    (blksize % sizeof(struct dirent));
+	if (prev != NULL) {
+		prev->d_reclen += del->d_reclen;
 	} else {
-		SLSINO(sdvp).ino_size -= sizeof(struct dirent);
-		slsfs_bdirty(last_bp);
+		del->d_fileno = 0;
+		del->d_namlen = 0;
+		del->d_type = DT_UNKNOWN;
 	}
 
-	if (last_bp != del_bp) {
-		slsfs_bdirty(del_bp);
+	if (sdvp->sn_dirhash != NULL) {
+		slsfs_dirhash_remove(sdvp->sn_dirhash,
+		    slsfs_dirhash_name(name->cn_nameptr, name->cn_namelen),
+		    dir.d_off);
+		if (slsfs_dirhash_setfree(sdvp->sn_dirhash, blkno,
+			slsfs_dirblk_free(bp, blksize)) != 0)
+			slsfs_dirhash_free(sdvp);
 	}
 
-	SLSVP(dvp)->sn_status |= SLOS_DIRTY;
+	slsfs_bdirty(bp);
+	slos_markdirty(SLSVP(dvp));
 
 	return (0);
 }
@@ -245,6 +629,7 @@ int
 slsfs_lookup_name(
     struct vnode *vp, struct componentname *name, struct dirent *dir_p)
 {
+	struct slsfs_dirhash *dh;
 	struct dirent *dir;
 	struct buf *bp = NULL;
 	int error;
@@ -254,25 +639,29 @@ slsfs_lookup_name(
 	size_t blksize = IOSIZE(svp);
 	size_t blks = SLSINO(svp).ino_blocks;
 
+	if (name != NULL) {
+		dh = slsfs_dirhash_get(vp);
+		if (dh != NULL)
+			return (slsfs_dirhash_lookup(vp, dh, name, dir_p));
+	}
+
 	for (int i = 0; i < blks; i++) {
 		error = slsfs_bread(
-		    vp, i, BLKSIZE(svp->sn_slos), curthread->td_ucred, 0, &bp);
+		    vp, i, blksize, curthread->td_ucred, 0, &bp);
 		if (error) {
 			return (error);
 		}
-		off = 0;
-		while ((off + sizeof(struct dirent)) < blksize) {
-			dir = (struct dirent *)(bp->b_data + off);
-			if (dir->d_reclen == 0) {
-				dir = NULL;
-				break;
-			}
+
+		DIRBLK_FOREACH (dir, off, bp, blksize) {
+			if (dir->d_fileno == 0)
+				continue;
 
 			if (name != NULL) {
 				if ((name->cn_namelen == dir->d_namlen) &&
 				    strncmp(name->cn_nameptr, dir->d_name,
 					name->cn_namelen) == 0) {
-					*dir_p = *dir;
+					memcpy(dir_p, dir, GENERIC_DIRSIZ(dir));
+					dir_p->d_reclen = GENERIC_DIRSIZ(dir_p);
 					brelse(bp);
 					return (0);
 				}
@@ -290,8 +679,6 @@ slsfs_lookup_name(
 					return 0;
 				}
 			}
-
-			off += sizeof(struct dirent);
 		}
 		brelse(bp);
 	}
@@ -318,25 +705,19 @@ slsfs_update_dirent(struct vnode *dvp, struct vnode *fvp, struct vnode *tvp)
 
 	for (int i = 0; i < blks; i++) {
 		error = slsfs_bread(
-		    dvp, i, BLKSIZE(svp->sn_slos), curthread->td_ucred, 0, &bp);
+		    dvp, i, blksize, curthread->td_ucred, 0, &bp);
 		if (error) {
 			return (error);
 		}
-		off = 0;
-		while ((off + sizeof(struct dirent)) < blksize) {
-			dir = (struct dirent *)(bp->b_data + off);
-			if (dir->d_reclen == 0) {
-				dir = NULL;
-				break;
-			}
 
-			if (dir->d_fileno == SLSVP(tvp)->sn_ino.ino_pid) {
+		DIRBLK_FOREACH (dir, off, bp, blksize) {
+			if (dir->d_fileno != 0 &&
+			    dir->d_fileno == SLSVP(tvp)->sn_ino.ino_pid) {
 				dir->d_fileno = SLSVP(fvp)->sn_ino.ino_pid;
 				slsfs_bdirty(bp);
 				DEBUG("Updating directory");
 				return (0);
 			}
-			off += sizeof(struct dirent);
 		}
 		brelse(bp);
 	}
@@ -344,6 +725,73 @@ slsfs_update_dirent(struct vnode *dvp, struct vnode *fvp, struct vnode *tvp)
 	return (0);
 }
 
+/*
+ * Copy out the live records of the directory starting at offset *offp, until
+ * the directory or the uio is exhausted. Offsets that fall inside a record,
+ * because the record they named was merged into its predecessor, resume at
+ * the next record.
+ */
+int
+slsfs_read_dir(struct vnode *vp, struct uio *io, off_t *offp)
+{
+	struct dirent *dp, dir;
+	struct buf *bp;
+	size_t blkno, blkoff;
+	off_t diroffset = *offp;
+	int error;
+
+	struct slos_node *svp = SLSVP(vp);
+	size_t filesize = SLSINO(svp).ino_size;
+	size_t blksize = IOSIZE(svp);
+
+	while (diroffset < filesize) {
+		blkno = diroffset / blksize;
+		error = slsfs_bread(
+		    vp, blkno, blksize, curthread->td_ucred, 0, &bp);
+		if (error) {
+			DEBUG("Problem reading from blk in readdir");
+			return (error);
+		}
+
+		if (!buf_mapped(bp)) {
+			brelse(bp);
+			return (EIO);
+		}
+
+		DIRBLK_FOREACH (dp, blkoff, bp, blksize) {
+			if ((blkno * blksize) + blkoff < diroffset)
+				continue;
+
+			if (dp->d_fileno != 0) {
+				memcpy(&dir, dp, GENERIC_DIRSIZ(dp));
+				dir.d_reclen = GENERIC_DIRSIZ(&dir);
+				dirent_terminate(&dir);
+				if (io->uio_resid < dir.d_reclen) {
+					brelse(bp);
+					*offp = diroffset;
+					return (0);
+				}
+
+				error = uiomove(&dir, dir.d_reclen, io);
+				if (error) {
+					DEBUG("Problem moving buffer");
+					brelse(bp);
+					return (error);
+				}
+			}
+
+			diroffset = (blkno * blksize) + blkoff + dp->d_reclen;
+		}
+
+		brelse(bp);
+		diroffset = MAX(diroffset, (blkno + 1) * blksize);
+	}
+
+	*offp = MIN(diroffset, filesize);
+
+	return (0);
+}
+
 int
 slsfs_dirempty(struct vnode *dvp)
 {
@@ -357,6 +805,7 @@ void inline slsfs_declink(struct vnode *vp)
 	SLSVP(vp)->sn_ino.ino_nlink--;
 	SLSVP(vp)->sn_ino.ino_flags |= IN_CHANGE;
 	if ((SLSVP(vp)->sn_ino.ino_nlink) == 0) {
-		SLSVP(vp)->sn_status |= SLOS_DIRTY | IN_DEAD;
+		slos_markdirty(SLSVP(vp));
+		SLSVP(vp)->sn_status |= IN_DEAD;
 	}
 }
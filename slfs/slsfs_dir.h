@@ -13,6 +13,9 @@ int slsfs_unlink_dir(
 int slsfs_dirempty(struct vnode *vp);
 int slsfs_update_dirent(
     struct vnode *tdvp, struct vnode *fvp, struct vnode *tvp);
+int slsfs_read_dir(struct vnode *vp, struct uio *io, off_t *offp);
+
+void slsfs_dirhash_free(struct slos_node *svp);
 
 void slsfs_declink(struct vnode *vp);
 
@@ -50,6 +50,11 @@
 
 static MALLOC_DEFINE(M_SLSFS, "slsfs_mount", "SLSFS mount structures");
 
+int slsfs_sync_threads = 4;
+uint64_t slsfs_sync_flushed = 0;
+struct sls_histogram slsfs_commit_batch;
+struct sls_histogram slsfs_fsync_latency;
+
 void slos_radix_init(void);
 void slos_radix_fini(void);
 
@@ -175,9 +180,7 @@ slsfs_checksumtree_init(struct slos *slos)
 	diskptr_t ptr;
 	int error = 0;
 
-	size_t offset = ((NUMSBS * slos->slos_sb->sb_ssize) /
-			    slos->slos_sb->sb_bsize) +
-	    1;
+	size_t offset = slos_alloc_systree(slos, SLOS_SYSTREE_CKSUM);
 	if (slos->slos_sb->sb_epoch == EPOCH_INVAL) {
 		MPASS(error == 0);
 		error = fbtree_sysinit(slos, offset, &ptr);
@@ -244,6 +247,22 @@ slsfs_startupfs(struct mount *mp)
 		}
 		DEBUG1("Creating taskqueue %p", slos.slos_tq);
 	}
+
+	/*
+	 * Flushes get their own threads, because they wait on IOs that are
+	 * completed by the SLOS taskqueue.
+	 */
+	if (slos.slos_synctq == NULL && slsfs_sync_threads > 0) {
+		slos.slos_synctq = taskqueue_create("SLOS Sync Taskqueue",
+		    M_WAITOK, taskqueue_thread_enqueue, &slos.slos_synctq);
+		error = taskqueue_start_threads(&slos.slos_synctq,
+		    slsfs_sync_threads, PVFS, "SLOS Sync Threads");
+		if (error != 0) {
+			taskqueue_free(slos.slos_synctq);
+			slos.slos_synctq = NULL;
+		}
+	}
+	slos_gc_init(&slos);
 	/*
 	 * Initialize in memory the allocator and the vnode used for inode
 	 * bookkeeping.
@@ -277,8 +296,15 @@ slsfs_create_slos(struct mount *mp, struct vnode *devvp)
 
 	cv_init(&slos.slsfs_sync_cv, "SLSFS Syncer CV");
 	mtx_init(&slos.slsfs_sync_lk, "syncer lock", NULL, MTX_DEF);
+	mtx_init(&slos.slos_dirtylk, "slos dirty list", NULL, MTX_DEF);
+	TAILQ_INIT(&slos.slos_dirtyq);
+	slos.slos_ndirty = 0;
+	slos.slos_dirtylost = 0;
 	slos.slsfs_dirtybufcnt = 0;
 	slos.slsfs_syncing = 0;
+	slos.slsfs_commitgen = 0;
+	slos.slsfs_commitdone = 0;
+	slos.slsfs_commitwaiters = 0;
 	slos.slsfs_mount = mp;
 
 	slos.slos_vp = devvp;
@@ -307,6 +333,7 @@ slsfs_create_slos(struct mount *mp, struct vnode *devvp)
 error:
 	cv_destroy(&slos.slsfs_sync_cv);
 	mtx_destroy(&slos.slsfs_sync_lk);
+	mtx_destroy(&slos.slos_dirtylk);
 	return (error);
 }
 
@@ -517,71 +544,179 @@ error:
 
 uint64_t checkpoints = 0;
 
+#define SLSFS_SYNC_BATCH (64)
+
+/*
+ * Check whether a checkpoint left any dirty state behind, either because it
+ * skipped a node or because a node was freed while dirty.
+ */
+static bool
+slsfs_checkpoint_complete(void)
+{
+	bool complete;
+
+	mtx_lock(&slos.slos_dirtylk);
+	complete = (slos.slos_ndirty == 0) && (slos.slos_dirtylost == 0);
+	slos.slos_dirtylost = 0;
+	mtx_unlock(&slos.slos_dirtylk);
+
+	return (complete);
+}
+
+struct slsfs_synctask {
+	struct task st_tk;
+	struct slos_node *st_svp;
+	struct slsfs_syncbatch *st_batch;
+};
+
+/* A set of dirty nodes flushed in parallel. */
+struct slsfs_syncbatch {
+	struct mtx sb_mtx;
+	struct cv sb_cv;
+	int sb_pending;
+	int sb_error;
+	bool sb_complete;
+	int sb_closing;
+	struct slsfs_synctask sb_tasks[SLSFS_SYNC_BATCH];
+};
+
+/*
+ * Flush the data and btree of a dirty node. Nodes whose vnode is busy are
+ * left on the dirty list for the next checkpoint.
+ */
 static void
-slsfs_checkpoint(struct mount *mp, int closing)
+slsfs_sync_task(void *ctx, int __unused pending)
 {
-	struct vnode *vp, *mvp = NULL;
-	struct buf *bp;
-	struct slos_node *svp;
-	struct slos_inode *ino;
-	struct timespec te;
-	diskptr_t ptr;
+	struct slsfs_synctask *st = (struct slsfs_synctask *)ctx;
+	struct slsfs_syncbatch *batch = st->st_batch;
+	struct slos_node *svp = st->st_svp;
+	struct vnode *vp = svp->sn_vp;
+	bool requeue = false;
 	int error;
 
-again:
-	/* Go through the list of vnodes attached to the filesystem. */
-	MNT_VNODE_FOREACH_ACTIVE (vp, mp, mvp) {
-		/* If we can't get a reference, the vnode is probably dead. */
-		if (vp->v_type == VNON) {
-			VI_UNLOCK(vp);
-			continue;
-		}
+	vhold(vp);
+	error = vget(vp, LK_EXCLUSIVE | LK_NOWAIT, curthread);
+	if (error != 0) {
+		requeue = true;
+		error = 0;
+		goto out;
+	}
 
-		if (vp == slos.slsfs_inodes) {
-			VI_UNLOCK(vp);
-			continue;
-		}
+	if (SLSVP(vp)->sn_status & SLOS_DIRTY) {
+		/* Step 1 and 2 Sync data and mark underlying Btree Copy
+		 * on write*/
+		error = slos_sync_vp(vp, batch->sb_closing);
 
-		if ((error = vget(vp, LK_EXCLUSIVE | LK_INTERLOCK | LK_NOWAIT,
-			 curthread)) != 0) {
-			if (error == ENOENT) {
-				MNT_VNODE_FOREACH_ALL_ABORT(mp, mvp);
-				goto again;
-			}
-			continue;
-		}
+		/* Sync of data and btree complete - unmark them and
+		 * update the root and dirty the root*/
+		if (error == 0)
+			error = slos_update(SLSVP(vp));
+	}
+
+	vput(vp);
+
+out:
+	slos_dirty_done(&slos, svp, requeue);
+	vdrop(vp);
+
+	mtx_lock(&batch->sb_mtx);
+	if (error != 0)
+		batch->sb_error = error;
+	if (requeue)
+		batch->sb_complete = false;
+	batch->sb_pending -= 1;
+	if (batch->sb_pending == 0)
+		cv_signal(&batch->sb_cv);
+	mtx_unlock(&batch->sb_mtx);
+}
 
-		// Skip over the btrees for now as we will sync them after the
-		// data syncs
-		if ((vp->v_vflag & VV_SYSTEM) ||
-		    ((vp->v_type != VDIR) && (vp->v_type != VREG) &&
-			(vp->v_type != VLNK)) ||
-		    (vp->v_data == NULL)) {
-			vput(vp);
-			continue;
+/*
+ * Flush the nodes on the dirty list, in batches spread across the sync
+ * taskqueue. Only the nodes dirty when we start are visited, so nodes that
+ * are dirtied again while we flush wait for the next checkpoint.
+ */
+static int
+slsfs_sync_dirty(int closing, bool *completep)
+{
+	struct slsfs_syncbatch *batch;
+	struct slsfs_synctask *st;
+	uint64_t remaining;
+	int error = 0;
+	int i, n;
+
+	mtx_lock(&slos.slos_dirtylk);
+	remaining = slos.slos_ndirty;
+	mtx_unlock(&slos.slos_dirtylk);
+	if (remaining == 0)
+		return (0);
+
+	batch = malloc(sizeof(*batch), M_SLSFS, M_WAITOK | M_ZERO);
+	mtx_init(&batch->sb_mtx, "slsfssync", NULL, MTX_DEF);
+	cv_init(&batch->sb_cv, "slsfssync");
+	batch->sb_complete = true;
+	batch->sb_closing = closing;
+
+	while (remaining > 0 && batch->sb_error == 0) {
+		for (i = 0; i < SLSFS_SYNC_BATCH && remaining > 0; i++) {
+			st = &batch->sb_tasks[i];
+			st->st_svp = slos_dirty_pop(&slos);
+			if (st->st_svp == NULL)
+				break;
+
+			remaining -= 1;
+			st->st_batch = batch;
+			TASK_INIT(&st->st_tk, 0, slsfs_sync_task, st);
 		}
 
-		if (SLSVP(vp)->sn_status & SLOS_DIRTY) {
-			/* Step 1 and 2 Sync data and mark underlying Btree Copy
-			 * on write*/
-			error = slos_sync_vp(vp, closing);
-			if (error) {
-				vput(vp);
-				return;
-			}
-
-			/* Sync of data and btree complete - unmark them and
-			 * update the root and dirty the root*/
-			error = slos_update(SLSVP(vp));
-			if (error) {
-				vput(vp);
-				return;
-			}
+		if (i == 0)
+			break;
+
+		n = i;
+		batch->sb_pending = n;
+		while (i-- > 0) {
+			st = &batch->sb_tasks[i];
+			if (slos.slos_synctq != NULL)
+				taskqueue_enqueue(slos.slos_synctq, &st->st_tk);
+			else
+				slsfs_sync_task(st, 0);
 		}
 
-		vput(vp);
+		mtx_lock(&batch->sb_mtx);
+		while (batch->sb_pending > 0)
+			cv_wait(&batch->sb_cv, &batch->sb_mtx);
+		mtx_unlock(&batch->sb_mtx);
+
+		slsfs_sync_flushed += n;
 	}
 
+	error = batch->sb_error;
+	if (!batch->sb_complete)
+		*completep = false;
+
+	cv_destroy(&batch->sb_cv);
+	mtx_destroy(&batch->sb_mtx);
+	free(batch, M_SLSFS);
+
+	return (error);
+}
+
+static void
+slsfs_checkpoint(struct mount *mp, int closing)
+{
+	struct buf *bp;
+	struct slos_node *svp;
+	struct slos_inode *ino;
+	struct timespec te;
+	bool complete = true;
+	uint64_t epoch;
+	diskptr_t ptr;
+	int error;
+
+	/* Flush the data and btrees of the dirty nodes. */
+	error = slsfs_sync_dirty(closing, &complete);
+	if (error != 0)
+		return;
+
 	// Check if both the underlying Btree needs a sync or the inode itself -
 	// should be a way to make it the same TODO
 	// Just a hack for now to get this thing working XXX Why is it a hack?
@@ -653,7 +788,7 @@ again:
 
 		/* 4 Sync the allocator */
 		DEBUG("Syncing the allocator");
-		slos_allocator_sync(&slos, slos.slos_sb);
+		slos_allocator_sync(&slos, slos.slos_sb, closing != 0);
 		DEBUG2("Epoch %lu done at superblock index %u",
 		    slos.slos_sb->sb_epoch, slos.slos_sb->sb_index);
 		SLSVP(slos.slsfs_inodes)->sn_status &= ~(SLOS_DIRTY);
@@ -683,13 +818,51 @@ again:
 		slos.slos_sb->sb_data_synced = 0;
 		slos.slos_sb->sb_meta_synced = 0;
 		slos.slos_sb->sb_attempted_checkpoints = 0;
+		epoch = slos.slos_sb->sb_epoch;
 		slos.slos_sb->sb_epoch += 1;
+
+		if (!slsfs_checkpoint_complete())
+			complete = false;
+		slos_gc_checkpointed(&slos, epoch, complete);
 	} else {
 		slos.slos_sb->sb_attempted_checkpoints++;
 	}
 }
 
 uint64_t checkpointtime = 100;
+
+/*
+ * Start a checkpoint. Everyone who asked for a commit until now is served
+ * by it, and anyone arriving from here on waits for the next one.
+ */
+static uint64_t
+slsfs_commit_start(struct slos *slos)
+{
+	uint64_t batch;
+
+	mtx_assert(&slos->slsfs_sync_lk, MA_OWNED);
+
+	slos->slsfs_syncing = 1;
+	slos->slsfs_commitgen += 1;
+	batch = slos->slsfs_commitwaiters;
+	slos->slsfs_commitwaiters = 0;
+
+	return (batch);
+}
+
+static void
+slsfs_commit_done(struct slos *slos, uint64_t batch)
+{
+	mtx_assert(&slos->slsfs_sync_lk, MA_OWNED);
+
+	slos->slsfs_syncing = 0;
+	slos->slsfs_commitdone = slos->slsfs_commitgen;
+	cv_broadcast(&slos->slsfs_sync_cv);
+
+	if (batch > 0)
+		sls_histogram_record(&slsfs_commit_batch, batch);
+}
+
 /*
  * Daemon that flushes dirty buffers to the device.
  *
@@ -702,19 +875,19 @@ slsfs_syncer(struct slos *slos)
 	slos->slsfs_sync_exit = 0;
 	struct timespec ts, te;
 	uint64_t elapsed, period;
+	uint64_t batch;
 
 	/* Periodically sync until we unmount. */
 	mtx_lock(&slos->slsfs_sync_lk);
 	while (!slos->slsfs_sync_exit) {
-		slos->slsfs_syncing = 1;
+		batch = slsfs_commit_start(slos);
 		mtx_unlock(&slos->slsfs_sync_lk);
 		nanotime(&ts);
 		slsfs_checkpoint(slos->slsfs_mount, 0);
 		nanotime(&te);
 		/* Notify anyone waiting to synchronize. */
 		mtx_lock(&slos->slsfs_sync_lk);
-		slos->slsfs_syncing = 0;
-		cv_broadcast(&slos->slsfs_sync_cv);
+		slsfs_commit_done(slos, batch);
 		mtx_unlock(&slos->slsfs_sync_lk);
 
 		elapsed = (1000000000ULL * (te.tv_sec - ts.tv_sec)) +
@@ -729,9 +902,13 @@ slsfs_syncer(struct slos *slos)
 			te.tv_nsec = 0;
 		}
 
-		/* Wait until it's time to flush again. */
+		/*
+		 * Wait until it's time to flush again, unless callers arrived
+		 * during the last checkpoint and are waiting for the next.
+		 */
 		mtx_lock(&slos->slsfs_sync_lk);
-		if (te.tv_nsec > 0) {
+		if (te.tv_nsec > 0 && slos->slsfs_commitwaiters == 0 &&
+		    !slos->slsfs_sync_exit) {
 			msleep_sbt(&slos->slsfs_syncing, &slos->slsfs_sync_lk,
 			    PRIBIO, "Sync-wait", SBT_1NS * te.tv_nsec, 0,
 			    C_HARDCLOCK);
@@ -739,16 +916,15 @@ slsfs_syncer(struct slos *slos)
 	}
 
 	DEBUG("Syncer exiting");
-	slos->slsfs_syncing = 1;
+	batch = slsfs_commit_start(slos);
 	mtx_unlock(&slos->slsfs_sync_lk);
 	/* One last checkpoint before we exit. */
 	slsfs_checkpoint(slos->slsfs_mount, 1);
 
 	mtx_lock(&slos->slsfs_sync_lk);
 	/* Notify anyone else waiting to flush one last time. */
-	slos->slsfs_syncing = 0;
 	DEBUG("Wake- up external");
-	cv_broadcast(&slos->slsfs_sync_cv);
+	slsfs_commit_done(slos, batch);
 
 	DEBUG("Syncer exited");
 	slos->slsfs_syncertd = NULL;
@@ -791,17 +967,14 @@ slsfs_init_fs(struct mount *mp)
 }
 
 /*
- * Wake up the SLOS syncer.
+ * Wait until a checkpoint that started after the call completes. Callers
+ * that arrive together are batched into the same checkpoint, and callers
+ * that arrive while one is running attach to the next.
  */
-int
-slsfs_wakeup_syncer(int is_exiting)
+static int
+slsfs_commit_wait(void)
 {
-	/* Don't sync again if already in progress. */
-	/* XXX Maybe exit if it's already in progress? How do we
-	 * serialize writes and syncs? (If a write after the last
-	 * sync but before this one doesn't get  written by the former
-	 * then we have to go through with the latter).
-	 */
+	uint64_t target;
 
 	mtx_lock(&slos.slsfs_sync_lk);
 	if (slos.slsfs_syncertd == NULL) {
@@ -809,29 +982,58 @@ slsfs_wakeup_syncer(int is_exiting)
 		return (0);
 	}
 
-	if (slos.slsfs_syncing) {
+	/* A running checkpoint may have missed our writes. */
+	target = slos.slsfs_commitgen + 1;
+	slos.slsfs_commitwaiters += 1;
+	if (!slos.slsfs_syncing)
+		wakeup(&slos.slsfs_syncing);
+
+	while (slos.slsfs_commitdone < target && slos.slsfs_syncertd != NULL)
 		cv_wait(&slos.slsfs_sync_cv, &slos.slsfs_sync_lk);
-	}
+	mtx_unlock(&slos.slsfs_sync_lk);
+
+	return (0);
+}
 
-	slos.slsfs_syncing = 1;
+/*
+ * Wake up the SLOS syncer.
+ */
+int
+slsfs_wakeup_syncer(int is_exiting)
+{
 	if (is_exiting) {
+		mtx_lock(&slos.slsfs_sync_lk);
 		slos.slsfs_sync_exit = 1;
+		mtx_unlock(&slos.slsfs_sync_lk);
 	}
 
-	/* The actual wakeup. */
-	wakeup(&slos.slsfs_syncing);
+	return (slsfs_commit_wait());
+}
 
-	if (slos.slsfs_syncertd == NULL) {
+/*
+ * Make everything written so far durable on behalf of fsync.
+ */
+int
+slsfs_group_commit(void)
+{
+	sbintime_t sbt;
+	int error;
+
+	/* Nothing was written since the last checkpoint. */
+	mtx_lock(&slos.slsfs_sync_lk);
+	if (!slos.slsfs_syncing && slos.slos_sb->sb_data_synced == 0 &&
+	    slos.slos_sb->sb_meta_synced == 0) {
 		mtx_unlock(&slos.slsfs_sync_lk);
 		return (0);
 	}
-
-	/* Wait until the syncer notifies us it's done. */
-	while (slos.slsfs_syncing)
-		cv_wait(&slos.slsfs_sync_cv, &slos.slsfs_sync_lk);
 	mtx_unlock(&slos.slsfs_sync_lk);
 
-	return (0);
+	sbt = sbinuptime();
+	error = slsfs_commit_wait();
+	sls_histogram_record(
+	    &slsfs_fsync_latency, sbttons(sbinuptime() - sbt));
+
+	return (error);
 }
 
 static int
@@ -894,6 +1096,7 @@ slsfs_mount(struct mount *mp)
 	SLOS_UNLOCK(&slos);
 
 	if (mp->mnt_data != NULL) {
+		slos_gc_drain(&slos);
 		slsfs_wakeup_syncer(1);
 		vflush(mp, 0, FORCECLOSE, curthread);
 
@@ -1121,6 +1324,7 @@ slsfs_unmount(struct mount *mp, int mntflags)
 	 * nonexistent taskqueue. If the SLS reattaches and tries to reuse it we
 	 * will crash.
 	 */
+	slos_gc_drain(slos);
 	if (slos->slos_tq != NULL)
 		taskqueue_free(slos->slos_tq);
 	slos->slos_tq = NULL;
@@ -1130,6 +1334,9 @@ slsfs_unmount(struct mount *mp, int mntflags)
 	 * vnodes, so this is going to be the last flush we need.
 	 */
 	slsfs_wakeup_syncer(1);
+	if (slos->slos_synctq != NULL)
+		taskqueue_free(slos->slos_synctq);
+	slos->slos_synctq = NULL;
 
 	error = vflush(mp, 0, flags, curthread);
 	if (error) {
@@ -1156,6 +1363,7 @@ slsfs_unmount(struct mount *mp, int mntflags)
 
 	cv_destroy(&slos->slsfs_sync_cv);
 	mtx_destroy(&slos->slsfs_sync_lk);
+	mtx_destroy(&slos->slos_dirtylk);
 	slsfs_freemntinfo(mp);
 
 	DEBUG("Freeing mount info");
@@ -1278,6 +1486,7 @@ slsfs_vget(struct mount *mp, uint64_t ino, int flags, struct vnode **vpp)
 	}
 
 	svnode->sn_slos = &slos;
+	svnode->sn_vp = vp;
 	vp->v_data = svnode;
 	vp->v_bufobj.bo_ops = &bufops_slsfs;
 	vp->v_bufobj.bo_bsize = IOSIZE(svnode);
@@ -158,6 +158,7 @@ slsfs_reclaim(struct vop_reclaim_args *args)
 		cache_purge(vp);
 		if (vp != slos.slsfs_inodes)
 			vfs_hash_remove(vp);
+		slsfs_dirhash_free(svp);
 		slos_vpfree(svp->sn_slos, svp);
 	}
 
@@ -197,7 +198,7 @@ slsfs_mkdir(struct vop_mkdir_args *args)
 
 	SLSVP(dvp)->sn_ino.ino_nlink++;
 	SLSVP(dvp)->sn_ino.ino_flags |= IN_CHANGE;
-	SLSVP(dvp)->sn_status |= SLOS_DIRTY;
+	slos_markdirty(SLSVP(dvp));
 
 	MPASS(SLSVP(dvp)->sn_ino.ino_nlink >= 3);
 	MPASS(SLSVP(vp)->sn_ino.ino_nlink == 2);
@@ -248,18 +249,13 @@ slsfs_open(struct vop_open_args *args)
 static int
 slsfs_readdir(struct vop_readdir_args *args)
 {
-	struct buf *bp;
-	struct dirent dir;
-	size_t blkno;
-	off_t blkoff;
-	size_t diroffset, anyleft;
+	off_t diroffset;
 	int error = 0;
 
 	struct vnode *vp = args->a_vp;
 	struct slos_node *slsvp = SLSVP(vp);
 	struct uio *io = args->a_uio;
 	size_t filesize = SLSINO(slsvp).ino_size;
-	size_t blksize = IOSIZE(slsvp);
 
 	KASSERT(slsvp->sn_slos != NULL, ("Null slos"));
 	if (vp->v_type != VDIR) {
@@ -267,59 +263,11 @@ slsfs_readdir(struct vop_readdir_args *args)
 	}
 
 	if ((io->uio_offset < filesize) &&
-	    (io->uio_resid >= sizeof(struct dirent))) {
+	    (io->uio_resid >= GENERIC_MINDIRSIZ)) {
 		diroffset = io->uio_offset;
-		blkno = io->uio_offset / blksize;
-		blkoff = io->uio_offset % blksize;
-		error = slsfs_bread(
-		    vp, blkno, blksize, curthread->td_ucred, 0, &bp);
-		if (error) {
-			brelse(bp);
-			DEBUG("Problem reading from blk in readdir");
+		error = slsfs_read_dir(vp, io, &diroffset);
+		if (error)
 			return (error);
-		}
-		/* Create the UIO for the disk. */
-		while (diroffset < filesize) {
-			anyleft = ((diroffset % blksize) +
-				      sizeof(struct dirent)) > blksize;
-			if (anyleft) {
-				blkoff = 0;
-				blkno++;
-				diroffset = blkno * blksize;
-				brelse(bp);
-				error = slsfs_bread(vp, blkno, blksize,
-				    curthread->td_ucred, 0, &bp);
-				if (error) {
-					brelse(bp);
-					return (error);
-				}
-			}
-			if (buf_mapped(bp)) {
-				KASSERT(bp->b_bcount > blkoff,
-				    ("Blkoff out of range of buffer"));
-				dir = *((struct dirent *)(bp->b_data + blkoff));
-				if (dir.d_reclen == 0) {
-					break;
-				}
-				dir.d_reclen = GENERIC_DIRSIZ(&dir);
-				dirent_terminate(&dir);
-				if (io->uio_resid < GENERIC_DIRSIZ(&dir)) {
-					break;
-				}
-
-				error = uiomove(&dir, dir.d_reclen, io);
-				if (error) {
-					DEBUG("Problem moving buffer");
-					return (error);
-				}
-			} else {
-				brelse(bp);
-				return (EIO);
-			}
-			diroffset += sizeof(struct dirent);
-			blkoff += sizeof(struct dirent);
-		}
-		brelse(bp);
 		io->uio_offset = diroffset;
 	}
 
@@ -460,7 +408,7 @@ slsfs_rmdir(struct vop_rmdir_args *args)
 
 	MPASS(SLSVP(dvp)->sn_ino.ino_nlink >= 3);
 	slsfs_declink(dvp);
-	SLSVP(dvp)->sn_status |= SLOS_DIRTY;
+	slos_markdirty(SLSVP(dvp));
 	// XXX This is weird , this is something FFS does, it purges the cache
 	// of the parent directory which seems funky
 	cache_purge(dvp);
@@ -472,9 +420,11 @@ slsfs_rmdir(struct vop_rmdir_args *args)
 		return (error);
 	}
 
+	slsfs_dirhash_free(svp);
 	svp->sn_ino.ino_nlink -= 2;
 	svp->sn_ino.ino_flags |= IN_CHANGE;
-	svp->sn_status |= SLOS_DIRTY | IN_DEAD;
+	slos_markdirty(svp);
+	svp->sn_status |= IN_DEAD;
 	KASSERT(svp->sn_ino.ino_nlink == 0,
 	    ("Problem with ino links - %lu", svp->sn_ino.ino_nlink));
 	DEBUG("Removing directory done");
@@ -545,8 +495,8 @@ slsfs_remove(struct vop_remove_args *args)
 	}
 
 	slsfs_declink(vp);
-	SLSVP(dvp)->sn_status |= SLOS_DIRTY;
-	SLSVP(vp)->sn_status |= SLOS_DIRTY;
+	slos_markdirty(SLSVP(dvp));
+	slos_markdirty(SLSVP(vp));
 
 	return (0);
 }
@@ -643,7 +593,7 @@ slsfs_write(struct vop_write_args *args)
 	}
 
 	if (modified) {
-		svp->sn_status |= SLOS_DIRTY;
+		slos_markdirty(svp);
 	}
 
 	return (error);
@@ -831,15 +781,45 @@ slsfs_bmap(struct vop_bmap_args *args)
 		return (0);
 	}
 
+	/* The blocks of compressed extents do not hold the data as is. */
+	if (ptr.csize != 0)
+		return (EOPNOTSUPP);
+
 	*bnp = (extbn + (lbn - extlbn)) * scaling;
 
 	return (0);
 }
 
+/*
+ * The syncer skips locked vnodes, so flush our own node before waiting for
+ * the checkpoint that commits it.
+ */
+static int
+slsfs_fsync_node(struct vnode *vp)
+{
+	struct slos_node *svp = SLSVP(vp);
+	int error;
+
+	if (svp->sn_status & SLOS_DIRTY) {
+		error = slos_sync_vp(vp, 0);
+		if (error != 0)
+			return (error);
+
+		error = slos_update(svp);
+		if (error != 0)
+			return (error);
+	}
+
+	return (slsfs_group_commit());
+}
+
 static int
 slsfs_fsync(struct vop_fsync_args *args)
 {
-	return (0);
+	if (args->a_waitfor != MNT_WAIT)
+		return (0);
+
+	return (slsfs_fsync_node(args->a_vp));
 }
 
 static int
@@ -864,71 +844,83 @@ slsfs_print(struct vop_print_args *args)
 	return (0);
 }
 
-static int
-slsfs_check_cksum(struct buf *bp)
+/* Checksums of a buffer, one per page, keyed by the page's disk block. */
+struct slsfs_cksums {
+	uint64_t blks[MAXPHYS / PAGE_SIZE];
+	uint32_t cksums[MAXPHYS / PAGE_SIZE];
+	int count;
+};
+
+static void
+slsfs_calc_cksums(struct buf *bp, struct slsfs_cksums *cks)
 {
 	size_t cksize;
-	uint32_t cksum, check;
-	int error;
-	struct fbtree *tree = &slos.slos_cktree->sn_tree;
-	uint64_t blk = bp->b_blkno;
 	size_t size = 0;
+	int i;
 
-	MPASS((bp->b_bcount % BLKSIZE(&slos)) == 0);
+	KASSERT(bp->b_bcount <= MAXPHYS, ("buffer %p too large", bp));
 
-	while (size < bp->b_bcount) {
+	for (i = 0; size < bp->b_bcount; i++) {
 		cksize = min(PAGE_SIZE, bp->b_bcount - size);
-		cksum = calculate_crc32c(~0, bp->b_data + size, cksize);
+		cks->blks[i] = bp->b_blkno + i;
+		cks->cksums[i] = calculate_crc32c(
+		    ~0, bp->b_data + size, cksize);
 		size += cksize;
-		blk++;
-		error = fbtree_get(tree, &blk, &check);
+	}
+
+	cks->count = i;
+}
+
+static int
+slsfs_check_cksum(struct buf *bp, struct slsfs_cksums *cks)
+{
+	uint32_t check;
+	int error;
+	int i;
+
+	struct fbtree *tree = &slos.slos_cktree->sn_tree;
+
+	MPASS((bp->b_bcount % BLKSIZE(&slos)) == 0);
+
+	for (i = 0; i < cks->count; i++) {
+		error = fbtree_get(tree, &cks->blks[i], &check);
 		if (error == EINVAL) {
 			return 0;
 		} else if (error) {
 			panic("Problem with read cksum %d", error);
 		}
 
-		if (check != cksum) {
-			printf("%lu, %lu, %lu", blk, cksize, bp->b_bcount);
+		if (check != cks->cksums[i]) {
+			DEBUG3("Checksum mismatch on block %lu (%d of %lu)",
+			    cks->blks[i], i, bp->b_bcount);
 			return EINVAL;
 		}
 	}
 	return (0);
 }
 
+/*
+ * The page keys of a buffer are consecutive, so they are inserted together
+ * instead of descending the tree once per page.
+ */
 static int
-slsfs_update_cksum(struct buf *bp)
+slsfs_update_cksum(struct buf *bp, struct slsfs_cksums *cks)
 {
-	size_t cksize;
-	uint32_t cksum;
-	struct fnode_iter iter;
-	int error = 0;
-
 	struct fbtree *tree = &slos.slos_cktree->sn_tree;
-	uint64_t blk = bp->b_blkno;
-	size_t size = 0;
-	while (size < bp->b_bcount) {
-		cksize = min(PAGE_SIZE, bp->b_bcount - size);
-		cksum = calculate_crc32c(~0, bp->b_data + size, cksize);
-		size += cksize;
-		error = fbtree_keymin_iter(tree, &blk, &iter);
-		KASSERT(error == 0, ("error %d by fbtree_keymin_iter", error));
-		if (ITER_ISNULL(iter) || ITER_KEY_T(iter, uint64_t) != blk) {
-			error = fnode_insert(iter.it_node, &blk, &cksum);
-		} else {
-			fiter_replace(&iter, &cksum);
-		}
-		if (error) {
-			panic("Issue with updating checksum tree %d", error);
-		}
-		blk++;
+	int error;
+
+	error = fbtree_bulkinsert(tree, cks->blks, cks->cksums, cks->count);
+	if (error) {
+		panic("Issue with updating checksum tree %d", error);
 	}
+
 	return (0);
 }
 
 int
 slsfs_cksum(struct buf *bp)
 {
+	struct slsfs_cksums cks;
 	int error;
 	struct fbtree *tree = &slos.slos_cktree->sn_tree;
 
@@ -940,14 +932,17 @@ slsfs_cksum(struct buf *bp)
 
 	switch (bp->b_iocmd) {
 	case BIO_READ:
+		slsfs_calc_cksums(bp, &cks);
 		BTREE_LOCK(tree, LK_SHARED);
-		error = slsfs_check_cksum(bp);
+		error = slsfs_check_cksum(bp, &cks);
 		BTREE_UNLOCK(tree, 0);
 
 		return (error);
 	case BIO_WRITE:
+		/* Hash outside the lock, it is the expensive part. */
+		slsfs_calc_cksums(bp, &cks);
 		BTREE_LOCK(tree, LK_EXCLUSIVE);
-		error = slsfs_update_cksum(bp);
+		error = slsfs_update_cksum(bp, &cks);
 		BTREE_UNLOCK(tree, 0);
 
 		return (error);
@@ -1029,7 +1024,7 @@ slsfs_strategy(struct vop_strategy_args *args)
 
 		if (bp->b_iocmd == BIO_WRITE) {
 			if (ptr.epoch == slos.slos_sb->sb_epoch &&
-			    ptr.offset != 0) {
+			    ptr.offset != 0 && ptr.csize == 0) {
 				/* The segment is current and exists on disk. */
 				slos_ptr_trimstart(bp->b_lblkno,
 				    ITER_KEY_T(iter, uint64_t), fsbsize, &ptr);
@@ -1066,7 +1061,14 @@ slsfs_strategy(struct vop_strategy_args *args)
 			    &slos.slos_sb->sb_data_synced, bp->b_bcount);
 			bp->b_blkno = ptr.offset;
 		} else if (bp->b_iocmd == BIO_READ) {
-			if (ptr.offset != 0) {
+			if (ptr.csize != 0) {
+				/* Only the SLS reads compressed extents. */
+				ITER_RELEASE(iter);
+				bp->b_ioflags |= BIO_ERROR;
+				bp->b_error = EOPNOTSUPP;
+				bufdone(bp);
+				return (0);
+			} else if (ptr.offset != 0) {
 				/* Find where we must start reading from. */
 				slos_ptr_trimstart(bp->b_lblkno,
 				    ITER_KEY_T(iter, uint64_t), fsbsize, &ptr);
@@ -2131,7 +2133,7 @@ slsfs_sas_trace_commit(void)
 
 	SDT_PROBE1(sas, , , write, written);
 
-	taskqueue_drain_all(slos.slos_tq);
+	slos_io_drain();
 	SDT_PROBE0(sas, , , block);
 
 	atomic_add_64(&slsfs_sas_commits, 1);
@@ -2302,7 +2304,7 @@ slsfs_symlink(struct vop_symlink_args *ap)
 	if (error) {
 		vput(vp);
 	}
-	SLSVP(vp)->sn_status |= SLOS_DIRTY;
+	slos_markdirty(SLSVP(vp));
 	*vpp = vp;
 
 	return (error);
@@ -2705,7 +2707,13 @@ slsfs_wal_allocate_extent(struct vnode *vp, size_t size)
 static int
 slsfs_wal_fsync(struct vop_fsync_args *ap)
 {
-	return (vn_fsync_buf(ap->a_vp, ap->a_waitfor));
+	int error;
+
+	error = vn_fsync_buf(ap->a_vp, ap->a_waitfor);
+	if (error != 0 || ap->a_waitfor != MNT_WAIT)
+		return (error);
+
+	return (slsfs_fsync_node(ap->a_vp));
 }
 
 int
@@ -1,7 +1,12 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/buf.h>
+#include <sys/malloc.h>
 #include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/pcpu.h>
+#include <sys/queue.h>
+#include <sys/smp.h>
 #include <sys/uio.h>
 #include <sys/vnode.h>
 
@@ -28,6 +33,147 @@
 static const size_t CHUNK_SIZE = (16 * MB);
 static const size_t WAL_CHUNK = (50 * GB);
 static diskptr_t wal_allocations;
+
+static MALLOC_DEFINE(M_SLOS_ALLOC, "slos_alloc", "SLOS allocator");
+
+/*
+ * An extent carved out of the free trees. We keep recently carved extents
+ * around so that the garbage collector does not reclaim blocks that have been
+ * handed out but are not yet reachable from any superblock.
+ */
+struct slos_carve {
+	uint64_t sc_start; /* First block of the extent */
+	uint64_t sc_end;   /* Block right after the extent */
+	uint64_t sc_epoch; /* Last epoch blocks were handed out from it */
+	TAILQ_ENTRY(slos_carve) sc_entries;
+};
+
+/*
+ * Each CPU bump allocates from its own chunk under its own mutex. Only
+ * refilling a chunk touches the allocator trees.
+ */
+struct slos_pcpuchunk {
+	struct mtx pc_mtx;
+	diskptr_t pc_chunk; /* Unallocated part of the chunk */
+	uint64_t pc_start;  /* First block of the chunk */
+	uint64_t pc_epoch;  /* Last epoch the chunk was allocated from */
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * The size tree maps extent sizes to offsets, but different free extents can
+ * have the same size. Sizes are always block multiples, so we make keys unique
+ * by using the low bits of the key as a tiebreaker.
+ */
+#define STREE_KEYSIZE(slos, key) (rounddown((key), BLKSIZE(slos)))
+
+/*
+ * Add a free extent to the size tree. If all tiebreakers for the size are
+ * taken the extent is only tracked by the offset tree; it still gets merged
+ * with its neighbors when they are freed.
+ */
+static int
+slos_stree_insert(struct slos *slos, uint64_t size, uint64_t off)
+{
+	struct fnode_iter iter;
+	uint64_t key = size;
+	int error;
+
+	error = fbtree_keymax_iter(STREE(slos), &key, &iter);
+	if (error != 0)
+		return (error);
+
+	for (; !ITER_ISNULL(iter); ITER_NEXT(iter)) {
+		if (ITER_KEY_T(iter, uint64_t) != key)
+			break;
+		key += 1;
+	}
+
+	if (key >= size + BLKSIZE(slos))
+		return (ENOSPC);
+
+	return (fbtree_insert(STREE(slos), &key, &off));
+}
+
+/*
+ * Remove a free extent from the size tree, if it is there.
+ */
+static int
+slos_stree_remove(struct slos *slos, uint64_t size, uint64_t off)
+{
+	struct fnode_iter iter;
+	uint64_t key = size;
+	int error;
+
+	error = fbtree_keymax_iter(STREE(slos), &key, &iter);
+	if (error != 0)
+		return (error);
+
+	for (; !ITER_ISNULL(iter); ITER_NEXT(iter)) {
+		key = ITER_KEY_T(iter, uint64_t);
+		if (STREE_KEYSIZE(slos, key) != size)
+			break;
+
+		if (ITER_VAL_T(iter, uint64_t) == off)
+			return (fbtree_remove(STREE(slos), &key, &off));
+	}
+
+	return (ENOENT);
+}
+
+/*
+ * Remember an extent the allocator handed out at the given epoch.
+ */
+static void
+slos_alloc_carve(
+    struct slos *slos, uint64_t start, uint64_t end, uint64_t epoch)
+{
+	struct slos_blkalloc *alloc = &slos->slos_alloc;
+	struct slos_carve *carve, *tcarve;
+
+	if (start == end)
+		return;
+
+	/* Carves older than the fence cannot hide live blocks anymore. */
+	TAILQ_FOREACH_SAFE (carve, &alloc->a_carves, sc_entries, tcarve) {
+		if (alloc->a_fence == EPOCH_INVAL ||
+		    carve->sc_epoch >= alloc->a_fence)
+			break;
+		TAILQ_REMOVE(&alloc->a_carves, carve, sc_entries);
+		free(carve, M_SLOS_ALLOC);
+	}
+
+	/* Grow the newest carve instead of adding one per block. */
+	carve = TAILQ_LAST(&alloc->a_carves, slos_carves);
+	if (carve != NULL && carve->sc_epoch == epoch &&
+	    carve->sc_end == start) {
+		carve->sc_end = end;
+		return;
+	}
+
+	carve = malloc(sizeof(*carve), M_SLOS_ALLOC, M_WAITOK);
+	carve->sc_start = start;
+	carve->sc_end = end;
+	carve->sc_epoch = epoch;
+	TAILQ_INSERT_TAIL(&alloc->a_carves, carve, sc_entries);
+}
+
+static void
+slos_alloc_carvefree(struct slos *slos)
+{
+	struct slos_blkalloc *alloc = &slos->slos_alloc;
+	struct slos_carve *carve, *tcarve;
+
+	/* The list is still zeroed out before the first mount. */
+	if (TAILQ_FIRST(&alloc->a_carves) == NULL) {
+		TAILQ_INIT(&alloc->a_carves);
+		return;
+	}
+
+	TAILQ_FOREACH_SAFE (carve, &alloc->a_carves, sc_entries, tcarve) {
+		TAILQ_REMOVE(&alloc->a_carves, carve, sc_entries);
+		free(carve, M_SLOS_ALLOC);
+	}
+}
 /*
  * Generic uint64_t comparison function.
  */
@@ -62,6 +208,8 @@ slos_blkalloc_wal(struct slos *slos, size_t bytes, diskptr_t *ptr)
 		ptr->offset = wal_allocations.offset;
 		ptr->size = rounded;
 		ptr->epoch = slos->slos_sb->sb_epoch;
+		ptr->csize = 0;
+		ptr->coff = 0;
 		wal_allocations.offset += blocks;
 		wal_allocations.size -= rounded;
 		return (0);
@@ -71,19 +219,25 @@ slos_blkalloc_wal(struct slos *slos, size_t bytes, diskptr_t *ptr)
 }
 
 static int
-fast_path(struct slos *slos, uint64_t bytes, diskptr_t *ptr)
+fast_path(struct slos *slos, struct slos_pcpuchunk *pc, uint64_t bytes,
+    diskptr_t *ptr)
 {
 	uint64_t blksize = BLKSIZE(slos);
-	diskptr_t *chunk = &slos->slos_alloc.chunk;
+	diskptr_t *chunk = &pc->pc_chunk;
 	size_t rounded = roundup(bytes, blksize);
 	size_t blocks = rounded / blksize;
 
+	mtx_assert(&pc->pc_mtx, MA_OWNED);
+
 	if (chunk->size >= blocks * blksize) {
 		ptr->offset = chunk->offset;
 		ptr->size = rounded;
 		ptr->epoch = slos->slos_sb->sb_epoch;
+		ptr->csize = 0;
+		ptr->coff = 0;
 		chunk->offset += blocks;
 		chunk->size -= rounded;
+		pc->pc_epoch = ptr->epoch;
 		return (0);
 	}
 
@@ -120,6 +274,7 @@ slos_blkalloc_large_unlocked(struct slos *slos, size_t size, diskptr_t *ptr)
 	if (error) {
 		panic("Problem removing element in allocation");
 	}
+	fullsize = STREE_KEYSIZE(slos, fullsize);
 
 	KASSERT(fullsize >= asked, ("Simple allocation first"));
 
@@ -132,19 +287,23 @@ slos_blkalloc_large_unlocked(struct slos *slos, size_t size, diskptr_t *ptr)
 	fullsize -= asked;
 	off += (asked / blksize);
 
-	error = fbtree_insert(STREE(slos), &fullsize, &off);
-	if (error) {
-		panic("Problem removing element in allocation");
-	}
+	if (fullsize > 0) {
+		error = slos_stree_insert(slos, fullsize, off);
+		if (error != 0 && error != ENOSPC) {
+			panic("Problem removing element in allocation");
+		}
 
-	error = fbtree_insert(OTREE(slos), &off, &fullsize);
-	if (error) {
-		panic("Problem removing element in allocation");
+		error = fbtree_insert(OTREE(slos), &off, &fullsize);
+		if (error) {
+			panic("Problem removing element in allocation");
+		}
 	}
 
 	ptr->offset = location;
 	ptr->size = asked;
 	ptr->epoch = slos->slos_sb->sb_epoch;
+	ptr->csize = 0;
+	ptr->coff = 0;
 
 	return (0);
 }
@@ -154,77 +313,452 @@ slos_blkalloc_large(struct slos *slos, size_t size, diskptr_t *ptr)
 {
 	int error;
 
-	BTREE_LOCK(STREE(slos), LK_EXCLUSIVE);
-	BTREE_LOCK(OTREE(slos), LK_EXCLUSIVE);
+	slos_alloc_lock(slos);
 	error = slos_blkalloc_large_unlocked(slos, size, ptr);
-	BTREE_UNLOCK(OTREE(slos), 0);
-	BTREE_UNLOCK(STREE(slos), 0);
+	if (error == 0) {
+		slos_alloc_carve(slos, ptr->offset,
+		    ptr->offset + (ptr->size / BLKSIZE(slos)), ptr->epoch);
+	}
+	slos_alloc_unlock(slos);
 
 	return (error);
 }
 
 /*
- * Generic block allocator for the SLOS. We never explicitly free.
+ * Retire a CPU's chunk. The part of it that was handed out is remembered for
+ * the garbage collector, the rest goes back to the free trees. Requires the
+ * allocator lock.
+ */
+static void
+slos_chunk_retire(struct slos *slos, struct slos_pcpuchunk *pc)
+{
+	diskptr_t chunk;
+	uint64_t start, epoch;
+	int error;
+
+	mtx_lock(&pc->pc_mtx);
+	chunk = pc->pc_chunk;
+	start = pc->pc_start;
+	epoch = pc->pc_epoch;
+	pc->pc_chunk.offset = 0;
+	pc->pc_chunk.size = 0;
+	pc->pc_start = 0;
+	mtx_unlock(&pc->pc_mtx);
+
+	slos_alloc_carve(slos, start, chunk.offset, epoch);
+	if (chunk.size == 0)
+		return;
+
+	error = slos_blkfree_unlocked(slos, chunk.offset, chunk.size);
+	if (error != 0) {
+		/* Leave the blocks to the garbage collector. */
+		slos_alloc_carve(slos, chunk.offset,
+		    chunk.offset + (chunk.size / BLKSIZE(slos)), epoch);
+	}
+}
+
+/*
+ * Return the unused part of every CPU's chunk to the free trees.
+ */
+static void
+slos_alloc_release(struct slos *slos)
+{
+	int i;
+
+	slos_alloc_lock(slos);
+	CPU_FOREACH (i)
+		slos_chunk_retire(slos, &slos->slos_alloc.a_pcpu[i]);
+	slos_alloc_unlock(slos);
+}
+
+/*
+ * The allocator is under pressure when no free extent can refill a chunk.
+ * Requires the allocator lock.
+ */
+static bool
+slos_alloc_pressure(struct slos *slos)
+{
+	struct fnode_iter iter;
+	uint64_t key = CHUNK_SIZE;
+	int error;
+
+	error = fbtree_keymax_iter(STREE(slos), &key, &iter);
+	if (error != 0)
+		return (true);
+
+	return (ITER_ISNULL(iter));
+}
+
+/*
+ * Return the chunks of the CPUs that have not allocated anything since the
+ * last sync, or all of them if we are closing or low on space. Busy CPUs keep
+ * their chunks across syncs.
+ */
+static void
+slos_alloc_trim(struct slos *slos, bool closing)
+{
+	uint64_t epoch = slos->slos_sb->sb_epoch;
+	struct slos_pcpuchunk *pc;
+	bool all, stale;
+	int i;
+
+	slos_alloc_lock(slos);
+	all = closing || slos_alloc_pressure(slos);
+	CPU_FOREACH (i) {
+		pc = &slos->slos_alloc.a_pcpu[i];
+
+		mtx_lock(&pc->pc_mtx);
+		stale = (pc->pc_epoch < epoch);
+		mtx_unlock(&pc->pc_mtx);
+
+		if (all || stale)
+			slos_chunk_retire(slos, pc);
+	}
+	slos_alloc_unlock(slos);
+}
+
+/*
+ * Generic block allocator for the SLOS. Blocks are never explicitly freed,
+ * the garbage collector returns them to the allocator when no retained
+ * superblock refers to them anymore.
  */
 int
 slos_blkalloc(struct slos *slos, size_t bytes, diskptr_t *ptr)
 {
-	diskptr_t *chunk = &slos->slos_alloc.chunk;
+	struct slos_pcpuchunk *pc;
+	diskptr_t chunk;
 	int error;
 
-	/* Get an extent large enough to cover the allocation. */
+	if (bytes > CHUNK_SIZE)
+		return (slos_blkalloc_large(slos, bytes, ptr));
+
+	/* Try to bump allocate from this CPU's chunk. */
+	pc = &slos->slos_alloc.a_pcpu[curcpu];
+	mtx_lock(&pc->pc_mtx);
+	if (fast_path(slos, pc, bytes, ptr) == 0) {
+		mtx_unlock(&pc->pc_mtx);
+		return (0);
+	}
+	mtx_unlock(&pc->pc_mtx);
+
+	/*
+	 * Refill the chunk. We might have migrated in the meantime, and the
+	 * chunk might have been refilled by another thread; it does not matter
+	 * since retiring the chunk returns its free blocks.
+	 */
+	slos_alloc_lock(slos);
+	slos_chunk_retire(slos, pc);
+
+	error = slos_blkalloc_large_unlocked(slos, CHUNK_SIZE, &chunk);
+	/*
+	 * Reclaimed space can be fragmented, and free space can be held by
+	 * other CPUs. Fall back to carving out just enough for the allocation.
+	 */
+	if (error == ENOSPC)
+		error = slos_blkalloc_large_unlocked(slos, bytes, &chunk);
+	if (error == ENOSPC) {
+		slos_alloc_unlock(slos);
+		slos_alloc_release(slos);
+		slos_alloc_lock(slos);
+		error = slos_blkalloc_large_unlocked(slos, bytes, &chunk);
+	}
+	if (error != 0) {
+		panic("Problem allocating %d\n", error);
+	}
+
+	mtx_lock(&pc->pc_mtx);
+	KASSERT(pc->pc_chunk.size == 0, ("refilling chunk in use"));
+	pc->pc_chunk = chunk;
+	pc->pc_start = chunk.offset;
+	pc->pc_epoch = chunk.epoch;
+	error = fast_path(slos, pc, bytes, ptr);
+	mtx_unlock(&pc->pc_mtx);
+	slos_alloc_unlock(slos);
+
+	KASSERT(error == 0, ("refilled chunk too small"));
+
+	return (0);
+}
+
+/* Returns the amount of free bytes in the SLOS. */
+int slos_freebytes(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t freebytes = 0;
+	struct fnode_iter iter;
+	uint64_t off = 0;
+	int error;
+
+	if (slos.slos_alloc.a_offset == NULL)
+		return (SYSCTL_OUT(req, &freebytes, sizeof(freebytes)));
+
+	BTREE_LOCK(OTREE(&slos), LK_SHARED);
+	error = fbtree_keymax_iter(OTREE(&slos), &off, &iter);
+	if (error != 0) {
+		BTREE_UNLOCK(OTREE(&slos), 0);
+		return (error);
+	}
+
+	for (; !ITER_ISNULL(iter); ITER_NEXT(iter))
+		freebytes += ITER_VAL_T(iter, uint64_t);
+	BTREE_UNLOCK(OTREE(&slos), 0);
+
+	error = SYSCTL_OUT(req, &freebytes, sizeof(freebytes));
+
+	return (error);
+}
+
+/*
+ * Take a new reference to an allocated block. The reference is not reachable
+ * from any superblock until the current epoch is on disk, so carve the block
+ * to keep the garbage collector away from it until then.
+ */
+int
+slos_blkref(struct slos *slos, uint64_t blk)
+{
+	uint64_t start, end;
+	int error;
+
+	slos_alloc_lock(slos);
+	error = slos_alloc_nextused(slos, blk, &start, &end);
+	if (error == 0 && start != blk)
+		error = ESTALE;
+	if (error == 0)
+		slos_alloc_carve(slos, blk, blk + 1, slos->slos_sb->sb_epoch);
+	slos_alloc_unlock(slos);
+
+	return (error);
+}
+
+/*
+ * Lock the allocator trees. The size tree is always locked first.
+ */
+void
+slos_alloc_lock(struct slos *slos)
+{
 	BTREE_LOCK(STREE(slos), LK_EXCLUSIVE);
-	while (true) {
-		if (!fast_path(slos, bytes, ptr)) {
-			BTREE_UNLOCK(STREE(slos), 0);
-			return (0);
-		}
+	BTREE_LOCK(OTREE(slos), LK_EXCLUSIVE);
+}
 
-		BTREE_LOCK(OTREE(slos), LK_EXCLUSIVE);
-		if (chunk->size > bytes) {
-			BTREE_UNLOCK(OTREE(slos), 0);
+void
+slos_alloc_unlock(struct slos *slos)
+{
+	BTREE_UNLOCK(OTREE(slos), 0);
+	BTREE_UNLOCK(STREE(slos), 0);
+}
+
+/*
+ * Get the first block of a system tree. Passing SLOS_SYSTREES gives the first
+ * block after all of them.
+ */
+uint64_t
+slos_alloc_systree(struct slos *slos, int systree)
+{
+	uint64_t ringblks;
+
+	/* The superblock ring is followed by an unused block. */
+	ringblks = ((NUMSBS * slos->slos_sb->sb_ssize) /
+		       slos->slos_sb->sb_bsize) +
+	    1;
+
+	return (ringblks + (systree * SLOS_SYSTREE_BLKS));
+}
+
+/*
+ * Get the range of blocks the allocator manages, excluding the superblocks,
+ * the system trees, the blocks set aside at creation, and the WAL region.
+ */
+void
+slos_alloc_bounds(struct slos *slos, uint64_t *start, uint64_t *end)
+{
+	*start = slos_alloc_systree(slos, SLOS_SYSTREES) + NEWOSDSIZE;
+	*end = (slos->slos_sb->sb_size - WAL_CHUNK) / BLKSIZE(slos);
+}
+
+/*
+ * Find the first allocated range starting at or after the block. The range
+ * extends up to the next free extent, or to UINT64_MAX if there is none.
+ * Requires the allocator lock.
+ */
+int
+slos_alloc_nextused(
+    struct slos *slos, uint64_t blk, uint64_t *start, uint64_t *end)
+{
+	uint64_t blksize = BLKSIZE(slos);
+	struct fnode_iter iter;
+	uint64_t key = blk;
+	int error;
+
+	/* Skip the free extent the block is in, if any. */
+	error = fbtree_keymin_iter(OTREE(slos), &key, &iter);
+	if (error != 0)
+		return (error);
+
+	if (!ITER_ISNULL(iter)) {
+		key = ITER_KEY_T(iter, uint64_t);
+		blk = MAX(blk, key + (ITER_VAL_T(iter, uint64_t) / blksize));
+	}
+
+	/* Skip any free extents right next to it. */
+	key = blk;
+	error = fbtree_keymax_iter(OTREE(slos), &key, &iter);
+	if (error != 0)
+		return (error);
+
+	for (; !ITER_ISNULL(iter); ITER_NEXT(iter)) {
+		key = ITER_KEY_T(iter, uint64_t);
+		if (key != blk)
+			break;
+		blk = key + (ITER_VAL_T(iter, uint64_t) / blksize);
+	}
+
+	*start = blk;
+	*end = ITER_ISNULL(iter) ? UINT64_MAX : ITER_KEY_T(iter, uint64_t);
+
+	return (0);
+}
+
+/*
+ * Find the first part of [start, end) the allocator may have handed out at or
+ * after the epoch: any CPU's current chunk, or any extent carved since then.
+ * Requires the allocator lock.
+ */
+bool
+slos_alloc_inuse(struct slos *slos, uint64_t epoch, uint64_t start,
+    uint64_t end, uint64_t *usestart, uint64_t *useend)
+{
+	struct slos_blkalloc *alloc = &slos->slos_alloc;
+	struct slos_pcpuchunk *pc;
+	struct slos_carve *carve;
+	uint64_t cstart, cend;
+	int i;
+
+	*usestart = UINT64_MAX;
+	*useend = UINT64_MAX;
+
+	CPU_FOREACH (i) {
+		pc = &alloc->a_pcpu[i];
+		mtx_lock(&pc->pc_mtx);
+		cstart = pc->pc_start;
+		cend = pc->pc_chunk.offset +
+		    (pc->pc_chunk.size / BLKSIZE(slos));
+		mtx_unlock(&pc->pc_mtx);
+
+		if (cstart == cend || cstart >= end || cend <= start)
 			continue;
-		}
 
-		error = slos_blkalloc_large_unlocked(slos, CHUNK_SIZE,
-		    &slos->slos_alloc.chunk);
-		if (error != 0) {
-			panic("Problem allocating %d\n", error);
+		if (MAX(cstart, start) < *usestart) {
+			*usestart = MAX(cstart, start);
+			*useend = cend;
 		}
+	}
 
-		BTREE_UNLOCK(OTREE(slos), 0);
+	TAILQ_FOREACH (carve, &alloc->a_carves, sc_entries) {
+		if (carve->sc_epoch < epoch)
+			continue;
+
+		if (carve->sc_start >= end || carve->sc_end <= start)
+			continue;
+
+		if (MAX(carve->sc_start, start) < *usestart) {
+			*usestart = MAX(carve->sc_start, start);
+			*useend = carve->sc_end;
+		}
 	}
+
+	return (*usestart != UINT64_MAX);
 }
 
-/* Returns the amount of free bytes in the SLOS. */
 /*
- * HACKS HACKS HACKS: Without GC what we're left with
- * is a bump allocator. We just read the size of the
- * leftover chunks to find how much space is left.
+ * Return an extent to the allocator, coalescing it with any free extents
+ * right before or after it. Requires the allocator lock.
  */
-int slos_freebytes(SYSCTL_HANDLER_ARGS)
+int
+slos_blkfree_unlocked(struct slos *slos, uint64_t off, uint64_t size)
 {
-	uint64_t freebytes;
+	uint64_t blksize = BLKSIZE(slos);
 	struct fnode_iter iter;
-	uint64_t asked = 0;
+	uint64_t prevoff = off;
+	uint64_t prevsize;
+	uint64_t nextoff;
+	uint64_t nextsize;
 	int error;
 
-	error = fbtree_keymax_iter(STREE(&slos), &asked, &iter);
-	if (error != 0) {
+	KASSERT(size > 0 && size % blksize == 0, ("freeing %lu bytes", size));
+
+	error = fbtree_keymin_iter(OTREE(slos), &prevoff, &iter);
+	if (error != 0)
 		return (error);
+
+	if (!ITER_ISNULL(iter)) {
+		prevoff = ITER_KEY_T(iter, uint64_t);
+		prevsize = ITER_VAL_T(iter, uint64_t);
+		if (prevoff + (prevsize / blksize) > off) {
+			KASSERT(false, ("freeing free block %lu", off));
+			return (EINVAL);
+		}
+
+		if (prevoff + (prevsize / blksize) == off) {
+			error = fbtree_remove(OTREE(slos), &prevoff, &prevsize);
+			if (error != 0)
+				return (error);
+			(void)slos_stree_remove(slos, prevsize, prevoff);
+
+			off = prevoff;
+			size += prevsize;
+		}
 	}
 
-	if (ITER_ISNULL(iter)) {
-		printf("SLOS is full!\n");
-		return (ENOSPC);
+	nextoff = off + (size / blksize);
+	if (fbtree_get(OTREE(slos), &nextoff, &nextsize) == 0) {
+		error = fbtree_remove(OTREE(slos), &nextoff, &nextsize);
+		if (error != 0)
+			return (error);
+		(void)slos_stree_remove(slos, nextsize, nextoff);
+
+		size += nextsize;
 	}
 
-	freebytes = ITER_KEY_T(iter, uint64_t);
-	error = SYSCTL_OUT(req, &freebytes, sizeof(freebytes));
+	error = fbtree_insert(OTREE(slos), &off, &size);
+	if (error != 0)
+		return (error);
+
+	error = slos_stree_insert(slos, size, off);
+	if (error == ENOSPC)
+		error = 0;
 
 	return (error);
 }
 
+/*
+ * Set up empty per-CPU chunks. The chunks survive remounts, but anything left
+ * in them is stale.
+ */
+static void
+slos_alloc_pcpuinit(struct slos *slos)
+{
+	struct slos_blkalloc *alloc = &slos->slos_alloc;
+	struct slos_pcpuchunk *pc;
+	int i;
+
+	if (alloc->a_pcpu == NULL) {
+		alloc->a_pcpu = mallocarray(mp_maxid + 1, sizeof(*alloc->a_pcpu),
+		    M_SLOS_ALLOC, M_WAITOK | M_ZERO);
+		CPU_FOREACH (i)
+			mtx_init(&alloc->a_pcpu[i].pc_mtx, "slospcpu", NULL,
+			    MTX_DEF);
+	}
+
+	CPU_FOREACH (i) {
+		pc = &alloc->a_pcpu[i];
+		mtx_lock(&pc->pc_mtx);
+		pc->pc_chunk.offset = 0;
+		pc->pc_chunk.size = 0;
+		pc->pc_start = 0;
+		pc->pc_epoch = 0;
+		mtx_unlock(&pc->pc_mtx);
+	}
+}
+
 /*
  * Initialize the in-memory allocator state at mount time.
  */
@@ -246,11 +780,7 @@ slos_allocator_init(struct slos *slos)
 	 * and bump it to allocate.
 	 */
 
-	size_t offset = ((NUMSBS * slos->slos_sb->sb_ssize) /
-			    slos->slos_sb->sb_bsize) +
-	    1;
-	// Checksum tree is allocated first.
-	offset += 2;
+	size_t offset = slos_alloc_systree(slos, SLOS_SYSTREE_ALLOCOFF);
 	if (slos->slos_sb->sb_epoch == EPOCH_INVAL) {
 		DEBUG1(
 		    "Bootstrapping Allocator for first time startup starting at offset %lu",
@@ -262,9 +792,9 @@ slos_allocator_init(struct slos *slos)
 		 * for the root of the tree.
 		 */
 		fbtree_sysinit(slos, offset, &slos->slos_sb->sb_allocoffset);
-		offset += 2;
+		offset = slos_alloc_systree(slos, SLOS_SYSTREE_ALLOCSIZE);
 		fbtree_sysinit(slos, offset, &slos->slos_sb->sb_allocsize);
-		offset += 2;
+		offset = slos_alloc_systree(slos, SLOS_SYSTREES);
 	}
 
 	uint64_t offbl = slos->slos_sb->sb_allocoffset.offset;
@@ -292,8 +822,9 @@ slos_allocator_init(struct slos *slos)
 	}
 	slos->slos_alloc.a_size = sizet;
 
-	slos->slos_alloc.chunk.offset = 0;
-	slos->slos_alloc.chunk.size = 0;
+	slos_alloc_pcpuinit(slos);
+	slos->slos_alloc.a_fence = EPOCH_INVAL;
+	slos_alloc_carvefree(slos);
 
 	// We just have to readjust the elements in the btree since we are not
 	// using them for the same purpose of keeping track of data
@@ -355,6 +886,17 @@ slos_allocator_init(struct slos *slos)
 int
 slos_allocator_uninit(struct slos *slos)
 {
+	struct slos_blkalloc *alloc = &slos->slos_alloc;
+	int i;
+
+	if (alloc->a_pcpu != NULL) {
+		CPU_FOREACH (i)
+			mtx_destroy(&alloc->a_pcpu[i].pc_mtx);
+		free(alloc->a_pcpu, M_SLOS_ALLOC);
+		alloc->a_pcpu = NULL;
+	}
+
+	slos_alloc_carvefree(slos);
 	slos_vpfree(slos, slos->slos_alloc.a_offset);
 	slos->slos_alloc.a_offset = NULL;
 	slos_vpfree(slos, slos->slos_alloc.a_size);
@@ -367,12 +909,18 @@ slos_allocator_uninit(struct slos *slos)
  * Flush the allocator state to disk.
  */
 int
-slos_allocator_sync(struct slos *slos, struct slos_sb *newsb)
+slos_allocator_sync(struct slos *slos, struct slos_sb *newsb, bool closing)
 {
 	int error;
 	struct buf *bp;
 	diskptr_t ptr;
 
+	/*
+	 * Give back the chunks of idle CPUs. This dirties the trees, so do it
+	 * before we size the allocation for them.
+	 */
+	slos_alloc_trim(slos, closing);
+
 	/* This is just arbitrary right now.  We need a better way of
 	 * calculating the dirty blocks we over allocate because we need to
 	 * reallocate parents as well even though they may not be dirty, we are
@@ -389,8 +937,12 @@ slos_allocator_sync(struct slos *slos, struct slos_sb *newsb)
 	    (FBTREE_DIRTYCNT(STREE(slos)) * 5) + 2;
 
 	DEBUG("Syncing Allocator");
-	// Allocate and sync the btree's
-	error = slos_blkalloc(slos, total_allocations * BLKSIZE(slos), &ptr);
+	/*
+	 * Refilling a per-CPU chunk would dirty the trees after we sized the
+	 * allocation, so carve it out of the trees directly.
+	 */
+	error = slos_blkalloc_large(
+	    slos, total_allocations * BLKSIZE(slos), &ptr);
 	if (error != 0) {
 		printf("Unexpected slos_blkalloc failed %d!\n", error);
 		return (error);
@@ -7,13 +7,47 @@
 #define OTREE(slos) (&((slos)->slos_alloc.a_offset->sn_tree))
 #define STREE(slos) (&((slos)->slos_alloc.a_size->sn_tree))
 
+/*
+ * The system trees created with fbtree_sysinit() sit right after the
+ * superblock ring, each taking a block for its inode and one for its root.
+ */
+#define SLOS_SYSTREE_BLKS (2)
+#define SLOS_SYSTREE_CKSUM (0)
+#define SLOS_SYSTREE_ALLOCOFF (1)
+#define SLOS_SYSTREE_ALLOCSIZE (2)
+#define SLOS_SYSTREES (3)
+
 int slos_allocator_init(struct slos *slos);
 int uint64_t_comp(const void *k1, const void *k2);
 int slos_allocator_uninit(struct slos *slos);
-int slos_allocator_sync(struct slos *slos, struct slos_sb *newsb);
+int slos_allocator_sync(
+    struct slos *slos, struct slos_sb *newsb, bool closing);
 int slos_blkalloc(struct slos *slos, size_t bytes, diskptr_t *ptr);
 int slos_blkalloc_large(struct slos *slos, size_t bytes, diskptr_t *ptr);
 int slos_blkalloc_wal(struct slos *slos, size_t bytes, diskptr_t *ptr);
+int slos_blkref(struct slos *slos, uint64_t blk);
+
+void slos_alloc_lock(struct slos *slos);
+void slos_alloc_unlock(struct slos *slos);
+uint64_t slos_alloc_systree(struct slos *slos, int systree);
+void slos_alloc_bounds(struct slos *slos, uint64_t *start, uint64_t *end);
+int slos_alloc_nextused(
+    struct slos *slos, uint64_t blk, uint64_t *start, uint64_t *end);
+bool slos_alloc_inuse(struct slos *slos, uint64_t epoch, uint64_t start,
+    uint64_t end, uint64_t *usestart, uint64_t *useend);
+int slos_blkfree_unlocked(struct slos *slos, uint64_t off, uint64_t size);
+
+extern int slos_gc_enabled;
+extern uint64_t slos_gc_interval;
+extern int slos_gc_batch;
+extern int slos_gc_delay;
+extern uint64_t slos_gc_runs;
+extern uint64_t slos_gc_scanned;
+extern uint64_t slos_gc_freed;
+
+void slos_gc_init(struct slos *slos);
+void slos_gc_drain(struct slos *slos);
+void slos_gc_checkpointed(struct slos *slos, uint64_t epoch, bool complete);
 
 int slos_freebytes(SYSCTL_HANDLER_ARGS);
 
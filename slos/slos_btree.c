@@ -39,6 +39,8 @@ struct extent {
 	uint64_t end;
 	uint64_t target;
 	uint64_t epoch;
+	uint32_t csize; /* Size of the compressed frame, if any */
+	uint32_t coff;	/* Offset of the start in the uncompressed frame */
 };
 
 /*
@@ -2200,6 +2202,86 @@ fbtree_replace(struct fbtree *tree, void *key, void *value)
 	return (0);
 }
 
+/*
+ * Insert an array of key-value pairs sorted by key, replacing the values of
+ * keys already present. Pairs that fall in the same leaf share one descent
+ * from the root, and the leaf is written once for all of them.
+ */
+int
+fbtree_bulkinsert(struct fbtree *tree, void *keys, void *values, int n)
+{
+	char bound[tree->bt_keysize];
+	struct fnode *node, *next;
+	void *key, *value;
+	bool bounded, dirty;
+	int error, index;
+	int i = 0;
+
+	KASSERT((tree->bt_flags & FN_ALLOWDUPLICATE) == 0,
+	    ("bulk insert into a tree with duplicates"));
+
+	while (i < n) {
+		key = (char *)keys + (i * tree->bt_keysize);
+		error = fnode_init(tree, tree->bt_root, &node);
+		if (error) {
+			return (error);
+		}
+
+		/* Find the leaf of the key, and the first key past it. */
+		bounded = false;
+		while (NODE_TYPE(node) == BT_INTERNAL) {
+			index = fnode_first_greater(node, key);
+			if (index < NODE_SIZE(node)) {
+				memcpy(bound, fnode_getkey(node, index),
+				    tree->bt_keysize);
+				bounded = true;
+			}
+
+			error = fnode_fetch(node, index, &next);
+			if (error) {
+				return (error);
+			}
+			node = next;
+		}
+
+		dirty = false;
+		for (; i < n; i++) {
+			key = (char *)keys + (i * tree->bt_keysize);
+			value = (char *)values + (i * tree->bt_valsize);
+			if (bounded && NODE_COMPARE(node, key, bound) >= 0)
+				break;
+
+			index = fnode_first_greater_equal(node, key);
+			if (index < NODE_SIZE(node) &&
+			    NODE_COMPARE(node, fnode_getkey(node, index), key) ==
+				0) {
+				fnode_setval(node, index, value);
+				dirty = true;
+				continue;
+			}
+
+			/* Inserts that split the leaf go through the slow path. */
+			if (NODE_SIZE(node) + 2 >= NODE_MAX(node)) {
+				error = fnode_insert(node, key, value);
+				if (error) {
+					return (error);
+				}
+				dirty = false;
+				i++;
+				break;
+			}
+
+			fnode_insert_at(node, key, value, index);
+			dirty = true;
+		}
+
+		if (dirty)
+			fnode_write(node);
+	}
+
+	return (0);
+}
+
 void
 fiter_replace(struct fnode_iter *it, void *val)
 {
@@ -2311,6 +2393,8 @@ fbtree_sysinit(struct slos *slos, size_t offset, diskptr_t *ptr)
 	ino.ino_magic = SLOS_IMAGIC;
 	ptr->offset = offset;
 	ptr->size = BLKSIZE(slos);
+	ptr->csize = 0;
+	ptr->coff = 0;
 	ino.ino_pid = -1;
 	ino.ino_blk = offset;
 	ino.ino_btree.offset = offset + 1;
@@ -2350,7 +2434,10 @@ static void
 extent_clip_tail(struct extent *extent, uint64_t boundary)
 {
 	if (boundary > extent->start) {
-		if (extent->target != 0) {
+		/* Compressed frames can only be read in whole. */
+		if (extent->csize != 0) {
+			extent->coff += (boundary - extent->start) * PAGE_SIZE;
+		} else if (extent->target != 0) {
 			extent->target += boundary - extent->start;
 		}
 		extent->start = boundary;
@@ -2372,12 +2459,16 @@ set_extent(struct extent *extent, uint64_t lbn, uint64_t size, uint64_t target,
 	extent->end = lbn + (size / PAGE_SIZE);
 	extent->target = target;
 	extent->epoch = epoch;
+	extent->csize = 0;
+	extent->coff = 0;
 }
 
 static void
 diskptr_to_extent(struct extent *extent, uint64_t lbn, const diskptr_t *diskptr)
 {
 	set_extent(extent, lbn, diskptr->size, diskptr->offset, diskptr->epoch);
+	extent->csize = diskptr->csize;
+	extent->coff = diskptr->coff;
 }
 
 static void
@@ -2388,6 +2479,8 @@ extent_to_diskptr(
 	diskptr->offset = extent->target;
 	diskptr->size = (extent->end - extent->start) * PAGE_SIZE;
 	diskptr->epoch = extent->epoch;
+	diskptr->csize = extent->csize;
+	diskptr->coff = extent->coff;
 }
 
 /*
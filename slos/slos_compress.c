@@ -0,0 +1,286 @@
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+
+#include "slos_compress.h"
+
+/*
+ * Compression for the data of the SLOS. This is a byte-oriented LZ77 variant
+ * in the format of LZ4 blocks: each sequence is a token holding the lengths
+ * of a literal run and of a match, the literals, and the 16-bit offset of the
+ * match. It is fast enough to keep up with the disk, which matters more to
+ * us than the compression ratio.
+ */
+
+#define SLOS_CMP_MINMATCH (4)
+#define SLOS_CMP_MAXOFF (65535)
+#define SLOS_CMP_RUNMASK (15)
+/* The data always ends with a few literals, like in LZ4. */
+#define SLOS_CMP_LASTLITERALS (5)
+#define SLOS_CMP_MFLIMIT (12)
+/* Skip ahead faster the longer we go without finding matches. */
+#define SLOS_CMP_SKIPLOG (6)
+
+static __inline uint32_t
+slos_cmp_read32(const u_char *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return (val);
+}
+
+static __inline uint64_t
+slos_cmp_read64(const u_char *p)
+{
+	uint64_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return (val);
+}
+
+/*
+ * Count how many bytes match after the first ones, a word at a time.
+ */
+static size_t
+slos_cmp_count(const u_char *ip, const u_char *ref, const u_char *limit)
+{
+	const u_char *start = ip;
+	uint64_t diff;
+
+	while (ip + sizeof(diff) <= limit) {
+		diff = slos_cmp_read64(ip) ^ slos_cmp_read64(ref);
+		if (diff != 0) {
+#if BYTE_ORDER == LITTLE_ENDIAN
+			return ((ip - start) + (__builtin_ctzll(diff) >> 3));
+#else
+			return ((ip - start) + (__builtin_clzll(diff) >> 3));
+#endif
+		}
+
+		ip += sizeof(diff);
+		ref += sizeof(diff);
+	}
+
+	while (ip < limit && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+
+	return (ip - start);
+}
+
+static __inline u_int
+slos_cmp_hash(uint32_t val)
+{
+	return ((val * 2654435761U) >> (32 - SLOS_CMP_HASHLOG));
+}
+
+/* Worst case number of bytes taken up by a length field. */
+static __inline size_t
+slos_cmp_lenbytes(size_t len)
+{
+	return ((len >= SLOS_CMP_RUNMASK) ? (len / 255) + 1 : 0);
+}
+
+static u_char *
+slos_cmp_putlen(u_char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return (op);
+}
+
+static int
+slos_cmp_getlen(const u_char **ipp, const u_char *iend, size_t *lenp)
+{
+	const u_char *ip = *ipp;
+	u_char byte;
+
+	do {
+		if (ip == iend)
+			return (EINVAL);
+		byte = *ip++;
+		*lenp += byte;
+	} while (byte == 255);
+
+	*ipp = ip;
+	return (0);
+}
+
+/*
+ * Emit a sequence: the literals from the anchor, followed by a match of the
+ * given length and offset. Matches of length 0 end the data. Returns NULL if
+ * the sequence does not fit in the output.
+ */
+static u_char *
+slos_cmp_putseq(u_char *op, u_char *oend, const u_char *anchor, size_t litlen,
+    size_t off, size_t mlen)
+{
+	u_char *token;
+	size_t need;
+
+	need = 1 + slos_cmp_lenbytes(litlen) + litlen;
+	if (mlen > 0)
+		need += 2 + slos_cmp_lenbytes(mlen - SLOS_CMP_MINMATCH);
+	if (need > (size_t)(oend - op))
+		return (NULL);
+
+	token = op++;
+	if (litlen >= SLOS_CMP_RUNMASK) {
+		*token = SLOS_CMP_RUNMASK << 4;
+		op = slos_cmp_putlen(op, litlen - SLOS_CMP_RUNMASK);
+	} else {
+		*token = litlen << 4;
+	}
+
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	if (mlen == 0)
+		return (op);
+
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+
+	mlen -= SLOS_CMP_MINMATCH;
+	if (mlen >= SLOS_CMP_RUNMASK) {
+		*token |= SLOS_CMP_RUNMASK;
+		op = slos_cmp_putlen(op, mlen - SLOS_CMP_RUNMASK);
+	} else {
+		*token |= mlen;
+	}
+
+	return (op);
+}
+
+/*
+ * Compress the source into the destination. The work area must hold
+ * SLOS_CMP_WORKSIZE bytes. Returns the size of the compressed data, or 0 if
+ * it does not fit in the destination.
+ */
+size_t
+slos_compress(
+    const void *src, size_t srclen, void *dst, size_t dstlen, void *work)
+{
+	const u_char *base = src;
+	const u_char *ip = base, *anchor = base, *ref;
+	const u_char *iend = base + srclen;
+	const u_char *mflimit, *matchlimit;
+	u_char *op = dst, *oend = op + dstlen;
+	uint32_t *table = work;
+	size_t mlen;
+	u_int h;
+
+	KASSERT(srclen <= UINT32_MAX, ("compressing %lu bytes", srclen));
+	memset(table, 0, SLOS_CMP_WORKSIZE);
+
+	if (srclen <= SLOS_CMP_MFLIMIT)
+		goto last;
+
+	mflimit = iend - SLOS_CMP_MFLIMIT;
+	matchlimit = iend - SLOS_CMP_LASTLITERALS;
+
+	while (ip < mflimit) {
+		h = slos_cmp_hash(slos_cmp_read32(ip));
+		ref = base + table[h];
+		table[h] = ip - base;
+
+		if (ref >= ip || ip - ref > SLOS_CMP_MAXOFF ||
+		    slos_cmp_read32(ref) != slos_cmp_read32(ip)) {
+			ip += 1 + ((ip - anchor) >> SLOS_CMP_SKIPLOG);
+			continue;
+		}
+
+		/* Extend the match in both directions. */
+		while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		mlen = SLOS_CMP_MINMATCH +
+		    slos_cmp_count(ip + SLOS_CMP_MINMATCH,
+			ref + SLOS_CMP_MINMATCH, matchlimit);
+
+		op = slos_cmp_putseq(op, oend, anchor, ip - anchor, ip - ref,
+		    mlen);
+		if (op == NULL)
+			return (0);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+last:
+	op = slos_cmp_putseq(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL)
+		return (0);
+
+	return (op - (u_char *)dst);
+}
+
+/*
+ * Decompress the source until the destination is full. The destination can
+ * be shorter than the uncompressed data, in which case we stop early.
+ */
+int
+slos_decompress(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+	const u_char *ip = src, *iend = ip + srclen;
+	u_char *op = dst, *oend = op + dstlen;
+	const u_char *ref;
+	size_t len, off, ncopy;
+	u_char token;
+	int error;
+
+	while (ip < iend && op < oend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == SLOS_CMP_RUNMASK) {
+			error = slos_cmp_getlen(&ip, iend, &len);
+			if (error != 0)
+				return (error);
+		}
+
+		if (len > (size_t)(iend - ip))
+			return (EINVAL);
+
+		ncopy = MIN(len, (size_t)(oend - op));
+		memcpy(op, ip, ncopy);
+		op += ncopy;
+		ip += len;
+
+		/* The last sequence has no match. */
+		if (ip == iend || op == oend)
+			break;
+
+		if (iend - ip < 2)
+			return (EINVAL);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - (u_char *)dst))
+			return (EINVAL);
+
+		len = token & SLOS_CMP_RUNMASK;
+		if (len == SLOS_CMP_RUNMASK) {
+			error = slos_cmp_getlen(&ip, iend, &len);
+			if (error != 0)
+				return (error);
+		}
+		len = MIN(len + SLOS_CMP_MINMATCH, (size_t)(oend - op));
+
+		/* Matches can overlap with their own output. */
+		ref = op - off;
+		if (off >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return ((op == oend) ? 0 : EINVAL);
+}
@@ -0,0 +1,24 @@
+#ifndef _SLOS_COMPRESS_H_
+#define _SLOS_COMPRESS_H_
+
+#include <sys/param.h>
+
+#define SLOS_CMPMAGIC (0x534c5a31) /* "SLZ1" */
+#define SLOS_CMP_HASHLOG (12)
+
+/* Scratch space the compressor needs for its match table. */
+#define SLOS_CMP_WORKSIZE (sizeof(uint32_t) << SLOS_CMP_HASHLOG)
+
+/* Header of a compressed frame on disk. */
+struct slos_cmphdr {
+	uint32_t ch_magic;  /* SLOS_CMPMAGIC */
+	uint32_t ch_ulen;   /* Size of the data before compression */
+	uint32_t ch_clen;   /* Size of the compressed data after the header */
+	uint32_t ch_unused; /* Padding */
+};
+
+size_t slos_compress(
+    const void *src, size_t srclen, void *dst, size_t dstlen, void *work);
+int slos_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+#endif /* _SLOS_COMPRESS_H_ */
@@ -0,0 +1,578 @@
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bitstring.h>
+#include <sys/buf.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/taskqueue.h>
+#include <sys/vnode.h>
+
+#include <machine/atomic.h>
+
+#include <slos.h>
+#include <slos_inode.h>
+#include <slos_io.h>
+#include <slsfs.h>
+
+#include <btree.h>
+
+#include "debug.h"
+#include "slos_alloc.h"
+
+/*
+ * Garbage collector for the SLOS block allocator.
+ *
+ * Every write is copy on write, so the blocks of older epochs stay allocated
+ * forever unless someone returns them. The collector marks all blocks
+ * reachable from the superblocks still in the ring or from the trees in
+ * memory, then returns the allocated blocks that were not marked to the
+ * allocator. It is off by default.
+ *
+ * Blocks handed out after the last complete checkpoint are not reachable from
+ * any superblock yet. The allocator keeps track of the extents it carves out,
+ * and we never reclaim extents used at or after the fence epoch.
+ */
+
+static MALLOC_DEFINE(M_SLOS_GC, "slos_gc", "SLOS garbage collector");
+
+int slos_gc_enabled = 0;
+uint64_t slos_gc_interval = NUMSBS;
+int slos_gc_batch = 64;
+int slos_gc_delay = 1;
+
+uint64_t slos_gc_runs;
+uint64_t slos_gc_scanned;
+uint64_t slos_gc_freed;
+
+struct slos_gc {
+	struct slos *gc_slos;
+	bitstr_t *gc_marks; /* Blocks reachable from a retained epoch */
+	uint64_t gc_nblks;  /* Blocks in the device */
+	uint64_t gc_fence;  /* Oldest epoch whose allocations we keep */
+	int gc_budget;	    /* Work left until we back off */
+};
+
+typedef int (*slos_gc_leaf_t)(struct slos_gc *gc, void *val);
+
+/*
+ * Throttle the collector. After every batch of work wait for any checkpoint in
+ * progress to finish, then back off for a while.
+ */
+static int
+slos_gc_yield(struct slos_gc *gc, int work)
+{
+	struct slos *slos = gc->gc_slos;
+
+	gc->gc_budget -= work;
+	if (gc->gc_budget > 0)
+		return (0);
+
+	gc->gc_budget = imax(slos_gc_batch, 1);
+
+	mtx_lock(&slos->slsfs_sync_lk);
+	while (slos->slsfs_syncing && !slos->slos_gcstop)
+		cv_wait(&slos->slsfs_sync_cv, &slos->slsfs_sync_lk);
+	mtx_unlock(&slos->slsfs_sync_lk);
+
+	if (slos->slos_gcstop)
+		return (EINTR);
+
+	if (slos_gc_delay > 0)
+		pause("slosgc", imax((slos_gc_delay * hz) / 1000, 1));
+
+	return (0);
+}
+
+/*
+ * Mark a range of blocks. Returns true if the first block was already marked.
+ */
+static bool
+slos_gc_mark(struct slos_gc *gc, uint64_t blkno, uint64_t nblks)
+{
+	bool marked;
+
+	if (blkno >= gc->gc_nblks || nblks == 0)
+		return (true);
+
+	nblks = MIN(nblks, gc->gc_nblks - blkno);
+	marked = bit_test(gc->gc_marks, blkno);
+	bit_nset(gc->gc_marks, blkno, blkno + nblks - 1);
+
+	return (marked);
+}
+
+/*
+ * Mark a btree node and its ancestors. Siblings share their parent, so stop
+ * early if the node has the same parent as the last one we visited.
+ */
+static int
+slos_gc_path(struct slos_gc *gc, struct fnode *node, struct fnode **lastp)
+{
+	struct fnode *parent;
+	int error;
+
+	slos_gc_mark(gc, node->fn_location, 1);
+
+	error = fnode_parent(node, &parent);
+	if (error != 0)
+		return (error);
+
+	if (parent == *lastp)
+		return (0);
+	*lastp = parent;
+
+	for (node = parent; node != NULL; node = parent) {
+		slos_gc_mark(gc, node->fn_location, 1);
+		error = fnode_parent(node, &parent);
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Mark all nodes of a btree, and pass each value to the leaf function. The
+ * nodes are read through the tree, so for trees in use we also see the
+ * modifications that are not on disk yet.
+ */
+static int
+slos_gc_walk(struct slos_gc *gc, struct fbtree *tree, slos_gc_leaf_t leaf)
+{
+	struct fnode *node = NULL, *last = NULL;
+	struct fnode_iter iter;
+	uint64_t key = 0;
+	int error;
+
+	/* The root is all there is to an empty tree. */
+	slos_gc_mark(gc, tree->bt_root, 1);
+
+	error = fbtree_keymax_iter(tree, &key, &iter);
+	if (error != 0)
+		return (error);
+
+	for (; !ITER_ISNULL(iter); ITER_NEXT(iter)) {
+		if (iter.it_node != node) {
+			node = iter.it_node;
+			error = slos_gc_path(gc, node, &last);
+			if (error != 0)
+				return (error);
+		}
+
+		if (leaf == NULL)
+			continue;
+
+		error = leaf(gc, ITER_VAL(iter));
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+/* Mark the data extent pointed to by a file btree value. */
+static int
+slos_gc_extent(struct slos_gc *gc, void *val)
+{
+	diskptr_t ptr;
+	size_t size;
+
+	memcpy(&ptr, val, sizeof(ptr));
+	if (ptr.offset == 0)
+		return (0);
+
+	/* Compressed extents keep their whole frame alive. */
+	size = (ptr.csize != 0) ? ptr.csize : ptr.size;
+	slos_gc_mark(gc, ptr.offset, howmany(size, BLKSIZE(gc->gc_slos)));
+
+	return (0);
+}
+
+/*
+ * Bring in an inode of an older epoch as a private in-memory node. Nothing
+ * else can reach the node, so its tree is walked without locking. Blocks
+ * that do not hold an inode are skipped.
+ */
+static int
+slos_gc_import(struct slos_gc *gc, uint64_t blkno, struct slos_node **svpp)
+{
+	int error;
+
+	*svpp = NULL;
+	if (blkno == 0 || slos_gc_mark(gc, blkno, 1))
+		return (0);
+
+	error = slos_gc_yield(gc, 1);
+	if (error != 0)
+		return (error);
+
+	atomic_add_64(&slos_gc_scanned, 1);
+
+	error = slos_svpimport(gc->gc_slos, blkno, true, svpp);
+	if (error == EINVAL) {
+		*svpp = NULL;
+		return (0);
+	}
+
+	return (error);
+}
+
+/*
+ * Mark an inode and the data it points to. Nodes are never modified after
+ * they are on disk, so if we have seen the inode before from another
+ * superblock we have already seen its tree.
+ */
+static int
+slos_gc_inode(struct slos_gc *gc, uint64_t blkno, size_t vs,
+    slos_gc_leaf_t leaf)
+{
+	struct slos_node *svp;
+	int error;
+
+	error = slos_gc_import(gc, blkno, &svp);
+	if (error != 0 || svp == NULL)
+		return (error);
+
+	/* Only the checksum tree does not hold extents. */
+	if (vs != sizeof(diskptr_t))
+		fbtree_init(svp->sn_fdev, svp->sn_tree.bt_root,
+		    sizeof(uint64_t), vs, &uint64_t_comp, "GC tree", 0,
+		    &svp->sn_tree);
+
+	error = slos_gc_walk(gc, &svp->sn_tree, leaf);
+	slos_vpfree(gc->gc_slos, svp);
+
+	return (error);
+}
+
+/*
+ * Mark an extent of the inode file. Each block holds an inode, so trace the
+ * file of every block we have not seen before.
+ */
+static int
+slos_gc_inodes(struct slos_gc *gc, void *val)
+{
+	uint64_t blkno;
+	diskptr_t ptr;
+	int error;
+
+	memcpy(&ptr, val, sizeof(ptr));
+	if (ptr.offset == 0)
+		return (0);
+
+	for (blkno = ptr.offset;
+	     blkno < ptr.offset + howmany(ptr.size, BLKSIZE(gc->gc_slos));
+	     blkno++) {
+		error = slos_gc_inode(
+		    gc, blkno, sizeof(diskptr_t), slos_gc_extent);
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Mark the system inode of an allocator tree from an older superblock. The
+ * allocator trees are updated in place, so only the current ones are worth
+ * walking; we just keep the blocks the old superblock refers to directly.
+ */
+static int
+slos_gc_allocino(struct slos_gc *gc, uint64_t blkno)
+{
+	struct slos_node *svp;
+	int error;
+
+	error = slos_gc_import(gc, blkno, &svp);
+	if (error != 0 || svp == NULL)
+		return (error);
+
+	slos_gc_mark(gc, svp->sn_tree.bt_root, 1);
+	slos_vpfree(gc->gc_slos, svp);
+
+	return (0);
+}
+
+static int
+slos_gc_marksb(struct slos_gc *gc, struct slos_sb *sb)
+{
+	int error;
+
+	error = slos_gc_inode(
+	    gc, sb->sb_root.offset, sizeof(diskptr_t), slos_gc_inodes);
+	if (error != 0)
+		return (error);
+
+	error = slos_gc_inode(
+	    gc, sb->sb_cksumtree.offset, sizeof(uint32_t), NULL);
+	if (error != 0)
+		return (error);
+
+	error = slos_gc_allocino(gc, sb->sb_allocoffset.offset);
+	if (error != 0)
+		return (error);
+
+	return (slos_gc_allocino(gc, sb->sb_allocsize.offset));
+}
+
+/* Mark an in-memory node along with its tree, dirty nodes included. */
+static int
+slos_gc_node(struct slos_gc *gc, struct slos_node *svp, slos_gc_leaf_t leaf)
+{
+	int error;
+
+	slos_gc_mark(gc, svp->sn_ino.ino_blk, 1);
+
+	BTREE_LOCK(&svp->sn_tree, LK_SHARED);
+	error = slos_gc_walk(gc, &svp->sn_tree, leaf);
+	BTREE_UNLOCK(&svp->sn_tree, 0);
+
+	return (error);
+}
+
+/*
+ * Mark the blocks referenced by the in-memory state: the current allocator
+ * and checksum trees, and the trees of all files with a vnode. These can
+ * point to blocks that no superblock on disk refers to yet.
+ */
+static int
+slos_gc_markmem(struct slos_gc *gc)
+{
+	struct slos *slos = gc->gc_slos;
+	struct mount *mp = slos->slsfs_mount;
+	struct vnode *vp, *mvp;
+	int error;
+
+	slos_alloc_lock(slos);
+	error = slos_gc_walk(gc, OTREE(slos), NULL);
+	if (error == 0)
+		error = slos_gc_walk(gc, STREE(slos), NULL);
+	slos_alloc_unlock(slos);
+	if (error != 0)
+		return (error);
+
+	slos_gc_mark(gc, slos->slos_alloc.a_offset->sn_ino.ino_blk, 1);
+	slos_gc_mark(gc, slos->slos_alloc.a_size->sn_ino.ino_blk, 1);
+
+	if (slos->slos_cktree != NULL) {
+		error = slos_gc_node(gc, slos->slos_cktree, NULL);
+		if (error != 0)
+			return (error);
+	}
+
+	MNT_VNODE_FOREACH_ALL(vp, mp, mvp)
+	{
+		/* Skip the fake device vnodes backing the btrees. */
+		if (vp->v_type == VNON || vp->v_type == VCHR ||
+		    vp->v_data == NULL || SLSVP(vp)->sn_vp != vp) {
+			VI_UNLOCK(vp);
+			continue;
+		}
+
+		if (vget(vp, LK_SHARED | LK_INTERLOCK, curthread) != 0)
+			continue;
+
+		error = slos_gc_node(gc, SLSVP(vp), slos_gc_extent);
+		vput(vp);
+		if (error == 0)
+			error = slos_gc_yield(gc, 1);
+		if (error != 0) {
+			MNT_VNODE_FOREACH_ALL_ABORT(mp, mvp);
+			return (error);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Return all unmarked allocated blocks to the allocator, a batch at a time.
+ */
+static int
+slos_gc_sweep(struct slos_gc *gc)
+{
+	struct slos *slos = gc->gc_slos;
+	struct vnode *devvp = slos->slos_vp;
+	uint64_t blksize = BLKSIZE(slos);
+	uint64_t change = blksize / devvp->v_bufobj.bo_bsize;
+	uint64_t usestart, useend;
+	uint64_t cursor, limit;
+	uint64_t start, end;
+	int first, last;
+	int error = 0;
+	int freed;
+
+	slos_alloc_bounds(slos, &cursor, &limit);
+	limit = MIN(limit, gc->gc_nblks);
+
+	while (cursor < limit) {
+		error = slos_gc_yield(gc, slos_gc_batch);
+		if (error != 0)
+			return (error);
+
+		slos_alloc_lock(slos);
+		error = slos_alloc_nextused(slos, cursor, &start, &end);
+		if (error != 0) {
+			slos_alloc_unlock(slos);
+			return (error);
+		}
+		end = MIN(end, limit);
+
+		VOP_LOCK(devvp, LK_EXCLUSIVE | LK_RETRY);
+		for (freed = 0; start < end && freed < slos_gc_batch;) {
+			bit_ffc_at(gc->gc_marks, start, end, &first);
+			if (first < 0) {
+				start = end;
+				break;
+			}
+
+			bit_ffs_at(gc->gc_marks, first, end, &last);
+			if (last < 0)
+				last = end;
+
+			if (slos_alloc_inuse(slos, gc->gc_fence, first, last,
+				&usestart, &useend)) {
+				if (usestart == first) {
+					start = useend;
+					continue;
+				}
+				last = usestart;
+			}
+
+			error = slos_blkfree_unlocked(
+			    slos, first, (last - first) * blksize);
+			if (error != 0)
+				break;
+
+			/* Drop any stale device buffers for the blocks. */
+			v_inval_buf_range(devvp, first * change,
+			    last * change, devvp->v_bufobj.bo_bsize);
+
+			atomic_add_64(&slos_gc_freed, (last - first) * blksize);
+			freed += 1;
+			start = last;
+		}
+		VOP_UNLOCK(devvp, 0);
+		slos_alloc_unlock(slos);
+
+		if (error != 0)
+			return (error);
+
+		cursor = start;
+	}
+
+	return (0);
+}
+
+static void
+slos_gc_task(void *ctx, int __unused pending)
+{
+	struct slos *slos = (struct slos *)ctx;
+	struct slos_gc gc;
+	struct slos_sb *sb;
+	int error;
+	int i;
+
+	gc.gc_slos = slos;
+	gc.gc_fence = atomic_load_acq_64(&slos->slos_alloc.a_fence);
+	gc.gc_nblks = slos->slos_sb->sb_size / BLKSIZE(slos);
+	gc.gc_budget = imax(slos_gc_batch, 1);
+
+	/* Nothing is safe to reclaim before the first complete checkpoint. */
+	if (gc.gc_fence == EPOCH_INVAL)
+		return;
+
+	if (gc.gc_nblks > INT_MAX) {
+		printf("SLOS too large for garbage collection\n");
+		return;
+	}
+
+	gc.gc_marks = bit_alloc(gc.gc_nblks, M_SLOS_GC, M_WAITOK);
+	sb = malloc(sizeof(*sb), M_SLOS_GC, M_WAITOK);
+
+	for (i = 0; i < NUMSBS; i++) {
+		if (slos_sbat(slos, i, sb) != 0)
+			continue;
+
+		if (sb->sb_epoch == EPOCH_INVAL || sb->sb_root.offset == 0)
+			continue;
+
+		error = slos_gc_marksb(&gc, sb);
+		if (error != 0)
+			goto out;
+	}
+
+	/*
+	 * The in-memory trees last: they never skip marked nodes, but the
+	 * on-disk trees skip inodes we have seen, and a file in memory can
+	 * have dropped extents its inode on disk still points to.
+	 */
+	error = slos_gc_markmem(&gc);
+	if (error != 0)
+		goto out;
+
+	error = slos_gc_sweep(&gc);
+	if (error != 0)
+		goto out;
+
+	atomic_add_64(&slos_gc_runs, 1);
+
+out:
+	if (error != 0 && error != EINTR)
+		printf("SLOS garbage collection failed with %d\n", error);
+
+	free(sb, M_SLOS_GC);
+	free(gc.gc_marks, M_SLOS_GC);
+}
+
+void
+slos_gc_init(struct slos *slos)
+{
+	TASK_INIT(&slos->slos_gctask, 0, slos_gc_task, slos);
+	slos->slos_gcepochs = 0;
+	slos->slos_gcstop = 0;
+}
+
+/*
+ * Stop any running collection and wait for it to exit.
+ */
+void
+slos_gc_drain(struct slos *slos)
+{
+	if (slos->slos_tq == NULL)
+		return;
+
+	mtx_lock(&slos->slsfs_sync_lk);
+	slos->slos_gcstop = 1;
+	cv_broadcast(&slos->slsfs_sync_cv);
+	mtx_unlock(&slos->slsfs_sync_lk);
+
+	taskqueue_cancel(slos->slos_tq, &slos->slos_gctask, NULL);
+	taskqueue_drain(slos->slos_tq, &slos->slos_gctask);
+}
+
+/*
+ * Called by the syncer after a checkpoint is on disk. If the checkpoint
+ * includes all dirty state, everything allocated before its epoch is either
+ * reachable from its superblock or garbage, so move the fence up.
+ */
+void
+slos_gc_checkpointed(struct slos *slos, uint64_t epoch, bool complete)
+{
+	if (complete)
+		atomic_store_rel_64(&slos->slos_alloc.a_fence, epoch);
+
+	if (!slos_gc_enabled || slos_gc_interval == 0 || slos->slos_gcstop)
+		return;
+
+	if ((slos->slsfs_mount->mnt_flag & MNT_RDONLY) != 0)
+		return;
+
+	if (++slos->slos_gcepochs < slos_gc_interval)
+		return;
+
+	slos->slos_gcepochs = 0;
+	if (slos->slos_tq != NULL)
+		taskqueue_enqueue(slos->slos_tq, &slos->slos_gctask);
+}
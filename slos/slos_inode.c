@@ -6,6 +6,7 @@
 #include <sys/mount.h>
 #include <sys/sbuf.h>
 #include <sys/sysctl.h>
+#include <sys/systm.h>
 #include <sys/time.h>
 #include <sys/ucred.h>
 #include <sys/uio.h>
@@ -38,6 +39,13 @@ static int slos_count_opened_bytes;
 
 extern uint64_t slsfs_sas_aborts;
 extern uint64_t slsfs_sas_commits;
+extern int slsfs_dirhash_minblks;
+extern uint64_t slsfs_dirhash_maxmem;
+extern uint64_t slsfs_dirhash_mem;
+extern int slsfs_sync_threads;
+extern uint64_t slsfs_sync_flushed;
+extern struct sls_histogram slsfs_commit_batch;
+extern struct sls_histogram slsfs_fsync_latency;
 
 #ifdef INVARIANTS
 static void
@@ -122,12 +130,81 @@ slos_init(void)
 	    "Direct buffer IOs initiated");
 	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "io_done", CTLFLAG_RD, &slos_io_done, 0, "Direct buffer IOs done");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_zeroed", CTLFLAG_RD, &slos_io_zeroed, 0,
+	    "Pages read from zero extents without IO");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_cmpin", CTLFLAG_RD, &slos_io_cmpin, 0,
+	    "Bytes of data given to the compressor");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_cmpout", CTLFLAG_RD, &slos_io_cmpout, 0,
+	    "Bytes written out for the data given to the compressor");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_decompressed", CTLFLAG_RD, &slos_io_decompressed, 0,
+	    "Pages read from compressed extents");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_qdepth", CTLFLAG_RW, &slos_io_qdepth, 0,
+	    "Maximum direct buffer IOs in flight");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_segsize", CTLFLAG_RW, &slos_io_segsize, 0,
+	    "Size of segments checkpoint writes are packed in, 0 to disable");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "io_segments", CTLFLAG_RD, &slos_io_segments, 0,
+	    "Packed segments written");
 	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "sas_commits", CTLFLAG_RD, &slsfs_sas_commits, 0,
 	    "SAS commits done");
 	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "sas_aborts", CTLFLAG_RD, &slsfs_sas_aborts, 0, "SAS aborts done");
 
+	(void)SYSCTL_ADD_PROC(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "freebytes", CTLTYPE_U64 | CTLFLAG_RD, NULL, 0, &slos_freebytes,
+	    "QU", "Bytes in the allocator's free extents");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_enabled", CTLFLAG_RW, &slos_gc_enabled, 0,
+	    "Reclaim blocks unreachable from retained superblocks");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_interval", CTLFLAG_RW, &slos_gc_interval, 0,
+	    "Checkpoints between garbage collections");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_batch", CTLFLAG_RW, &slos_gc_batch, 0,
+	    "Blocks read or extents freed before the collector backs off");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_delay", CTLFLAG_RW, &slos_gc_delay, 0,
+	    "Milliseconds the collector backs off between batches");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_runs", CTLFLAG_RD, &slos_gc_runs, 0,
+	    "Garbage collections completed");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_scanned", CTLFLAG_RD, &slos_gc_scanned, 0,
+	    "Metadata blocks read by the collector");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "gc_freed", CTLFLAG_RD, &slos_gc_freed, 0,
+	    "Bytes returned to the allocator by the collector");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dirhash_minblks", CTLFLAG_RW, &slsfs_dirhash_minblks, 0,
+	    "Directory blocks before lookups use a name index, 0 to disable");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dirhash_maxmem", CTLFLAG_RW, &slsfs_dirhash_maxmem, 0,
+	    "Maximum bytes used by directory name indices");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dirhash_mem", CTLFLAG_RD, &slsfs_dirhash_mem, 0,
+	    "Bytes used by directory name indices");
+	(void)SYSCTL_ADD_INT(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "sync_threads", CTLFLAG_RW, &slsfs_sync_threads, 0,
+	    "Threads flushing dirty nodes at mount time, 0 for none");
+	(void)SYSCTL_ADD_U64(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "sync_flushed", CTLFLAG_RD, &slsfs_sync_flushed, 0,
+	    "Dirty nodes visited by the syncer");
+	(void)SYSCTL_ADD_OPAQUE(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "commit_batch", CTLFLAG_RD, &slsfs_commit_batch,
+	    sizeof(slsfs_commit_batch), "S,sls_histogram",
+	    "Fsync callers served per checkpoint (log2 buckets)");
+	(void)SYSCTL_ADD_OPAQUE(&slos_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "fsync_latency", CTLFLAG_RD, &slsfs_fsync_latency,
+	    sizeof(slsfs_fsync_latency), "S,sls_histogram",
+	    "Time fsync waits for a checkpoint (ns, log2 buckets)");
+
 	/* Get a new unique identifier generator. */
 	slsid_unr = new_unrhdr(SLOS_SYSTEM_MAX, INT_MAX, NULL);
 
@@ -273,6 +350,9 @@ slos_svpimport(
 	 * The refcount will be incremented by the caller.
 	 */
 	svp->sn_slos = slos;
+	svp->sn_dirhash = NULL;
+	svp->sn_vp = NULL;
+	svp->sn_dqstate = SLOS_DQ_NONE;
 	fbtree_init(svp->sn_fdev, ino->ino_btree.offset, sizeof(uint64_t),
 	    sizeof(diskptr_t), &compare_vnode_t, "VNode Tree", 0,
 	    &svp->sn_tree);
@@ -314,6 +394,22 @@ error:
 void
 slos_vpfree(struct slos *slos, struct slos_node *vp)
 {
+	/* Nodes without a vnode never enter the dirty list. */
+	if (vp->sn_vp != NULL) {
+		mtx_lock(&slos->slos_dirtylk);
+		while (vp->sn_dqstate == SLOS_DQ_INFLIGHT)
+			msleep(&vp->sn_dqstate, &slos->slos_dirtylk, PVFS,
+			    "slosdq", 0);
+		if (vp->sn_dqstate == SLOS_DQ_QUEUED) {
+			TAILQ_REMOVE(&slos->slos_dirtyq, vp, sn_dirtyq);
+			slos->slos_ndirty -= 1;
+			vp->sn_dqstate = SLOS_DQ_NONE;
+		}
+		if (vp->sn_status & SLOS_DIRTY)
+			slos->slos_dirtylost = 1;
+		mtx_unlock(&slos->slos_dirtylk);
+	}
+
 	fbtree_destroy(&vp->sn_tree);
 	uma_zfree(slos_node_zone, vp);
 }
@@ -529,6 +625,83 @@ slos_update(struct slos_node *svp)
 	return (0);
 }
 
+/*
+ * Mark a node as dirty and put it on the dirty list, so that the syncer
+ * only visits nodes that have something to flush. The inodes file and
+ * nodes without a vnode are flushed separately.
+ */
+void
+slos_markdirty(struct slos_node *svp)
+{
+	struct slos *slos = svp->sn_slos;
+	struct vnode *vp = svp->sn_vp;
+
+	svp->sn_status |= SLOS_DIRTY;
+
+	if (svp->sn_dqstate == SLOS_DQ_QUEUED)
+		return;
+
+	if (vp == NULL || vp == slos->slsfs_inodes ||
+	    (vp->v_vflag & VV_SYSTEM) ||
+	    ((vp->v_type != VDIR) && (vp->v_type != VREG) &&
+		(vp->v_type != VLNK)))
+		return;
+
+	/*
+	 * In-flight nodes are put back on the list by the syncer once it sees
+	 * the dirty bit.
+	 */
+	mtx_lock(&slos->slos_dirtylk);
+	if (svp->sn_dqstate == SLOS_DQ_NONE) {
+		TAILQ_INSERT_TAIL(&slos->slos_dirtyq, svp, sn_dirtyq);
+		svp->sn_dqstate = SLOS_DQ_QUEUED;
+		slos->slos_ndirty += 1;
+	}
+	mtx_unlock(&slos->slos_dirtylk);
+}
+
+/*
+ * Take the next node off the dirty list. The node cannot be freed until it
+ * is passed to slos_dirty_done().
+ */
+struct slos_node *
+slos_dirty_pop(struct slos *slos)
+{
+	struct slos_node *svp;
+
+	mtx_lock(&slos->slos_dirtylk);
+	svp = TAILQ_FIRST(&slos->slos_dirtyq);
+	if (svp != NULL) {
+		TAILQ_REMOVE(&slos->slos_dirtyq, svp, sn_dirtyq);
+		svp->sn_dqstate = SLOS_DQ_INFLIGHT;
+		slos->slos_ndirty -= 1;
+	}
+	mtx_unlock(&slos->slos_dirtylk);
+
+	return (svp);
+}
+
+/*
+ * Finish flushing a node, putting it back on the list if it was not flushed
+ * or was dirtied again in the meantime.
+ */
+void
+slos_dirty_done(struct slos *slos, struct slos_node *svp, bool requeue)
+{
+	mtx_lock(&slos->slos_dirtylk);
+	KASSERT(svp->sn_dqstate == SLOS_DQ_INFLIGHT,
+	    ("node %p not being flushed", svp));
+	if (requeue || (svp->sn_status & SLOS_DIRTY)) {
+		TAILQ_INSERT_TAIL(&slos->slos_dirtyq, svp, sn_dirtyq);
+		svp->sn_dqstate = SLOS_DQ_QUEUED;
+		slos->slos_ndirty += 1;
+	} else {
+		svp->sn_dqstate = SLOS_DQ_NONE;
+	}
+	wakeup(&svp->sn_dqstate);
+	mtx_unlock(&slos->slos_dirtylk);
+}
+
 int
 initialize_inode(struct slos *slos, uint64_t pid, diskptr_t *p)
 {
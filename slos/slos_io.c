@@ -13,8 +13,10 @@
 #include <sys/limits.h>
 #include <sys/lock.h>
 #include <sys/malloc.h>
+#include <sys/mutex.h>
 #include <sys/namei.h>
 #include <sys/pcpu.h>
+#include <sys/queue.h>
 #include <sys/rwlock.h>
 #include <sys/stat.h>
 #include <sys/syscallsubr.h>
@@ -40,6 +42,8 @@
 
 #include "debug.h"
 #include "slos_alloc.h"
+#include "slos_compress.h"
+#include "slsfs_buf.h"
 
 /* We have only one SLOS currently. */
 struct slos slos;
@@ -51,17 +55,65 @@ struct slos slos;
 int slos_pbufcnt = -1;
 uint64_t slos_io_initiated;
 uint64_t slos_io_done;
+uint64_t slos_io_zeroed;
+
+/* Bytes given to the compressor, and bytes written out in their place. */
+uint64_t slos_io_cmpin;
+uint64_t slos_io_cmpout;
+/* Pages read back from compressed frames. */
+uint64_t slos_io_decompressed;
+
+/* Maximum number of IOs the SLOS keeps in flight at the device. */
+int slos_io_qdepth = 256;
+
+/* Size of the segments packed writes are gathered in, 0 to disable packing. */
+uint64_t slos_io_segsize = 1024 * 1024;
+uint64_t slos_io_segments;
+
+/*
+ * IO accounting. Asynchronous IOs are pending from the time they are created
+ * until they complete, and all IOs are active while the device has them.
+ */
+static struct mtx slos_io_mtx;
+static struct cv slos_io_slotcv;
+static struct cv slos_io_draincv;
+static uint64_t slos_io_pending;
+static int slos_io_active;
+static int slos_io_draining;
 
 static uma_zone_t slos_taskctx_zone;
 
 MALLOC_DEFINE(M_SLOS_SB, "slos_superblock", "SLOS superblock");
+static MALLOC_DEFINE(M_SLOS_IO, "slos_io", "SLOS IO segments");
 
 struct slos_taskctx {
 	struct task tk;
 	struct vnode *vp;
 	struct buf *bp;
+	void (*iodone)(struct buf *); /* The caller's completion routine */
+	bool async;
+	int error;
+	TAILQ_ENTRY(slos_taskctx) entries;
+};
+
+/*
+ * A group of writes from possibly different vnodes, laid out back to back on
+ * disk and sent to the device as a single IO.
+ */
+struct slos_segment {
+	struct task sg_tk;
+	TAILQ_HEAD(, slos_taskctx) sg_runs;
+	size_t sg_npages;
 };
 
+/* The segment currently being filled, protected by the IO mutex. */
+static struct slos_segment *slos_segcur;
+
+/* The IO context of a buffer the SLOS has sent to the device. */
+#define b_slosctx b_fsprivate1
+/* The compressed frame a write sends out instead of its pages. */
+#define b_slosframe b_fsprivate3
+
 int
 slos_io_init(void)
 {
@@ -71,15 +123,86 @@ slos_io_init(void)
 	if (slos_taskctx_zone == NULL)
 		return (ENOMEM);
 
+	mtx_init(&slos_io_mtx, "slosio", NULL, MTX_DEF);
+	cv_init(&slos_io_slotcv, "slosioslot");
+	cv_init(&slos_io_draincv, "slosiodrain");
+
 	return (0);
 }
 
 void
 slos_io_uninit(void)
 {
+	cv_destroy(&slos_io_draincv);
+	cv_destroy(&slos_io_slotcv);
+	mtx_destroy(&slos_io_mtx);
 	uma_zdestroy(slos_taskctx_zone);
 }
 
+/*
+ * Wait for a slot at the device.
+ */
+static void
+slos_io_slotget(void)
+{
+	mtx_lock(&slos_io_mtx);
+	while (slos_io_active >= imax(slos_io_qdepth, 1))
+		cv_wait(&slos_io_slotcv, &slos_io_mtx);
+	slos_io_active += 1;
+	mtx_unlock(&slos_io_mtx);
+}
+
+/*
+ * Account for an IO that is done, either because it completed or because we
+ * failed to start it.
+ */
+static void
+slos_io_retire(bool started, bool async)
+{
+	mtx_lock(&slos_io_mtx);
+	if (started) {
+		slos_io_active -= 1;
+		cv_signal(&slos_io_slotcv);
+	}
+
+	if (async) {
+		KASSERT(slos_io_pending > 0, ("no pending IOs"));
+		slos_io_pending -= 1;
+		if (slos_io_pending == 0)
+			cv_broadcast(&slos_io_draincv);
+	}
+	mtx_unlock(&slos_io_mtx);
+}
+
+static void slos_segment_submit(struct slos_segment *seg);
+
+/*
+ * Wait until all asynchronous IOs created so far have completed.
+ */
+void
+slos_io_drain(void)
+{
+	struct slos_segment *seg;
+
+	mtx_lock(&slos_io_mtx);
+	slos_io_draining += 1;
+	while (slos_io_pending > 0) {
+		/* Send out any partially filled segment. */
+		seg = slos_segcur;
+		slos_segcur = NULL;
+		if (seg != NULL) {
+			mtx_unlock(&slos_io_mtx);
+			slos_segment_submit(seg);
+			mtx_lock(&slos_io_mtx);
+			continue;
+		}
+
+		cv_wait(&slos_io_draincv, &slos_io_mtx);
+	}
+	slos_io_draining -= 1;
+	mtx_unlock(&slos_io_mtx);
+}
+
 /*
  * Initialize a UIO for operation rwflag at offset off,
  * and asssign an IO vector to the given UIO.
@@ -142,6 +265,14 @@ slos_sbat(struct slos *slos, int index, struct slos_sb *sb)
 	if (sb->sb_bsize != slos->slos_bsize)
 		return (EINVAL);
 
+	/* The on-disk layout changes between versions, refuse other ones. */
+	if (sb->sb_majver != SLOS_MAJOR_VERSION ||
+	    sb->sb_minver != SLOS_MINOR_VERSION) {
+		DEBUG3("Superblock %d has version %u.%u", index,
+		    sb->sb_majver, sb->sb_minver);
+		return (EINVAL);
+	}
+
 	return (0);
 }
 
@@ -208,6 +339,8 @@ slos_sbread(struct slos *slos)
 	/* Last superblock we read was invalid, reread the last valid one. */
 	error = slos_sbat(slos, largestepoch_i, sb);
 	if (error != 0) {
+		printf("ERROR: No valid SLOS %u.%u superblock found\n",
+		    SLOS_MAJOR_VERSION, SLOS_MINOR_VERSION);
 		free(sb, M_SLOS_SB);
 		return (error);
 	}
@@ -257,13 +390,21 @@ slos_ptr_trimstart(
 	     "not aligned to block size %lu",
 		ptr->size, blksize));
 
-	ptr->offset += off;
+	/* Compressed frames are read in whole, only the data moves. */
+	if (ptr->csize != 0)
+		ptr->coff += off * blksize;
+	else
+		ptr->offset += off;
 	ptr->size -= off * blksize;
 }
 
-/* Do the necessary btree manipulations before initiating an IO. */
+/*
+ * Do the necessary btree manipulations before initiating an IO. The physical
+ * segment is allocated here, unless the caller already has one.
+ */
 static int __attribute__((noinline))
-slos_io_setdaddr(struct slos_node *svp, size_t size, struct buf *bp)
+slos_io_setdaddr(
+    struct slos_node *svp, size_t size, struct buf *bp, diskptr_t *segptr)
 {
 	struct fbtree *tree = &svp->sn_tree;
 	struct slos_diskptr ptr;
@@ -280,15 +421,25 @@ slos_io_setdaddr(struct slos_node *svp, size_t size, struct buf *bp)
 	end = (bp->b_lblkno * IOSIZE(svp)) + size;
 	if (svp->sn_ino.ino_size < end) {
 		svp->sn_ino.ino_size = end;
-		svp->sn_status |= SLOS_DIRTY;
+		slos_markdirty(svp);
 	}
 
-	error = slos_blkalloc(svp->sn_slos, size, &ptr);
-	if (error != 0)
-		goto error;
+	if (segptr == NULL) {
+		error = slos_blkalloc(svp->sn_slos, bp->b_resid, &ptr);
+		if (error != 0)
+			goto error;
+	} else {
+		ptr = *segptr;
+	}
+
+	KASSERT(ptr.size == bp->b_resid,
+	    ("requested %lu bytes on disk, got %lu", bp->b_resid, ptr.size));
 
-	KASSERT(ptr.size == size,
-	    ("requested %lu bytes on disk, got %lu", ptr.size, size));
+	/* Compressed writes map more data than they have blocks. */
+	if (bp->b_slosframe != NULL) {
+		ptr.csize = ptr.size;
+		ptr.size = size;
+	}
 
 	/* No need to free the block if we fail, it'll get GCed. */
 	error = fbtree_replace(&svp->sn_tree, &bp->b_lblkno, &ptr);
@@ -315,7 +466,7 @@ error:
 }
 
 static int
-slos_io_getdaddr(struct slos_node *svp, struct buf *bp)
+slos_io_getdaddr(struct slos_node *svp, struct buf *bp, diskptr_t *ptrp)
 {
 	int error;
 	struct slos_diskptr ptr;
@@ -337,6 +488,13 @@ slos_io_getdaddr(struct slos_node *svp, struct buf *bp)
 	KASSERT(!ITER_ISNULL(iter),
 	    ("could not find logical offset %lu on disk", lblkno));
 	ptr = ITER_VAL_T(iter, diskptr_t);
+
+	/* Zero extents have no blocks behind them. */
+	if (ptr.offset == 0) {
+		bp->b_blkno = (daddr_t)(-1);
+		goto out;
+	}
+
 	slos_ptr_trimstart(bp->b_lblkno, lblkno, SLOS_BSIZE(slos), &ptr);
 
 	KASSERT(bp->b_bcount <= ptr.size,
@@ -346,6 +504,8 @@ slos_io_getdaddr(struct slos_node *svp, struct buf *bp)
 
 	bp->b_blkno = ptr.offset;
 
+out:
+	*ptrp = ptr;
 	VOP_UNLOCK(tree->bt_backend, 0);
 	BTREE_UNLOCK(tree, 0);
 
@@ -360,6 +520,361 @@ error:
 	return (error);
 }
 
+/*
+ * Find the extent backing a logical block of the vnode, trimmed to the block.
+ */
+static int
+slos_io_bmapptr(struct vnode *vp, uint64_t lblkno, struct slos_diskptr *ptrp)
+{
+	struct slos_node *svp = SLSVP(vp);
+	struct fbtree *tree = &svp->sn_tree;
+	struct slos_diskptr ptr;
+	struct fnode_iter iter;
+	uint64_t key = lblkno;
+	int error;
+
+	VOP_LOCK(tree->bt_backend, LK_EXCLUSIVE);
+	BTREE_LOCK(tree, LK_SHARED);
+
+	error = fbtree_keymin_iter(tree, &key, &iter);
+	if (error != 0)
+		goto out;
+
+	if (ITER_ISNULL(iter)) {
+		error = ENOENT;
+		goto out;
+	}
+
+	key = ITER_KEY_T(iter, uint64_t);
+	ptr = ITER_VAL_T(iter, diskptr_t);
+	/* Blocks of compressed frames do not hold the data as is. */
+	if (ptr.offset == 0 || ptr.csize != 0 ||
+	    key + (ptr.size / IOSIZE(svp)) <= lblkno) {
+		error = ENOENT;
+		goto out;
+	}
+
+	ptr.offset += lblkno - key;
+	ptr.size = IOSIZE(svp);
+	*ptrp = ptr;
+
+out:
+	BTREE_UNLOCK(tree, 0);
+	VOP_UNLOCK(tree->bt_backend, 0);
+
+	return (error);
+}
+
+/*
+ * Find the physical block backing a logical block of the vnode.
+ */
+int
+slos_io_bmap(struct vnode *vp, uint64_t lblkno, uint64_t *blkno)
+{
+	struct slos_diskptr ptr;
+	int error;
+
+	error = slos_io_bmapptr(vp, lblkno, &ptr);
+	if (error == 0)
+		*blkno = ptr.offset;
+
+	return (error);
+}
+
+/*
+ * Point a logical block of the vnode to the physical block backing a logical
+ * block of another vnode, instead of writing out the data. Only extents of
+ * the current epoch are overwritten in place, so we keep the epoch of the
+ * source: neither owner can then write to the block, and it does not change
+ * while the source still maps it. We only have to make sure it still does,
+ * and that it holds the same data.
+ */
+int
+slos_io_share(struct vnode *vp, uint64_t lblkno, struct vnode *srcvp,
+    uint64_t srclblkno, uint64_t blkno, const void *data)
+{
+	struct slos_node *svp = SLSVP(vp);
+	struct slos *slos = svp->sn_slos;
+	struct fbtree *tree = &svp->sn_tree;
+	struct slos_diskptr ptr;
+	size_t size = IOSIZE(svp);
+	struct buf *bp;
+	size_t end;
+	int error;
+
+	error = slos_io_bmapptr(srcvp, srclblkno, &ptr);
+	if (error != 0)
+		return (error);
+
+	if (ptr.offset != blkno)
+		return (ESTALE);
+
+	/* The source can still overwrite blocks of the current epoch. */
+	if (ptr.epoch == slos->slos_sb->sb_epoch)
+		return (ESTALE);
+
+	error = slos_blkref(slos, blkno);
+	if (error != 0)
+		return (error);
+
+	error = slsfs_devbread(slos, blkno, size, &bp);
+	if (error != 0)
+		return (error);
+
+	if (memcmp(bp->b_data, data, size) != 0)
+		error = ESTALE;
+
+	/* Data blocks do not belong in the device's buffer cache. */
+	bp->b_flags |= B_NOCACHE;
+	brelse(bp);
+	if (error != 0)
+		return (error);
+
+	ptr.size = size;
+
+	BTREE_LOCK(tree, LK_EXCLUSIVE);
+	VOP_LOCK(tree->bt_backend, LK_EXCLUSIVE);
+
+	error = fbtree_rangeinsert(tree, lblkno, size);
+	if (error == 0)
+		error = fbtree_replace(tree, &lblkno, &ptr);
+
+	end = IDX_TO_OFF(lblkno) + size;
+	if (error == 0 && SLSINO(svp).ino_size < end) {
+		SLSINO(svp).ino_size = end;
+		slos_markdirty(svp);
+	}
+
+	VOP_UNLOCK(tree->bt_backend, 0);
+	BTREE_UNLOCK(tree, 0);
+	if (error != 0)
+		return (error);
+
+	vnode_pager_setsize(vp, SLSINO(svp).ino_size);
+
+	return (0);
+}
+
+/*
+ * Map a range of logical blocks of the vnode to a zero extent. Zero extents
+ * read back as zeroes, so zero pages need neither IO nor space on disk.
+ */
+int
+slos_io_zero(struct vnode *vp, uint64_t lblkno, size_t size)
+{
+	struct slos_node *svp = SLSVP(vp);
+	struct fbtree *tree = &svp->sn_tree;
+	size_t end;
+	int error;
+
+	KASSERT(size > 0 && size % IOSIZE(svp) == 0,
+	    ("zero extent of size %lu", size));
+
+	BTREE_LOCK(tree, LK_EXCLUSIVE);
+	VOP_LOCK(tree->bt_backend, LK_EXCLUSIVE);
+
+	/* The new extent has no physical block, which is what we want. */
+	error = fbtree_rangeinsert(tree, lblkno, size);
+
+	end = IDX_TO_OFF(lblkno) + size;
+	if (error == 0 && SLSINO(svp).ino_size < end) {
+		SLSINO(svp).ino_size = end;
+		slos_markdirty(svp);
+	}
+
+	VOP_UNLOCK(tree->bt_backend, 0);
+	BTREE_UNLOCK(tree, 0);
+	if (error != 0)
+		return (error);
+
+	vnode_pager_setsize(vp, SLSINO(svp).ino_size);
+
+	return (0);
+}
+
+/*
+ * Complete a read from a zero extent without going to the device.
+ */
+static void
+slos_io_zerofill(struct buf *bp)
+{
+	int i;
+
+	for (i = 0; i < bp->b_npages; i++)
+		pmap_zero_page(bp->b_pages[i]);
+
+	atomic_add_64(&slos_io_zeroed, bp->b_npages);
+	bp->b_resid = 0;
+	bufdone(bp);
+}
+
+/*
+ * Complete a read from a compressed extent. We read in the whole frame and
+ * decompress it up to the end of the data we need, then copy the data over.
+ */
+static void
+slos_io_readframe(struct buf *bp, diskptr_t *ptr)
+{
+	struct slos_cmphdr *hdr;
+	struct buf *fbp = NULL;
+	char *data = NULL;
+	size_t len;
+	int error;
+	int i;
+
+	KASSERT(bp->b_bcount == bp->b_npages * PAGE_SIZE,
+	    ("buffer has %d pages but %lu bytes", bp->b_npages,
+		bp->b_bcount));
+
+	error = slsfs_devbread(&slos, ptr->offset, ptr->csize, &fbp);
+	if (error != 0)
+		goto out;
+
+	hdr = (struct slos_cmphdr *)fbp->b_data;
+	len = ptr->coff + bp->b_bcount;
+	if (hdr->ch_magic != SLOS_CMPMAGIC ||
+	    hdr->ch_clen > ptr->csize - sizeof(*hdr) || hdr->ch_ulen < len) {
+		printf("ERROR: Invalid compressed frame at %lu\n", ptr->offset);
+		error = EIO;
+		goto out;
+	}
+
+	data = malloc(len, M_SLOS_IO, M_WAITOK);
+	error = slos_decompress(&hdr[1], hdr->ch_clen, data, len);
+	if (error != 0) {
+		printf("ERROR: Corrupt compressed frame at %lu\n", ptr->offset);
+		error = EIO;
+		goto out;
+	}
+
+	for (i = 0; i < bp->b_npages; i++) {
+		memcpy((void *)PHYS_TO_DMAP(VM_PAGE_TO_PHYS(bp->b_pages[i])),
+		    &data[ptr->coff + i * PAGE_SIZE], PAGE_SIZE);
+	}
+
+	atomic_add_64(&slos_io_decompressed, bp->b_npages);
+
+out:
+	free(data, M_SLOS_IO);
+	if (fbp != NULL) {
+		/* Data blocks do not belong in the device's buffer cache. */
+		fbp->b_flags |= B_NOCACHE;
+		brelse(fbp);
+	}
+
+	if (error != 0) {
+		bp->b_ioflags |= BIO_ERROR;
+		bp->b_error = error;
+	} else {
+		bp->b_resid = 0;
+	}
+	bufdone(bp);
+}
+
+/*
+ * Compress the pages of a write into a frame, and point the buffer to it.
+ * The write still maps all of its pages, but only the frame goes to disk.
+ * Returns false if compression would not save us any blocks.
+ */
+bool
+slos_io_compress(struct buf *bp)
+{
+	size_t lsize = bp->b_npages * PAGE_SIZE;
+	size_t blksize = SLOS_BSIZE(slos);
+	struct slos_cmphdr *hdr;
+	char *frame, *src;
+	size_t clen, csize;
+	int i;
+
+	KASSERT(bp->b_iocmd == BIO_WRITE, ("compressing a read"));
+	KASSERT(!buf_mapped(bp), ("compressing a mapped buffer"));
+	KASSERT(bp->b_resid == lsize,
+	    ("buffer has %d pages but %lu bytes", bp->b_npages, bp->b_resid));
+
+	/* Frames are read back through the device's buffers. */
+	if (lsize <= blksize || lsize > MAXBCACHEBUF)
+		return (false);
+
+	/* The compressor needs the data and its table in one place. */
+	src = malloc(lsize + SLOS_CMP_WORKSIZE, M_SLOS_IO, M_WAITOK);
+	for (i = 0; i < bp->b_npages; i++) {
+		memcpy(&src[i * PAGE_SIZE],
+		    (void *)PHYS_TO_DMAP(VM_PAGE_TO_PHYS(bp->b_pages[i])),
+		    PAGE_SIZE);
+	}
+
+	/* Only bother if we save at least a block. */
+	frame = malloc(lsize - blksize, M_SLOS_IO, M_WAITOK);
+	hdr = (struct slos_cmphdr *)frame;
+	clen = slos_compress(src, lsize, &hdr[1],
+	    lsize - blksize - sizeof(*hdr), &src[lsize]);
+	free(src, M_SLOS_IO);
+
+	atomic_add_64(&slos_io_cmpin, lsize);
+	if (clen == 0) {
+		atomic_add_64(&slos_io_cmpout, lsize);
+		free(frame, M_SLOS_IO);
+		return (false);
+	}
+
+	*hdr = (struct slos_cmphdr) {
+		.ch_magic = SLOS_CMPMAGIC,
+		.ch_ulen = lsize,
+		.ch_clen = clen,
+	};
+
+	csize = roundup(sizeof(*hdr) + clen, blksize);
+	bzero(&frame[sizeof(*hdr) + clen], csize - sizeof(*hdr) - clen);
+	atomic_add_64(&slos_io_cmpout, csize);
+
+	bp->b_data = frame;
+	bp->b_slosframe = frame;
+	bp->b_resid = bp->b_bcount = bp->b_bufsize = csize;
+
+	return (true);
+}
+
+/*
+ * Free the frame of a compressed write once the device is done with it.
+ */
+static void
+slos_io_framefree(struct buf *bp)
+{
+	if (bp->b_slosframe == NULL)
+		return;
+
+	free(bp->b_slosframe, M_SLOS_IO);
+	bp->b_slosframe = NULL;
+	bp->b_data = unmapped_buf;
+}
+
+/*
+ * Map the blocks of a write, and update the size at the vnode and inode
+ * layers.
+ */
+static int
+slos_io_prepwrite(struct vnode *vp, struct buf *bp, diskptr_t *segptr)
+{
+	struct slos_node *svp = SLSVP(vp);
+	size_t iosize = bp->b_resid;
+	int error;
+
+	/* Compressed writes map all of their pages, not just the frame. */
+	if (bp->b_slosframe != NULL)
+		iosize = bp->b_npages * PAGE_SIZE;
+
+	error = slos_io_setdaddr(svp, iosize, bp, segptr);
+	if (error != 0)
+		return (error);
+
+	if (IDX_TO_OFF(bp->b_lblkno) + iosize > SLSINO(svp).ino_size) {
+		SLSINO(svp).ino_size = IDX_TO_OFF(bp->b_lblkno) + iosize;
+		vnode_pager_setsize(vp, SLSINO(svp).ino_size);
+	}
+
+	return (0);
+}
+
 /*
  * Set up the physical on-disk address for the IO.
  */
@@ -376,6 +891,35 @@ slos_io_physaddr(struct buf *bp, struct slos *slos)
 	bp->b_iooffset = dbtob(bp->b_blkno);
 }
 
+/*
+ * Completion routine for all SLOS IOs, called by the GEOM up thread. Nobody
+ * waits for asynchronous IOs, so we release their buffers here.
+ */
+static void
+slos_io_iodone(struct buf *bp)
+{
+	struct slos_taskctx *task = bp->b_slosctx;
+	void (*iodone)(struct buf *) = task->iodone;
+	bool async = task->async;
+
+	bp->b_slosctx = NULL;
+	atomic_add_64(&slos_io_done, 1);
+	slos_io_framefree(bp);
+
+	/* Our buffers are never B_ASYNC, so bdone() is all bufdone() does. */
+	if (iodone != NULL)
+		(*iodone)(bp);
+	else
+		bdone(bp);
+
+	if (async) {
+		relpbuf(bp, &slos_pbufcnt);
+		uma_zfree(slos_taskctx_zone, task);
+	}
+
+	slos_io_retire(true, async);
+}
+
 /* Perform an IO without copying from the VM objects to the buffer. */
 static void
 slos_io(void *ctx, int __unused pending)
@@ -384,8 +928,9 @@ slos_io(void *ctx, int __unused pending)
 	struct vnode *vp = task->vp;
 	struct slos_node *svp = SLSVP(task->vp);
 	struct buf *bp = task->bp;
-	size_t iosize = bp->b_resid;
+	bool async = task->async;
 	int iocmd = bp->b_iocmd;
+	diskptr_t ptr;
 	int error;
 
 	KASSERT(iocmd == BIO_READ || iocmd == BIO_WRITE,
@@ -404,25 +949,30 @@ slos_io(void *ctx, int __unused pending)
 
 	if (iocmd == BIO_WRITE) {
 		/* Create the physical segment backing the write. */
-		error = slos_io_setdaddr(svp, bp->b_resid, bp);
+		error = slos_io_prepwrite(vp, bp, NULL);
 		if (error != 0) {
 			printf("ERROR: IO failed with %d\n", error);
 			goto out;
 		}
-
-		/* Update the size at the vnode and inode layers. */
-		if (IDX_TO_OFF(bp->b_lblkno) + iosize > SLSINO(svp).ino_size) {
-			SLSINO(svp).ino_size = IDX_TO_OFF(bp->b_lblkno) +
-			    iosize;
-			vnode_pager_setsize(vp, SLSINO(svp).ino_size);
-		}
 	} else if (iocmd == BIO_READ) {
 		/* Retrieve the physical segment backing the read. */
-		error = slos_io_getdaddr(svp, bp);
+		error = slos_io_getdaddr(svp, bp, &ptr);
 		if (error != 0) {
 			printf("ERROR: IO failed with %d\n", error);
 			goto out;
 		}
+
+		/* Zero extents are filled in without any IO. */
+		if (ptr.offset == 0) {
+			slos_io_zerofill(bp);
+			goto out;
+		}
+
+		/* Compressed extents are read in through the frame. */
+		if (ptr.csize != 0) {
+			slos_io_readframe(bp, &ptr);
+			goto out;
+		}
 	}
 
 	slos_io_physaddr(bp, &slos);
@@ -437,30 +987,44 @@ slos_io(void *ctx, int __unused pending)
 		slos.slos_sb->sb_bsize *
 		    (SLOS_BSIZE(slos) / SLOS_DEVBSIZE(slos))));
 
-	g_vfs_strategy(&slos.slos_vp->v_bufobj, bp);
-
 	/*
-	 * Wait for the buffer to be done. Because the task calling
-	 * slos_io() only exits after bwait() returns, waiting for the
-	 * taskqueue to be drained is equivalent to waiting until all data has
-	 * hit the disk.
+	 * Hand the buffer off to the device. The buffer and the task are
+	 * released by the completion routine for asynchronous IOs, so we
+	 * cannot touch them after this point.
 	 */
+	task->iodone = bp->b_iodone;
+	bp->b_iodone = slos_io_iodone;
+	bp->b_slosctx = task;
+
+	slos_io_slotget();
+	g_vfs_strategy(&slos.slos_vp->v_bufobj, bp);
+	if (async) {
+		vrele(vp);
+		return;
+	}
+
 	error = bufwait(bp);
 	if (error != 0)
 		DEBUG1("ERROR: bufwait returned %d", error);
 
-	atomic_add_64(&slos_io_done, 1);
+	relpbuf(bp, &slos_pbufcnt);
+	vrele(vp);
+	uma_zfree(slos_taskctx_zone, task);
+	return;
+
 out:
 	BUF_ASSERT_LOCKED(bp);
+	slos_io_framefree(bp);
 	relpbuf(bp, &slos_pbufcnt);
 
 	vrele(vp);
 
 	uma_zfree(slos_taskctx_zone, task);
+	slos_io_retire(false, async);
 }
 
 static struct slos_taskctx *
-slos_iotask_init(struct vnode *vp, struct buf *bp)
+slos_iotask_init(struct vnode *vp, struct buf *bp, bool async)
 {
 	struct slos_taskctx *ctx;
 
@@ -468,6 +1032,7 @@ slos_iotask_init(struct vnode *vp, struct buf *bp)
 	*ctx = (struct slos_taskctx) {
 		.vp = vp,
 		.bp = bp,
+		.async = async,
 	};
 
 	return (ctx);
@@ -479,7 +1044,7 @@ slos_iotask_create(struct vnode *vp, struct buf *bp, bool async)
 	struct slos_taskctx *ctx;
 
 	KASSERT(bp->b_resid > 0, ("IO of size 0"));
-	ctx = slos_iotask_init(vp, bp);
+	ctx = slos_iotask_init(vp, bp, async);
 
 	BUF_ASSERT_LOCKED(bp);
 
@@ -487,6 +1052,10 @@ slos_iotask_create(struct vnode *vp, struct buf *bp, bool async)
 	vref(vp);
 
 	if (async) {
+		mtx_lock(&slos_io_mtx);
+		slos_io_pending += 1;
+		mtx_unlock(&slos_io_mtx);
+
 		TASK_INIT(&ctx->tk, 0, &slos_io, ctx);
 		BUF_KERNPROC(bp);
 		taskqueue_enqueue(slos.slos_tq, &ctx->tk);
@@ -497,6 +1066,220 @@ slos_iotask_create(struct vnode *vp, struct buf *bp, bool async)
 	return (0);
 }
 
+/* Maximum number of pages in a segment. */
+static size_t
+slos_segment_maxpages(void)
+{
+	return (MIN(slos_io_segsize, MAXPHYS) / PAGE_SIZE);
+}
+
+/* Complete a write of the segment and retire its task. */
+static void
+slos_segment_rundone(struct slos_taskctx *task, int error)
+{
+	void (*iodone)(struct buf *);
+	struct buf *bp = task->bp;
+
+	if (error != 0) {
+		bp->b_ioflags |= BIO_ERROR;
+		bp->b_error = error;
+	} else {
+		bp->b_resid = 0;
+	}
+
+	iodone = bp->b_iodone;
+	bp->b_iodone = NULL;
+	if (iodone != NULL)
+		(*iodone)(bp);
+	else
+		bdone(bp);
+
+	relpbuf(bp, &slos_pbufcnt);
+	if (task->vp != NULL)
+		vrele(task->vp);
+	uma_zfree(slos_taskctx_zone, task);
+	slos_io_retire(false, true);
+}
+
+/*
+ * Completion routine for segments. Complete each write in the segment as if
+ * it had been sent to the device on its own.
+ */
+static void
+slos_segment_iodone(struct buf *sbp)
+{
+	struct slos_segment *seg = sbp->b_slosctx;
+	struct slos_taskctx *task, *ttask;
+	int error;
+
+	sbp->b_slosctx = NULL;
+	error = ((sbp->b_ioflags & BIO_ERROR) != 0) ? sbp->b_error : 0;
+
+	TAILQ_FOREACH_SAFE (task, &seg->sg_runs, entries, ttask) {
+		TAILQ_REMOVE(&seg->sg_runs, task, entries);
+
+		/* Writes we could not map only fill space in the segment. */
+		if (task->error != 0) {
+			relpbuf(task->bp, &slos_pbufcnt);
+			uma_zfree(slos_taskctx_zone, task);
+			slos_io_retire(false, true);
+			continue;
+		}
+
+		atomic_add_64(&slos_io_done, 1);
+		slos_segment_rundone(task, error);
+	}
+
+	relpbuf(sbp, &slos_pbufcnt);
+	free(seg, M_SLOS_IO);
+
+	slos_io_retire(true, false);
+}
+
+/*
+ * Allocate a single physical extent for all writes in the segment, map each
+ * write to its part of the extent, and send them to the device in one IO.
+ */
+static void
+slos_segment_io(void *ctx, int __unused pending)
+{
+	struct slos_segment *seg = (struct slos_segment *)ctx;
+	struct slos_taskctx *task, *ttask;
+	struct buf *sbp, *bp;
+	diskptr_t segptr, ptr;
+	size_t size = 0;
+	int error;
+
+	TAILQ_FOREACH (task, &seg->sg_runs, entries)
+		size += task->bp->b_resid;
+
+	/* Running out of space is not fatal, fail the writes instead. */
+	error = slos_blkalloc(&slos, size, &segptr);
+	if (error != 0) {
+		printf("ERROR: Segment allocation failed with %d\n", error);
+		TAILQ_FOREACH_SAFE (task, &seg->sg_runs, entries, ttask) {
+			TAILQ_REMOVE(&seg->sg_runs, task, entries);
+			slos_segment_rundone(task, error);
+		}
+		free(seg, M_SLOS_IO);
+		return;
+	}
+
+	sbp = getpbuf(&slos_pbufcnt);
+	sbp->b_data = unmapped_buf;
+	sbp->b_npages = 0;
+	sbp->b_iocmd = BIO_WRITE;
+	sbp->b_resid = sbp->b_bcount = sbp->b_bufsize = size;
+	sbp->b_blkno = segptr.offset;
+
+	ptr = segptr;
+	TAILQ_FOREACH (task, &seg->sg_runs, entries) {
+		bp = task->bp;
+		ptr.size = bp->b_resid;
+
+		task->error = slos_io_prepwrite(task->vp, bp, &ptr);
+		if (task->error != 0)
+			printf("ERROR: IO failed with %d\n", task->error);
+
+		memcpy(&sbp->b_pages[sbp->b_npages], bp->b_pages,
+		    bp->b_npages * sizeof(*bp->b_pages));
+		sbp->b_npages += bp->b_npages;
+		ptr.offset += bp->b_resid / SLOS_BSIZE(slos);
+
+		/* The vnode is only needed to map the write. */
+		vrele(task->vp);
+		task->vp = NULL;
+	}
+
+	KASSERT(sbp->b_npages == seg->sg_npages,
+	    ("segment has %d pages, expected %lu", sbp->b_npages,
+		seg->sg_npages));
+
+	slos_io_physaddr(sbp, &slos);
+	sbp->b_iodone = slos_segment_iodone;
+	sbp->b_slosctx = seg;
+	BUF_KERNPROC(sbp);
+
+	atomic_add_64(&slos_io_segments, 1);
+	slos_io_slotget();
+	g_vfs_strategy(&slos.slos_vp->v_bufobj, sbp);
+}
+
+static void
+slos_segment_submit(struct slos_segment *seg)
+{
+	TASK_INIT(&seg->sg_tk, 0, &slos_segment_io, seg);
+	taskqueue_enqueue(slos.slos_tq, &seg->sg_tk);
+}
+
+/*
+ * Asynchronously write out a buffer, possibly packing it together with other
+ * writes into a larger sequential segment. Small writes from different vnodes
+ * end up next to each other on disk, and reach the device as one large IO.
+ * Segments are sent out when full, or when draining the SLOS IOs.
+ */
+int
+slos_iotask_pack(struct vnode *vp, struct buf *bp)
+{
+	struct slos_segment *seg, *newseg;
+	struct slos_segment *full = NULL, *sealed = NULL;
+	struct slos_taskctx *ctx;
+	size_t maxpages;
+
+	/* Compressed frames do not fit in the page-based segments. */
+	maxpages = slos_segment_maxpages();
+	if (bp->b_iocmd != BIO_WRITE || bp->b_npages >= maxpages ||
+	    bp->b_slosframe != NULL)
+		return (slos_iotask_create(vp, bp, true));
+
+	KASSERT(bp->b_resid > 0, ("IO of size 0"));
+	BUF_ASSERT_LOCKED(bp);
+
+	ctx = slos_iotask_init(vp, bp, true);
+	newseg = malloc(sizeof(*newseg), M_SLOS_IO, M_WAITOK | M_ZERO);
+	TAILQ_INIT(&newseg->sg_runs);
+
+	/* The corresponding vrele() is in the segment task. */
+	vref(vp);
+	BUF_KERNPROC(bp);
+
+	mtx_lock(&slos_io_mtx);
+	slos_io_pending += 1;
+
+	seg = slos_segcur;
+	if (seg != NULL && seg->sg_npages + bp->b_npages > maxpages) {
+		full = seg;
+		seg = NULL;
+	}
+
+	if (seg == NULL) {
+		seg = newseg;
+		newseg = NULL;
+	}
+
+	TAILQ_INSERT_TAIL(&seg->sg_runs, ctx, entries);
+	seg->sg_npages += bp->b_npages;
+
+	/* Do not hold back writes someone is waiting for. */
+	if (seg->sg_npages == maxpages || slos_io_draining > 0) {
+		sealed = seg;
+		slos_segcur = NULL;
+	} else {
+		slos_segcur = seg;
+	}
+	mtx_unlock(&slos_io_mtx);
+
+	if (newseg != NULL)
+		free(newseg, M_SLOS_IO);
+
+	if (full != NULL)
+		slos_segment_submit(full);
+	if (sealed != NULL)
+		slos_segment_submit(sealed);
+
+	return (0);
+}
+
 boolean_t
 slos_hasblock(struct vnode *vp, uint64_t lblkno_req, int *rbehind, int *rahead)
 {
@@ -357,6 +357,8 @@ stree_init(struct vnode *vp, daddr_t daddr, struct slos_rdxtree **streep)
 	ptr.offset = daddr;
 	ptr.size = BLKSIZE(&slos);
 	ptr.epoch = slos.slos_sb->sb_epoch;
+	ptr.csize = 0;
+	ptr.coff = 0;
 
 	*streep = stree;
 	return (0);
@@ -860,6 +862,8 @@ stree_extent_find(struct slos_rdxtree *stree, uint64_t offset, diskptr_t *ptr)
 		ptr->offset = STREE_INVAL.offset;
 		ptr->size = 0;
 		ptr->epoch = STREE_INVAL.epoch;
+		ptr->csize = 0;
+		ptr->coff = 0;
 		return (0);
 	}
 
@@ -867,6 +871,8 @@ stree_extent_find(struct slos_rdxtree *stree, uint64_t offset, diskptr_t *ptr)
 	ptr->offset = pblk.offset;
 	ptr->size = BLKSIZE(&slos);
 	ptr->epoch = pblk.epoch;
+	ptr->csize = 0;
+	ptr->coff = 0;
 
 	for (blklen = 1; siter_iter(&siter) == 0; blklen++) {
 		siter_access(&siter, &pblk);
@@ -1441,12 +1447,16 @@ siter_extent_keymin_find(struct stree_iter *siter, diskptr_t *ptr)
 		ptr->offset = STREE_INVAL.offset;
 		ptr->size = 0;
 		ptr->epoch = STREE_INVAL.epoch;
+		ptr->csize = 0;
+		ptr->coff = 0;
 		return (EINVAL);
 	}
 
 	ptr->offset = pblk.offset;
 	ptr->size = BLKSIZE(&slos);
 	ptr->epoch = pblk.epoch;
+	ptr->csize = 0;
+	ptr->coff = 0;
 
 	for (blklen = 1; siter_extent_keymin_next(siter) == 0; blklen++) {
 		/* Ensure the data is logically contiguous. */
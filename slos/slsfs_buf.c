@@ -54,6 +54,8 @@ slsfs_buf_nocollide(struct vnode *vp, struct fnode_iter *biter, uint64_t bno,
 	ptr.offset = 0;
 	ptr.size = size;
 	ptr.epoch = EPOCH_INVAL;
+	ptr.csize = 0;
+	ptr.coff = 0;
 	error = BTREE_LOCK(tree, LK_UPGRADE);
 	if (error) {
 		panic("Could not acquire lock upgrade on Btree %d", error);
@@ -283,7 +285,7 @@ slsfs_bdirty(struct buf *buf)
 
 	/* Be aggressive and start the IO immediately. */
 	buf->b_flags |= B_CLUSTEROK;
-	SLSVP(buf->b_vp)->sn_status |= SLOS_DIRTY;
+	slos_markdirty(SLSVP(buf->b_vp));
 	bawrite(buf);
 
 	atomic_add_64(&slos.slos_sb->sb_used, size / BLKSIZE(&slos));
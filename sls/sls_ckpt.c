@@ -23,6 +23,7 @@
 #include <sys/shm.h>
 #include <sys/signalvar.h>
 #include <sys/stat.h>
+#include <sys/sx.h>
 #include <sys/syscallsubr.h>
 #include <sys/taskqueue.h>
 #include <sys/time.h>
@@ -39,6 +40,7 @@
 
 #include <slos.h>
 #include <slos_inode.h>
+#include <slos_io.h>
 #include <sls_data.h>
 
 #include "debug.h"
@@ -60,10 +62,31 @@
 	(atomic_load_int(&slsp->slsp_status) != 0 && SLS_PROCALIVE(proc))
 
 int sls_vfs_sync = 0;
-int sls_only_flush_deltas = 0;
 uint64_t sls_ckpt_attempted;
 uint64_t sls_ckpt_done;
 uint64_t sls_ckpt_duration;
+/* Maximum number of pipelined checkpoints being flushed per partition. */
+u_int sls_pipeline_depth = 2;
+/* Maximum memory held by the shadows of in-flight checkpoints. */
+uint64_t sls_pipeline_maxbytes = 512 * 1024 * 1024;
+uint64_t sls_pipeline_stalls = 0;
+/* Minimum number of processes for capturing their metadata in parallel. */
+u_int sls_meta_parallel = 8;
+uint64_t sls_meta_parallel_runs = 0;
+uint64_t sls_meta_saved_ns = 0;
+uint64_t sls_ckpt_skipped = 0;
+/* Maximum number of retired checkpoints waiting to be collapsed. */
+u_int sls_collapse_maxgens = 4;
+/* Objects collapsed per acquisition of the shadow lock. */
+u_int sls_collapse_batch = 256;
+uint64_t sls_collapse_stalls = 0;
+/* Maximum checkpoints waiting for the remote to acknowledge them. */
+u_int sls_repl_depth = 4;
+/* Seconds to wait for the remote to acknowledge a checkpoint. */
+u_int sls_repl_acktimeout = 30;
+uint64_t sls_repl_coalesced = 0;
+uint64_t sls_repl_retries = 0;
+uint64_t sls_repl_stalls = 0;
 
 SDT_PROBE_DEFINE1(sls, , fillckpt, , "char *");
 SDT_PROBE_DEFINE1(sls, , sls_checkpointd, , "char *");
@@ -72,6 +95,27 @@ SDT_PROBE_DEFINE0(sls, , , stopclock_start);
 SDT_PROBE_DEFINE0(sls, , , meta_start);
 SDT_PROBE_DEFINE0(sls, , , stopclock_finish);
 SDT_PROBE_DEFINE0(sls, , , meta_finish);
+SDT_PROBE_DEFINE3(sls, , , meta_parallel, "int", "uint64_t", "uint64_t");
+SDT_PROBE_DEFINE3(sls, , , adaptive_period, "uint64_t", "uint64_t", "long");
+
+/* State of the adaptive period controller of a checkpointing daemon. */
+struct slsckpt_adaptive {
+	uint64_t rate;	   /* Dirty pages per second */
+	uint64_t pagecost; /* Stop time per dirty page in ns */
+	uint64_t lastns;   /* Time of the last dirty page sample */
+	uint64_t ckptns;   /* Start time of the last checkpoint */
+	long period;	   /* Current period in ms */
+};
+
+/* Metadata capture of a single process, run by the metadata taskqueue. */
+struct slsckpt_metactx {
+	struct task tk;
+	struct proc *p;
+	slsset *procset;
+	struct slsckpt_data *shard;
+	uint64_t duration; /* Time spent capturing, in ns */
+	int error;
+};
 
 /*
  * Stop the processes, and wait until they are truly not running.
@@ -185,11 +229,198 @@ out:
 	return (error);
 }
 
+static void
+slsckpt_metatask(void *ctx, int __unused pending)
+{
+	struct slsckpt_metactx *metactx = (struct slsckpt_metactx *)ctx;
+	struct timespec tstart, tend;
+
+	nanotime(&tstart);
+	metactx->error = slsckpt_metadata(
+	    metactx->p, metactx->procset, metactx->shard);
+	nanotime(&tend);
+
+	metactx->duration = TONANO(tend) - TONANO(tstart);
+}
+
+/*
+ * Capture the metadata of all processes in parallel, each into its own shard.
+ * The shards are merged in the order of the process set, so the result is the
+ * same no matter which capture finishes first.
+ */
+static int
+slsckpt_metadata_parallel(slsset *procset, struct slsckpt_data *sckpt)
+{
+	struct slsckpt_metactx *metactx;
+	struct timespec tstart, tend;
+	struct slskv_iter iter;
+	uint64_t serial = 0;
+	uint64_t elapsed;
+	struct proc *p;
+	int nprocs = 0;
+	int error = 0;
+	int i;
+
+	metactx = mallocarray(procset->count, sizeof(*metactx), M_SLSMM,
+	    M_WAITOK | M_ZERO);
+
+	nanotime(&tstart);
+	KVSET_FOREACH(procset, iter, p)
+	{
+		KASSERT(nprocs < procset->count, ("process set grew"));
+		error = slsckpt_shard_alloc(sckpt, &metactx[nprocs].shard);
+		if (error != 0) {
+			KV_ABORT(iter);
+			break;
+		}
+
+		metactx[nprocs].p = p;
+		metactx[nprocs].procset = procset;
+		TASK_INIT(&metactx[nprocs].tk, 0, &slsckpt_metatask,
+		    &metactx[nprocs]);
+		taskqueue_enqueue(slsm.slsm_metatq, &metactx[nprocs].tk);
+		nprocs += 1;
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		taskqueue_drain(slsm.slsm_metatq, &metactx[i].tk);
+		serial += metactx[i].duration;
+
+		if (error == 0 && metactx[i].error != 0) {
+			DEBUG2("Checkpointing process %d failed with %d\n",
+			    metactx[i].p->p_pid, metactx[i].error);
+			error = metactx[i].error;
+		}
+
+		if (error == 0)
+			error = slsckpt_shard_merge(sckpt, metactx[i].shard);
+
+		slsckpt_shard_free(metactx[i].shard);
+	}
+	nanotime(&tend);
+
+	free(metactx, M_SLSMM);
+
+	if (error != 0)
+		return (error);
+
+	/* Compare against the time capturing the processes one by one. */
+	elapsed = TONANO(tend) - TONANO(tstart);
+	SDT_PROBE3(sls, , , meta_parallel, nprocs, elapsed, serial);
+	atomic_add_64(&sls_meta_parallel_runs, 1);
+	if (serial > elapsed)
+		atomic_add_64(&sls_meta_saved_ns, serial - elapsed);
+
+	return (0);
+}
+
+static void
+slsckpt_collapsetask(void *ctx, int __unused pending)
+{
+	struct slstable_collapsectx *collapsectx =
+	    (struct slstable_collapsectx *)ctx;
+	struct slsckpt_data *oldsckpt = collapsectx->oldsckpt;
+	struct slsckpt_data *sckpt = collapsectx->sckpt;
+	struct slspart *slsp = collapsectx->slsp;
+	struct slskv_table *objtable;
+	bool done;
+
+	SDT_PROBE1(sls, , sls_ckpt, , "Collapsing retired checkpoint");
+
+	objtable = (sckpt != NULL) ? sckpt->sckpt_shadowtable : NULL;
+
+	/*
+	 * Collapse in batches, so that a checkpoint that wants to shadow the
+	 * objects does not wait for the whole table with its processes
+	 * stopped.
+	 */
+	do {
+		sx_xlock(&slsp->slsp_shadowlk);
+		done = slsvm_objtable_collapse_some(oldsckpt->sckpt_shadowtable,
+		    objtable, max(sls_collapse_batch, 1));
+		sx_xunlock(&slsp->slsp_shadowlk);
+	} while (!done);
+
+	/* Keep the retired checkpoint around for the next one. */
+	if (sckpt != NULL) {
+		slsckpt_clear(oldsckpt);
+
+		sx_xlock(&slsp->slsp_shadowlk);
+		if (slsp->slsp_blanksckpt == NULL) {
+			slsp->slsp_blanksckpt = oldsckpt;
+			oldsckpt = NULL;
+		}
+		sx_xunlock(&slsp->slsp_shadowlk);
+
+		slsckpt_drop(sckpt);
+	}
+
+	if (oldsckpt != NULL)
+		slsckpt_drop(oldsckpt);
+
+	uma_zfree(slstable_task_zone, collapsectx);
+
+	/* This is the last access, the partition may be destroyed after. */
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_collapsing -= 1;
+	cv_broadcast(&slsp->slsp_epochcv);
+	mtx_unlock(&slsp->slsp_epochmtx);
+}
+
+/*
+ * Retire a checkpoint, handing its shadows to the collapse thread. If it was
+ * replaced by a newer checkpoint, the shadows are collapsed into the newer
+ * one's shadow table.
+ */
+static void
+slsckpt_collapse(struct slspart *slsp, struct slsckpt_data *oldsckpt,
+    struct slsckpt_data *sckpt)
+{
+	struct slstable_collapsectx *collapsectx;
+
+	collapsectx = uma_zalloc(slstable_task_zone, M_WAITOK);
+	collapsectx->slsp = slsp;
+	collapsectx->oldsckpt = oldsckpt;
+	collapsectx->sckpt = sckpt;
+	if (sckpt != NULL)
+		slsckpt_hold(sckpt);
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_collapsing += 1;
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	TASK_INIT(&collapsectx->tk, 0, &slsckpt_collapsetask, collapsectx);
+	taskqueue_enqueue(slsm.slsm_collapsetq, &collapsectx->tk);
+}
+
+/*
+ * Throttle compaction if too many retired checkpoints are waiting to be
+ * collapsed, since their shadow chains keep growing until then.
+ */
+static void
+slsckpt_collapse_wait(struct slspart *slsp)
+{
+	bool stalled = false;
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	while (slsp->slsp_collapsing > 0 &&
+	    slsp->slsp_collapsing >= sls_collapse_maxgens) {
+		stalled = true;
+		cv_wait(&slsp->slsp_epochcv, &slsp->slsp_epochmtx);
+	}
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	if (stalled)
+		atomic_add_64(&sls_collapse_stalls, 1);
+}
+
 void
 slsckpt_compact(struct slspart *slsp, struct slsckpt_data *sckpt)
 {
 	struct slsckpt_data *old_sckpt;
-	struct slskv_table *objtable;
+
+	/* Do not collapse objects while the next checkpoint shadows them. */
+	sx_assert(&slsp->slsp_shadowlk, SA_XLOCKED);
 
 	if ((slsp->slsp_target == SLS_MEM) || (slsp->slsp_mode == SLS_DELTA)) {
 
@@ -197,15 +428,8 @@ slsckpt_compact(struct slspart *slsp, struct slsckpt_data *sckpt)
 		old_sckpt = slsp->slsp_sckpt;
 		slsp->slsp_sckpt = sckpt;
 
-		if (old_sckpt != NULL) {
-			objtable = (sckpt != NULL) ? sckpt->sckpt_shadowtable :
-						     0;
-			slsvm_objtable_collapse(
-			    old_sckpt->sckpt_shadowtable, objtable);
-
-			slsckpt_clear(old_sckpt);
-			slsp->slsp_blanksckpt = old_sckpt;
-		}
+		if (old_sckpt != NULL)
+			slsckpt_collapse(slsp, old_sckpt, sckpt);
 
 		return;
 	}
@@ -216,12 +440,31 @@ slsckpt_compact(struct slspart *slsp, struct slsckpt_data *sckpt)
 	/* Destroy the shadows. We don't keep any between iterations. */
 	DEBUG("Compacting full checkpoint");
 	KASSERT(slsp->slsp_sckpt == NULL, ("Full disk checkpoint has data"));
-	slsckpt_drop(sckpt);
+	slsckpt_collapse(slsp, sckpt, NULL);
+}
+
+/*
+ * Index the pages the checkpoint wrote, and report how many it deduplicated.
+ */
+static void
+slsckpt_dedupdone(struct slspart *slsp, struct slsckpt_data *sckpt_data)
+{
+	uint64_t pages = sckpt_data->sckpt_dedup_pages;
+	uint64_t hits = sckpt_data->sckpt_dedup_hits;
+
+	slsdedup_ckptdone(sckpt_data);
+
+	slsp->slsp_deduppages = pages;
+	slsp->slsp_deduphits = hits;
+	slsp->slsp_dedupratio = (pages > 0) ? (hits * 100) / pages : 0;
+	DEBUG3("Partition %lu deduplicated %lu of %lu pages", slsp->slsp_oid,
+	    hits, pages);
 }
 
 static int
 slsckpt_io_slos(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 {
+	sbintime_t sbt = sbinuptime();
 	int error;
 
 	error = sls_write_slos(slsp->slsp_oid, sckpt_data);
@@ -229,10 +472,14 @@ slsckpt_io_slos(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 		return (error);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Initiating IO to disk");
+	slsp_phase(slsp, SLSPHASE_IOINIT, &sbt);
 
-	/* Drain the taskqueue, ensuring all IOs have hit the disk. */
-	taskqueue_drain_all(slos.slos_tq);
+	/* Wait until all IOs have hit the disk. */
+	slos_io_drain();
+	if (SLSATTR_ISDEDUP(sckpt_data->sckpt_attr))
+		slsckpt_dedupdone(slsp, sckpt_data);
 	error = slsfs_wakeup_syncer(0);
+	slsp_phase(slsp, SLSPHASE_IODRAIN, &sbt);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Draining taskqueue");
 
@@ -244,6 +491,7 @@ slsckpt_io_file(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 {
 	struct vnode *vp = (struct vnode *)slsp->slsp_backend;
 	struct thread *td = curthread;
+	sbintime_t sbt = sbinuptime();
 	int error;
 
 	error = sls_write_file(slsp, sckpt_data);
@@ -251,10 +499,12 @@ slsckpt_io_file(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 		return (error);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Initiating IO to disk");
+	slsp_phase(slsp, SLSPHASE_IOINIT, &sbt);
 
 	VOP_LOCK(vp, LK_EXCLUSIVE);
 	error = VOP_FSYNC(vp, MNT_WAIT, td);
 	VOP_UNLOCK(vp, 0);
+	slsp_phase(slsp, SLSPHASE_IODRAIN, &sbt);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Draining taskqueue");
 
@@ -262,54 +512,70 @@ slsckpt_io_file(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 }
 
 static int
-slsckpt_io_socket(struct slspart *slsp, struct slsckpt_data *sckpt_data)
+slsckpt_io_socket(struct slspart *slsp, struct slsckpt_data *sckpt_data,
+    uint64_t epoch, int depth)
 {
+	sbintime_t sbt = sbinuptime();
 	int error;
 
-	error = sls_write_socket(slsp, sckpt_data);
-	if (error != 0)
-		return (error);
+	error = sls_write_socket(slsp, sckpt_data, epoch, depth);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Initiating IO to remote server");
+	slsp_phase(slsp, SLSPHASE_IOINIT, &sbt);
 
-	/* The write routine is currently synchronous, no draining necessary. */
+	/* The write returns once the remote has the data, nothing to drain. */
 
 	return (error);
 }
 
+/* Finish the records of the checkpoint before writing them out. */
 static int
-slsckpt_initio(struct slspart *slsp, struct slsckpt_data *sckpt_data)
+slsckpt_prepio(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 {
+	sbintime_t sbt;
 	int error;
 
-	/* No need to flush memory backends. */
-	if (slsp->slsp_target == SLS_MEM)
-		return (0);
-
 	/* Create a record for every vnode. */
 	/*
 	 * Actually serializing vnodes proves costly for applications with
 	 * hundreds of vnodes. We avoid it completely for in-memory checkponts,
 	 * and defer it to after the partition has resumed if using disk.
 	 */
+	sbt = sbinuptime();
 	error = slsckpt_vnode_serialize(sckpt_data);
 	if (error != 0)
 		return (error);
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Serializing vnodes");
+	slsp_phase(slsp, SLSPHASE_VNODES, &sbt);
 
 	error = sbuf_finish(sckpt_data->sckpt_meta);
 	if (error != 0)
 		return (error);
 
-	error = sbuf_finish(sckpt_data->sckpt_dataid);
+	return (sbuf_finish(sckpt_data->sckpt_dataid));
+}
+
+static int
+slsckpt_initio(struct slspart *slsp, struct slsckpt_data *sckpt_data)
+{
+	int error;
+
+	/* No need to flush memory backends. */
+	if (slsp->slsp_target == SLS_MEM)
+		return (0);
+
+	error = slsckpt_prepio(slsp, sckpt_data);
 	if (error != 0)
 		return (error);
 
 	/* Initiate IO, if necessary. */
 	switch (slsp->slsp_target) {
 	case SLS_SOCKSND:
-		return (slsckpt_io_socket(slsp, sckpt_data));
+		error = slsckpt_io_socket(
+		    slsp, sckpt_data, slsp->slsp_epoch, 0);
+		slssnd_release(sckpt_data);
+		return (error);
 
 	case SLS_SOCKRCV:
 		return (EOPNOTSUPP);
@@ -329,6 +595,326 @@ slsckpt_initio(struct slspart *slsp, struct slsckpt_data *sckpt_data)
 	}
 }
 
+/*
+ * Flush a checkpoint to the backend, fold it into the partition's in-memory
+ * state, and advance the epoch. Runs either inline or from the pipeline.
+ */
+static void
+slsckpt_flush(
+    struct slspart *slsp, struct slsckpt_data *sckpt, uint64_t nextepoch)
+{
+	struct timespec tstart, tend;
+	sbintime_t sbt;
+	int error;
+
+	nanotime(&tstart);
+	error = slsckpt_initio(slsp, sckpt);
+	if (error != 0)
+		DEBUG1("slsckpt_initio failed with %d", error);
+	nanotime(&tend);
+
+	slsp->slsp_flushns = TONANO(tend) - TONANO(tstart);
+
+	/*
+	 * Collapse the shadows. Region checkpoints and restores drain the
+	 * pipeline before they touch the partition's checkpoint data.
+	 */
+	sbt = sbinuptime();
+	slsckpt_collapse_wait(slsp);
+	sx_xlock(&slsp->slsp_shadowlk);
+	slsckpt_compact(slsp, sckpt);
+	sx_xunlock(&slsp->slsp_shadowlk);
+	slsp_phase(slsp, SLSPHASE_COMPACT, &sbt);
+
+	/* Advance the current major epoch. */
+	slsp_epoch_advance(slsp, nextepoch);
+}
+
+static void
+slsckpt_pipetask(void *ctx, int __unused pending)
+{
+	struct slstable_pipectx *pipectx = (struct slstable_pipectx *)ctx;
+	struct slspart *slsp = pipectx->slsp;
+
+	SDT_PROBE1(sls, , sls_ckpt, , "Flushing pipelined checkpoint");
+
+	slsckpt_flush(slsp, pipectx->sckpt, pipectx->nextepoch);
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_inflight -= 1;
+	slsp->slsp_inflightbytes -= pipectx->bytes;
+	cv_broadcast(&slsp->slsp_epochcv);
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	uma_zfree(slstable_task_zone, pipectx);
+
+	/* Drop the reference held by the pipeline. */
+	slsp_deref(slsp);
+}
+
+/*
+ * Estimate the memory pinned by a checkpoint until it is flushed, i.e., the
+ * pages of the objects frozen by shadowing.
+ */
+static size_t
+slsckpt_residentbytes(struct slsckpt_data *sckpt)
+{
+	struct slskv_iter iter;
+	vm_object_t obj, shadow;
+	size_t bytes = 0;
+
+	KV_FOREACH(sckpt->sckpt_shadowtable, iter, obj, shadow)
+	bytes += ptoa(obj->resident_page_count);
+
+	return (bytes);
+}
+
+/*
+ * Hand the checkpoint to the flush thread. The caller can make the partition
+ * available right away, since the flush thread advances the epoch in order.
+ */
+static void
+slsckpt_pipeline(
+    struct slspart *slsp, struct slsckpt_data *sckpt, uint64_t nextepoch)
+{
+	struct slstable_pipectx *pipectx;
+
+	pipectx = uma_zalloc(slstable_task_zone, M_WAITOK);
+	pipectx->slsp = slsp;
+	pipectx->sckpt = sckpt;
+	pipectx->nextepoch = nextepoch;
+	pipectx->bytes = slsckpt_residentbytes(sckpt);
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_inflight += 1;
+	slsp->slsp_inflightbytes += pipectx->bytes;
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	slsp_ref(slsp);
+	TASK_INIT(&pipectx->tk, 0, &slsckpt_pipetask, &pipectx->tk);
+	taskqueue_enqueue(slsm.slsm_ckpttq, &pipectx->tk);
+}
+
+/*
+ * Throttle the checkpointer if too many checkpoints are in flight, or if
+ * their shadows are pinning too much memory.
+ */
+static void
+slsckpt_pipeline_wait(struct slspart *slsp)
+{
+	bool stalled = false;
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	while (slsp->slsp_inflight > 0 &&
+	    (slsp->slsp_inflight >= sls_pipeline_depth ||
+		slsp->slsp_inflightbytes >= sls_pipeline_maxbytes)) {
+		stalled = true;
+		cv_wait(&slsp->slsp_epochcv, &slsp->slsp_epochmtx);
+	}
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	if (stalled)
+		atomic_add_64(&sls_pipeline_stalls, 1);
+}
+
+/*
+ * Retire the checkpoints up to and including the given one, now that the
+ * remote has them or they are abandoned. They are compacted in order, as
+ * if each had been flushed on its own.
+ */
+static void
+slsckpt_replretire(struct slspart *slsp, struct slstable_replctx *last)
+{
+	struct slstable_replctx *replctx;
+	sbintime_t sbt;
+	bool done;
+
+	do {
+		mtx_lock(&slsp->slsp_epochmtx);
+		replctx = TAILQ_FIRST(&slsp->slsp_replq);
+		mtx_unlock(&slsp->slsp_epochmtx);
+
+		done = (replctx == last);
+		slssnd_release(replctx->sckpt);
+
+		sbt = sbinuptime();
+		slsckpt_collapse_wait(slsp);
+		sx_xlock(&slsp->slsp_shadowlk);
+		slsckpt_compact(slsp, replctx->sckpt);
+		sx_xunlock(&slsp->slsp_shadowlk);
+		slsp_phase(slsp, SLSPHASE_COMPACT, &sbt);
+
+		slsp_epoch_advance(slsp, replctx->nextepoch);
+
+		mtx_lock(&slsp->slsp_epochmtx);
+		TAILQ_REMOVE(&slsp->slsp_replq, replctx, next);
+		slsp->slsp_repllag -= 1;
+		slsp->slsp_repllagbytes -= replctx->bytes;
+		cv_broadcast(&slsp->slsp_epochcv);
+		mtx_unlock(&slsp->slsp_epochmtx);
+
+		uma_zfree(slstable_task_zone, replctx);
+	} while (!done);
+}
+
+/*
+ * Whether sending the checkpoint again cannot succeed: either we could not
+ * prepare its records, or the remote rejected it.
+ */
+static bool
+slsckpt_repl_permanent(struct slstable_replctx *replctx, int error)
+{
+	return (replctx->preperror != 0 || error == EPROTO);
+}
+
+/*
+ * Give up on the remote. The queued checkpoints are dropped, and the
+ * checkpointer stops with the error the next time it waits for us.
+ */
+static void
+slsckpt_repl_stop(struct slspart *slsp, int error)
+{
+	SLS_WARN("Replication of partition %lu failed with %d\n",
+	    slsp->slsp_oid, error);
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_replerror = error;
+	slsp->slsp_replabort = true;
+	cv_broadcast(&slsp->slsp_epochcv);
+	mtx_unlock(&slsp->slsp_epochmtx);
+}
+
+/*
+ * Send out the checkpoints of a partition. Only the newest checkpoint in the
+ * queue is sent, carrying the pages of the older ones with it: if the link
+ * is slower than the partition dirties memory, checkpoints pile up while we
+ * send, and the next send coalesces them. The epochs only advance once the
+ * remote acknowledges the send. Failed sends are retried with backoff, again
+ * coalescing anything taken in the meantime. Failures that resending cannot
+ * fix stop replication for good, and the checkpointer reports them.
+ */
+void
+slsckpt_repltask(void *ctx, int __unused pending)
+{
+	struct slspart *slsp = (struct slspart *)ctx;
+	struct slstable_replctx *last;
+	struct timespec tstart, tend;
+	int backoff = hz;
+	uint64_t depth;
+	bool abort;
+	int error;
+
+	for (;;) {
+		mtx_lock(&slsp->slsp_epochmtx);
+		last = TAILQ_LAST(&slsp->slsp_replq, slstable_replq);
+		depth = slsp->slsp_repllag - 1;
+		abort = slsp->slsp_replabort;
+		mtx_unlock(&slsp->slsp_epochmtx);
+
+		if (last == NULL)
+			return;
+
+		SDT_PROBE1(sls, , sls_ckpt, , "Replicating checkpoint");
+
+		if (!last->prepared) {
+			last->preperror = slsckpt_prepio(slsp, last->sckpt);
+			last->prepared = true;
+		}
+
+		nanotime(&tstart);
+		error = last->preperror;
+		if (error == 0 && !abort)
+			error = slsckpt_io_socket(
+			    slsp, last->sckpt, last->nextepoch - 1, depth);
+		nanotime(&tend);
+
+		slsp->slsp_flushns = TONANO(tend) - TONANO(tstart);
+
+		if (error != 0 && !abort) {
+			if (slsckpt_repl_permanent(last, error)) {
+				slsckpt_repl_stop(slsp, error);
+				continue;
+			}
+
+			DEBUG1("Replicating checkpoint failed with %d", error);
+			atomic_add_64(&sls_repl_retries, 1);
+
+			/* Partition teardown wakes us up to drop the queue. */
+			mtx_lock(&slsp->slsp_epochmtx);
+			if (!slsp->slsp_replabort)
+				msleep(&slsp->slsp_replabort,
+				    &slsp->slsp_epochmtx, 0, "slsrepl",
+				    backoff);
+			mtx_unlock(&slsp->slsp_epochmtx);
+			backoff = imin(2 * backoff,
+			    imax(sls_repl_acktimeout, 1) * hz);
+			continue;
+		}
+
+		backoff = hz;
+
+		if (depth > 0) {
+			atomic_add_64(&sls_repl_coalesced, depth);
+			slsp->slsp_replcoalesced += depth;
+		}
+
+		slsckpt_replretire(slsp, last);
+	}
+}
+
+/*
+ * Queue the checkpoint for the replication threads. Like with pipelining,
+ * the caller can make the partition available right away.
+ */
+static void
+slsckpt_replicate(
+    struct slspart *slsp, struct slsckpt_data *sckpt, uint64_t nextepoch)
+{
+	struct slstable_replctx *replctx;
+
+	replctx = uma_zalloc(slstable_task_zone, M_WAITOK);
+	replctx->sckpt = sckpt;
+	replctx->nextepoch = nextepoch;
+	replctx->bytes = slsckpt_residentbytes(sckpt);
+	replctx->prepared = false;
+	replctx->preperror = 0;
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	TAILQ_INSERT_TAIL(&slsp->slsp_replq, replctx, next);
+	slsp->slsp_repllag += 1;
+	slsp->slsp_repllagbytes += replctx->bytes;
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	taskqueue_enqueue(slsm.slsm_repltq, &slsp->slsp_repltk);
+}
+
+/*
+ * Throttle the checkpointer if the remote is too far behind. Coalescing
+ * keeps the link busy, but the frozen pages of every checkpoint in the queue
+ * stay in memory until the remote has them.
+ */
+static int
+slsckpt_replicate_wait(struct slspart *slsp)
+{
+	bool stalled = false;
+	int error;
+
+	mtx_lock(&slsp->slsp_epochmtx);
+	while (slsp->slsp_replerror == 0 && slsp->slsp_repllag > 0 &&
+	    (slsp->slsp_repllag >= sls_repl_depth ||
+		slsp->slsp_repllagbytes >= sls_pipeline_maxbytes)) {
+		stalled = true;
+		cv_wait(&slsp->slsp_epochcv, &slsp->slsp_epochmtx);
+	}
+	error = slsp->slsp_replerror;
+	mtx_unlock(&slsp->slsp_epochmtx);
+
+	if (stalled)
+		atomic_add_64(&sls_repl_stalls, 1);
+
+	return (error);
+}
+
 /*
  * Checkpoint a process once. This includes stopping and restarting
  * it properly, as well as shadowing any VM objects directly accessible
@@ -338,19 +924,29 @@ static int __attribute__((noinline)) sls_ckpt(slsset *procset,
     struct proc *pcaller, struct slspart *slsp, uint64_t nextepoch)
 {
 	struct slsckpt_data *sckpt;
+	struct timespec tstart, tend;
 	struct slskv_iter iter;
 	struct thread *td;
 	struct proc *p;
+	sbintime_t sbt;
 	int error = 0;
 
+	nanotime(&tstart);
+	sbt = sbinuptime();
+
 	DEBUG("Process stopped");
 #ifdef KTR
 	KVSET_FOREACH(procset, iter, p) { slsvm_print_vmspace(p->p_vmspace); }
 #endif
 
+	/* Keep the previous checkpoint from being compacted under us. */
+	sx_xlock(&slsp->slsp_shadowlk);
+
 	error = slsckpt_alloc(slsp, &sckpt);
-	if (error != 0)
+	if (error != 0) {
+		sx_xunlock(&slsp->slsp_shadowlk);
 		return (error);
+	}
 
 	SDT_PROBE0(sls, , , meta_start);
 	SDT_PROBE1(sls, , sls_ckpt, , "Creating the checkpoint");
@@ -365,24 +961,33 @@ static int __attribute__((noinline)) sls_ckpt(slsset *procset,
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Getting System V memory");
 
-	/* Get the data from all processes in the partition. */
-	KVSET_FOREACH(procset, iter, p)
-	{
-
-		/* Insert the process into Aurora. */
-		slsp_attach(slsp->slsp_oid, p);
+	/* Insert the processes into Aurora. */
+	KVSET_FOREACH(procset, iter, p) { slsp_attach(slsp->slsp_oid, p); }
 
-		error = slsckpt_metadata(p, procset, sckpt);
+	/* Get the data from all processes in the partition. */
+	if (sls_meta_parallel > 0 && procset->count >= sls_meta_parallel) {
+		error = slsckpt_metadata_parallel(procset, sckpt);
 		if (error != 0) {
-			DEBUG2("Checkpointing process %d failed with %d\n",
-			    p->p_pid, error);
-			KV_ABORT(iter);
 			slsckpt_cont(procset, pcaller);
 			goto error;
 		}
+	} else {
+		KVSET_FOREACH(procset, iter, p)
+		{
+			error = slsckpt_metadata(p, procset, sckpt);
+			if (error != 0) {
+				DEBUG2("Checkpointing process %d failed "
+				       "with %d\n",
+				    p->p_pid, error);
+				KV_ABORT(iter);
+				slsckpt_cont(procset, pcaller);
+				goto error;
+			}
+		}
 	}
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Getting the metadata");
+	slsp_phase(slsp, SLSPHASE_METADATA, &sbt);
 
 	SDT_PROBE0(sls, , , meta_finish);
 	/* Shadow the objects to be dumped. */
@@ -394,6 +999,7 @@ static int __attribute__((noinline)) sls_ckpt(slsset *procset,
 	}
 
 	SDT_PROBE1(sls, , sls_ckpt, , "Shadowing the objects");
+	slsp_phase(slsp, SLSPHASE_SHADOW, &sbt);
 
 	KVSET_FOREACH(procset, iter, p)
 	{
@@ -403,11 +1009,17 @@ static int __attribute__((noinline)) sls_ckpt(slsset *procset,
 			    TD_IS_INHIBITED(td), ("thread is not inhibited"));
 	}
 
+	sx_xunlock(&slsp->slsp_shadowlk);
+
 	/*
 	 * Let the process execute ASAP. For a one-off checkpoint, the process
 	 * is also waiting for the partition to signal the operation is done.
 	 */
 	slsckpt_cont(procset, pcaller);
+	slsp_phase(slsp, SLSPHASE_CONT, &sbt);
+
+	nanotime(&tend);
+	slsp->slsp_stopns = TONANO(tend) - TONANO(tstart);
 
 	if (slsp->slsp_attr.attr_period == 0)
 		slsp_signal(slsp, 0);
@@ -416,32 +1028,20 @@ static int __attribute__((noinline)) sls_ckpt(slsset *procset,
 	SDT_PROBE0(sls, , , stopclock_finish);
 
 	/*
-	 * HACK: For Metropolis we want to measure
-	 * the storage density only of deltas, since
-	 * full checkpoint space usage is amortized.
-	 * Use a sysctl to blackhole full checkpoints.
+	 * In pipelined mode the IO for this checkpoint overlaps with the next
+	 * one, so the partition becomes available as soon as the processes
+	 * are running again. One-off checkpoints gain nothing from this.
+	 * Checkpoints sent to a remote always go through the replication
+	 * queue, since the link may be much slower than the disk.
 	 */
-	if (!sls_only_flush_deltas ||
-	    ((slsp->slsp_mode == SLS_DELTA) && (slsp->slsp_sckpt != NULL))) {
-		error = slsckpt_initio(slsp, sckpt);
-		if (error != 0)
-			DEBUG1("slsckpt_initio failed with %d", error);
-	}
+	if (slsp->slsp_target == SLS_SOCKSND &&
+	    slsp->slsp_attr.attr_period != 0)
+		slsckpt_replicate(slsp, sckpt, nextepoch);
+	else if (SLSP_PIPELINE(slsp) && slsp->slsp_attr.attr_period != 0)
+		slsckpt_pipeline(slsp, sckpt, nextepoch);
+	else
+		slsckpt_flush(slsp, sckpt, nextepoch);
 
-	/*
-	 * Collapse the shadows. Do it before making the partition available to
-	 * safely execute with region checkpoints.
-	 */
-	slsckpt_compact(slsp, sckpt);
-
-	/* Advance the current major epoch. */
-	slsp_epoch_advance(slsp, nextepoch);
-
-	/*
-	 * Mark the partition as available. We don't have pipelining, so we wait
-	 * for the taskqueue to drain before making the partition available
-	 * again.
-	 */
 	error = slsp_setstate(slsp, SLSP_CHECKPOINTING, SLSP_AVAILABLE, false);
 	KASSERT(error == 0, ("partition not in ckpt state"));
 
@@ -454,6 +1054,8 @@ error:
 	if (sckpt != NULL)
 		slsckpt_drop(sckpt);
 
+	sx_xunlock(&slsp->slsp_shadowlk);
+
 	if (slsp->slsp_attr.attr_period == 0)
 		slsp_signal(slsp, error);
 
@@ -652,6 +1254,64 @@ slsckpt_prepare_state(struct slspart *slsp, bool *retry)
 	return (true);
 }
 
+#define SLSCKPT_EWMA(old, sample) (((old)*3 + (sample)) / 4)
+
+/* Sample the pages the partition dirtied since its last checkpoint. */
+static uint64_t
+slsckpt_adaptive_sample(struct slsckpt_adaptive *adapt, slsset *procset)
+{
+	uint64_t dirty, elapsed, now;
+	struct timespec ts;
+
+	dirty = slsvm_procset_dirty(procset);
+
+	nanotime(&ts);
+	now = TONANO(ts);
+	elapsed = now - adapt->lastns;
+	adapt->lastns = now;
+
+	if (elapsed > 0)
+		adapt->rate = SLSCKPT_EWMA(
+		    adapt->rate, (dirty * 1000 * 1000 * 1000) / elapsed);
+
+	return (dirty);
+}
+
+/*
+ * Choose the next checkpoint period. Stop time grows with the pages dirtied
+ * during the period, so the period is sized to dirty just as many pages as
+ * the stop time budget allows. The configured period is the upper bound and
+ * bounds the data lost on a crash; without a budget the period stays there.
+ */
+static void
+slsckpt_adaptive_update(
+    struct slsckpt_adaptive *adapt, struct slspart *slsp, uint64_t dirty)
+{
+	uint64_t budget = (uint64_t)slsp->slsp_attr.attr_stopbudget * 1000;
+	uint64_t period = slsp->slsp_attr.attr_period;
+	uint64_t pagecost;
+
+	if (dirty > 0) {
+		pagecost = MAX(slsp->slsp_stopns / dirty, 1);
+		adapt->pagecost = (adapt->pagecost == 0) ?
+		    pagecost :
+		    SLSCKPT_EWMA(adapt->pagecost, pagecost);
+	}
+
+	if (budget > 0 && adapt->rate > 0 && adapt->pagecost > 0)
+		period = ((budget / adapt->pagecost) * 1000) / adapt->rate;
+
+	/* Do not start checkpoints faster than the backend flushes them. */
+	period = MAX(period, slsp->slsp_flushns / (1000 * 1000));
+
+	period = MAX(period, slsp->slsp_attr.attr_period_min);
+	period = MIN(period, slsp->slsp_attr.attr_period);
+	adapt->period = period;
+
+	SDT_PROBE3(sls, , , adaptive_period, dirty, slsp->slsp_stopns,
+	    adapt->period);
+}
+
 /*
  * System process that continuously checkpoints a partition.
  */
@@ -660,16 +1320,21 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 {
 	struct proc *pcaller = args->pcaller;
 	struct slspart *slsp = args->slsp;
+	struct slsckpt_adaptive adapt;
 	struct timespec tstart, tend;
+	sbintime_t sbt;
 	long msec_elapsed, msec_left;
 	bool recurse = args->recurse;
 	int stateerr, error = 0;
 	slsset *procset = NULL;
 	uint64_t localepoch;
 	uint64_t *nextepoch;
+	bool ckpted = false;
+	uint64_t dirty = 0;
 	struct proc *p;
 	bool retry;
 	const long period = slsp->slsp_attr.attr_period;
+	const bool adaptive = SLSP_ADAPTIVE(slsp) && (period != 0);
 
 	/* Use local storage for the epoch if the caller doesn't care. */
 	nextepoch = args->nextepoch;
@@ -679,6 +1344,13 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 	/* Free the arguments, everything is now in the local stack. */
 	free(args, M_SLSMM);
 
+	/* Start from the longest period until we know the workload. */
+	nanotime(&tstart);
+	adapt = (struct slsckpt_adaptive) {
+		.lastns = TONANO(tstart),
+		.period = period,
+	};
+
 	/* The set of processes we are going to checkpoint. */
 	error = slsset_create(&procset);
 	if (error != 0) {
@@ -701,6 +1373,14 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 			continue;
 		}
 
+		/* Do not run too far ahead of the flush thread. */
+		slsckpt_pipeline_wait(slsp);
+		error = slsckpt_replicate_wait(slsp);
+		if (error != 0) {
+			DEBUG1("Replication failed with %d\n", error);
+			break;
+		}
+
 		DEBUG1("Attempting checkpoint %d", sls_ckpt_attempted);
 		error = slsckpt_gather(slsp, procset, pcaller, recurse);
 		if (error != 0) {
@@ -710,7 +1390,38 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 
 		DEBUG("Gathered all processes");
 
+		/*
+		 * Do not stop the partition if there is nothing new to save.
+		 * The sample only sees anonymous memory, so still checkpoint
+		 * at least once a period to pick up everything else.
+		 */
+		if (adaptive) {
+			dirty = slsckpt_adaptive_sample(&adapt, procset);
+			if (dirty == 0 && ckpted &&
+			    adapt.lastns - adapt.ckptns <
+				(uint64_t)period * 1000 * 1000) {
+				/* Gathering the children stops the processes. */
+				if (recurse)
+					slsckpt_cont(procset, pcaller);
+
+				KVSET_FOREACH_POP(procset, p)
+				PRELE(p);
+
+				stateerr = slsp_setstate(slsp,
+				    SLSP_CHECKPOINTING, SLSP_AVAILABLE, false);
+				KASSERT(stateerr == 0,
+				    ("partition in state %d",
+					slsp->slsp_status));
+
+				atomic_add_64(&sls_ckpt_skipped, 1);
+				slsckpt_adaptive_update(&adapt, slsp, 0);
+				goto next;
+			}
+		}
+
+		sbt = sbinuptime();
 		slsckpt_stop(procset, pcaller);
+		slsp_phase(slsp, SLSPHASE_STOP, &sbt);
 
 		DEBUG("Stopped all processes");
 
@@ -726,9 +1437,9 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 			break;
 		}
 
-		nanotime(&tend);
-
 		sls_ckpt_done += 1;
+		ckpted = true;
+		adapt.ckptns = TONANO(tstart);
 
 		/* Release all checkpointed processes. */
 		KVSET_FOREACH_POP(procset, p)
@@ -739,10 +1450,23 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 		if (period == 0)
 			goto out;
 
+		if (adaptive)
+			slsckpt_adaptive_update(&adapt, slsp, dirty);
+
+	next:
+		nanotime(&tend);
+
 		/* Else compute how long we need to wait until we need to
 		 * checkpoint again. */
 		msec_elapsed = (TONANO(tend) - TONANO(tstart)) / (1000 * 1000);
-		msec_left = period - msec_elapsed;
+		msec_left = adapt.period - msec_elapsed;
+
+		/* Wake up in time to keep the checkpoints a period apart. */
+		if (adaptive && ckpted)
+			msec_left = MIN(msec_left,
+			    period -
+				(long)((TONANO(tend) - adapt.ckptns) /
+				    (1000 * 1000)));
 		if (msec_left > 0)
 			pause_sbt("slscpt", SBT_1MS * msec_left, 0,
 			    C_HARDCLOCK | C_CATCH);
@@ -754,6 +1478,9 @@ sls_checkpointd(struct sls_checkpointd_args *args)
 		 */
 	}
 
+	/* Flush out any checkpoints still in the pipeline. */
+	slsp_pipeline_drain(slsp);
+
 	/*
 	 * If we exited normally, and the process is still in the SLOS,
 	 * mark the process as available for checkpointing.
@@ -0,0 +1,310 @@
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/buf.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/vnode.h>
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+
+#include <machine/atomic.h>
+#include <machine/vmparam.h>
+
+#include <slos.h>
+#include <slos_inode.h>
+#include <slos_io.h>
+#include <slsfs.h>
+
+#include "debug.h"
+#include "sls_dedup.h"
+#include "sls_internal.h"
+#include "sls_kv.h"
+
+/*
+ * Page deduplication for the SLOS. Pages written out by checkpoints are
+ * indexed by the hash of their contents. When a later write finds an
+ * identical page in the index, the record points to the existing block
+ * instead of getting a copy of the data.
+ *
+ * Blocks in the SLOS are never overwritten, so an indexed block holds the
+ * same data for as long as the record that wrote it still maps it. Entries
+ * are never updated when records move on; we instead check that the mapping
+ * is still there when we find the entry, and compare the data itself to rule
+ * out hash collisions.
+ */
+
+uint64_t sls_dedup_maxentries = 1024 * 1024;
+uint64_t sls_dedup_pages;
+uint64_t sls_dedup_hits;
+uint64_t sls_dedup_stale;
+
+#define SLSDEDUP_PRIME1 (0x9e3779b185ebca87ULL)
+#define SLSDEDUP_PRIME2 (0xc2b2ae3d27d4eb4fULL)
+#define SLSDEDUP_PRIME3 (0x165667b19e3779f9ULL)
+
+#define SLSDEDUP_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static __inline uint64_t
+slsdedup_round(uint64_t acc, uint64_t val)
+{
+	acc += val * SLSDEDUP_PRIME2;
+	acc = SLSDEDUP_ROTL(acc, 31);
+
+	return (acc * SLSDEDUP_PRIME1);
+}
+
+/*
+ * Hash a page. Matches are always verified, so a fast non-cryptographic hash
+ * is enough. This is the main loop of XXH64, which keeps four independent
+ * accumulators to hide the latency of the multiplications.
+ */
+static uint64_t
+slsdedup_hash(const void *data)
+{
+	const uint64_t *words = (const uint64_t *)data;
+	uint64_t acc0 = SLSDEDUP_PRIME1 + SLSDEDUP_PRIME2;
+	uint64_t acc1 = SLSDEDUP_PRIME2;
+	uint64_t acc2 = 0;
+	uint64_t acc3 = -SLSDEDUP_PRIME1;
+	uint64_t hash;
+	size_t i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*words); i += 4) {
+		acc0 = slsdedup_round(acc0, words[i]);
+		acc1 = slsdedup_round(acc1, words[i + 1]);
+		acc2 = slsdedup_round(acc2, words[i + 2]);
+		acc3 = slsdedup_round(acc3, words[i + 3]);
+	}
+
+	hash = SLSDEDUP_ROTL(acc0, 1) + SLSDEDUP_ROTL(acc1, 7) +
+	    SLSDEDUP_ROTL(acc2, 12) + SLSDEDUP_ROTL(acc3, 18);
+
+	hash ^= hash >> 33;
+	hash *= SLSDEDUP_PRIME2;
+	hash ^= hash >> 29;
+	hash *= SLSDEDUP_PRIME3;
+	hash ^= hash >> 32;
+
+	return (hash);
+}
+
+static bool
+slsdedup_lookup(uint64_t hash, struct slsdedup_ent *ent)
+{
+	struct slsdedup_ent *cur;
+	bool found;
+
+	mtx_lock(&slsm.slsm_deduplk);
+	found = (slskv_find(slsm.slsm_dedup, hash, (uintptr_t *)&cur) == 0);
+	if (found)
+		*ent = *cur;
+	mtx_unlock(&slsm.slsm_deduplk);
+
+	return (found);
+}
+
+/*
+ * Remove a stale entry, unless someone already replaced it.
+ */
+static void
+slsdedup_remove(uint64_t hash, struct slsdedup_ent *ent)
+{
+	struct slsdedup_ent *cur = NULL;
+
+	mtx_lock(&slsm.slsm_deduplk);
+	if (slskv_find(slsm.slsm_dedup, hash, (uintptr_t *)&cur) != 0 ||
+	    memcmp(cur, ent, sizeof(*cur)) != 0)
+		cur = NULL;
+	if (cur != NULL)
+		slskv_del(slsm.slsm_dedup, hash);
+	mtx_unlock(&slsm.slsm_deduplk);
+
+	free(cur, M_SLSMM);
+}
+
+static void
+slsdedup_insert(uint64_t hash, struct slsdedup_ent *ent)
+{
+	struct slsdedup_ent *new, *old = NULL;
+	uint64_t oldhash;
+
+	new = malloc(sizeof(*new), M_SLSMM, M_WAITOK);
+	*new = *ent;
+
+	mtx_lock(&slsm.slsm_deduplk);
+
+	/* Newer blocks are likely to stay mapped for longer. */
+	if (slskv_find(slsm.slsm_dedup, hash, (uintptr_t *)&old) == 0) {
+		*old = *ent;
+		mtx_unlock(&slsm.slsm_deduplk);
+		free(new, M_SLSMM);
+		return;
+	}
+
+	/* Make room by evicting an arbitrary entry. */
+	old = NULL;
+	if (slsm.slsm_dedup->count >= sls_dedup_maxentries)
+		(void)slskv_pop(slsm.slsm_dedup, &oldhash, (uintptr_t *)&old);
+
+	if (slskv_add(slsm.slsm_dedup, hash, (uintptr_t)new) != 0) {
+		free(old, M_SLSMM);
+		old = new;
+	}
+
+	mtx_unlock(&slsm.slsm_deduplk);
+
+	free(old, M_SLSMM);
+}
+
+/*
+ * Point the logical block of the record to the block the entry describes.
+ */
+static int
+slsdedup_share(
+    struct vnode *vp, uint64_t lblkno, struct slsdedup_ent *ent, void *data)
+{
+	struct vnode *srcvp;
+	int error;
+
+	/* Repeated checkpoints of the same record are the common case. */
+	if (ent->de_ino == INUM(SLSVP(vp))) {
+		return (slos_io_share(
+		    vp, lblkno, vp, ent->de_lblkno, ent->de_blkno, data));
+	}
+
+	error = VFS_VGET(slos.slsfs_mount, ent->de_ino, LK_EXCLUSIVE, &srcvp);
+	if (error != 0)
+		return (error);
+	VOP_UNLOCK(srcvp, 0);
+
+	error = slos_io_share(
+	    vp, lblkno, srcvp, ent->de_lblkno, ent->de_blkno, data);
+	vrele(srcvp);
+
+	return (error);
+}
+
+/*
+ * Go through the pages of a write until we find one already in the SLOS, and
+ * map it to the existing block. Only the pages before it have to be written
+ * out. Returns their number, and whether the page after them was mapped.
+ */
+int
+slsdedup_writebuf(
+    struct vnode *vp, struct buf *bp, struct slsckpt_data *sckpt, bool *hit)
+{
+	struct slsdedup_cand *cand;
+	struct slsdedup_ent ent;
+	uint64_t lblkno, hash;
+	void *data;
+	int error;
+	int i;
+
+	*hit = false;
+
+	/* References are to whole blocks. */
+	if (BLKSIZE(&slos) != PAGE_SIZE)
+		return (bp->b_npages);
+
+	for (i = 0; i < bp->b_npages; i++) {
+		data = (void *)PHYS_TO_DMAP(VM_PAGE_TO_PHYS(bp->b_pages[i]));
+		lblkno = bp->b_lblkno + i;
+		hash = slsdedup_hash(data);
+
+		if (slsdedup_lookup(hash, &ent)) {
+			error = slsdedup_share(vp, lblkno, &ent, data);
+			if (error == 0) {
+				*hit = true;
+				break;
+			}
+
+			DEBUG1("Dropping stale dedup entry (error %d)", error);
+			slsdedup_remove(hash, &ent);
+			atomic_add_64(&sls_dedup_stale, 1);
+		}
+
+		/* Index the page after the checkpoint is on disk. */
+		cand = malloc(sizeof(*cand), M_SLSMM, M_WAITOK);
+		cand->dc_vp = vp;
+		cand->dc_lblkno = lblkno;
+		vref(vp);
+
+		if (slskv_add(sckpt->sckpt_dedup, hash, (uintptr_t)cand) != 0) {
+			vrele(vp);
+			free(cand, M_SLSMM);
+		}
+	}
+
+	atomic_add_64(&sckpt->sckpt_dedup_pages, i + (*hit ? 1 : 0));
+	atomic_add_64(&sls_dedup_pages, i + (*hit ? 1 : 0));
+	if (*hit) {
+		atomic_add_64(&sckpt->sckpt_dedup_hits, 1);
+		atomic_add_64(&sls_dedup_hits, 1);
+	}
+
+	return (i);
+}
+
+/*
+ * Add the pages a checkpoint wrote to the index. Must be called after all of
+ * its IO is done, when the pages have their final blocks.
+ */
+void
+slsdedup_ckptdone(struct slsckpt_data *sckpt)
+{
+	struct slsdedup_cand *cand;
+	struct slsdedup_ent ent;
+	uint64_t hash;
+	int error;
+
+	KV_FOREACH_POP(sckpt->sckpt_dedup, hash, cand)
+	{
+		ent.de_ino = INUM(SLSVP(cand->dc_vp));
+		ent.de_lblkno = cand->dc_lblkno;
+		error = slos_io_bmap(cand->dc_vp, ent.de_lblkno, &ent.de_blkno);
+		if (error == 0)
+			slsdedup_insert(hash, &ent);
+
+		vrele(cand->dc_vp);
+		free(cand, M_SLSMM);
+	}
+}
+
+/*
+ * Forget the pages of a checkpoint that never made it to disk.
+ */
+void
+slsdedup_ckptclear(struct slsckpt_data *sckpt)
+{
+	struct slsdedup_cand *cand;
+	uint64_t hash;
+
+	KV_FOREACH_POP(sckpt->sckpt_dedup, hash, cand)
+	{
+		vrele(cand->dc_vp);
+		free(cand, M_SLSMM);
+	}
+
+	sckpt->sckpt_dedup_pages = 0;
+	sckpt->sckpt_dedup_hits = 0;
+}
+
+/*
+ * Empty the index.
+ */
+void
+slsdedup_flush(void)
+{
+	struct slsdedup_ent *ent;
+	uint64_t hash;
+
+	mtx_lock(&slsm.slsm_deduplk);
+	KV_FOREACH_POP(slsm.slsm_dedup, hash, ent)
+	free(ent, M_SLSMM);
+	mtx_unlock(&slsm.slsm_deduplk);
+}
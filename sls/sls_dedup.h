@@ -0,0 +1,34 @@
+#ifndef _SLS_DEDUP_H_
+#define _SLS_DEDUP_H_
+
+#include <sys/param.h>
+#include <sys/buf.h>
+#include <sys/vnode.h>
+
+struct slsckpt_data;
+
+/* A page stored in the SLOS, indexed by the hash of its contents. */
+struct slsdedup_ent {
+	uint64_t de_ino;    /* Inode of the record holding the page */
+	uint64_t de_lblkno; /* Logical block of the page in the record */
+	uint64_t de_blkno;  /* Physical block backing it when indexed */
+};
+
+/* A page written by a checkpoint, indexed once its IO is done. */
+struct slsdedup_cand {
+	struct vnode *dc_vp; /* Referenced vnode of the record */
+	uint64_t dc_lblkno;  /* Logical block of the page in the record */
+};
+
+int slsdedup_writebuf(struct vnode *vp, struct buf *bp,
+    struct slsckpt_data *sckpt, bool *hit);
+void slsdedup_ckptdone(struct slsckpt_data *sckpt);
+void slsdedup_ckptclear(struct slsckpt_data *sckpt);
+void slsdedup_flush(void);
+
+extern uint64_t sls_dedup_maxentries;
+extern uint64_t sls_dedup_pages;
+extern uint64_t sls_dedup_hits;
+extern uint64_t sls_dedup_stale;
+
+#endif /* _SLS_DEDUP_H_ */
@@ -1,9 +1,9 @@
 #include <sys/param.h>
-#include <sys/filio.h>
 #include <sys/ktr.h>
 #include <sys/lock.h>
 #include <sys/proc.h>
 #include <sys/rwlock.h>
+#include <sys/sbuf.h>
 #include <sys/taskqueue.h>
 
 #include <vm/vm.h>
@@ -38,29 +38,37 @@ sls_writedata_file_write(
 }
 
 static int
-sls_writedata_file_pages(int fd, vm_object_t obj)
+sls_writedata_file_pages(
+    int fd, vm_object_t obj, struct sbuf *runs, vm_pindex_t *endp)
 {
+	struct sls_filerun run = { 0, 0, 0 };
 	struct iovec aiov[MAXIO];
+	uint64_t nzero = 0;
 	vm_page_t ms[MAXIO];
 	vm_pindex_t pinit;
+	uint64_t flags;
 	int error = 0;
 	vm_page_t m;
 	size_t index;
 	off_t off;
+	int i;
 
 	VM_OBJECT_WLOCK(obj);
 	vm_object_pip_add(obj, 1);
 
 	index = 0;
-	for (m = vm_page_find_least(obj, 0), pinit = m->pindex; m != NULL;
+	for (m = vm_page_find_least(obj, 0); m != NULL;
 	     m = TAILQ_NEXT(m, listq)) {
-		if ((m->pindex != pinit + index) || (index == MAXIO)) {
+		if ((index > 0) &&
+		    ((m->pindex != pinit + index) || (index == MAXIO))) {
 			VM_OBJECT_WUNLOCK(obj);
 			error = sls_writedata_file_write(
 			    fd, aiov, index, off, ms);
 			VM_OBJECT_WLOCK(obj);
 
 			index = 0;
+			if (error != 0)
+				break;
 		}
 
 		KASSERT(m->object == obj,
@@ -70,6 +78,33 @@ sls_writedata_file_pages(int fd, vm_object_t obj)
 		KASSERT(pagesizes[m->psind] <= PAGE_SIZE,
 		    ("dumping page %p with size %ld", m, pagesizes[m->psind]));
 
+		flags = 0;
+		if (sls_zero_elim && slsvm_page_iszero(m))
+			flags = SLSFILERUN_ZERO;
+
+		/* Close the current run if the page does not extend it. */
+		if ((run.npages > 0) &&
+		    (m->pindex != run.pindex + run.npages ||
+			flags != run.flags)) {
+			if (sbuf_bcat(runs, &run, sizeof(run)) != 0) {
+				error = ENOMEM;
+				break;
+			}
+			run.npages = 0;
+		}
+
+		if (run.npages == 0) {
+			run.pindex = m->pindex;
+			run.flags = flags;
+		}
+		run.npages += 1;
+
+		/* Zero pages are only recorded in the runs. */
+		if (flags & SLSFILERUN_ZERO) {
+			nzero += 1;
+			continue;
+		}
+
 		if (index == 0) {
 			off = (m->pindex + SLOS_OBJOFF) * PAGE_SIZE;
 			pinit = m->pindex;
@@ -80,27 +115,73 @@ sls_writedata_file_pages(int fd, vm_object_t obj)
 		aiov[index].iov_len = PAGE_SIZE;
 		ms[index] = m;
 		index += 1;
-
-		if (error != 0)
-			break;
 	}
 
 	if (index > 0) {
 		VM_OBJECT_WUNLOCK(obj);
-		error = sls_writedata_file_write(fd, aiov, index, off, ms);
+		if (error == 0) {
+			error = sls_writedata_file_write(
+			    fd, aiov, index, off, ms);
+		} else {
+			for (i = 0; i < index; i++)
+				ms[i]->oflags &= ~VPO_SWAPINPROG;
+		}
 		VM_OBJECT_WLOCK(obj);
 	}
 
 	vm_object_pip_add(obj, -1);
 	VM_OBJECT_WUNLOCK(obj);
 
-	return (error);
+	atomic_add_64(&sls_zero_pages, nzero);
+	if (error != 0)
+		return (error);
+
+	*endp = run.pindex + run.npages;
+	if (run.npages == 0)
+		return (0);
+
+	if (sbuf_bcat(runs, &run, sizeof(run)) != 0)
+		return (ENOMEM);
+
+	return (0);
+}
+
+/* Write out the page runs of the object and the header pointing to them. */
+static int
+sls_writedata_file_runs(int fd, struct sbuf *runs, off_t hdroff,
+    vm_pindex_t end)
+{
+	struct sls_filehdr hdr;
+	off_t off;
+	int error;
+
+	error = sbuf_finish(runs);
+	if (error != 0)
+		return (error);
+
+	hdr.magic = SLSFILE_MAGIC;
+	hdr.version = SLSFILE_VERSION;
+	hdr.runoff = (end + SLOS_OBJOFF) * PAGE_SIZE;
+	hdr.nruns = sbuf_len(runs) / sizeof(struct sls_filerun);
+
+	if (hdr.nruns > 0) {
+		off = hdr.runoff;
+		error = slsio_fdwrite(
+		    fd, sbuf_data(runs), sbuf_len(runs), &off);
+		if (error != 0)
+			return (error);
+	}
+
+	off = hdroff;
+	return (slsio_fdwrite(fd, (char *)&hdr, sizeof(hdr), &off));
 }
 
 static int __attribute__((noinline))
 sls_writedata_file(int recfd, struct sls_record *rec)
 {
 	struct slsvmobject *vminfo;
+	vm_pindex_t end = 0;
+	struct sbuf *runs;
 	vm_object_t obj;
 	size_t off = 0;
 	int error;
@@ -110,18 +191,26 @@ sls_writedata_file(int recfd, struct sls_record *rec)
 	obj = (vm_object_t)vminfo->objptr;
 	vminfo->objptr = NULL;
 
+	KASSERT(sbuf_len(rec->srec_sb) == sizeof(*vminfo),
+	    ("unexpected object record size %ld", sbuf_len(rec->srec_sb)));
+
+	runs = sbuf_new_auto();
+
 	error = slsio_fdwrite(
 	    recfd, sbuf_data(rec->srec_sb), sbuf_len(rec->srec_sb), &off);
 	if (error != 0)
 		goto out;
 
-	if (obj == NULL || !OBJT_ISANONYMOUS(obj))
-		goto out;
+	if (obj != NULL && OBJT_ISANONYMOUS(obj)) {
+		KASSERT(obj->objid == rec->srec_id,
+		    ("object and record have different OIDs"));
 
-	KASSERT(obj->objid == rec->srec_id,
-	    ("object and record have different OIDs"));
+		error = sls_writedata_file_pages(recfd, obj, runs, &end);
+		if (error != 0)
+			goto out;
+	}
 
-	error = sls_writedata_file_pages(recfd, obj);
+	error = sls_writedata_file_runs(recfd, runs, sizeof(*vminfo), end);
 
 	/*
 	 * XXX We do not populate the prefault vector, because
@@ -129,6 +218,8 @@ sls_writedata_file(int recfd, struct sls_record *rec)
 	 */
 
 out:
+	sbuf_delete(runs);
+
 	/* Release the reference this function holds. */
 	vm_object_deallocate(obj);
 
@@ -304,90 +395,145 @@ sls_readdata_file_record(
 	return (0);
 }
 
+/* Read in the array of page runs of the object. */
 static int
-sls_readdata_file(int fd, vm_object_t obj)
+sls_readdata_file_runs(int fd, struct sls_filerun **runsp, size_t *nrunsp)
 {
-	struct thread *td = curthread;
-	off_t start, end;
-	vm_page_t m;
+	struct sls_filerun *runs;
+	struct sls_filehdr hdr;
+	size_t len;
 	off_t off;
 	int error;
 
-	struct stat sb;
-	error = kern_fstat(td, fd, &sb);
+	off = sizeof(struct slsvmobject);
+	error = slsio_fdread(fd, (char *)&hdr, sizeof(hdr), &off);
 	if (error != 0)
 		return (error);
 
-	start = SLOS_OBJOFF * PAGE_SIZE;
-	while (true) {
-		/* ENXIO denotes there is no more data till EOF. */
-		error = kern_ioctl(td, fd, FIOSEEKDATA, (caddr_t)&start);
-		if (error == ENXIO) {
-			error = 0;
-			break;
-		}
-		if (error != 0)
-			break;
+	if (hdr.magic != SLSFILE_MAGIC || hdr.version != SLSFILE_VERSION) {
+		DEBUG2("Data file has magic %x version %u", hdr.magic,
+		    hdr.version);
+		return (EINVAL);
+	}
 
-		end = start;
-		error = kern_ioctl(td, fd, FIOSEEKHOLE, (caddr_t)&end);
-		if (error != 0)
-			break;
+	*runsp = NULL;
+	*nrunsp = hdr.nruns;
+	if (hdr.nruns == 0)
+		return (0);
 
-		KASSERT(start % PAGE_SIZE == 0,
-		    ("unaligned read start %ld", start));
-		KASSERT(end % PAGE_SIZE == 0, ("unaligned read end %ld", end));
+	if (hdr.nruns > IOSIZE_MAX / sizeof(*runs))
+		return (EINVAL);
 
-		/* Roll start forward depending on the contiguity. */
-		for (; start < end; start += PAGE_SIZE) {
-			VM_OBJECT_WLOCK(obj);
-			vm_page_grab_pages(obj,
-			    (start / PAGE_SIZE) - SLOS_OBJOFF, VM_ALLOC_NORMAL,
-			    &m, 1);
+	len = hdr.nruns * sizeof(*runs);
+	runs = malloc(len, M_SLSMM, M_WAITOK);
 
-			m->valid = 0;
-			m->oflags |= VPO_SWAPINPROG;
+	off = hdr.runoff;
+	error = slsio_fdread(fd, (char *)runs, len, &off);
+	if (error != 0) {
+		free(runs, M_SLSMM);
+		return (error);
+	}
 
-			vm_object_pip_add(obj, 1);
-			VM_OBJECT_WUNLOCK(obj);
+	*runsp = runs;
 
-			off = start;
-			slsio_fdread(fd, (char *)PHYS_TO_DMAP(m->phys_addr),
-			    PAGE_SIZE, &off);
+	return (0);
+}
 
-			m->valid = VM_PAGE_BITS_ALL;
-			m->oflags &= ~VPO_SWAPINPROG;
-			vm_page_xunbusy(m);
+/* Read a batch of contiguous pages with a single vectored read. */
+static int
+sls_readdata_file_batch(int fd, vm_object_t obj, vm_pindex_t pindex, int count)
+{
+	struct iovec aiov[MAXIO];
+	vm_page_t ms[MAXIO];
+	off_t off;
+	int error;
+	int i;
 
-			VM_OBJECT_WLOCK(obj);
-			/*
-			 * The underlying FS might add zero blocks to the file
-			 * because of its allocation size. These zero pages
-			 * might interfere with execution in case the object is
-			 * shadowing a parent which actually backs the zeroed
-			 * out page with data. In that case the zeroed out page
-			 * prevents shadowing and probably leads to a crash.
-			 * Check if a page is zeroed out, assume that this is
-			 * due to the underlying file system, and remove it.
-			 *
-			 * XXX Actually not even that is correct, what if the
-			 * zeroes in the shadow are generated by the
-			 * application? This system of storing checkpoints is
-			 * imperfect in this regard.
-			 */
-			if (!memcmp((void *)PHYS_TO_DMAP(m->phys_addr),
-				zero_region, PAGE_SIZE)) {
-				vm_object_page_remove(
-				    obj, m->pindex, m->pindex + 1, 0);
-			}
+	KASSERT(count <= MAXIO, ("batch of %d pages too large", count));
+
+	VM_OBJECT_WLOCK(obj);
+	vm_page_grab_pages(obj, pindex, VM_ALLOC_NORMAL, ms, count);
+	for (i = 0; i < count; i++) {
+		ms[i]->valid = 0;
+		ms[i]->oflags |= VPO_SWAPINPROG;
+		aiov[i].iov_base = (char *)PHYS_TO_DMAP(ms[i]->phys_addr);
+		aiov[i].iov_len = PAGE_SIZE;
+	}
+
+	vm_object_pip_add(obj, 1);
+	VM_OBJECT_WUNLOCK(obj);
+
+	off = (pindex + SLOS_OBJOFF) * PAGE_SIZE;
+	error = slsio_fdreadv(fd, aiov, count, &off);
+
+	VM_OBJECT_WLOCK(obj);
+	for (i = 0; i < count; i++) {
+		if (error == 0)
+			ms[i]->valid = VM_PAGE_BITS_ALL;
+		ms[i]->oflags &= ~VPO_SWAPINPROG;
+		vm_page_xunbusy(ms[i]);
+	}
 
-			vm_object_pip_add(obj, -1);
+	/* Do not leave invalid pages in the object. */
+	if (error != 0)
+		vm_object_page_remove(obj, pindex, pindex + count, 0);
+
+	vm_object_pip_add(obj, -1);
+	VM_OBJECT_WUNLOCK(obj);
+
+	return (error);
+}
+
+/*
+ * Restores use the page runs recorded at checkpoint time to read only the
+ * pages we actually wrote, instead of probing the file for data. This also
+ * avoids confusing zero blocks added by the file system with zero pages of
+ * the application, which we record as zero runs.
+ */
+static int
+sls_readdata_file(int fd, vm_object_t obj)
+{
+	struct sls_filerun *runs;
+	vm_pindex_t pindex, end;
+	size_t nruns;
+	int error;
+	int count;
+	int i;
+
+	error = sls_readdata_file_runs(fd, &runs, &nruns);
+	if (error != 0)
+		return (error);
+
+	for (i = 0; i < nruns; i++) {
+		end = runs[i].pindex + runs[i].npages;
+		if (end > obj->size || end < runs[i].pindex ||
+		    (runs[i].flags & ~SLSFILERUN_ZERO) != 0) {
+			error = EINVAL;
+			break;
+		}
+
+		/* Zero runs have no data in the file. */
+		if (runs[i].flags & SLSFILERUN_ZERO) {
+			VM_OBJECT_WLOCK(obj);
+			slsvm_object_zerorun(obj, runs[i].pindex,
+			    runs[i].npages);
 			VM_OBJECT_WUNLOCK(obj);
+			continue;
+		}
+
+		for (pindex = runs[i].pindex; pindex < end; pindex += count) {
+			count = imin(MAXIO, end - pindex);
+			error = sls_readdata_file_batch(fd, obj, pindex, count);
+			if (error != 0)
+				break;
 		}
 
-		start = end;
+		if (error != 0)
+			break;
 	}
 
+	free(runs, M_SLSMM);
+
 	return (error);
 }
 
@@ -442,14 +588,32 @@ out:
 	return (error);
 }
 
+static void
+sls_read_file_task(void *ctx, int __unused pending)
+{
+	union slstable_taskctx *taskctx = (union slstable_taskctx *)ctx;
+	struct slstable_readctx *readctx = &taskctx->read;
+	int error;
+
+	error = sls_read_file_datarec(
+	    readctx->slsp, readctx->oid, readctx->rectable, readctx->objtable);
+	/* Keep the first error we come across. */
+	if (error != 0)
+		atomic_cmpset_int(readctx->error, 0, error);
+
+	uma_zfree(slstable_task_zone, taskctx);
+}
+
 static int
 sls_read_file_datarec_all(struct slspart *slsp, char **bufp, size_t *buflenp,
     struct slskv_table *rectable, struct slskv_table *objtable)
 {
 	size_t original_buflen, data_buflen, data_idlen;
+	union slstable_taskctx *taskctx;
+	struct slstable_readctx *readctx;
 	uint64_t *data_ids;
+	int error = 0;
 	char *buf;
-	int error;
 	int i;
 
 	original_buflen = *buflenp;
@@ -467,13 +631,24 @@ sls_read_file_datarec_all(struct slspart *slsp, char **bufp, size_t *buflenp,
 	KASSERT(data_buflen < original_buflen,
 	    ("VM data array larger than the buffer itself"));
 
+	/* Read in the objects in parallel. */
 	for (i = 0; i < data_idlen; i++) {
-		error = sls_read_file_datarec(
-		    slsp, data_ids[i], rectable, objtable);
-		if (error != 0)
-			return (error);
+		taskctx = uma_zalloc(slstable_task_zone, M_WAITOK);
+		readctx = &taskctx->read;
+		readctx->slsp = slsp;
+		readctx->oid = data_ids[i];
+		readctx->objtable = objtable;
+		readctx->rectable = rectable;
+		readctx->error = &error;
+		TASK_INIT(&readctx->tk, 0, &sls_read_file_task, &readctx->tk);
+		taskqueue_enqueue(slsm.slsm_tabletq, &readctx->tk);
 	}
 
+	taskqueue_drain_all(slsm.slsm_tabletq);
+
+	if (error != 0)
+		return (error);
+
 	*bufp = &buf[data_buflen];
 	*buflenp = original_buflen - data_buflen;
 
@@ -44,8 +44,14 @@ struct sls_metadata {
 	int slsm_swapobjs;     /* Number of Aurora swap objects */
 	int slsm_inprog;       /* Operations in progress */
 	struct taskqueue *slsm_tabletq; /* Write taskqueue */
+	struct taskqueue *slsm_ckpttq;	/* Pipelined checkpoint taskqueue */
+	struct taskqueue *slsm_metatq;	/* Metadata capture taskqueue */
+	struct taskqueue *slsm_collapsetq; /* Shadow collapse taskqueue */
+	struct taskqueue *slsm_repltq;	   /* Replication taskqueue */
 	LIST_HEAD(, proc) slsm_plist; /* List of processes in Aurora */
 	struct slskv_table *slsm_prefault; /* Prefault table */
+	struct slskv_table *slsm_dedup;	   /* Page hash index of the SLOS */
+	struct mtx slsm_deduplk;	   /* Protects the index entries */
 	LIST_HEAD(, sls_backend) slsm_backends;
 };
 
@@ -59,6 +65,9 @@ struct slsckpt_data {
 #define sckpt_target sckpt_attr.attr_target
 	struct sbuf *sckpt_meta;   /* Serialized metadata records */
 	struct sbuf *sckpt_dataid; /* Serialized data records */
+	struct slskv_table *sckpt_dedup; /* Written pages to deduplicate */
+	uint64_t sckpt_dedup_pages;	 /* Pages considered for dedup */
+	uint64_t sckpt_dedup_hits;	 /* Pages written as references */
 };
 
 /* An in-memory version of an Aurora record. */
@@ -85,6 +94,7 @@ struct slsrest_data {
 	struct slskv_table *sesstable; /* Holds the old-new session ID pairs */
 	struct slspart *slsp;	     /* The partition being restored */
 	sls_rest_cb cb;		       /* SLS restore callback */
+	sls_rest_cb readycb;	       /* Called when a process is restored */
 	void *cb_args;		       /* Callback arguments */
 
 	struct cv proccv;   /* Used for synchronization during restores */
@@ -155,9 +165,10 @@ void sls_checkpointd(struct sls_checkpointd_args *args);
 void sls_restored(struct sls_restored_args *args);
 
 int sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb sls_cb,
-    void *cb_arg);
+    sls_rest_cb readycb, void *cb_arg);
 
 extern struct sysctl_ctx_list aurora_ctx;
+extern struct sysctl_oid *sls_partoid;
 
 /* Statistics and configuration variables accessible through sysctl. */
 extern uint64_t sls_bytes_written_vfs;
@@ -167,6 +178,8 @@ extern uint64_t sls_bytes_read_direct;
 extern int sls_vfs_sync;
 extern int sls_drop_io;
 extern uint64_t sls_pages_grabbed;
+extern int sls_zero_elim;
+extern uint64_t sls_zero_pages;
 extern uint64_t sls_io_initiated;
 extern char *sls_basedir;
 extern uint64_t sls_prefault_anonios;
@@ -179,6 +192,21 @@ extern uint64_t sls_memsnap_done;
 extern uint64_t sls_ckpt_attempted;
 extern uint64_t sls_ckpt_done;
 extern uint64_t sls_ckpt_duration;
+extern u_int sls_pipeline_depth;
+extern uint64_t sls_pipeline_maxbytes;
+extern uint64_t sls_pipeline_stalls;
+extern u_int sls_meta_parallel;
+extern uint64_t sls_meta_parallel_runs;
+extern uint64_t sls_meta_saved_ns;
+extern uint64_t sls_ckpt_skipped;
+extern u_int sls_collapse_maxgens;
+extern u_int sls_collapse_batch;
+extern uint64_t sls_collapse_stalls;
+extern u_int sls_repl_depth;
+extern u_int sls_repl_acktimeout;
+extern uint64_t sls_repl_coalesced;
+extern uint64_t sls_repl_retries;
+extern uint64_t sls_repl_stalls;
 SDT_PROVIDER_DECLARE(sls);
 
 #define SLS_ASSERT_LOCKED() (mtx_assert(&slsm.slsm_mtx, MA_OWNED))
@@ -276,14 +304,43 @@ struct slstable_msnapctx {
 	int *error;
 };
 
+struct slstable_pipectx {
+	struct task tk;
+	struct slspart *slsp;
+	struct slsckpt_data *sckpt;
+	uint64_t nextepoch;
+	size_t bytes;
+};
+
+struct slstable_collapsectx {
+	struct task tk;
+	struct slspart *slsp;
+	struct slsckpt_data *oldsckpt; /* Retired checkpoint */
+	struct slsckpt_data *sckpt;    /* Checkpoint replacing it, if any */
+};
+
+/* A checkpoint waiting to be acknowledged by the remote. */
+struct slstable_replctx {
+	TAILQ_ENTRY(slstable_replctx) next;
+	struct slsckpt_data *sckpt;
+	uint64_t nextepoch;
+	size_t bytes;
+	bool prepared; /* Records ready to be sent */
+	int preperror; /* Error preparing the records */
+};
+
 union slstable_taskctx {
 	struct slstable_readctx read;
 	struct slstable_writectx write;
 	struct slstable_wfdctx wfd;
 	struct slstable_msnapctx msnap;
+	struct slstable_pipectx pipe;
+	struct slstable_collapsectx collapse;
+	struct slstable_replctx repl;
 };
 
 void slsckpt_compact(struct slspart *slsp, struct slsckpt_data *sckpt);
+void slsckpt_repltask(void *ctx, int pending);
 
 typedef bool (*sls_kill_cb)(struct proc *);
 int sls_kill(sls_kill_cb cb);
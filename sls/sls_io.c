@@ -59,14 +59,53 @@ slsio_fdread(int fd, char *buf, size_t len, off_t *offp)
 	return (error);
 }
 
+int
+slsio_fdreadv(int fd, struct iovec *aiov, size_t count, off_t *offp)
+{
+	struct thread *td = curthread;
+	struct uio auio;
+	size_t len = 0;
+	int error;
+	int i;
+
+	for (i = 0; i < count; i++)
+		len += aiov[i].iov_len;
+
+	if (len > IOSIZE_MAX)
+		return (EINVAL);
+
+	auio.uio_iov = aiov;
+	auio.uio_iovcnt = count;
+
+	auio.uio_resid = len;
+	auio.uio_segflg = UIO_SYSSPACE;
+
+	if (offp != NULL)
+		error = kern_preadv(td, fd, &auio, *offp);
+	else
+		error = kern_readv(td, fd, &auio);
+
+	if (error != 0)
+		return (error);
+
+	/* Data runs are recorded at checkpoint time, so we never hit EOF. */
+	if (td->td_retval[0] != len)
+		return (EIO);
+
+	return (0);
+}
+
 int
 slsio_fdwritev(int fd, struct iovec *aiov, size_t count, off_t *offp)
 {
-	/* XXX HACK. We normally compute uio_resid. */
-	size_t len = count * PAGE_SIZE;
 	struct thread *td = curthread;
 	struct uio auio;
+	size_t len = 0;
 	int error;
+	int i;
+
+	for (i = 0; i < count; i++)
+		len += aiov[i].iov_len;
 
 	if (len > IOSIZE_MAX)
 		return (EINVAL);
@@ -85,8 +124,13 @@ slsio_fdwritev(int fd, struct iovec *aiov, size_t count, off_t *offp)
 	if (error != 0)
 		return (error);
 
-	KASSERT(td->td_retval[0] == len,
-	    ("wrote %ld, expected %ld", td->td_retval[0], len));
+	/*
+	 * Sockets with a send timeout report partial writes as successful.
+	 * The rest of the stream would be out of sync, so fail the write.
+	 */
+	if (td->td_retval[0] != len)
+		return (EWOULDBLOCK);
+
 	return (0);
 }
 
@@ -117,8 +161,13 @@ slsio_fdwrite(int fd, char *buf, size_t len, off_t *offp)
 	if (error != 0)
 		return (error);
 
-	KASSERT(td->td_retval[0] == len,
-	    ("wrote %ld, expected %ld", td->td_retval[0], len));
+	/*
+	 * Sockets with a send timeout report partial writes as successful.
+	 * The rest of the stream would be out of sync, so fail the write.
+	 */
+	if (td->td_retval[0] != len)
+		return (EWOULDBLOCK);
+
 	return (0);
 }
 
@@ -192,21 +241,23 @@ slsio_open_sls(uint64_t oid, bool create, struct file **fpp)
 }
 
 static int
-slsio_doio(struct file *fp, void *buf, size_t len, enum uio_rw rw)
+slsio_doiov(struct file *fp, struct iovec *aiov, size_t count, enum uio_rw rw)
 {
 	struct thread *td = curthread;
 	size_t iosize = 0;
 	uint64_t back = 0;
-	struct iovec aiov;
 	struct uio auio;
 	int error = 0;
+	size_t len = 0;
+	int i;
 
 	ASSERT_VOP_LOCKED(vp, ("vnode %p is unlocked", vp));
 
-	aiov.iov_base = buf;
-	aiov.iov_len = len;
-	auio.uio_iov = &aiov;
-	auio.uio_iovcnt = 1;
+	for (i = 0; i < count; i++)
+		len += aiov[i].iov_len;
+
+	auio.uio_iov = aiov;
+	auio.uio_iovcnt = count;
 
 	auio.uio_offset = -1;
 	auio.uio_segflg = UIO_SYSSPACE;
@@ -247,12 +298,29 @@ out:
 	return (error);
 }
 
+static int
+slsio_doio(struct file *fp, void *buf, size_t len, enum uio_rw rw)
+{
+	struct iovec aiov;
+
+	aiov.iov_base = buf;
+	aiov.iov_len = len;
+
+	return (slsio_doiov(fp, &aiov, 1, rw));
+}
+
 int
 slsio_fpread(struct file *fp, void *buf, size_t size)
 {
 	return (slsio_doio(fp, buf, size, UIO_READ));
 }
 
+int
+slsio_fpreadv(struct file *fp, struct iovec *aiov, size_t count)
+{
+	return (slsio_doiov(fp, aiov, count, UIO_READ));
+}
+
 int
 slsio_fpwrite(struct file *fp, void *buf, size_t size)
 {
@@ -4,9 +4,11 @@
 int slsio_open_vfs(char *name, int *fdp);
 int slsio_open_sls(uint64_t oid, bool create, struct file **fpp);
 int slsio_fpread(struct file *fp, void *buf, size_t size);
+int slsio_fpreadv(struct file *fp, struct iovec *aiov, size_t count);
 int slsio_fpwrite(struct file *fp, void *buf, size_t size);
 int slsio_fdread(int fd, char *buf, size_t len, off_t *offp);
 int slsio_fdwrite(int fd, char *buf, size_t len, off_t *offp);
+int slsio_fdreadv(int fd, struct iovec *aiov, size_t count, off_t *offp);
 int slsio_fdwritev(int fd, struct iovec *aiov, size_t count, off_t *offp);
 int sls_write_rcvdone(struct slspart *slsp);
 
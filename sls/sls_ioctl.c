@@ -31,6 +31,7 @@
 
 #include "debug.h"
 #include "sls_backend.h"
+#include "sls_dedup.h"
 #include "sls_internal.h"
 #include "sls_io.h"
 #include "sls_kv.h"
@@ -50,11 +51,11 @@ SDT_PROVIDER_DEFINE(sls);
 /* Variables set using sysctls. */
 extern int sls_objprotect;
 extern int sls_tracebuf;
-extern int sls_only_flush_deltas;
 extern uint64_t sls_successful_restores;
 
 struct sls_metadata slsm;
 struct sysctl_ctx_list aurora_ctx;
+struct sysctl_oid *sls_partoid;
 
 static bool
 sls_kill_always(struct proc *p)
@@ -297,6 +298,17 @@ sls_partadd(struct sls_partadd_args *args)
 	if (target >= SLS_TARGETS)
 		return (EINVAL);
 
+	/* The adaptive period moves between the minimum and the period. */
+	if (SLSATTR_ISADAPTIVE(args->attr)) {
+		if (args->attr.attr_period_min <= 0 ||
+		    args->attr.attr_period < args->attr.attr_period_min ||
+		    args->attr.attr_stopbudget < 0)
+			return (EINVAL);
+	}
+
+	if (args->attr.attr_poolsize < 0)
+		return (EINVAL);
+
 	/* Check if the OID is in range. */
 	if (args->oid < SLS_OIDMIN || args->oid > SLS_OIDMAX)
 		return (EINVAL);
@@ -531,6 +543,9 @@ sls_sysctl_init(void)
 	root = SYSCTL_ADD_ROOT_NODE(&aurora_ctx, OID_AUTO, "aurora", CTLFLAG_RW,
 	    0, "Aurora statistics and configuration variables");
 
+	sls_partoid = SYSCTL_ADD_NODE(&aurora_ctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "partition", CTLFLAG_RD, 0, "Per-partition statistics");
+
 	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "bytes_written_vfs", CTLFLAG_RD, &sls_bytes_written_vfs, 0,
 	    "Bytes written using the VFS interface");
@@ -569,9 +584,72 @@ sls_sysctl_init(void)
 	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "ckpt_done", CTLFLAG_RW, &sls_ckpt_done, 0,
 	    "Checkpoints successfully done");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "ckpt_skipped", CTLFLAG_RD, &sls_ckpt_skipped, 0,
+	    "Adaptive checkpoints skipped because nothing was dirtied");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "collapse_maxgens", CTLFLAG_RW, &sls_collapse_maxgens, 0,
+	    "Maximum retired checkpoints waiting to be collapsed");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "collapse_batch", CTLFLAG_RW, &sls_collapse_batch, 0,
+	    "Objects collapsed per acquisition of the shadow lock");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "collapse_stalls", CTLFLAG_RD, &sls_collapse_stalls, 0,
+	    "Compactions throttled by pending collapses");
 	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "ckpt_duration", CTLFLAG_RW, &sls_ckpt_duration, 0,
 	    "Total run time of the checkpointer");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "pipeline_depth", CTLFLAG_RW, &sls_pipeline_depth, 0,
+	    "Maximum pipelined checkpoints in flight per partition");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "pipeline_maxbytes", CTLFLAG_RW, &sls_pipeline_maxbytes, 0,
+	    "Maximum memory held by in-flight pipelined checkpoints");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "pipeline_stalls", CTLFLAG_RD, &sls_pipeline_stalls, 0,
+	    "Checkpoints delayed waiting for the pipeline to drain");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "repl_depth", CTLFLAG_RW, &sls_repl_depth, 0,
+	    "Maximum checkpoints per partition waiting for the remote");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "repl_acktimeout", CTLFLAG_RW, &sls_repl_acktimeout, 0,
+	    "Seconds to wait for the remote to acknowledge a checkpoint");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "repl_coalesced", CTLFLAG_RD, &sls_repl_coalesced, 0,
+	    "Checkpoints sent to the remote as part of a later one");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "repl_retries", CTLFLAG_RD, &sls_repl_retries, 0,
+	    "Failed sends to the remote that were retried");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "repl_stalls", CTLFLAG_RD, &sls_repl_stalls, 0,
+	    "Checkpoints delayed waiting for the remote to catch up");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dedup_maxentries", CTLFLAG_RW, &sls_dedup_maxentries, 0,
+	    "Maximum pages in the dedup index");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dedup_pages", CTLFLAG_RD, &sls_dedup_pages, 0,
+	    "Pages checked for duplicates");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dedup_hits", CTLFLAG_RD, &sls_dedup_hits, 0,
+	    "Pages written as references to existing blocks");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "dedup_stale", CTLFLAG_RD, &sls_dedup_stale, 0,
+	    "Dedup index entries that did not match anymore");
+	(void)SYSCTL_ADD_INT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "zero_elim", CTLFLAG_RW, &sls_zero_elim, 1,
+	    "Store zero pages as zero runs instead of writing them out");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "zero_pages", CTLFLAG_RD, &sls_zero_pages, 0,
+	    "Zero pages checkpointed without writing them out");
+	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "meta_parallel", CTLFLAG_RW, &sls_meta_parallel, 0,
+	    "Minimum processes for capturing metadata in parallel, 0 disables");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "meta_parallel_runs", CTLFLAG_RD, &sls_meta_parallel_runs, 0,
+	    "Checkpoints that captured metadata in parallel");
+	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+	    "meta_saved_ns", CTLFLAG_RD, &sls_meta_saved_ns, 0,
+	    "Stop time saved by capturing metadata in parallel (ns)");
 	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "async_slos", CTLFLAG_RW, &sls_async_slos, 0,
 	    "Asynchronous SLOS writes");
@@ -581,9 +659,6 @@ sls_sysctl_init(void)
 	(void)SYSCTL_ADD_UINT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "tracebuf", CTLFLAG_RW, &sls_tracebuf, 1,
 	    "Use the pmap trace buffer when protecting pages");
-	(void)SYSCTL_ADD_INT(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
-	    "only_flush_deltas", CTLFLAG_RD, &sls_only_flush_deltas, 0,
-	    "Only flush delta checkponits, blackhole the full ones");
 	(void)SYSCTL_ADD_U64(&aurora_ctx, SYSCTL_CHILDREN(root), OID_AUTO,
 	    "prefault_anonpages", CTLFLAG_RD, &sls_prefault_anonpages, 0,
 	    "Pages prefaulted by the SLS");
@@ -611,6 +686,7 @@ sls_sysctl_fini(void)
 {
 	if (sysctl_ctx_free(&aurora_ctx))
 		printf("Failed to destroy sysctl\n");
+	sls_partoid = NULL;
 }
 
 static int
@@ -696,6 +772,9 @@ sls_partadd_default_osd(void)
 	partadd_args.attr.attr_mode = SLS_FULL;
 	partadd_args.attr.attr_target = SLS_OSD;
 	partadd_args.attr.attr_period = 0;
+	partadd_args.attr.attr_period_min = 0;
+	partadd_args.attr.attr_stopbudget = 0;
+	partadd_args.attr.attr_poolsize = 0;
 	partadd_args.attr.attr_flags = SLSATTR_IGNUNLINKED;
 	partadd_args.attr.attr_amplification = 1;
 	partadd_args.backendfd = -1;
@@ -720,6 +799,9 @@ sls_partadd_default_mem(void)
 	partadd_args.attr.attr_mode = SLS_FULL;
 	partadd_args.attr.attr_target = SLS_MEM;
 	partadd_args.attr.attr_period = 0;
+	partadd_args.attr.attr_period_min = 0;
+	partadd_args.attr.attr_stopbudget = 0;
+	partadd_args.attr.attr_poolsize = 0;
 	partadd_args.attr.attr_flags = SLSATTR_IGNUNLINKED;
 	partadd_args.attr.attr_amplification = 1;
 	partadd_args.backendfd = -1;
@@ -748,11 +830,13 @@ slsm_init_locking(void)
 {
 	mtx_init(&slsm.slsm_mtx, "slsm", NULL, MTX_DEF);
 	cv_init(&slsm.slsm_exitcv, "slsm");
+	mtx_init(&slsm.slsm_deduplk, "slsdedup", NULL, MTX_DEF);
 }
 
 static void
 slsm_fini_locking(void)
 {
+	mtx_destroy(&slsm.slsm_deduplk);
 	cv_destroy(&slsm.slsm_exitcv);
 	mtx_destroy(&slsm.slsm_mtx);
 }
@@ -774,6 +858,10 @@ slsm_init_contents(void)
 	if (error != 0)
 		return (error);
 
+	error = slskv_create(&slsm.slsm_dedup);
+	if (error != 0)
+		return (error);
+
 	return (0);
 }
 
@@ -790,6 +878,13 @@ slsm_fini_contents(void)
 		slskv_destroy(slsm.slsm_prefault);
 	}
 
+	/* Destroy the page hash index. */
+	if (slsm.slsm_dedup != NULL) {
+		slsdedup_flush();
+		slskv_destroy(slsm.slsm_dedup);
+		slsm.slsm_dedup = NULL;
+	}
+
 	/* Destroy partitions. */
 	if (slsm.slsm_parts != NULL) {
 		slskv_destroy(slsm.slsm_parts);
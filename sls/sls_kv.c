@@ -1,3 +1,4 @@
+#ifdef _KERNEL
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/lock.h>
@@ -6,9 +7,13 @@
 #include <sys/queue.h>
 #include <sys/sbuf.h>
 
+#include <machine/atomic.h>
+
 #include <vm/uma.h>
 
 #include "sls_internal.h"
+#endif /* _KERNEL */
+
 #include "sls_kv.h"
 
 /*
@@ -22,8 +27,34 @@
  * might thus return erroneous results. The same holds for a popall operation.
  */
 
-/* Hash function from keys to buckets. */
-#define SLSKV_BUCKETNO(table, key) (((u_long)key & table->mask))
+/*
+ * Hash function from keys to buckets. Keys are mostly kernel pointers and
+ * object IDs, whose low bits are either aligned or sequential, so mix all
+ * bits of the key before masking (the 64bit MurmurHash3 finalizer).
+ */
+static __inline u_long
+slskv_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return ((u_long)key);
+}
+
+#define SLSKV_BUCKETNO(table, hash) ((hash) & (table)->mask)
+#define SLSKV_OLDBUCKETNO(table, hash) ((hash) & (table)->oldmask)
+#define SLSKV_STRIPE(hash) ((hash) & (SLSKV_LOCKS - 1))
+#define SLSKV_LOCK(table, stripe) (mtx_lock_spin(&(table)->mtx[(stripe)]))
+#define SLSKV_UNLOCK(table, stripe) (mtx_unlock_spin(&(table)->mtx[(stripe)]))
+
+/* Old buckets migrated by each operation on a stripe. */
+#define SLSKV_REHASHSTEPS (2)
+/* Value of the rehash cursor of a stripe when it is not migrating. */
+#define SLSKV_REHASHDONE (~0UL)
+
 #define SLSKVPAIR_ZONEWARM (8192)
 #define SLSKV_ZONEWARM (256)
 
@@ -32,6 +63,22 @@ uma_zone_t slskv_zone = NULL;
 
 int slskv_count = 0;
 
+static void
+slskv_freebucket(struct slskv_pairs *bucket)
+{
+	struct slskv_pair *kv, *tmpkv;
+
+	LIST_FOREACH_SAFE (kv, bucket, next, tmpkv) {
+		/*
+		 * Remove all elements from each bucket and free them.
+		 * We are also responsible for freeing the values
+		 * themselves.
+		 */
+		LIST_REMOVE(kv, next);
+		uma_zfree(slskvpair_zone, kv);
+	}
+}
+
 static int
 slskv_zone_ctor(void *mem, int size, void *args __unused, int flags __unused)
 {
@@ -44,24 +91,38 @@ static void
 slskv_zone_dtor(void *mem, int size, void *args __unused)
 {
 	struct slskv_table *table;
-	struct slskv_pair *kv, *tmpkv;
-	int i;
+	u_long i;
 
 	table = (struct slskv_table *)mem;
 
 	/* Iterate all buckets. */
-	for (i = 0; i <= table->mask; i++) {
-		LIST_FOREACH_SAFE (kv, &table->buckets[i], next, tmpkv) {
-			/*
-			 * Remove all elements from each bucket and free them.
-			 * We are also responsible for freeing the values
-			 * themselves.
-			 */
-			LIST_REMOVE(kv, next);
-			uma_zfree(slskvpair_zone, kv);
-		}
+	for (i = 0; i <= table->mask; i++)
+		slskv_freebucket(&table->buckets[i]);
+
+	/* Free any pairs that were never migrated. */
+	if (table->oldbuckets != NULL) {
+		for (i = 0; i <= table->oldmask; i++)
+			slskv_freebucket(&table->oldbuckets[i]);
+		if (table->oldbuckets != table->initbuckets)
+			hashdestroy(table->oldbuckets, M_SLSMM, table->oldmask);
+		table->oldbuckets = NULL;
+	}
+
+	/* Cached tables go back to their original size. */
+	if (table->buckets != table->initbuckets) {
+		hashdestroy(table->buckets, M_SLSMM, table->mask);
+		table->buckets = table->initbuckets;
+		table->mask = table->initmask;
 	}
 
+	for (i = 0; i < SLSKV_LOCKS; i++)
+		table->rehash[i] = SLSKV_REHASHDONE;
+	table->oldmask = 0;
+	table->migrating = 0;
+	table->iters = 0;
+	table->count = 0;
+	table->pophint = 0;
+
 	atomic_add_int(&slskv_count, -1);
 }
 
@@ -78,9 +139,20 @@ slskv_zone_init(void *mem, int size, int flags __unused)
 	if (table->buckets == NULL)
 		return (ENOMEM);
 
+	table->initbuckets = table->buckets;
+	table->initmask = table->mask;
+	table->oldbuckets = NULL;
+	table->oldmask = 0;
+	table->migrating = 0;
+	table->iters = 0;
+	table->count = 0;
+	table->pophint = 0;
+
 	/* Initialize the mutexes. */
-	for (i = 0; i < SLSKV_BUCKETS; i++)
+	for (i = 0; i < SLSKV_LOCKS; i++) {
 		mtx_init(&table->mtx[i], "slskvmtx", NULL, MTX_SPIN);
+		table->rehash[i] = SLSKV_REHASHDONE;
+	}
 
 	table->data = NULL;
 
@@ -99,7 +171,7 @@ slskv_zone_fini(void *mem, int size)
 	hashdestroy(table->buckets, M_SLSMM, table->mask);
 
 	/* Destroy the lock. */
-	for (i = 0; i < SLSKV_BUCKETS; i++)
+	for (i = 0; i < SLSKV_LOCKS; i++)
 		mtx_destroy(&table->mtx[i]);
 }
 
@@ -159,14 +231,165 @@ slskv_destroy(struct slskv_table *table)
 	uma_zfree(slskv_zone, table);
 }
 
+/*
+ * Move a few of the stripe's pairs from the old buckets to the new ones. The
+ * old buckets of a stripe are migrated in increasing order, so any old bucket
+ * below the stripe's cursor is empty. If this call finishes the migration of
+ * the last stripe, return the old buckets so that the caller frees them after
+ * dropping the lock.
+ */
+static struct slskv_pairs *
+slskv_migrate_locked(
+    struct slskv_table *table, u_long stripe, u_long steps, u_long *oldmaskp)
+{
+	struct slskv_pairs *oldbucket, *oldbuckets;
+	struct slskv_pair *kv;
+	u_long hash;
+
+	mtx_assert(&table->mtx[stripe], MA_OWNED);
+	*oldmaskp = 0;
+
+	/* The stripe is not migrating. */
+	if (table->rehash[stripe] > table->oldmask)
+		return (NULL);
+
+	for (; steps > 0 && table->rehash[stripe] <= table->oldmask; steps--) {
+		oldbucket = &table->oldbuckets[table->rehash[stripe]];
+		while ((kv = LIST_FIRST(oldbucket)) != NULL) {
+			LIST_REMOVE(kv, next);
+			hash = slskv_hash(kv->key);
+			LIST_INSERT_HEAD(
+			    &table->buckets[SLSKV_BUCKETNO(table, hash)], kv,
+			    next);
+		}
+
+		table->rehash[stripe] += SLSKV_LOCKS;
+	}
+
+	if (table->rehash[stripe] <= table->oldmask)
+		return (NULL);
+
+	/* Done with this stripe, check if it was the last one. */
+	table->rehash[stripe] = SLSKV_REHASHDONE;
+	if (atomic_fetchadd_int(&table->migrating, -1) != 1)
+		return (NULL);
+
+	/* The table may grow again as soon as we clear the old buckets. */
+	oldbuckets = table->oldbuckets;
+	*oldmaskp = table->oldmask;
+	atomic_store_rel_ptr((volatile uintptr_t *)&table->oldbuckets, 0);
+
+	return (oldbuckets);
+}
+
+/*
+ * Free the old buckets once all stripes have been migrated. The initial
+ * buckets stay around, so that the table can shrink back to them when it is
+ * returned to the zone.
+ */
+static void
+slskv_migrate_done(
+    struct slskv_table *table, struct slskv_pairs *oldbuckets, u_long oldmask)
+{
+	if (oldbuckets == NULL || oldbuckets == table->initbuckets)
+		return;
+
+	hashdestroy(oldbuckets, M_SLSMM, oldmask);
+}
+
+/* Finish migrating the whole table. */
+static void
+slskv_rehash_all(struct slskv_table *table)
+{
+	struct slskv_pairs *oldbuckets;
+	u_long oldmask, stripe;
+
+	if (atomic_load_acq_int(&table->migrating) == 0)
+		return;
+
+	for (stripe = 0; stripe < SLSKV_LOCKS; stripe++) {
+		SLSKV_LOCK(table, stripe);
+		oldbuckets = slskv_migrate_locked(
+		    table, stripe, SLSKV_REHASHDONE, &oldmask);
+		SLSKV_UNLOCK(table, stripe);
+
+		slskv_migrate_done(table, oldbuckets, oldmask);
+	}
+}
+
+/*
+ * Double the number of buckets. Only swap in the new buckets here; the pairs
+ * move over gradually as each stripe is accessed.
+ */
+static void
+slskv_grow(struct slskv_table *table)
+{
+	struct slskv_pairs *buckets;
+	u_long mask, stripe;
+
+	buckets = hashinit_flags(
+	    2 * (table->mask + 1), M_SLSMM, &mask, HASH_NOWAIT);
+	if (buckets == NULL)
+		return;
+
+	for (stripe = 0; stripe < SLSKV_LOCKS; stripe++)
+		mtx_lock_spin_flags(&table->mtx[stripe], MTX_DUPOK);
+
+	/* Someone else might have already started growing the table. */
+	if (table->migrating != 0 || table->oldbuckets != NULL ||
+	    table->iters != 0 || mask <= table->mask) {
+		for (stripe = 0; stripe < SLSKV_LOCKS; stripe++)
+			SLSKV_UNLOCK(table, stripe);
+		hashdestroy(buckets, M_SLSMM, mask);
+		return;
+	}
+
+	table->oldbuckets = table->buckets;
+	table->oldmask = table->mask;
+	table->buckets = buckets;
+	table->mask = mask;
+	for (stripe = 0; stripe < SLSKV_LOCKS; stripe++)
+		table->rehash[stripe] = stripe;
+	table->migrating = SLSKV_LOCKS;
+
+	for (stripe = 0; stripe < SLSKV_LOCKS; stripe++)
+		SLSKV_UNLOCK(table, stripe);
+}
+
+static __inline bool
+slskv_overloaded(struct slskv_table *table, u_long count)
+{
+	return (count > SLSKV_LOADFACTOR * (table->mask + 1) &&
+	    atomic_load_acq_int(&table->migrating) == 0 &&
+	    atomic_load_acq_int(&table->iters) == 0);
+}
+
+/* Get the bucket that currently holds a key. */
+static struct slskv_pairs *
+slskv_bucket_locked(struct slskv_table *table, u_long hash)
+{
+	u_long stripe = SLSKV_STRIPE(hash);
+	u_long oldbucket;
+
+	/* Old buckets behind the cursor have already been migrated. */
+	if (table->rehash[stripe] <= table->oldmask) {
+		oldbucket = SLSKV_OLDBUCKETNO(table, hash);
+		if (oldbucket >= table->rehash[stripe])
+			return (&table->oldbuckets[oldbucket]);
+	}
+
+	return (&table->buckets[SLSKV_BUCKETNO(table, hash)]);
+}
+
 /* Find a value corresponding to a 64bit key. */
 static int
-slskv_find_unlocked(struct slskv_table *table, uint64_t key, uintptr_t *value)
+slskv_find_unlocked(
+    struct slskv_table *table, uint64_t key, u_long hash, uintptr_t *value)
 {
 	struct slskv_pair *kv;
 
 	/* Traverse the bucket for the specific key. */
-	LIST_FOREACH (kv, &table->buckets[SLSKV_BUCKETNO(table, key)], next) {
+	LIST_FOREACH (kv, slskv_bucket_locked(table, hash), next) {
 		if (kv->key == key) {
 			*value = kv->value;
 			return (0);
@@ -180,24 +403,31 @@ slskv_find_unlocked(struct slskv_table *table, uint64_t key, uintptr_t *value)
 int
 slskv_find(struct slskv_table *table, uint64_t key, uintptr_t *value)
 {
+	struct slskv_pairs *oldbuckets;
+	u_long hash = slskv_hash(key);
+	u_long oldmask;
 	int error;
 
-	mtx_lock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
-	error = slskv_find_unlocked(table, key, value);
-	mtx_unlock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
+	SLSKV_LOCK(table, SLSKV_STRIPE(hash));
+	oldbuckets = slskv_migrate_locked(
+	    table, SLSKV_STRIPE(hash), SLSKV_REHASHSTEPS, &oldmask);
+	error = slskv_find_unlocked(table, key, hash, value);
+	SLSKV_UNLOCK(table, SLSKV_STRIPE(hash));
+
+	slskv_migrate_done(table, oldbuckets, oldmask);
 
 	return (error);
 }
 
 static int
-slskv_add_unlocked(struct slskv_table *table, struct slskv_pair *newkv)
+slskv_add_unlocked(
+    struct slskv_table *table, u_long hash, struct slskv_pair *newkv)
 {
 	struct slskv_pairs *bucket;
 	struct slskv_pair *kv;
 
 	/* Get the bucket for the key. */
-
-	bucket = &table->buckets[SLSKV_BUCKETNO(table, newkv->key)];
+	bucket = slskv_bucket_locked(table, hash);
 
 	/* Try to find existing instances of the key. */
 	LIST_FOREACH (kv, bucket, next) {
@@ -216,7 +446,10 @@ slskv_add_unlocked(struct slskv_table *table, struct slskv_pair *newkv)
 int
 slskv_add(struct slskv_table *table, uint64_t key, uintptr_t value)
 {
+	struct slskv_pairs *oldbuckets;
 	struct slskv_pair *newkv;
+	u_long hash = slskv_hash(key);
+	u_long count, oldmask;
 	int error;
 
 	newkv = uma_zalloc(slskvpair_zone, M_NOWAIT);
@@ -226,24 +459,34 @@ slskv_add(struct slskv_table *table, uint64_t key, uintptr_t value)
 	newkv->key = key;
 	newkv->value = value;
 
-	mtx_lock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
-	error = slskv_add_unlocked(table, newkv);
-	mtx_unlock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
+	SLSKV_LOCK(table, SLSKV_STRIPE(hash));
+	oldbuckets = slskv_migrate_locked(
+	    table, SLSKV_STRIPE(hash), SLSKV_REHASHSTEPS, &oldmask);
+	error = slskv_add_unlocked(table, hash, newkv);
+	SLSKV_UNLOCK(table, SLSKV_STRIPE(hash));
+
+	slskv_migrate_done(table, oldbuckets, oldmask);
 
-	if (error != 0)
+	if (error != 0) {
 		uma_zfree(slskvpair_zone, newkv);
+		return (error);
+	}
 
-	return (error);
+	count = atomic_fetchadd_long(&table->count, 1) + 1;
+	if (slskv_overloaded(table, count))
+		slskv_grow(table);
+
+	return (0);
 }
 
 static struct slskv_pair *
-slskv_del_unlocked(struct slskv_table *table, uint64_t key)
+slskv_del_unlocked(struct slskv_table *table, uint64_t key, u_long hash)
 {
 	struct slskv_pairs *bucket;
 	struct slskv_pair *kv, *tmpkv;
 
 	/* Get the bucket for the key and traverse it. */
-	bucket = &table->buckets[SLSKV_BUCKETNO(table, key)];
+	bucket = slskv_bucket_locked(table, hash);
 
 	LIST_FOREACH_SAFE (kv, bucket, next, tmpkv) {
 		/*
@@ -265,36 +508,44 @@ slskv_del_unlocked(struct slskv_table *table, uint64_t key)
 void
 slskv_del(struct slskv_table *table, uint64_t key)
 {
+	struct slskv_pairs *oldbuckets;
 	struct slskv_pair *kv;
+	u_long hash = slskv_hash(key);
+	u_long oldmask;
 
-	mtx_lock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
-	kv = slskv_del_unlocked(table, key);
-	mtx_unlock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
+	SLSKV_LOCK(table, SLSKV_STRIPE(hash));
+	oldbuckets = slskv_migrate_locked(
+	    table, SLSKV_STRIPE(hash), SLSKV_REHASHSTEPS, &oldmask);
+	kv = slskv_del_unlocked(table, key, hash);
+	SLSKV_UNLOCK(table, SLSKV_STRIPE(hash));
 
+	slskv_migrate_done(table, oldbuckets, oldmask);
+
+	if (kv == NULL)
+		return;
+
+	atomic_subtract_long(&table->count, 1);
 	uma_zfree(slskvpair_zone, kv);
 }
 
 static struct slskv_pair *
-slskv_pop_unlocked(struct slskv_table *table, uint64_t *key, uintptr_t *value)
+slskv_pop_unlocked(
+    struct slskv_table *table, u_long i, uint64_t *key, uintptr_t *value)
 {
 	struct slskv_pairs *bucket;
 	struct slskv_pair *kv;
-	int i;
 
-	for (i = 0; i <= table->mask; i++) {
-		bucket = &table->buckets[i];
-		if (!LIST_EMPTY(bucket)) {
-			kv = LIST_FIRST(bucket);
+	bucket = &table->buckets[i];
+	if (LIST_EMPTY(bucket))
+		return (NULL);
 
-			*key = kv->key;
-			*value = kv->value;
+	kv = LIST_FIRST(bucket);
 
-			LIST_REMOVE(kv, next);
-			return (kv);
-		}
-	}
+	*key = kv->key;
+	*value = kv->value;
 
-	return (NULL);
+	LIST_REMOVE(kv, next);
+	return (kv);
 }
 
 /*
@@ -304,18 +555,36 @@ slskv_pop_unlocked(struct slskv_table *table, uint64_t *key, uintptr_t *value)
 int
 slskv_pop(struct slskv_table *table, uint64_t *key, uintptr_t *value)
 {
-	struct slskv_pair *kv;
+	struct slskv_pair *kv = NULL;
+	u_long i, start, stripe;
 
-	mtx_lock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
-	kv = slskv_pop_unlocked(table, key, value);
-	mtx_unlock_spin(&table->mtx[SLSKV_BUCKETNO(table, key)]);
+	/* Popping only looks at the current buckets. */
+	slskv_rehash_all(table);
 
-	if (kv != NULL) {
-		uma_zfree(slskvpair_zone, kv);
-		return (0);
+	/*
+	 * Tables are usually drained by popping repeatedly, so start from
+	 * the last bucket we found a pair in instead of the first one.
+	 */
+	start = table->pophint & table->mask;
+	for (i = 0; i <= table->mask; i++) {
+		stripe = SLSKV_STRIPE((start + i) & table->mask);
+		SLSKV_LOCK(table, stripe);
+		kv = slskv_pop_unlocked(
+		    table, (start + i) & table->mask, key, value);
+		SLSKV_UNLOCK(table, stripe);
+
+		if (kv != NULL)
+			break;
 	}
 
-	return (EINVAL);
+	if (kv == NULL)
+		return (EINVAL);
+
+	table->pophint = (start + i) & table->mask;
+	atomic_subtract_long(&table->count, 1);
+	uma_zfree(slskvpair_zone, kv);
+
+	return (0);
 }
 
 /*
@@ -359,6 +628,16 @@ slskv_iterstart(struct slskv_table *table)
 
 	KASSERT(table != NULL, ("iterating on NULL table\n"));
 
+	/*
+	 * Keep the table from growing, and only iterate the new buckets. A
+	 * concurrent slskv_grow() holds all stripe locks while swapping the
+	 * buckets, so wait it out before finishing the migration.
+	 */
+	atomic_add_int(&table->iters, 1);
+	SLSKV_LOCK(table, 0);
+	SLSKV_UNLOCK(table, 0);
+	slskv_rehash_all(table);
+
 	iter.table = table;
 	iter.bucket = 0;
 	iter.pair = NULL;
@@ -373,6 +652,9 @@ slskv_iterstart(struct slskv_table *table)
 int
 slskv_itercont(struct slskv_iter *iter, uint64_t *key, uintptr_t *value)
 {
+	if (iter->table == NULL)
+		return (SLSKV_ITERDONE);
+
 	if (iter->pair == NULL) {
 
 		/* We need to find the another bucket. */
@@ -381,7 +663,8 @@ slskv_itercont(struct slskv_iter *iter, uint64_t *key, uintptr_t *value)
 		/* If we have no more buckets to look at, iteration is done. */
 		if (iter->pair == NULL) {
 			KASSERT(iter->bucket > iter->table->mask,
-			    ("stopped iteration on bucket %d", iter->bucket));
+			    ("stopped iteration on bucket %lu", iter->bucket));
+			slskv_iterabort(iter);
 			return (SLSKV_ITERDONE);
 		}
 	}
@@ -396,10 +679,13 @@ slskv_itercont(struct slskv_iter *iter, uint64_t *key, uintptr_t *value)
 	return (0);
 }
 
-/* Abort the iteration. Needed to release the lock. */
+/* Abort the iteration. Needed to let the table grow again. */
 void
 slskv_iterabort(struct slskv_iter *iter)
 {
+	if (iter->table != NULL)
+		atomic_subtract_int(&iter->table->iters, 1);
+
 	bzero(iter, sizeof(*iter));
 }
 
@@ -1,6 +1,7 @@
 #ifndef _SLSKV_H_
 #define _SLSKV_H_
 
+#ifdef _KERNEL
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/lock.h>
@@ -12,9 +13,17 @@
 #include <vm/uma.h>
 
 #include <machine/param.h>
+#else
+/* Userspace builds provide their own locking and allocation primitives. */
+#include <slskv_compat.h>
+#endif /* _KERNEL */
 
-/* The number of buckets created. */
+/* The number of buckets a table starts with. */
 #define SLSKV_BUCKETS (16)
+/* The number of lock stripes, must divide the number of buckets. */
+#define SLSKV_LOCKS (16)
+/* Average chain length above which the table grows. */
+#define SLSKV_LOADFACTOR (2)
 
 /*
  * Generic hashtable data structure. Built on top
@@ -29,13 +38,27 @@ struct slskv_pair {
 
 LIST_HEAD(slskv_pairs, slskv_pair); /* A bucket of the hashtable */
 
-/* The main key-value table. */
+/*
+ * The main key-value table. Buckets are protected by a fixed set of striped
+ * locks; bucket i is covered by lock (i % SLSKV_LOCKS). Since the number of
+ * buckets is always a multiple of the number of locks, a key maps to the same
+ * lock before and after the table grows, so each stripe can move its own pairs
+ * to the new buckets incrementally without stopping the rest of the table.
+ */
 struct slskv_table {
-	struct mtx_padalign mtx[SLSKV_BUCKETS]; /* Per-bucket locking */
+	struct mtx_padalign mtx[SLSKV_LOCKS]; /* Per-stripe locking */
 	struct slskv_pairs *buckets; /* The buckets of key-value pairs */
-	/* Read-only elements of the struct */
-	u_long mask; /* Hashmask used by the builtin hashtable */
-	void *data;  /* Private data */
+	u_long mask;		     /* Hashmask used by the builtin hashtable */
+	struct slskv_pairs *oldbuckets; /* Buckets being migrated from */
+	u_long oldmask;			/* Hashmask of the old buckets */
+	u_long rehash[SLSKV_LOCKS];	/* Next old bucket to migrate */
+	int migrating;			/* Stripes still being migrated */
+	int iters;			/* Iterations in progress */
+	u_long count;			/* Number of pairs in the table */
+	u_long pophint;			/* Bucket to start popping from */
+	struct slskv_pairs *initbuckets; /* The initial, smallest buckets */
+	u_long initmask;		 /* Hashmask of the initial buckets */
+	void *data;			 /* Private data */
 };
 
 int slskv_create(struct slskv_table **tablep);
@@ -71,9 +94,10 @@ void slskv_fini(void);
 /*
  * Iterator used for dumping the contents of a key-value table.
  * This data structure should be opaque to the users of the table.
+ * The table does not grow while iterators are active.
  */
 struct slskv_iter {
-	int bucket;		   /* The bucket currently being dumped */
+	u_long bucket;		   /* The bucket currently being dumped */
 	struct slskv_pair *pair;   /* The KV pair currently being returned */
 	struct slskv_table *table; /* The table being currently returned */
 };
@@ -280,6 +280,47 @@ sls_pager_writebuf(
 	return (bp);
 }
 
+/*
+ * Drop the pages of a write buffer from the given index onwards, undoing the
+ * setup for them. Frees the buffer and returns NULL if no pages are left.
+ */
+struct buf *
+sls_pager_trimbuf(struct buf *bp, int npages)
+{
+	vm_object_t obj;
+	vm_page_t m;
+	int i;
+
+	KASSERT(npages <= bp->b_npages,
+	    ("trimming buffer of %d pages to %d", bp->b_npages, npages));
+	if (npages == bp->b_npages)
+		return (bp);
+
+	obj = bp->b_pages[0]->object;
+	VM_OBJECT_WLOCK(obj);
+	for (i = npages; i < bp->b_npages; i++) {
+		m = bp->b_pages[i];
+		m->oflags &= ~VPO_SWAPINPROG;
+		if (m->oflags & VPO_SWAPSLEEP) {
+			m->oflags &= ~VPO_SWAPSLEEP;
+			wakeup(&obj->paging_in_progress);
+		}
+	}
+	vm_object_pip_wakeupn(obj, bp->b_npages - npages);
+	VM_OBJECT_WUNLOCK(obj);
+
+	bp->b_npages = npages;
+	bp->b_resid = npages * PAGE_SIZE;
+	bp->b_bcount = bp->b_bufsize = bp->b_resid;
+	if (npages > 0)
+		return (bp);
+
+	bp->b_aurobj = NULL;
+	relpbuf(bp, &slos_pbufcnt);
+
+	return (NULL);
+}
+
 /*
  * Turn an Aurora object into a swap object. To be called both from the swapping
  * code and the Aurora shadowing code.
@@ -9,6 +9,7 @@ struct buf *sls_pager_readbuf(
     vm_object_t obj, vm_pindex_t pindex, size_t npages, bool *retry);
 struct buf *sls_pager_writebuf(
     vm_object_t obj, vm_pindex_t pindex, size_t targetsize, bool *retry);
+struct buf *sls_pager_trimbuf(struct buf *bp, int npages);
 
 void sls_pager_unregister(void);
 void sls_pager_swapoff(void);
@@ -13,8 +13,10 @@
 #include <sys/refcount.h>
 #include <sys/rwlock.h>
 #include <sys/shm.h>
+#include <sys/sx.h>
 #include <sys/signalvar.h>
 #include <sys/syscallsubr.h>
+#include <sys/sysctl.h>
 #include <sys/time.h>
 
 #include <vm/vm.h>
@@ -33,6 +35,7 @@
 #include "debug.h"
 #include "sls_backend.h"
 #include "sls_data.h"
+#include "sls_dedup.h"
 #include "sls_internal.h"
 #include "sls_partition.h"
 #include "sls_prefault.h"
@@ -61,6 +64,10 @@ slsckpt_init(struct slsckpt_data *sckpt)
 	if (error != 0)
 		goto error;
 
+	error = slskv_create(&sckpt->sckpt_dedup);
+	if (error != 0)
+		goto error;
+
 	sckpt->sckpt_meta = sbuf_new_auto();
 	if (sckpt->sckpt_meta == NULL)
 		goto error;
@@ -82,6 +89,7 @@ error:
 		sbuf_delete(sckpt->sckpt_meta);
 
 	if (sckpt != NULL) {
+		slskv_destroy(sckpt->sckpt_dedup);
 		slskv_destroy(sckpt->sckpt_vntable);
 		slskv_destroy(sckpt->sckpt_shadowtable);
 		slskv_destroy(sckpt->sckpt_rectable);
@@ -98,8 +106,10 @@ slsckpt_fini(struct slsckpt_data *sckpt)
 
 	sbuf_delete(sckpt->sckpt_dataid);
 	sbuf_delete(sckpt->sckpt_meta);
+	slskv_destroy(sckpt->sckpt_dedup);
 	slsset_destroy(sckpt->sckpt_vntable);
-	slskv_destroy(sckpt->sckpt_shadowtable);
+	if (sckpt->sckpt_shadowtable != NULL)
+		slskv_destroy(sckpt->sckpt_shadowtable);
 	slskv_destroy(sckpt->sckpt_rectable);
 	free(sckpt, M_SLSMM);
 }
@@ -113,9 +123,11 @@ slsckpt_clear(struct slsckpt_data *sckpt)
 	uint64_t slsid;
 
 	/* Collapse all objects now being backed. */
-	KV_FOREACH_POP(sckpt->sckpt_shadowtable, obj, shadow)
-	{
-		vm_object_deallocate(obj);
+	if (sckpt->sckpt_shadowtable != NULL) {
+		KV_FOREACH_POP(sckpt->sckpt_shadowtable, obj, shadow)
+		{
+			vm_object_deallocate(obj);
+		}
 	}
 
 	/* Release all held vnodes. */
@@ -129,6 +141,8 @@ slsckpt_clear(struct slsckpt_data *sckpt)
 	KV_FOREACH_POP(sckpt->sckpt_rectable, slsid, rec)
 	sls_record_destroy(rec);
 
+	slsdedup_ckptclear(sckpt);
+
 	sbuf_clear(sckpt->sckpt_dataid);
 	sbuf_clear(sckpt->sckpt_meta);
 }
@@ -158,6 +172,151 @@ slsckpt_alloc(struct slspart *slsp, struct slsckpt_data **sckptp)
 	return (0);
 }
 
+/*
+ * Create a shard of a checkpoint, into which the metadata of a single process
+ * is captured in parallel with the others. Shadowing changes the objects
+ * themselves, so shards use the shadow table of the checkpoint.
+ */
+int
+slsckpt_shard_alloc(struct slsckpt_data *sckpt, struct slsckpt_data **shardp)
+{
+	struct slsckpt_data *shard;
+	int error;
+
+	shard = malloc(sizeof(*shard), M_SLSMM, M_WAITOK | M_ZERO);
+	error = slsckpt_init(shard);
+	if (error != 0) {
+		free(shard, M_SLSMM);
+		return (error);
+	}
+
+	slskv_destroy(shard->sckpt_shadowtable);
+	shard->sckpt_shadowtable = sckpt->sckpt_shadowtable;
+	memcpy(&shard->sckpt_attr, &sckpt->sckpt_attr, sizeof(shard->sckpt_attr));
+	*shardp = shard;
+
+	return (0);
+}
+
+void
+slsckpt_shard_free(struct slsckpt_data *shard)
+{
+	KASSERT(shard->sckpt_refcount == 1, ("shard is shared"));
+
+	/* The shadow table belongs to the checkpoint. */
+	shard->sckpt_shadowtable = NULL;
+	slsckpt_drop(shard);
+}
+
+/*
+ * Move a record from the shard into the checkpoint. Records of resources
+ * shared between processes are captured by multiple shards; the checkpoint
+ * keeps the copy that was merged first.
+ */
+static int
+slsckpt_shard_moverec(
+    struct slsckpt_data *sckpt, struct slsckpt_data *shard, uint64_t slsid)
+{
+	struct sls_record *rec;
+	uintptr_t existing;
+	int error;
+
+	error = slskv_find(shard->sckpt_rectable, slsid, (uintptr_t *)&rec);
+	if (error != 0)
+		return (error);
+
+	slskv_del(shard->sckpt_rectable, slsid);
+
+	if (slskv_find(sckpt->sckpt_rectable, slsid, &existing) == 0) {
+		sls_record_destroy(rec);
+		return (EEXIST);
+	}
+
+	error = slskv_add(sckpt->sckpt_rectable, slsid, (uintptr_t)rec);
+	if (error != 0) {
+		sls_record_destroy(rec);
+		return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Merge a shard into the checkpoint. The records are appended in the order the
+ * shard created them, so merging the shards in a fixed order always results in
+ * the same checkpoint.
+ */
+int
+slsckpt_shard_merge(struct slsckpt_data *sckpt, struct slsckpt_data *shard)
+{
+	struct sls_record *rec;
+	uint64_t *slsids;
+	struct vnode *vp;
+	char *meta, *end;
+	size_t reclen;
+	size_t len;
+	size_t i;
+	int error;
+
+	error = sbuf_finish(shard->sckpt_meta);
+	if (error != 0)
+		return (error);
+
+	error = sbuf_finish(shard->sckpt_dataid);
+	if (error != 0)
+		return (error);
+
+	/* Each metadata record is serialized as the record, length, and data. */
+	meta = sbuf_data(shard->sckpt_meta);
+	end = meta + sbuf_len(shard->sckpt_meta);
+	for (; meta < end; meta += reclen) {
+		rec = (struct sls_record *)meta;
+		memcpy(&len, meta + sizeof(*rec), sizeof(len));
+		reclen = sizeof(*rec) + sizeof(len) + len;
+
+		error = slsckpt_shard_moverec(sckpt, shard, rec->srec_id);
+		if (error == EEXIST)
+			continue;
+		if (error != 0)
+			return (error);
+
+		error = sbuf_bcat(sckpt->sckpt_meta, meta, reclen);
+		if (error != 0)
+			return (error);
+	}
+
+	slsids = (uint64_t *)sbuf_data(shard->sckpt_dataid);
+	for (i = 0; i < sbuf_len(shard->sckpt_dataid) / sizeof(*slsids); i++) {
+		error = slsckpt_shard_moverec(sckpt, shard, slsids[i]);
+		if (error == EEXIST)
+			continue;
+		if (error != 0)
+			return (error);
+
+		error = sbuf_bcat(
+		    sckpt->sckpt_dataid, &slsids[i], sizeof(slsids[i]));
+		if (error != 0)
+			return (error);
+	}
+
+	/* Hand over the vnode references. */
+	KVSET_FOREACH_POP(shard->sckpt_vntable, vp)
+	{
+		if (slsset_find(sckpt->sckpt_vntable, (uint64_t)vp) == 0) {
+			vrele(vp);
+			continue;
+		}
+
+		error = slsset_add(sckpt->sckpt_vntable, (uint64_t)vp);
+		if (error != 0) {
+			vrele(vp);
+			return (error);
+		}
+	}
+
+	return (0);
+}
+
 void
 slsckpt_hold(struct slsckpt_data *sckpt)
 {
@@ -270,6 +429,109 @@ slsp_hasproc(struct slspart *slsp, pid_t pid)
 	return (true);
 }
 
+void
+slsp_phase_record(struct slspart *slsp, int phase, uint64_t ns)
+{
+	KASSERT(phase >= 0 && phase < SLSPHASES, ("invalid phase %d", phase));
+
+	sls_histogram_record(&slsp->slsp_hist[phase], ns);
+}
+
+/*
+ * Report a percentile of a phase histogram. The value is the upper bound of
+ * the bucket the percentile falls in, so it is accurate to a factor of 2.
+ */
+static int
+slsp_phase_percentile(SYSCTL_HANDLER_ARGS)
+{
+	struct sls_histogram *hist = (struct sls_histogram *)arg1;
+	uint64_t target, seen = 0;
+	uint64_t latency = 0;
+	int i;
+
+	target = howmany(hist->hist_count * arg2, 100);
+	for (i = 0; i < SLSHIST_BUCKETS && target > 0; i++) {
+		seen += hist->hist_buckets[i];
+		if (seen >= target) {
+			latency = 1ULL << i;
+			break;
+		}
+	}
+
+	return (SYSCTL_OUT(req, &latency, sizeof(latency)));
+}
+
+/* Export the phase histograms under aurora.partition.<oid>. */
+static void
+slsp_sysctl_init(struct slspart *slsp)
+{
+	static const char *phasenames[] = SLSPHASE_NAMES;
+	struct sysctl_oid *root, *phase;
+	char name[32];
+	int i;
+
+	CTASSERT(nitems(phasenames) == SLSPHASES);
+
+	sysctl_ctx_init(&slsp->slsp_sysctx);
+	if (sls_partoid == NULL)
+		return;
+
+	snprintf(name, sizeof(name), "%lu", slsp->slsp_oid);
+	root = SYSCTL_ADD_NODE(&slsp->slsp_sysctx, SYSCTL_CHILDREN(sls_partoid),
+	    OID_AUTO, name, CTLFLAG_RD, 0, "Partition statistics");
+	if (root == NULL)
+		return;
+
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "repl_lag_epochs", CTLFLAG_RD, &slsp->slsp_repllag, 0,
+	    "Checkpoints not yet acknowledged by the remote");
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "repl_lag_bytes", CTLFLAG_RD, &slsp->slsp_repllagbytes,
+	    0, "Memory held by checkpoints not yet acknowledged");
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "repl_coalesced", CTLFLAG_RD, &slsp->slsp_replcoalesced,
+	    0, "Checkpoints sent as part of a later one");
+	(void)SYSCTL_ADD_INT(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "repl_error", CTLFLAG_RD, &slsp->slsp_replerror, 0,
+	    "Error that stopped replication to the remote");
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "dedup_pages", CTLFLAG_RD, &slsp->slsp_deduppages, 0,
+	    "Pages the last checkpoint checked for duplicates");
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "dedup_hits", CTLFLAG_RD, &slsp->slsp_deduphits, 0,
+	    "Pages the last checkpoint wrote as references");
+	(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(root),
+	    OID_AUTO, "dedup_ratio", CTLFLAG_RD, &slsp->slsp_dedupratio, 0,
+	    "Percentage of duplicate pages in the last checkpoint");
+
+	for (i = 0; i < SLSPHASES; i++) {
+		phase = SYSCTL_ADD_NODE(&slsp->slsp_sysctx,
+		    SYSCTL_CHILDREN(root), OID_AUTO, phasenames[i], CTLFLAG_RD,
+		    0, "Phase latency");
+		if (phase == NULL)
+			return;
+
+		(void)SYSCTL_ADD_OPAQUE(&slsp->slsp_sysctx,
+		    SYSCTL_CHILDREN(phase), OID_AUTO, "histogram", CTLFLAG_RD,
+		    &slsp->slsp_hist[i], sizeof(slsp->slsp_hist[i]),
+		    "S,sls_histogram", "Latency histogram (ns, log2 buckets)");
+		(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(phase),
+		    OID_AUTO, "count", CTLFLAG_RD,
+		    &slsp->slsp_hist[i].hist_count, 0, "Times the phase ran");
+		(void)SYSCTL_ADD_U64(&slsp->slsp_sysctx, SYSCTL_CHILDREN(phase),
+		    OID_AUTO, "total", CTLFLAG_RD,
+		    &slsp->slsp_hist[i].hist_sum, 0, "Total time (ns)");
+		(void)SYSCTL_ADD_PROC(&slsp->slsp_sysctx,
+		    SYSCTL_CHILDREN(phase), OID_AUTO, "p50",
+		    CTLTYPE_U64 | CTLFLAG_RD, &slsp->slsp_hist[i], 50,
+		    &slsp_phase_percentile, "QU", "Median latency (ns)");
+		(void)SYSCTL_ADD_PROC(&slsp->slsp_sysctx,
+		    SYSCTL_CHILDREN(phase), OID_AUTO, "p99",
+		    CTLTYPE_U64 | CTLFLAG_RD, &slsp->slsp_hist[i], 99,
+		    &slsp_phase_percentile, "QU", "99th percentile latency (ns)");
+	}
+}
+
 /* Attach a process to the partition. */
 int
 slsp_attach(uint64_t oid, struct proc *p)
@@ -495,6 +757,13 @@ slsp_init(uint64_t oid, struct sls_attr attr, int fd, struct slspart **slspp)
 	mtx_init(&slsp->slsp_epochmtx, "slsepoch", NULL, MTX_DEF);
 	cv_init(&slsp->slsp_epochcv, "slsepoch");
 
+	sx_init(&slsp->slsp_shadowlk, "slsshadow");
+
+	TAILQ_INIT(&slsp->slsp_replq);
+	TASK_INIT(&slsp->slsp_repltk, 0, &slsckpt_repltask, slsp);
+
+	slsp_sysctl_init(slsp);
+
 	*slspp = slsp;
 
 	return (0);
@@ -508,6 +777,8 @@ error:
 	return (error);
 }
 
+void (*slsp_fini_hook)(uint64_t oid) = NULL;
+
 /*
  * Destroy a partition. The struct has to have
  * have already been removed from the hashtable.
@@ -518,9 +789,25 @@ slsp_fini(struct slspart *slsp)
 	struct thread *td = curthread;
 	int backend;
 
+	/* Nobody is left to restore checkpoints the remote never got. */
+	mtx_lock(&slsp->slsp_epochmtx);
+	slsp->slsp_replabort = true;
+	mtx_unlock(&slsp->slsp_epochmtx);
+	wakeup(&slsp->slsp_replabort);
+
+	/* The collapse thread does not hold a reference to the partition. */
+	slsp_pipeline_drain(slsp);
+	taskqueue_drain(slsm.slsm_repltq, &slsp->slsp_repltk);
+
 	/* Remove all processes currently in the partition from the SLS. */
 	slsp_detachall(slsp);
 
+	if (slsp_fini_hook != NULL)
+		slsp_fini_hook(slsp->slsp_oid);
+
+	/* Waits for any readers of the histograms. */
+	sysctl_ctx_free(&slsp->slsp_sysctx);
+
 	if (slsp->slsp_blanksckpt != NULL) {
 		slsckpt_drop(slsp->slsp_blanksckpt);
 		slsp->slsp_blanksckpt = NULL;
@@ -531,10 +818,16 @@ slsp_fini(struct slspart *slsp)
 	cv_destroy(&slsp->slsp_synccv);
 	mtx_destroy(&slsp->slsp_syncmtx);
 
+	KASSERT(slsp->slsp_inflight == 0,
+	    ("destroying partition with %d checkpoints in flight",
+		slsp->slsp_inflight));
+
 	mtx_assert(&slsp->slsp_epochmtx, MA_NOTOWNED);
 	cv_destroy(&slsp->slsp_epochcv);
 	mtx_destroy(&slsp->slsp_epochmtx);
 
+	sx_destroy(&slsp->slsp_shadowlk);
+
 	/* Destroy the proc bookkeeping structure. */
 	slsset_destroy(slsp->slsp_procs);
 
@@ -736,6 +1029,22 @@ slsp_epoch_advance(struct slspart *slsp, uint64_t next_epoch)
 	mtx_unlock(&slsp->slsp_epochmtx);
 }
 
+/*
+ * Wait until all pipelined checkpoints of the partition have been flushed and
+ * compacted, and all retired checkpoints have been collapsed. The caller must
+ * hold the partition in a state other than SLSP_AVAILABLE, so that no new
+ * checkpoints can enter the pipeline.
+ */
+void
+slsp_pipeline_drain(struct slspart *slsp)
+{
+	mtx_lock(&slsp->slsp_epochmtx);
+	while (slsp->slsp_inflight > 0 || slsp->slsp_collapsing > 0 ||
+	    !TAILQ_EMPTY(&slsp->slsp_replq))
+		cv_wait(&slsp->slsp_epochcv, &slsp->slsp_epochmtx);
+	mtx_unlock(&slsp->slsp_epochmtx);
+}
+
 int
 slsp_waitfor(struct slspart *slsp)
 {
@@ -5,6 +5,9 @@
 #include <sys/sbuf.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 #include <sys/un.h>
 #include <sys/unpcb.h>
 
@@ -63,6 +66,25 @@ struct slspart {
 	uint64_t slsp_epoch;	  /* Current epoch, for ckpt on disk */
 	uint64_t slsp_nextepoch; /* Epoch the caller's operations will be in
 				    after completion*/
+	int slsp_inflight;	  /* Pipelined checkpoints still flushing */
+	int slsp_collapsing;	  /* Retired checkpoints not yet collapsed */
+	size_t slsp_inflightbytes; /* Memory held by in-flight checkpoints */
+	/* Checkpoints sent to the remote but not yet acknowledged. */
+	TAILQ_HEAD(slstable_replq, slstable_replctx) slsp_replq;
+	struct task slsp_repltk; /* Sends out the replication queue */
+	uint64_t slsp_repllag;	 /* Epochs the remote is behind */
+	uint64_t slsp_repllagbytes; /* Memory held by them */
+	uint64_t slsp_replcoalesced; /* Epochs sent as part of a later one */
+	bool slsp_replabort;	     /* Drop checkpoints the remote lacks */
+	int slsp_replerror;	     /* Error that stopped replication */
+	struct sx slsp_shadowlk;  /* Serializes shadowing and compaction */
+	uint64_t slsp_stopns;	  /* Stop time of the last checkpoint */
+	uint64_t slsp_flushns;	  /* Flush time of the last checkpoint */
+	uint64_t slsp_deduppages; /* Pages the last checkpoint hashed */
+	uint64_t slsp_deduphits;  /* Pages it wrote as references */
+	uint64_t slsp_dedupratio; /* Percentage of them */
+	struct sls_histogram slsp_hist[SLSPHASES]; /* Phase latencies */
+	struct sysctl_ctx_list slsp_sysctx; /* Per-partition sysctls */
 	void *slsp_backend; /* Opaque backend pointer, dependent on type */
 
 	LIST_ENTRY(slspart) slsp_parts; /* List of active SLS partitions */
@@ -86,6 +108,9 @@ int slsp_add(
     uint64_t oid, struct sls_attr attr, int fd, struct slspart **slspp);
 void slsp_del(uint64_t oid);
 
+/* Called when a partition is destroyed, used by modules built on the SLS. */
+extern void (*slsp_fini_hook)(uint64_t oid);
+
 void slsp_delall(void);
 
 void slsp_ref(struct slspart *slsp);
@@ -95,6 +120,7 @@ void slsp_deref_locked(struct slspart *slsp);
 int slsp_isempty(struct slspart *slsp);
 uint64_t slsp_epoch_preadvance(struct slspart *slsp);
 void slsp_epoch_advance(struct slspart *slsp, uint64_t next_epoch);
+void slsp_pipeline_drain(struct slspart *slsp);
 
 void slsp_signal(struct slspart *slsp, int retval);
 int slsp_waitfor(struct slspart *slsp);
@@ -104,6 +130,20 @@ int slsp_setstate(
 int slsp_getstate(struct slspart *slsp);
 
 bool slsp_hasproc(struct slspart *slsp, pid_t pid);
+void slsp_phase_record(struct slspart *slsp, int phase, uint64_t ns);
+
+/*
+ * Account the time since *sbtp to a phase, and restart the clock for
+ * the next one.
+ */
+static inline void
+slsp_phase(struct slspart *slsp, int phase, sbintime_t *sbtp)
+{
+	sbintime_t now = sbinuptime();
+
+	slsp_phase_record(slsp, phase, sbttons(now - *sbtp));
+	*sbtp = now;
+}
 bool slsp_rest_from_mem(struct slspart *slsp);
 bool slsp_restorable(struct slspart *slsp);
 
@@ -114,12 +154,18 @@ bool slsp_restorable(struct slspart *slsp);
 #define SLSP_PRECOPY(slsp) (SLSATTR_ISPRECOPY((slsp->slsp_attr)))
 #define SLSP_DELTAREST(slsp) (SLSATTR_ISDELTAREST((slsp->slsp_attr)))
 #define SLSP_NOCKPT(slsp) (SLSATTR_ISNOCKPT((slsp->slsp_attr)))
+#define SLSP_PIPELINE(slsp) (SLSATTR_ISPIPELINE((slsp->slsp_attr)))
+#define SLSP_ADAPTIVE(slsp) (SLSATTR_ISADAPTIVE((slsp->slsp_attr)))
 
 extern uma_zone_t slsckpt_zone;
 int slsckpt_alloc(struct slspart *slsp, struct slsckpt_data **sckptp);
 void slsckpt_clear(struct slsckpt_data *sckpt);
 void slsckpt_hold(struct slsckpt_data *sckpt);
 void slsckpt_drop(struct slsckpt_data *sckpt);
+int slsckpt_shard_alloc(
+    struct slsckpt_data *sckpt, struct slsckpt_data **shardp);
+void slsckpt_shard_free(struct slsckpt_data *shard);
+int slsckpt_shard_merge(struct slsckpt_data *sckpt, struct slsckpt_data *shard);
 int slsckpt_addrecord(
     struct slsckpt_data *sckpt, uint64_t slsid, struct sbuf *sb, uint64_t type);
 
@@ -145,8 +191,10 @@ slsp_proc_in_part(struct slspart *slsp, struct proc *p)
 	/* Make sure the process is in the partition. */
 	KVSET_FOREACH(slsp->slsp_procs, iter, pid)
 	{
-		if (p->p_pid == (pid_t)pid)
+		if (p->p_pid == (pid_t)pid) {
+			KV_ABORT(iter);
 			return (true);
+		}
 	}
 
 	return (false);
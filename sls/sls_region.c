@@ -2,6 +2,8 @@
 #include <sys/kthread.h>
 #include <sys/taskqueue.h>
 
+#include <slos_io.h>
+
 #include "debug.h"
 #include "sls_internal.h"
 #include "sls_vm.h"
@@ -173,9 +175,9 @@ slsckpt_dataregion_dump(struct slsckpt_data *sckpt_data, struct slspart *slsp,
 	}
 
 	SDT_PROBE0(sls, , , write);
-	/* Drain the taskqueue, ensuring all IOs have hit the disk. */
+	/* Wait until all IOs have hit the disk. */
 	if (slsp->slsp_target == SLS_OSD) {
-		taskqueue_drain_all(slos.slos_tq);
+		slos_io_drain();
 		/* XXX Using MNT_WAIT is causing a deadlock right now. */
 		VFS_SYNC(slos.slsfs_mount,
 		    (sls_vfs_sync != 0) ? MNT_WAIT : MNT_NOWAIT);
@@ -239,6 +241,9 @@ slsckpt_dataregion(struct slspart *slsp, struct proc *p, vm_ooffset_t addr,
 		return (EINVAL);
 	}
 
+	/* Pipelined checkpoints modify the partition's checkpoint data. */
+	slsp_pipeline_drain(slsp);
+
 	/*
 	 * Once a process is in a partition it is there forever, so there can be
 	 * no races with the call below.
@@ -305,7 +310,8 @@ error_single:
 	    false);
 	KASSERT(stateerr == 0, ("partition not in ckpt state"));
 
-	slsckpt_drop(sckpt);
+	if (sckpt != NULL)
+		slsckpt_drop(sckpt);
 
 	/* Remove the reference taken by the initial ioctl call. */
 	slsp_deref(slsp);
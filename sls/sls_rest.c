@@ -50,6 +50,7 @@
 
 #include <slos.h>
 #include <slos_inode.h>
+#include <slos_io.h>
 
 #include "debug.h"
 #include "sls_data.h"
@@ -495,7 +496,9 @@ slsrest_metadata(void *args)
 	struct slsrest_data *restdata;
 	struct proc *p = curproc;
 	uint64_t rest_stopped;
+	sls_rest_cb readycb;
 	size_t buflen;
+	void *cb_args;
 	int error;
 	char *buf;
 
@@ -557,6 +560,10 @@ slsrest_metadata(void *args)
 	if (restdata->cb != NULL)
 		restdata->cb(p, restdata->cb_args);
 
+	/* The restore data is gone once the barrier below is lifted. */
+	readycb = restdata->readycb;
+	cb_args = restdata->cb_args;
+
 	/* We're done restoring. If we are the last, notify the parent. */
 	mtx_lock(&restdata->procmtx);
 
@@ -600,6 +607,14 @@ slsrest_metadata(void *args)
 	 */
 
 	SDT_PROBE1(sls, , slsrest_metadata, , "Fixing up the tty");
+
+	/*
+	 * The restore is complete, but the process has not run yet. The
+	 * callback may hold it here for as long as it wants.
+	 */
+	if (readycb != NULL)
+		readycb(p, cb_args);
+
 	PROC_LOCK(p);
 	thread_single_end(p, SINGLE_BOUNDARY);
 	if (rest_stopped == 1)
@@ -851,7 +866,7 @@ slsrest_data_backend(struct slspart *slsp, struct slsrest_data *restdata)
 	}
 
 	if (slsp->slsp_target == SLS_OSD)
-		taskqueue_drain_all(slos.slos_tq);
+		slos_io_drain();
 
 	restdata->sckpt = sckpt;
 
@@ -958,11 +973,12 @@ error:
 
 int
 sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
-    void *cb_arg)
+    sls_rest_cb readycb, void *cb_arg)
 {
 	struct slsrest_data *restdata;
 	struct sls_record *rec;
 	struct slskv_iter iter;
+	sbintime_t sbt;
 	int stateerr;
 	uint64_t slsid;
 	size_t buflen;
@@ -979,6 +995,9 @@ sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
 		return (error);
 	}
 
+	/* Let pipelined checkpoints finish updating the partition. */
+	slsp_pipeline_drain(slsp);
+
 	/* Make sure an in-memory checkpoint already has data. */
 	if ((slsp->slsp_attr.attr_target == SLS_MEM) &&
 	    (slsp->slsp_sckpt == NULL)) {
@@ -989,6 +1008,7 @@ sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
 	}
 
 	/* Get the restore data from the appropriate backend. */
+	sbt = sbinuptime();
 	error = slsrest_data(slsp, &restdata);
 	if (error != 0) {
 		DEBUG2("%s: restoring data failed with %d\n", __func__, error);
@@ -999,7 +1019,9 @@ sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
 	}
 
 	restdata->cb = cb;
+	restdata->readycb = readycb;
 	restdata->cb_args = cb_arg;
+	slsp_phase(slsp, SLSPHASE_RESTREAD, &sbt);
 
 	SDT_PROBE1(sls, , sls_rest, , "Caching data");
 
@@ -1032,6 +1054,7 @@ sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
 		goto out;
 
 	SDT_PROBE1(sls, , sls_rest, , "Restoring files");
+	slsp_phase(slsp, SLSPHASE_RESTFILES, &sbt);
 
 	/* Restore all memory segments. */
 	KV_FOREACH(restdata->sckpt->sckpt_rectable, iter, slsid, rec)
@@ -1050,6 +1073,7 @@ sls_rest(struct slspart *slsp, uint64_t rest_stopped, sls_rest_cb cb,
 	}
 
 	SDT_PROBE1(sls, , sls_rest, , "Restoring SYSV shared memory");
+	slsp_phase(slsp, SLSPHASE_RESTSHM, &sbt);
 
 	/*
 	 * Fourth pass; restore processes. These depend on the objects
@@ -1090,6 +1114,8 @@ out:
 	mtx_unlock(&restdata->procmtx);
 
 	SDT_PROBE1(sls, , sls_rest, , "Waiting for processes");
+	if (error == 0)
+		slsp_phase(slsp, SLSPHASE_RESTPROCS, &sbt);
 
 	stateerr = slsp_setstate(slsp, SLSP_RESTORING, SLSP_AVAILABLE, false);
 	KASSERT(stateerr == 0, ("invalid state transition"));
@@ -1116,7 +1142,7 @@ sls_restored(struct sls_restored_args *args)
 	}
 
 	/* Restore the old process. */
-	error = sls_rest(args->slsp, args->rest_stopped, NULL, NULL);
+	error = sls_rest(args->slsp, args->rest_stopped, NULL, NULL, NULL);
 	if (error != 0)
 		DEBUG1("Error: sls_rest failed with %d", error);
 
@@ -4,6 +4,7 @@
 #include <sys/lock.h>
 #include <sys/pcpu.h>
 #include <sys/rwlock.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <vm/vm.h>
@@ -20,6 +21,7 @@
 #include "sls_internal.h"
 #include "sls_io.h"
 #include "sls_table.h"
+#include "sls_vm.h"
 
 struct sls_sockrcvd_state {
 	bool slsrcvd_done;
@@ -130,6 +132,127 @@ error:
 	return (error);
 }
 
+/*
+ * Receive a batch of page runs. Grab all pages up front, then read the data
+ * directly into them with one scattering read.
+ */
+static int
+slsrcvd_recruns(struct sls_sockrcvd_state *rcvd, struct slsmsg_recruns *msg)
+{
+	size_t nruns = msg->slsmsg_nruns;
+	vm_object_t obj = rcvd->slsrcvd_obj;
+	struct slsmsg_pagerun *runs;
+	size_t count, npages;
+	struct iovec *aiov;
+	vm_pindex_t end;
+	vm_page_t *ma;
+	int error;
+	int ret;
+	int i;
+
+	if (obj == NULL)
+		return (EBADMSG);
+
+	npages = msg->slsmsg_len / PAGE_SIZE;
+	if (nruns == 0 || nruns > SLSMSG_MAXPAGES || npages > SLSMSG_MAXPAGES ||
+	    msg->slsmsg_len != npages * PAGE_SIZE)
+		return (EBADMSG);
+
+	runs = malloc(sizeof(*runs) * nruns, M_SLSMM, M_WAITOK);
+	error = slsio_fpread(rcvd->slsrcvd_sock, runs, sizeof(*runs) * nruns);
+	if (error != 0) {
+		free(runs, M_SLSMM);
+		return (error);
+	}
+
+	/*
+	 * Make sure the runs are in order and add up before grabbing any
+	 * pages, overlapping runs would have us busy the same page twice.
+	 */
+	count = 0;
+	end = 0;
+	for (i = 0; i < nruns; i++) {
+		if (runs[i].slsmsg_pindex < end ||
+		    (runs[i].slsmsg_flags & ~SLSMSG_RUNZERO) != 0) {
+			free(runs, M_SLSMM);
+			return (EBADMSG);
+		}
+
+		end = runs[i].slsmsg_pindex + runs[i].slsmsg_npages;
+		if (end > obj->size || end <= runs[i].slsmsg_pindex) {
+			free(runs, M_SLSMM);
+			return (EBADMSG);
+		}
+
+		if ((runs[i].slsmsg_flags & SLSMSG_RUNZERO) == 0)
+			count += runs[i].slsmsg_npages;
+	}
+
+	if (count != npages) {
+		free(runs, M_SLSMM);
+		return (EBADMSG);
+	}
+
+	ma = malloc(sizeof(*ma) * npages, M_SLSMM, M_WAITOK);
+	aiov = malloc(sizeof(*aiov) * npages, M_SLSMM, M_WAITOK);
+
+	VM_OBJECT_WLOCK(obj);
+	count = 0;
+	for (i = 0; i < nruns; i++) {
+		/* Zero runs have no data, fill them in right away. */
+		if (runs[i].slsmsg_flags & SLSMSG_RUNZERO) {
+			slsvm_object_zerorun(obj, runs[i].slsmsg_pindex,
+			    runs[i].slsmsg_npages);
+			continue;
+		}
+
+		ret = vm_page_grab_pages(obj, runs[i].slsmsg_pindex,
+		    VM_ALLOC_NORMAL, &ma[count], runs[i].slsmsg_npages);
+		KASSERT(ret == runs[i].slsmsg_npages,
+		    ("blocking allocation failed"));
+		count += runs[i].slsmsg_npages;
+	}
+
+	for (i = 0; i < npages; i++) {
+		ma[i]->valid = 0;
+		ma[i]->oflags |= VPO_SWAPINPROG;
+		aiov[i].iov_base = (char *)PHYS_TO_DMAP(VM_PAGE_TO_PHYS(ma[i]));
+		aiov[i].iov_len = PAGE_SIZE;
+	}
+
+	vm_object_pip_add(obj, npages);
+	VM_OBJECT_WUNLOCK(obj);
+
+	error = 0;
+	if (npages > 0)
+		error = slsio_fpreadv(rcvd->slsrcvd_sock, aiov, npages);
+
+	VM_OBJECT_WLOCK(obj);
+	for (i = 0; i < npages; i++) {
+		if (error == 0)
+			ma[i]->valid = VM_PAGE_BITS_ALL;
+		ma[i]->oflags &= ~VPO_SWAPINPROG;
+		vm_page_xunbusy(ma[i]);
+	}
+
+	/* Do not leave invalid pages in the object. */
+	if (error != 0) {
+		for (i = 0; i < nruns; i++) {
+			vm_object_page_remove(obj, runs[i].slsmsg_pindex,
+			    runs[i].slsmsg_pindex + runs[i].slsmsg_npages, 0);
+		}
+	}
+
+	vm_object_pip_add(obj, -npages);
+	VM_OBJECT_WUNLOCK(obj);
+
+	free(aiov, M_SLSMM);
+	free(ma, M_SLSMM);
+	free(runs, M_SLSMM);
+
+	return (error);
+}
+
 static int
 slsrcvd_recmeta_manifest(
     struct sls_sockrcvd_state *rcvd, struct slsmsg_recmeta *msg)
@@ -245,24 +368,62 @@ slsrcvd_recmeta(struct sls_sockrcvd_state *rcvd, struct slsmsg_recmeta *msg)
 	}
 }
 
+/*
+ * Tell the sender whether we stored the checkpoint. It waits for the
+ * acknowledgement before it considers the epoch replicated.
+ */
+static int
+slsrcvd_ckptack(struct sls_sockrcvd_state *rcvd, int result)
+{
+	struct slsmsg_ckptack *ackmsg;
+	union slsmsg msg;
+
+	bzero(&msg, sizeof(msg));
+	ackmsg = (struct slsmsg_ckptack *)&msg;
+	*ackmsg = (struct slsmsg_ckptack) {
+		.slsmsg_type = SLSMSG_CKPTACK,
+		.slsmsg_epoch = rcvd->slsrcvd_epoch,
+		.slsmsg_error = result,
+	};
+
+	return (slsio_fpwrite(rcvd->slsrcvd_sock, &msg, sizeof(msg)));
+}
+
 static int
 slsrcvd_ckptdone(struct sls_sockrcvd_state *rcvd)
 {
 	struct slspart *slsp = rcvd->slsrcvd_slsp;
 	struct thread *td = curthread;
+	bool ack;
 	bool unused;
 	int error;
 
-	if (!slsckpt_prepare_state(slsp, &unused))
+	/* Registration messages do not carry a checkpoint. */
+	ack = (rcvd->slsrcvd_sckpt != NULL);
+
+	if (!slsckpt_prepare_state(slsp, &unused)) {
+		if (ack)
+			(void)slsrcvd_ckptack(rcvd, EBUSY);
 		return (EBUSY);
+	}
 
 	/* XXX Need a special compact operation */
+	sx_xlock(&slsp->slsp_shadowlk);
 	if (slsp->slsp_sckpt == NULL)
 		slsp->slsp_sckpt = rcvd->slsrcvd_sckpt;
 	else
 		slsckpt_compact(slsp, rcvd->slsrcvd_sckpt);
+	sx_xunlock(&slsp->slsp_shadowlk);
 	rcvd->slsrcvd_sckpt = NULL;
 
+	/* The checkpoint is ours now, a lost ack only costs a resend. */
+	if (ack) {
+		error = slsrcvd_ckptack(rcvd, 0);
+		if (error != 0)
+			SLS_WARN("Acknowledging epoch %lu failed with %d\n",
+			    rcvd->slsrcvd_epoch, error);
+	}
+
 	fdrop(rcvd->slsrcvd_sock, td);
 	rcvd->slsrcvd_sock = NULL;
 
@@ -307,6 +468,10 @@ slsrcvd_message(struct sls_sockrcvd_state *rcvd)
 		error = slsrcvd_recpages(rcvd, (struct slsmsg_recpages *)&msg);
 		break;
 
+	case SLSMSG_RECRUNS:
+		error = slsrcvd_recruns(rcvd, (struct slsmsg_recruns *)&msg);
+		break;
+
 	case SLSMSG_CKPTDONE:
 		error = slsrcvd_ckptdone(rcvd);
 		break;
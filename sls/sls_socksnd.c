@@ -3,6 +3,9 @@
 #include <sys/lock.h>
 #include <sys/proc.h>
 #include <sys/rwlock.h>
+#include <sys/socket.h>
+#include <sys/syscallsubr.h>
+#include <sys/uio.h>
 
 #include <vm/vm.h>
 #include <vm/vm_object.h>
@@ -20,7 +23,7 @@
 #include "sls_vm.h"
 
 static int
-slssnd_ckptstart(struct slspart *slsp, int sockfd)
+slssnd_ckptstart(struct slspart *slsp, int sockfd, uint64_t epoch)
 {
 	struct slsmsg_ckptstart *ckptmsg;
 	union slsmsg msg;
@@ -30,7 +33,9 @@ slssnd_ckptstart(struct slspart *slsp, int sockfd)
 
 	*ckptmsg = (struct slsmsg_ckptstart) {
 		.slsmsg_type = SLSMSG_CKPTSTART,
-		.slsmsg_epoch = slsp->slsp_epoch - 1,
+		.slsmsg_epoch = epoch,
+		/* Same collocation hack as the manifest below. */
+		.slsmsg_oid = slsp->slsp_oid + 1,
 	};
 
 	return (slsio_fdwrite(sockfd, (char *)&msg, sizeof(msg), NULL));
@@ -91,91 +96,295 @@ md5_page(vm_page_t m)
 	printf("Wrote %lx digest %lx\n", m->pindex, *(uint64_t *)digest);
 }
 
+/*
+ * Read a message from the receiver. Unlike slsio_fdread(), this does not
+ * assume the socket returns all the data at once.
+ */
 static int
-slssnd_pages(int sockfd, vm_page_t m, size_t pagecnt)
+slssnd_recv(int sockfd, char *buf, size_t len)
 {
-	struct slsmsg_recpages *pagemsg;
-	union slsmsg msg;
+	struct thread *td = curthread;
+	struct uio auio;
+	struct iovec aiov;
 	int error;
 
-	bzero(&msg, sizeof(msg));
-	pagemsg = (struct slsmsg_recpages *)&msg;
+	while (len > 0) {
+		aiov.iov_base = buf;
+		aiov.iov_len = len;
+		auio.uio_iov = &aiov;
+		auio.uio_iovcnt = 1;
+		auio.uio_resid = len;
+		auio.uio_segflg = UIO_SYSSPACE;
 
-	*pagemsg = (struct slsmsg_recpages) {
-		.slsmsg_type = SLSMSG_RECPAGES,
-		.slsmsg_len = PAGE_SIZE,
-		.slsmsg_offset = (m->pindex + SLOS_OBJOFF) * PAGE_SIZE,
-	};
+		error = kern_readv(td, sockfd, &auio);
+		if (error != 0)
+			return (error);
 
-	error = slsio_fdwrite(sockfd, (char *)&msg, sizeof(msg), NULL);
-	if (error != 0)
-		return (error);
+		/* The receiver hung up without acknowledging. */
+		if (td->td_retval[0] == 0)
+			return (ECONNRESET);
+
+		buf += td->td_retval[0];
+		len -= td->td_retval[0];
+	}
 
-	return (slsio_fdwrite(sockfd, (char *)PHYS_TO_DMAP(m->phys_addr),
-	    pagecnt * PAGE_SIZE, NULL));
+	return (0);
 }
 
+/* Wait until the receiver has stored the checkpoint. */
 static int
-sls_writedata_socket_pages(int sockfd, vm_object_t obj, bool *done)
+slssnd_ckptack(int sockfd, uint64_t epoch)
 {
-	vm_pindex_t pindex;
-	vm_page_t m;
+	struct slsmsg_ckptack *ackmsg;
+	union slsmsg msg;
 	int error;
 
-	*done = false;
+	error = slssnd_recv(sockfd, (char *)&msg, sizeof(msg));
+	if (error != 0)
+		return (error);
+
+	ackmsg = (struct slsmsg_ckptack *)&msg;
+	if (ackmsg->slsmsg_type != SLSMSG_CKPTACK ||
+	    ackmsg->slsmsg_epoch != epoch) {
+		SLS_WARN("Invalid acknowledgement for epoch %lu\n", epoch);
+		return (EPROTO);
+	}
 
-	VM_OBJECT_WLOCK(obj);
-	vm_object_pip_add(obj, 1);
+	/* Resending the same checkpoint will not help, fail for good. */
+	if (ackmsg->slsmsg_error != 0) {
+		SLS_WARN("Receiver failed to store epoch %lu with %lu\n",
+		    epoch, ackmsg->slsmsg_error);
+		return (EPROTO);
+	}
+
+	return (0);
+}
+
+/* A message's worth of page runs, sent with a single gathering write. */
+struct slssnd_batch {
+	union slsmsg msg;
+	struct slsmsg_pagerun runs[SLSMSG_MAXPAGES];
+	struct iovec aiov[SLSMSG_MAXPAGES + 2];
+	vm_page_t ms[SLSMSG_MAXPAGES];
+	size_t nruns;
+	size_t npages;
 
 	/*
-	 * start from 0;
-	 * keep going while physically and virtually contiguous;
-	 * when not,
-	 * break when we are done iterating.
+	 * The objects the pages come from, top to bottom, and the offset
+	 * of the record's object into each of them in pages.
 	 */
-	pindex = 0;
-	while ((m = vm_page_find_least(obj, pindex)) != NULL) {
-		KASSERT(m->object == obj,
-		    ("page %p in object %p "
-		     "associated with object %p",
-			m, obj, m->object));
-		KASSERT(pagesizes[m->psind] <= PAGE_SIZE,
-		    ("dumping page %p with size %ld", m, pagesizes[m->psind]));
+	vm_object_t *chain;
+	vm_pindex_t *offs;
+	int nchain;
+};
 
-		m->oflags |= VPO_SWAPINPROG;
-		VM_OBJECT_WUNLOCK(obj);
+static void
+slssnd_batch_add(struct slssnd_batch *batch, vm_page_t m, vm_pindex_t pindex)
+{
+	struct slsmsg_pagerun *run;
+	uint64_t flags;
+
+	KASSERT(batch->npages < SLSMSG_MAXPAGES, ("batch overflow"));
+	KASSERT(batch->nruns < SLSMSG_MAXPAGES, ("batch overflow"));
+
+	flags = 0;
+	if (sls_zero_elim && slsvm_page_iszero(m))
+		flags = SLSMSG_RUNZERO;
+
+	/* Extend the last run if the page is contiguous with it. */
+	run = (batch->nruns > 0) ? &batch->runs[batch->nruns - 1] : NULL;
+	if (run == NULL || run->slsmsg_pindex + run->slsmsg_npages != pindex ||
+	    run->slsmsg_flags != flags) {
+		run = &batch->runs[batch->nruns++];
+		run->slsmsg_pindex = pindex;
+		run->slsmsg_npages = 0;
+		run->slsmsg_flags = flags;
+	}
 
-		error = slssnd_pages(sockfd, m, 1);
+	run->slsmsg_npages += 1;
 
-		VM_OBJECT_WLOCK(obj);
-		m->oflags &= ~VPO_SWAPINPROG;
+	/* Zero runs are sent without any data. */
+	if (flags & SLSMSG_RUNZERO) {
+		atomic_add_64(&sls_zero_pages, 1);
+		return;
+	}
 
-		if (error != 0)
+	m->oflags |= VPO_SWAPINPROG;
+	batch->aiov[batch->npages + 2].iov_base = (char *)PHYS_TO_DMAP(
+	    m->phys_addr);
+	batch->aiov[batch->npages + 2].iov_len = PAGE_SIZE;
+	batch->ms[batch->npages++] = m;
+}
+
+/* Send out the batch. Called and returns with the chain locked. */
+static int
+slssnd_batch_flush(int sockfd, struct slssnd_batch *batch)
+{
+	struct slsmsg_recruns *runmsg;
+	int error;
+	int i;
+
+	bzero(&batch->msg, sizeof(batch->msg));
+	runmsg = (struct slsmsg_recruns *)&batch->msg;
+
+	*runmsg = (struct slsmsg_recruns) {
+		.slsmsg_type = SLSMSG_RECRUNS,
+		.slsmsg_nruns = batch->nruns,
+		.slsmsg_len = batch->npages * PAGE_SIZE,
+	};
+
+	batch->aiov[0].iov_base = (char *)&batch->msg;
+	batch->aiov[0].iov_len = sizeof(batch->msg);
+	batch->aiov[1].iov_base = (char *)batch->runs;
+	batch->aiov[1].iov_len = batch->nruns * sizeof(batch->runs[0]);
+
+	for (i = batch->nchain - 1; i >= 0; i--)
+		VM_OBJECT_WUNLOCK(batch->chain[i]);
+	error = slsio_fdwritev(sockfd, batch->aiov, batch->npages + 2, NULL);
+	for (i = 0; i < batch->nchain; i++)
+		VM_OBJECT_WLOCK(batch->chain[i]);
+
+	for (i = 0; i < batch->npages; i++)
+		batch->ms[i]->oflags &= ~VPO_SWAPINPROG;
+
+	batch->nruns = 0;
+	batch->npages = 0;
+
+	return (error);
+}
+
+/*
+ * Find the objects holding the pages of a record. When several epochs are
+ * sent as one, the object of the newest epoch still shadows the objects
+ * frozen by the epochs not yet sent, and the pages not written to since
+ * are in them. Aurora shadows keep the ID of the object they shadow.
+ */
+static void
+slssnd_chain_lock(vm_object_t obj, int depth, struct slssnd_batch *batch)
+{
+	vm_object_t cur, backer;
+
+	VM_OBJECT_WLOCK(obj);
+	batch->chain[0] = obj;
+	batch->offs[0] = 0;
+	batch->nchain = 1;
+
+	for (cur = obj; batch->nchain <= depth; cur = backer) {
+		backer = cur->backing_object;
+		if (backer == NULL || backer->objid != obj->objid)
 			break;
 
-		pindex = m->pindex + 1;
+		VM_OBJECT_WLOCK(backer);
+		batch->chain[batch->nchain] = backer;
+		batch->offs[batch->nchain] = batch->offs[batch->nchain - 1] +
+		    OFF_TO_IDX(cur->backing_object_offset);
+		batch->nchain += 1;
+	}
+}
+
+/* Check whether a newer object in the chain has its own copy of the page. */
+static bool
+slssnd_shadowed(struct slssnd_batch *batch, int level, vm_pindex_t pindex)
+{
+	int i;
+
+	for (i = 0; i < level; i++) {
+		if (vm_page_lookup(batch->chain[i], pindex + batch->offs[i]) !=
+		    NULL)
+			return (true);
+	}
+
+	return (false);
+}
+
+static int
+sls_writedata_socket_pages(int sockfd, vm_object_t obj, int depth)
+{
+	struct slssnd_batch *batch;
+	vm_pindex_t pindex;
+	vm_object_t cur;
+	int error = 0;
+	vm_page_t m, next;
+	int level;
+
+	batch = malloc(sizeof(*batch), M_SLSMM, M_WAITOK);
+	batch->nruns = 0;
+	batch->npages = 0;
+	batch->chain = malloc(sizeof(*batch->chain) * (depth + 1), M_SLSMM,
+	    M_WAITOK);
+	batch->offs = malloc(sizeof(*batch->offs) * (depth + 1), M_SLSMM,
+	    M_WAITOK);
+
+	/* Keep the chain from being collapsed while it is unlocked. */
+	slssnd_chain_lock(obj, depth, batch);
+	for (level = 0; level < batch->nchain; level++)
+		vm_object_pip_add(batch->chain[level], 1);
+
+	for (level = 0; level < batch->nchain && error == 0; level++) {
+		cur = batch->chain[level];
+		for (m = vm_page_find_least(cur, batch->offs[level]); m != NULL;
+		     m = next) {
+			next = TAILQ_NEXT(m, listq);
+			KASSERT(m->object == cur,
+			    ("page %p in object %p "
+			     "associated with object %p",
+				m, cur, m->object));
+			KASSERT(pagesizes[m->psind] <= PAGE_SIZE,
+			    ("dumping page %p with size %ld", m,
+				pagesizes[m->psind]));
+
+			pindex = m->pindex - batch->offs[level];
+			if (level > 0 && pindex >= obj->size)
+				break;
+
+			if (slssnd_shadowed(batch, level, pindex))
+				continue;
+
+			slssnd_batch_add(batch, m, pindex);
+			if (batch->npages < SLSMSG_MAXPAGES &&
+			    batch->nruns < SLSMSG_MAXPAGES)
+				continue;
+
+			error = slssnd_batch_flush(sockfd, batch);
+			if (error != 0)
+				break;
+
+			/* The flush unlocks the chain, look the next page up. */
+			next = vm_page_find_least(
+			    cur, pindex + batch->offs[level] + 1);
+		}
+
+		/* Runs in a message are sorted, send each level separately. */
+		if (error == 0 && batch->nruns > 0)
+			error = slssnd_batch_flush(sockfd, batch);
+	}
+
+	for (level = batch->nchain - 1; level >= 0; level--) {
+		vm_object_pip_add(batch->chain[level], -1);
+		VM_OBJECT_WUNLOCK(batch->chain[level]);
 	}
 
-	KASSERT(m == NULL, ("not null"));
-	vm_object_pip_add(obj, -1);
-	VM_OBJECT_WUNLOCK(obj);
+	free(batch->offs, M_SLSMM);
+	free(batch->chain, M_SLSMM);
+	free(batch, M_SLSMM);
 
-	*done = true;
 	return (error);
 }
 
 static int
-sls_writedata_socket(int sockfd, struct sls_record *rec)
+sls_writedata_socket(int sockfd, struct sls_record *rec, int depth)
 {
 	uint64_t totalpages, totalsize;
 	struct slsvmobject *vminfo;
 	vm_object_t obj;
-	bool done;
 	int error;
 
 	KASSERT(rec->srec_type == SLOSREC_VMOBJ, ("not a data record"));
 
-	/* Get the object itself, clean up the pointer when writing out. */
+	/*
+	 * Hide the object pointer from the receiver. We keep the reference
+	 * until the checkpoint is acknowledged, in case we send it again.
+	 */
 	vminfo = (struct slsvmobject *)sbuf_data(rec->srec_sb);
 	obj = (vm_object_t)vminfo->objptr;
 	vminfo->objptr = NULL;
@@ -184,23 +393,39 @@ sls_writedata_socket(int sockfd, struct sls_record *rec)
 	totalsize = (totalpages + SLOS_OBJOFF) * PAGE_SIZE;
 
 	error = slssnd_meta(sockfd, rec, totalsize);
+	vminfo->objptr = obj;
 	if (error != 0)
-		goto out;
+		return (error);
 
 	if (obj == NULL || !OBJT_ISANONYMOUS(obj))
-		goto out;
+		return (0);
 
-	do {
-		error = sls_writedata_socket_pages(sockfd, obj, &done);
-		if (error != 0)
-			goto out;
-	} while (!done);
+	return (sls_writedata_socket_pages(sockfd, obj, depth));
+}
 
-out:
-	/* Release the reference this function holds. */
-	vm_object_deallocate(obj);
+/*
+ * Release the references the records of a checkpoint hold to their objects.
+ * Called once the checkpoint is not going to be sent anymore.
+ */
+void
+slssnd_release(struct slsckpt_data *sckpt)
+{
+	struct slsvmobject *vminfo;
+	struct sls_record *rec;
+	struct slskv_iter iter;
+	vm_object_t obj;
+	uint64_t slsid;
 
-	return (error);
+	KV_FOREACH(sckpt->sckpt_rectable, iter, slsid, rec)
+	{
+		if (rec->srec_type != SLOSREC_VMOBJ)
+			continue;
+
+		vminfo = (struct slsvmobject *)sbuf_data(rec->srec_sb);
+		obj = (vm_object_t)vminfo->objptr;
+		vminfo->objptr = NULL;
+		vm_object_deallocate(obj);
+	}
 }
 
 int
@@ -236,12 +461,19 @@ slssnd_connect(struct sockaddr_in *sasrc, int *sockfdp)
 	return (0);
 }
 
+/*
+ * Send a checkpoint of the given epoch and wait for the receiver to store
+ * it. If depth is nonzero, the checkpoint also stands in for the depth
+ * epochs before it that were never sent, and carries their pages too.
+ */
 int
-sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt)
+sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt,
+    uint64_t epoch, int depth)
 {
 	struct thread *td = curthread;
 	struct sls_record *rec = NULL;
 	struct slskv_iter iter;
+	struct timeval tv;
 	uint64_t numids = 0;
 	uint64_t slsid;
 	int sockfd;
@@ -252,7 +484,23 @@ sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt)
 	if (error != 0)
 		return (error);
 
-	error = slssnd_ckptstart(slsp, sockfd);
+	/*
+	 * Do not wait forever on a receiver that went away or stopped
+	 * reading, either for its acknowledgement or for buffer space.
+	 */
+	tv.tv_sec = sls_repl_acktimeout;
+	tv.tv_usec = 0;
+	error = kern_setsockopt(td, sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+	    UIO_SYSSPACE, sizeof(tv));
+	if (error != 0)
+		goto out;
+
+	error = kern_setsockopt(td, sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+	    UIO_SYSSPACE, sizeof(tv));
+	if (error != 0)
+		goto out;
+
+	error = slssnd_ckptstart(slsp, sockfd, epoch);
 	if (error != 0)
 		goto out;
 
@@ -264,9 +512,11 @@ sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt)
 
 		KASSERT(slsid == rec->srec_id, ("record has wrong key"));
 
-		error = sls_writedata_socket(sockfd, rec);
-		if (error != 0)
+		error = sls_writedata_socket(sockfd, rec, depth);
+		if (error != 0) {
+			KV_ABORT(iter);
 			goto out;
+		}
 	}
 
 	/* XXX The + 1 is a gnarly hack to run the server and the client in the
@@ -302,6 +552,10 @@ sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt)
 	if (error != 0)
 		goto out;
 
+	error = slssnd_ckptack(sockfd, epoch);
+	if (error != 0)
+		goto out;
+
 out:
 	if (rec != NULL)
 		sls_record_destroy(rec);
@@ -20,6 +20,7 @@
 #include <sys/sbuf.h>
 #include <sys/shm.h>
 #include <sys/signalvar.h>
+#include <sys/smp.h>
 #include <sys/syscallsubr.h>
 #include <sys/taskqueue.h>
 #include <sys/time.h>
@@ -47,6 +48,7 @@
 #include <slsfs.h>
 
 #include "debug.h"
+#include "sls_dedup.h"
 #include "sls_internal.h"
 #include "sls_io.h"
 #include "sls_kv.h"
@@ -57,6 +59,7 @@
 #include "sls_vm.h"
 
 #define SLSTABLE_TASKWARM (256)
+#define SLSTABLE_REPLTHREADS (4) /* Partitions replicating at once */
 
 /* The maximum size of a single data transfer */
 uint64_t sls_contig_limit = MAXBCACHEBUF;
@@ -88,6 +91,66 @@ slstable_init(void)
 	if (error)
 		return (error);
 
+	/*
+	 * Pipelined checkpoints are flushed by a single thread, so that they
+	 * are written out and compacted in the order they were taken. The
+	 * flush itself waits on slsm_tabletq, so it cannot run there.
+	 */
+	slsm.slsm_ckpttq = taskqueue_create("slsckpttq", M_WAITOK,
+	    taskqueue_thread_enqueue, &slsm.slsm_ckpttq);
+	if (slsm.slsm_ckpttq == NULL)
+		return (ENOMEM);
+
+	error = taskqueue_start_threads(
+	    &slsm.slsm_ckpttq, 1, PVM, "SLS Checkpoint Flush Thread");
+	if (error)
+		return (error);
+
+	/*
+	 * Process metadata is captured while the partition is stopped, keep
+	 * it separate from the write tasks of earlier checkpoints.
+	 */
+	slsm.slsm_metatq = taskqueue_create("slsmetatq", M_WAITOK,
+	    taskqueue_thread_enqueue, &slsm.slsm_metatq);
+	if (slsm.slsm_metatq == NULL)
+		return (ENOMEM);
+
+	error = taskqueue_start_threads(
+	    &slsm.slsm_metatq, mp_ncpus, PVM, "SLS Metadata Threads");
+	if (error)
+		return (error);
+
+	/*
+	 * Retired checkpoints are collapsed by a single thread. Each collapse
+	 * rewrites the shadow table of the next checkpoint, so they have to
+	 * run in the order the checkpoints were compacted.
+	 */
+	slsm.slsm_collapsetq = taskqueue_create("slscollapsetq", M_WAITOK,
+	    taskqueue_thread_enqueue, &slsm.slsm_collapsetq);
+	if (slsm.slsm_collapsetq == NULL)
+		return (ENOMEM);
+
+	error = taskqueue_start_threads(
+	    &slsm.slsm_collapsetq, 1, PVM, "SLS Collapse Thread");
+	if (error)
+		return (error);
+
+	/*
+	 * Checkpoints replicated to a remote are sent by these threads. Each
+	 * partition has a single task, so its checkpoints go out in order,
+	 * while a slow link only holds up the partitions that use it.
+	 */
+	slsm.slsm_repltq = taskqueue_create("slsrepltq", M_WAITOK,
+	    taskqueue_thread_enqueue, &slsm.slsm_repltq);
+	if (slsm.slsm_repltq == NULL)
+		return (ENOMEM);
+
+	error = taskqueue_start_threads(
+	    &slsm.slsm_repltq, SLSTABLE_REPLTHREADS, PVM,
+	    "SLS Replication Threads");
+	if (error)
+		return (error);
+
 	slstable_task_zone = uma_zcreate("slstable",
 	    sizeof(union slstable_taskctx), NULL, NULL, NULL, NULL,
 	    UMA_ALIGNOF(union slstable_taskctx), 0);
@@ -102,6 +165,30 @@ slstable_init(void)
 void
 slstable_fini(void)
 {
+	if (slsm.slsm_ckpttq != NULL) {
+		taskqueue_drain_all(slsm.slsm_ckpttq);
+		taskqueue_free(slsm.slsm_ckpttq);
+		slsm.slsm_ckpttq = NULL;
+	}
+
+	if (slsm.slsm_repltq != NULL) {
+		taskqueue_drain_all(slsm.slsm_repltq);
+		taskqueue_free(slsm.slsm_repltq);
+		slsm.slsm_repltq = NULL;
+	}
+
+	if (slsm.slsm_metatq != NULL) {
+		taskqueue_drain_all(slsm.slsm_metatq);
+		taskqueue_free(slsm.slsm_metatq);
+		slsm.slsm_metatq = NULL;
+	}
+
+	if (slsm.slsm_collapsetq != NULL) {
+		taskqueue_drain_all(slsm.slsm_collapsetq);
+		taskqueue_free(slsm.slsm_collapsetq);
+		slsm.slsm_collapsetq = NULL;
+	}
+
 	/* Drain the write task queue just in case. */
 	if (slsm.slsm_tabletq != NULL) {
 		taskqueue_drain_all(slsm.slsm_tabletq);
@@ -940,7 +1027,7 @@ sls_read_slos(struct slspart *slsp, struct slsckpt_data **sckptp,
 	free(input_buf, M_SLSMM);
 
 	taskqueue_drain_all(slsm.slsm_tabletq);
-	taskqueue_drain_all(slos.slos_tq);
+	slos_io_drain();
 
 	SDT_PROBE1(sls, , sls_rest, , "Draining the taskqueues");
 	*sckptp = sckpt;
@@ -954,6 +1041,30 @@ error:
 	return (error);
 }
 
+/*
+ * Find the first run of zero pages in the buffer. Returns the number of pages
+ * before the run, and its length in *nzerop.
+ */
+static int
+sls_writeobj_zeroscan(struct buf *bp, int *nzerop)
+{
+	int start, i;
+
+	for (start = 0; start < bp->b_npages; start++) {
+		if (slsvm_page_iszero(bp->b_pages[start]))
+			break;
+	}
+
+	for (i = start; i < bp->b_npages; i++) {
+		if (!slsvm_page_iszero(bp->b_pages[i]))
+			break;
+	}
+
+	*nzerop = i - start;
+
+	return (start);
+}
+
 /*
  * Get the pages of an object in the form of a
  * linked list of contiguous memory areas.
@@ -961,11 +1072,16 @@ error:
  * This function is not inlined in order to be able to use DTrace on it.
  */
 static int __attribute__((noinline))
-sls_writeobj_data(struct vnode *vp, vm_object_t obj, size_t offset)
+sls_writeobj_data(struct vnode *vp, vm_object_t obj, size_t offset,
+    struct slsckpt_data *sckpt)
 {
+	bool dedup = SLSATTR_ISDEDUP(sckpt->sckpt_attr);
+	bool compress = SLSATTR_ISCOMPRESS(sckpt->sckpt_attr);
 	vm_pindex_t pindex;
+	uint64_t zlblkno;
 	struct buf *bp;
-	bool retry;
+	bool retry, hit;
+	int npages, nzero;
 	int error;
 
 	VM_OBJECT_ASSERT_WLOCKED(obj);
@@ -1008,11 +1124,72 @@ sls_writeobj_data(struct vnode *vp, vm_object_t obj, size_t offset)
 		 */
 		bp->b_lblkno += offset;
 
+		/*
+		 * Zero pages become zero extents, which take up no space. We
+		 * write out the pages before the first run of them, and pick up
+		 * the pages after it in the next run.
+		 */
+		nzero = 0;
+		if (sls_zero_elim) {
+			npages = sls_writeobj_zeroscan(bp, &nzero);
+			if (nzero > 0) {
+				zlblkno = bp->b_lblkno + npages;
+				pindex = bp->b_pages[npages]->pindex + nzero;
+				bp = sls_pager_trimbuf(bp, npages);
+			}
+		}
+
+		/*
+		 * Pages already in the SLOS become references to the existing
+		 * blocks. We stop at the first one, and pick up the pages after
+		 * it in the next run.
+		 */
+		if (dedup && bp != NULL) {
+			npages = slsdedup_writebuf(vp, bp, sckpt, &hit);
+			if (hit) {
+				/* We will get to the zero pages again. */
+				pindex = bp->b_pages[npages]->pindex + 1;
+				nzero = 0;
+			}
+			bp = sls_pager_trimbuf(bp, npages);
+		}
+
+		if (nzero > 0) {
+			error = slos_io_zero(vp, zlblkno, nzero * PAGE_SIZE);
+			if (error != 0) {
+				if (bp != NULL)
+					(void)sls_pager_trimbuf(bp, 0);
+				VM_OBJECT_WLOCK(obj);
+				return (error);
+			}
+
+			atomic_add_64(&sls_zero_pages, nzero);
+		}
+
+		if (bp == NULL) {
+			VM_OBJECT_WLOCK(obj);
+			continue;
+		}
+
+		/*
+		 * Compressed runs only write out their frame. They still hold
+		 * on to their pages, which are released when the IO is done.
+		 */
+		if (compress)
+			(void)slos_io_compress(bp);
+
 		/* Update the counter. */
 		sls_bytes_written_direct += bp->b_resid;
 
+		/*
+		 * Asynchronous writes are packed together with those of other
+		 * objects into large sequential segments.
+		 */
 		BUF_ASSERT_LOCKED(bp);
-		error = slos_iotask_create(vp, bp, sls_async_slos);
+		if (sls_async_slos)
+			error = slos_iotask_pack(vp, bp);
+		else
+			error = slos_iotask_create(vp, bp, false);
 		VM_OBJECT_WLOCK(obj);
 		if (error != 0) {
 			return (error);
@@ -1147,7 +1324,7 @@ sls_writedata_slos(struct sls_record *rec, struct slsckpt_data *sckpt)
 	 */
 	for (i = 0; i < amplification; i++) {
 		offset = i * obj->size * SLOS_OBJOFF;
-		ret = sls_writeobj_data(fp->f_vnode, obj, offset);
+		ret = sls_writeobj_data(fp->f_vnode, obj, offset, sckpt);
 		if (ret != 0)
 			break;
 	}
@@ -42,6 +42,8 @@ int sls_readmeta(char *buf, size_t buflen, struct slskv_table *table);
 int sls_read_file(struct slspart *slsp, struct slsckpt_data **sckpt,
     struct slskv_table *objtable);
 int sls_write_file(struct slspart *slsp, struct slsckpt_data *sckpt);
-int sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt);
+int sls_write_socket(struct slspart *slsp, struct slsckpt_data *sckpt,
+    uint64_t epoch, int depth);
+void slssnd_release(struct slsckpt_data *sckpt);
 
 #endif /* _SLSTABLE_H_ */
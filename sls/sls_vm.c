@@ -30,11 +30,57 @@
 
 int sls_objprotect = 1;
 int sls_tracebuf = 1;
+int sls_zero_elim = 1;
+uint64_t sls_zero_pages = 0;
 SDT_PROBE_DEFINE(sls, , , procset_loop);
 
 #define SLS_TRACEBUF_SIZE (32768)
 #define SLS_PRECOPY_MAX (64)
 
+/*
+ * Check whether a page is all zeroes. We OR together a cache line's worth of
+ * words before testing, so the loop has one branch per line and the compiler
+ * is free to use wide loads.
+ */
+bool
+slsvm_page_iszero(vm_page_t m)
+{
+	const uint64_t *words;
+	uint64_t acc;
+	int i;
+
+	words = (const uint64_t *)PHYS_TO_DMAP(VM_PAGE_TO_PHYS(m));
+	for (i = 0; i < PAGE_SIZE / sizeof(*words); i += 8) {
+		acc = words[i] | words[i + 1] | words[i + 2] | words[i + 3] |
+		    words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7];
+		if (acc != 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Fill in a run of zero pages of a restored object. The pages were not
+ * stored, so there is nothing to read.
+ */
+void
+slsvm_object_zerorun(vm_object_t obj, vm_pindex_t pindex, size_t npages)
+{
+	vm_page_t m;
+	size_t i;
+
+	VM_OBJECT_ASSERT_WLOCKED(obj);
+
+	for (i = 0; i < npages; i++) {
+		m = vm_page_grab(obj, pindex + i, VM_ALLOC_NORMAL);
+		if (m->valid != 0 || (m->flags & PG_ZERO) == 0)
+			pmap_zero_page(m);
+		m->valid = VM_PAGE_BITS_ALL;
+		vm_page_xunbusy(m);
+	}
+}
+
 /*
  * Preemptively create private copies of writable pages for the
  * new application. The new pages are inserted in the shadows,
@@ -280,6 +326,40 @@ slsvm_objtable_collapsenew(
 	}
 }
 
+static void
+slsvm_object_collapse(
+    vm_object_t obj, vm_object_t shadow, struct slskv_table *newtable)
+{
+	vm_object_t child;
+	int error;
+
+	KASSERT(obj != NULL, ("Null object"));
+
+	DEBUG4(
+	    "Deallocating object %p (ID %lx), with %d references and %d shadows",
+	    obj, obj->objid, obj->ref_count, obj->shadow_count);
+	if (newtable == NULL) {
+		vm_object_deallocate(obj);
+		return;
+	}
+
+	/* Collapse the old shadow into the parent. */
+	error = slskv_find(newtable, (uint64_t)shadow, (uintptr_t *)&child);
+	if (error != 0) {
+		/* Shadow not in the checkpoint, destroy the original
+		 * object. */
+		vm_object_deallocate(obj);
+		return;
+	}
+
+	/* The shadow is still in the checkpoint. */
+	vm_object_deallocate(shadow);
+	slskv_del(newtable, (uint64_t)shadow);
+	error = slskv_add(newtable, (uint64_t)obj, (uintptr_t)child);
+	KASSERT(error == 0,
+	    ("Object %p shadowed in consecutive checkpoints", obj));
+}
+
 /*
  * Collapse the old object table into the new one.
  */
@@ -287,39 +367,32 @@ void
 slsvm_objtable_collapse(
     struct slskv_table *objtable, struct slskv_table *newtable)
 {
-	vm_object_t obj, shadow, child;
-	int error;
+	vm_object_t obj, shadow;
 
 	/* Remove the Aurora reference from the backing objects. */
 	KV_FOREACH_POP(objtable, obj, shadow)
-	{
-		KASSERT(obj != NULL, ("Null object"));
+	slsvm_object_collapse(obj, shadow, newtable);
+}
 
-		DEBUG4(
-		    "Deallocating object %p (ID %lx), with %d references and %d shadows",
-		    obj, obj->objid, obj->ref_count, obj->shadow_count);
-		if (newtable == NULL) {
-			vm_object_deallocate(obj);
-			continue;
-		}
+/*
+ * Collapse at most count objects of the old object table into the new one.
+ * Returns true once the old table is empty.
+ */
+bool
+slsvm_objtable_collapse_some(
+    struct slskv_table *objtable, struct slskv_table *newtable, int count)
+{
+	vm_object_t obj, shadow;
 
-		/* Collapse the old shadow into the parent. */
-		error = slskv_find(
-		    newtable, (uint64_t)shadow, (uintptr_t *)&child);
-		if (error != 0) {
-			/* Shadow not in the checkpoint, destroy the original
-			 * object. */
-			vm_object_deallocate(obj);
-			continue;
-		}
+	for (; count > 0; count--) {
+		if (slskv_pop(objtable, (uint64_t *)&obj,
+			(uintptr_t *)&shadow) != 0)
+			return (true);
 
-		/* The shadow is still in the checkpoint. */
-		vm_object_deallocate(shadow);
-		slskv_del(newtable, (uint64_t)shadow);
-		error = slskv_add(newtable, (uint64_t)obj, (uintptr_t)child);
-		KASSERT(error == 0,
-		    ("Object %p shadowed in consecutive checkpoints", obj));
+		slsvm_object_collapse(obj, shadow, newtable);
 	}
+
+	return (objtable->count == 0);
 }
 
 static void
@@ -608,6 +681,48 @@ slsvm_procset_shadow(slsset *procset, struct slsckpt_data *sckpt)
 
 	return (0);
 }
+/*
+ * Estimate the pages the processes dirtied since they were last shadowed.
+ * Writes after a checkpoint land in the shadows on top of Aurora's objects,
+ * so their resident pages are exactly the new data. Anonymous memory not
+ * backed by Aurora has never been checkpointed and counts as dirty in full.
+ */
+uint64_t
+slsvm_procset_dirty(slsset *procset)
+{
+	struct vm_map_entry *entry, *header;
+	struct slskv_iter iter;
+	uint64_t dirty = 0;
+	vm_object_t obj;
+	struct proc *p;
+	vm_map_t map;
+
+	KVSET_FOREACH(procset, iter, p)
+	{
+		map = &p->p_vmspace->vm_map;
+		vm_map_lock_read(map);
+		header = &map->header;
+		for (entry = header->next; entry != header;
+		     entry = entry->next) {
+			if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0)
+				continue;
+
+			obj = entry->object.vm_object;
+			if (obj == NULL || !OBJT_ISANONYMOUS(obj))
+				continue;
+
+			/* Entries pointing into Aurora are read only. */
+			if ((obj->flags & OBJ_AURORA) != 0)
+				continue;
+
+			dirty += obj->resident_page_count;
+		}
+		vm_map_unlock_read(map);
+	}
+
+	return (dirty);
+}
+
 /* Transfer a reference between objects. */
 void
 slsvm_object_reftransfer(vm_object_t src, vm_object_t dst)
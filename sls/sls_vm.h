@@ -30,7 +30,10 @@ void slsvm_objtable_collapsenew(
     struct slskv_table *objtable, struct slskv_table *newtable);
 void slsvm_objtable_collapse(
     struct slskv_table *objtable, struct slskv_table *newtable);
+bool slsvm_objtable_collapse_some(
+    struct slskv_table *objtable, struct slskv_table *newtable, int count);
 int slsvm_procset_shadow(slsset *procset, struct slsckpt_data *sckpt);
+uint64_t slsvm_procset_dirty(slsset *procset);
 void slsvm_forceshadow(
     vm_object_t shadow, vm_object_t source, vm_ooffset_t offset);
 
@@ -40,6 +43,9 @@ int slsvm_object_shadow(struct slskv_table *objtable, vm_object_t *objp);
 void slsvm_object_copy(
     struct proc *p, struct vm_map_entry *entry, vm_object_t obj);
 void slsvm_object_precopy(vm_object_t object, vm_object_t parent);
+bool slsvm_page_iszero(vm_page_t m);
+void slsvm_object_zerorun(
+    vm_object_t obj, vm_pindex_t pindex, size_t npages);
 
 void slsvm_print_chain(vm_object_t shadow);
 void slsvm_print_crc32_vmspace(struct vmspace *vm);
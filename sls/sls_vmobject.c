@@ -2,12 +2,15 @@
 #include <sys/conf.h>
 #include <sys/fcntl.h>
 #include <sys/file.h>
+#include <sys/kernel.h>
 #include <sys/limits.h>
+#include <sys/lock.h>
 #include <sys/mman.h>
 #include <sys/namei.h>
 #include <sys/proc.h>
 #include <sys/rwlock.h>
 #include <sys/shm.h>
+#include <sys/sx.h>
 #include <sys/sysent.h>
 #include <sys/vnode.h>
 
@@ -120,10 +123,15 @@ error:
 }
 
 /*
- * Checkpoint and shadow a VM object backing a POSIX or SYSV memory segment.
+ * Metadata for different processes can be captured in parallel, but looking up
+ * and shadowing a shared object must happen atomically.
  */
-int
-slsvmobj_checkpoint_shm(vm_object_t *objp, struct slsckpt_data *sckpt_data)
+static struct sx slsvmobj_shmlk;
+SX_SYSINIT(slsvmobj_shmlk, &slsvmobj_shmlk, "slsshm");
+
+static int
+slsvmobj_checkpoint_shm_locked(
+    vm_object_t *objp, struct slsckpt_data *sckpt_data)
 {
 	vm_object_t obj, shadow;
 	int error;
@@ -169,6 +177,21 @@ slsvmobj_checkpoint_shm(vm_object_t *objp, struct slsckpt_data *sckpt_data)
 	*objp = shadow;
 	return (0);
 }
+
+/*
+ * Checkpoint and shadow a VM object backing a POSIX or SYSV memory segment.
+ */
+int
+slsvmobj_checkpoint_shm(vm_object_t *objp, struct slsckpt_data *sckpt_data)
+{
+	int error;
+
+	sx_xlock(&slsvmobj_shmlk);
+	error = slsvmobj_checkpoint_shm_locked(objp, sckpt_data);
+	sx_xunlock(&slsvmobj_shmlk);
+
+	return (error);
+}
 static int
 slsvmobj_restore(struct slsvmobject *info, struct slsckpt_data *sckpt,
     struct slskv_table *objtable)
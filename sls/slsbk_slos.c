@@ -9,6 +9,36 @@
 
 struct slspart_serial ssparts[SLS_OIDRANGE];
 
+/*
+ * The partition table starts with a header. Tables written before it had
+ * one begin with the entry for OID 0, which is never valid and so starts
+ * with zeroes instead of the magic.
+ */
+#define SSPART_MAGIC (0x7A5C9E3187D20B64ULL)
+#define SSPART_VERSION (1)
+
+struct slspart_header {
+	uint64_t ssh_magic;
+	uint64_t ssh_version;
+};
+
+/* Partition attributes and entries of unversioned tables. */
+struct sls_attr_v0 {
+	int attr_target;
+	int attr_mode;
+	int attr_period;
+	int attr_flags;
+	size_t attr_amplification;
+};
+
+struct slspart_serial_v0 {
+	bool sspart_valid;
+	uint64_t sspart_oid;
+	struct sls_attr_v0 sspart_attr;
+	uint64_t sspart_epoch;
+	char sspart_private[SSPART_BUFSIZE];
+};
+
 struct sls_backend_slos {
 	int slosbk_type;
 	struct sls_backend_ops *slosbk_ops;
@@ -82,12 +112,57 @@ slosbk_deserialize(void)
 	return (0);
 }
 
+/*
+ * Read a table without a header into the current format. The header we
+ * already read is the beginning of the first entry.
+ */
+static int
+slosbk_import_v0(struct file *fp, struct slspart_header *ssh)
+{
+	size_t sspartsv0_len = sizeof(struct slspart_serial_v0) * SLS_OIDRANGE;
+	struct slspart_serial_v0 *sspartsv0, *sspart;
+	int error;
+	int i;
+
+	sspartsv0 = malloc(sspartsv0_len, M_SLSMM, M_WAITOK | M_ZERO);
+	memcpy(sspartsv0, ssh, sizeof(*ssh));
+
+	error = slsio_fpread(fp, (char *)sspartsv0 + sizeof(*ssh),
+	    sspartsv0_len - sizeof(*ssh));
+	if (error != 0)
+		goto out;
+
+	for (i = 0; i < SLS_OIDRANGE; i++) {
+		sspart = &sspartsv0[i];
+		ssparts[i] = (struct slspart_serial) {
+			.sspart_valid = sspart->sspart_valid,
+			.sspart_oid = sspart->sspart_oid,
+			.sspart_attr = (struct sls_attr) {
+				.attr_target = sspart->sspart_attr.attr_target,
+				.attr_mode = sspart->sspart_attr.attr_mode,
+				.attr_period = sspart->sspart_attr.attr_period,
+				.attr_flags = sspart->sspart_attr.attr_flags,
+				.attr_amplification =
+				    sspart->sspart_attr.attr_amplification,
+			},
+			.sspart_epoch = sspart->sspart_epoch,
+		};
+		memcpy(ssparts[i].sspart_private, sspart->sspart_private,
+		    SSPART_BUFSIZE);
+	}
+
+out:
+	free(sspartsv0, M_SLSMM);
+	return (error);
+}
+
 static int
 slosbk_import(struct sls_backend *slsbk)
 {
 	struct sls_backend_slos *slosbk = (struct sls_backend_slos *)slsbk;
 	size_t ssparts_len = sizeof(ssparts[0]) * SLS_OIDRANGE;
 	struct thread *td = curthread;
+	struct slspart_header ssh;
 	struct file *fp;
 	int error;
 
@@ -105,7 +180,23 @@ slosbk_import(struct sls_backend *slsbk)
 		return (0);
 	}
 
-	error = slsio_fpread(fp, ssparts, ssparts_len);
+	error = slsio_fpread(fp, &ssh, sizeof(ssh));
+	if (error != 0) {
+		fdrop(fp, td);
+		return (error);
+	}
+
+	if (ssh.ssh_magic != SSPART_MAGIC) {
+		DEBUG("[SSPART] Converting unversioned partition table\n");
+		error = slosbk_import_v0(fp, &ssh);
+	} else if (ssh.ssh_version != SSPART_VERSION) {
+		printf("Partition table version %lu, expected %d\n",
+		    ssh.ssh_version, SSPART_VERSION);
+		error = EINVAL;
+	} else {
+		error = slsio_fpread(fp, ssparts, ssparts_len);
+	}
+
 	if (error != 0) {
 		fdrop(fp, td);
 		return (error);
@@ -126,6 +217,10 @@ slosbk_export(struct sls_backend *slsbk)
 {
 	struct sls_backend_slos *slosbk = (struct sls_backend_slos *)slsbk;
 	size_t ssparts_len = sizeof(ssparts[0]) * SLS_OIDRANGE;
+	struct slspart_header ssh = {
+		.ssh_magic = SSPART_MAGIC,
+		.ssh_version = SSPART_VERSION,
+	};
 	struct thread *td = curthread;
 	struct file *fp;
 	int error;
@@ -138,7 +233,9 @@ slosbk_export(struct sls_backend *slsbk)
 	if (error != 0)
 		return (error);
 
-	error = slsio_fpwrite(fp, ssparts, ssparts_len);
+	error = slsio_fpwrite(fp, &ssh, sizeof(ssh));
+	if (error == 0)
+		error = slsio_fpwrite(fp, ssparts, ssparts_len);
 	DEBUG1("Wrote %ld bytes for partitions\n", ssparts_len);
 
 	fdrop(fp, td);
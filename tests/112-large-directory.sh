@@ -0,0 +1,86 @@
+#!/bin/sh
+
+# Fill a directory past the point where lookups use the name index, remove
+# every other entry, and check the listing before and after a remount.
+
+NUMFILES=4096
+
+. aurora
+
+kldload slos
+slsnewfs
+slsmount
+
+DIR="$MNT/large"
+mkdir $DIR
+
+for i in `seq 1 $NUMFILES`; do
+	touch "$DIR/file-with-a-longer-name-$i"
+done
+
+for i in `seq 1 2 $NUMFILES`; do
+	rm "$DIR/file-with-a-longer-name-$i"
+done
+
+# Refill the freed space with names of a different length.
+for i in `seq 1 $(( $NUMFILES / 4 ))`; do
+	touch "$DIR/f$i"
+done
+
+EXPECTED=$(( $NUMFILES / 2 + $NUMFILES / 4 ))
+
+check_dir(){
+	COUNT=`ls $DIR | wc -l`
+	if [ $COUNT -ne $EXPECTED ]; then
+		echo "Directory has $COUNT entries, expected $EXPECTED"
+		exit 1
+	fi
+
+	for i in `seq 2 2 $NUMFILES`; do
+		if [ ! -e "$DIR/file-with-a-longer-name-$i" ]; then
+			echo "Missing entry $i"
+			exit 1
+		fi
+	done
+
+	if [ -e "$DIR/file-with-a-longer-name-1" ]; then
+		echo "Removed entry still present"
+		exit 1
+	fi
+}
+
+check_dir
+
+slsunmount
+if [ $? -ne 0 ]; then
+    echo "Failed to unmount the SLSFS"
+    exit 1
+fi
+
+slsmount
+if [ $? -ne 0 ]; then
+    echo "Failed to mount"
+    exit 1
+fi
+
+check_dir
+
+rm -r $DIR
+if [ $? -ne 0 ]; then
+    echo "Failed to remove the directory"
+    exit 1
+fi
+
+slsunmount
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+kldunload slos
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+exit 0
@@ -42,6 +42,7 @@ then
     exit 1
 fi
 
+RETRIES=`sysctl -n aurora.repl_retries`
 slsctl checkpoint -o $SENDOID -r
 if [ $? -ne 0 ];
 then
@@ -51,9 +52,20 @@ then
 fi
 
 sleep 5
+
+# The receiver acknowledges every epoch, so no send is ever retried.
+REPLERROR=`sysctl -n aurora.partition.$SENDOID.repl_error`
+RETRIES=$(( `sysctl -n aurora.repl_retries` - $RETRIES ))
 kill $PID
 sleep 2
 
+if [ "$REPLERROR" -ne 0 -o "$RETRIES" -ne 0 ];
+then
+    echo "Replication failed ($REPLERROR, $RETRIES retries)"
+    aurteardown
+    exit 1
+fi
+
 aurteardown
 if [ $? -ne 0 ]; then
     echo "Failed to tear down Aurora"
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+# The log runs in userspace with the SLS calls stubbed out, no need to load
+# the module.
+./walring/walring
+if [ $? -ne 0 ];
+then
+    echo "Write-ahead log test failed"
+    exit 1
+fi
+
+exit 0
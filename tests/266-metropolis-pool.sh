@@ -0,0 +1,32 @@
+#!/bin/sh
+
+. aurora
+
+aursetup
+
+echo "$PWD"
+./metroparts/metroparts -w 1>&2 &
+PID=$!
+
+wait $PID
+if [ $? -ne 0 ];
+then
+  echo "Metropolis mode failed"
+  aurteardown 
+  exit 1
+fi
+
+# Later invocations should have found an instance ready.
+HITS=`sysctl -n aurora_metropolis.1000.hits`
+if [ "$HITS" -eq 0 ];
+then
+  echo "No invocation was served from the pool"
+  aurteardown
+  exit 1
+fi
+
+aurteardown
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
@@ -0,0 +1,45 @@
+#!/bin/sh
+
+. aurora
+
+OID=2000
+
+aursetup
+if [ $? -ne 0 ]; then
+    echo "Failed to set up Aurora"
+    exit 1
+fi
+
+slsctl partadd slos -o $OID -D
+dd if=/dev/zero of=/dev/null bs=1m 1>&2 &
+slsctl attach -p `jobid %1` -o $OID
+
+# The second checkpoint finds the pages of the first in the index.
+for i in 1 2; do
+    slsctl checkpoint -o $OID -r
+    if [ $? -ne 0 ];
+    then
+        echo "Checkpoint $i failed"
+        killandwait %1
+        aurteardown
+        exit 1
+    fi
+done
+
+HITS=`sysctl -n aurora.partition.$OID.dedup_hits`
+killandwait %1
+
+if [ "$HITS" -eq 0 ];
+then
+    echo "No page was deduplicated"
+    aurteardown
+    exit 1
+fi
+
+aurteardown
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+exit 0
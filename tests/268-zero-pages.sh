@@ -0,0 +1,58 @@
+#!/bin/sh
+
+. aurora
+
+OID=2001
+
+aursetup
+if [ $? -ne 0 ]; then
+    echo "Failed to set up Aurora"
+    exit 1
+fi
+
+# The buffers of dd are full of zeroes.
+slsctl partadd slos -o $OID
+dd if=/dev/zero of=/dev/null bs=1m 1>&2 &
+slsctl attach -p `jobid %1` -o $OID
+
+BEFORE=`sysctl -n aurora.zero_pages`
+slsctl checkpoint -o $OID -r
+if [ $? -ne 0 ];
+then
+    echo "Checkpoint failed"
+    killandwait %1
+    aurteardown
+    exit 1
+fi
+
+AFTER=`sysctl -n aurora.zero_pages`
+killandwait %1
+
+if [ "$AFTER" -le "$BEFORE" ];
+then
+    echo "No zero page was elided"
+    aurteardown
+    exit 1
+fi
+
+# Zero pages are filled in on restore without reading them.
+slsctl restore -o $OID &
+PID=$!
+
+sleep 1
+kill $PID
+if [ $? -ne 0 ];
+then
+    echo "Restored process is not running"
+    aurteardown
+    exit 1
+fi
+wait $PID 2> /dev/null
+
+aurteardown
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+exit 0
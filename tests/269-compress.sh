@@ -0,0 +1,65 @@
+#!/bin/sh
+
+. aurora
+
+OID=2002
+
+aursetup
+if [ $? -ne 0 ]; then
+    echo "Failed to set up Aurora"
+    exit 1
+fi
+
+# Write out the zero buffers of dd so that they get compressed.
+ZEROELIM=`sysctl -n aurora.zero_elim`
+sysctl aurora.zero_elim=0 > /dev/null
+
+slsctl partadd slos -o $OID -z
+dd if=/dev/zero of=/dev/null bs=1m 1>&2 &
+slsctl attach -p `jobid %1` -o $OID
+
+CMPIN=`sysctl -n aurora_slos.io_cmpin`
+CMPOUT=`sysctl -n aurora_slos.io_cmpout`
+slsctl checkpoint -o $OID -r
+if [ $? -ne 0 ];
+then
+    echo "Checkpoint failed"
+    killandwait %1
+    sysctl aurora.zero_elim=$ZEROELIM > /dev/null
+    aurteardown
+    exit 1
+fi
+
+CMPIN=$(( `sysctl -n aurora_slos.io_cmpin` - $CMPIN ))
+CMPOUT=$(( `sysctl -n aurora_slos.io_cmpout` - $CMPOUT ))
+killandwait %1
+sysctl aurora.zero_elim=$ZEROELIM > /dev/null
+
+if [ "$CMPOUT" -ge "$CMPIN" ];
+then
+    echo "Data was not compressed ($CMPIN bytes to $CMPOUT)"
+    aurteardown
+    exit 1
+fi
+
+# The restore reads the data back through the compressed frames.
+slsctl restore -o $OID &
+PID=$!
+
+sleep 1
+kill $PID
+if [ $? -ne 0 ];
+then
+    echo "Restored process is not running"
+    aurteardown
+    exit 1
+fi
+wait $PID 2> /dev/null
+
+aurteardown
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+exit 0
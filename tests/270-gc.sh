@@ -0,0 +1,93 @@
+#!/bin/sh
+
+# Collect garbage while files are being rewritten, then make sure the data
+# survives a remount.
+
+. aurora
+
+REFDIR=/tmp/gcref
+WRITERS="1 2 3 4"
+
+aursetup
+if [ $? -ne 0 ]; then
+    echo "Failed to set up Aurora"
+    exit 1
+fi
+
+sysctl aurora_slos.gc_enabled=1 > /dev/null
+sysctl aurora_slos.gc_interval=1 > /dev/null
+sysctl aurora_slos.gc_delay=0 > /dev/null
+
+# Every rewrite leaves the old blocks behind for the collector.
+for i in $WRITERS; do
+    (
+	while [ ! -f /tmp/gcstop ]; do
+	    dd if=/dev/urandom of=$MNT/gc$i bs=64k count=16 2> /dev/null
+	done
+    ) &
+done
+
+RUNS=`sysctl -n aurora_slos.gc_runs`
+for i in `seq 30`; do
+    sync
+    sleep 1
+    if [ `sysctl -n aurora_slos.gc_runs` -gt $(( $RUNS + 1 )) ]; then
+	break
+    fi
+done
+
+touch /tmp/gcstop
+wait
+rm /tmp/gcstop
+
+if [ `sysctl -n aurora_slos.gc_runs` -le $(( $RUNS + 1 )) ]; then
+    echo "The garbage collector did not run"
+    aurteardown
+    exit 1
+fi
+
+if [ `sysctl -n aurora_slos.gc_freed` -eq 0 ]; then
+    echo "No garbage was collected"
+    aurteardown
+    exit 1
+fi
+
+sysctl aurora_slos.gc_enabled=0 > /dev/null
+
+mkdir -p $REFDIR
+for i in $WRITERS; do
+    cp $MNT/gc$i $REFDIR/gc$i
+done
+
+kldunload metropolis
+kldunload sls
+slsunmount
+if [ $? -ne 0 ]; then
+    echo "Failed to unmount the SLSFS"
+    rm -rf $REFDIR
+    exit 1
+fi
+
+slsmount
+if [ $? -ne 0 ]; then
+    echo "Failed to mount"
+    rm -rf $REFDIR
+    exit 1
+fi
+
+for i in $WRITERS; do
+    diff $REFDIR/gc$i $MNT/gc$i
+    if [ $? -ne 0 ]; then
+	echo "File gc$i corrupt after remount"
+	rm -rf $REFDIR
+	slsunmount
+	kldunload slos
+	exit 1
+    fi
+done
+
+rm -rf $REFDIR
+slsunmount
+kldunload slos
+
+exit 0
@@ -0,0 +1,48 @@
+#!/bin/sh
+
+. aurora
+
+OID=2003
+
+aursetup
+if [ $? -ne 0 ]; then
+    echo "Failed to set up Aurora"
+    exit 1
+fi
+
+# Keep the syncer from starting a new epoch between the snapshots.
+CKPTTIME=`sysctl -n aurora_slos.checkpointtime`
+sysctl aurora_slos.checkpointtime=100000 > /dev/null
+
+HITS=`sysctl -n aurora.dedup_hits`
+"./dedup/dedup" > /dev/null 2> /dev/null &
+wait $!
+
+HITS=$(( `sysctl -n aurora.dedup_hits` - $HITS ))
+sysctl aurora_slos.checkpointtime=$CKPTTIME > /dev/null
+
+if [ "$HITS" -eq 0 ];
+then
+    echo "No page was deduplicated"
+    aurteardown
+    exit 1
+fi
+
+# The restored process checks the pages the snapshots shared.
+slsctl restore -o $OID &
+wait $!
+RET=$?
+if [ $RET -ne 0 ];
+then
+    echo "Process exited with $RET"
+    aurteardown
+    exit 1
+fi
+
+aurteardown
+if [ $? -ne 0 ]; then
+    echo "Failed to tear down Aurora"
+    exit 1
+fi
+
+exit 0
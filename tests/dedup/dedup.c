@@ -0,0 +1,121 @@
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <sls.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MMAP_SIZE (PAGE_SIZE * 16)
+#define OID (2003)
+#define ROUNDS (8)
+
+/*
+ * The pages of the first mapping are indexed by a full checkpoint. The
+ * second mapping is then snapshotted with the same data, so that its pages
+ * share the blocks of the first, and right away with different data. The
+ * snapshots do not sync the SLOS, so the rewrite is in the same epoch, and
+ * must not reach the blocks the first mapping still uses.
+ */
+
+static void *
+mmap_anon(void)
+{
+	void *mapping;
+
+	mapping = mmap(NULL, MMAP_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (mapping == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	return (mapping);
+}
+
+static bool
+mmap_isfilled(void *addr, char c)
+{
+	int i;
+
+	for (i = 0; i < MMAP_SIZE; i++) {
+		if (((char *)addr)[i] != c)
+			return (false);
+	}
+
+	return (true);
+}
+
+int
+main(void)
+{
+	struct sls_attr attr;
+	uint64_t nextepoch;
+	void *orig, *copy;
+	int error;
+	int i;
+
+	attr = (struct sls_attr) {
+		.attr_target = SLS_OSD,
+		.attr_mode = SLS_DELTA,
+		.attr_flags = SLSATTR_IGNUNLINKED | SLSATTR_DEDUP,
+		.attr_amplification = 1,
+	};
+
+	orig = mmap_anon();
+	copy = mmap_anon();
+
+	error = sls_partadd(OID, attr, -1);
+	if (error != 0) {
+		perror("sls_partadd");
+		exit(1);
+	}
+
+	error = sls_attach(OID, getpid());
+	if (error != 0)
+		exit(1);
+
+	memset(orig, 'a', MMAP_SIZE);
+	memset(copy, 'c', MMAP_SIZE);
+
+	error = sls_checkpoint_epoch(OID, false, &nextepoch);
+	if (error != 0)
+		exit(1);
+
+	/* The restored process sees the last snapshot of the copy. */
+	if (mmap_isfilled(copy, 'b')) {
+		if (!mmap_isfilled(orig, 'a')) {
+			printf("Shared block overwritten: %.16s\n",
+			    (char *)orig);
+			exit(1);
+		}
+
+		printf("Secret ending!\n");
+		exit(0);
+	}
+
+	/* Only index the pages once they are on disk. */
+	error = sls_untilepoch(OID, nextepoch);
+	if (error != 0) {
+		fprintf(stderr, "sls_untilepoch: %s\n", strerror(error));
+		exit(1);
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		memset(copy, 'a', MMAP_SIZE);
+		error = sls_memsnap(OID, copy);
+		if (error != 0)
+			exit(1);
+
+		memset(copy, 'b', MMAP_SIZE);
+		error = sls_memsnap(OID, copy);
+		if (error != 0)
+			exit(1);
+	}
+
+	printf("Regular ending\n");
+
+	exit(1);
+}
@@ -27,6 +27,7 @@
 #define REPEATS (4)
 #define BUFSIZE (128)
 #define MAXDIGITS (20)
+#define POOLSIZE (2)
 
 #define SERVER ("./metroserver/metroserver")
 #define DELTASERVER ("./metrodelta/metrodelta")
@@ -38,6 +39,7 @@ static struct option pymetro_longopts[] = {
 	{ "accept4", no_argument, NULL, '4' },
 	{ "cached", no_argument, NULL, 'c' },
 	{ "deltarestore", no_argument, NULL, 'd' },
+	{ "pooled", no_argument, NULL, 'w' },
 	{ NULL, no_argument, NULL, 0 },
 };
 
@@ -233,13 +235,14 @@ main(int argc, char **argv)
 	bool cached = false;
 	bool isaccept4 = false;
 	bool deltarest = false;
+	bool pooled = false;
 	uint64_t oid;
 	pid_t pid;
 	int error;
 	long opt;
 	int i;
 
-	while ((opt = getopt_long(argc, argv, "4cd", pymetro_longopts, NULL)) !=
+	while ((opt = getopt_long(argc, argv, "4cdw", pymetro_longopts, NULL)) !=
 	    -1) {
 		switch (opt) {
 		case '4':
@@ -256,8 +259,13 @@ main(int argc, char **argv)
 			deltarest = true;
 			break;
 
+		case 'w':
+			/* Keep instances restored ahead of invocations. */
+			pooled = true;
+			break;
+
 		default:
-			printf("Usage:./pymetro [-4cd]\n");
+			printf("Usage:./pymetro [-4cdw]\n");
 			exit(EX_USAGE);
 			break;
 		}
@@ -285,6 +293,9 @@ main(int argc, char **argv)
 			if (cached)
 				attr.attr_flags |= SLSATTR_CACHEREST;
 
+			if (pooled)
+				attr.attr_poolsize = POOLSIZE;
+
 			if (deltarest) {
 				attr.attr_flags |= SLSATTR_DELTAREST;
 
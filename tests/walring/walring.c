@@ -0,0 +1,127 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sls_wal.h>
+
+#include "sls_stub.h"
+
+/*
+ * Exercise the write-ahead log from multiple threads with the SLS calls
+ * stubbed out. The log is small, so writers keep switching segments while
+ * the full ones are cleared. Replaying the log must only ever produce the
+ * last value a thread wrote into a slot.
+ */
+
+#define THREADS (8)
+#define SLOTS (32)
+#define WRITES (100 * 1000)
+#define WALSIZE (16 * 1024)
+
+struct sls_wal wal;
+long slots[THREADS][SLOTS];
+uint64_t syncs[THREADS];
+
+static void *
+walring_worker(void *arg)
+{
+	long id = (long)arg;
+	long i;
+
+	for (i = 1; i <= WRITES; i++) {
+		sls_wal_memcpy(&wal, &slots[id][i % SLOTS], &i, sizeof(i));
+		if ((i % 97) == 0) {
+			if (sls_wal_sync(&wal) != 0)
+				exit(EXIT_FAILURE);
+			syncs[id] += 1;
+		}
+	}
+
+	return (NULL);
+}
+
+int
+main()
+{
+	long expected[THREADS][SLOTS];
+	pthread_t tids[THREADS];
+	uint64_t totalsyncs = 0;
+	int restored = 0;
+	long i, j;
+
+	/* Make snapshots slow enough for callers to pile up. */
+	sls_stub_delay = 100;
+
+	if (sls_wal_open(&wal, 1, WALSIZE) != 0) {
+		perror("sls_wal_open()");
+		return (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		if (pthread_create(&tids[i], NULL, walring_worker, (void *)i) !=
+		    0) {
+			perror("pthread_create()");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(tids[i], NULL);
+		totalsyncs += syncs[i];
+	}
+
+	if (sls_stub_untilepochs == 0) {
+		fprintf(stderr, "The log never switched segments\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (sls_stub_memsnaps > totalsyncs) {
+		fprintf(stderr, "%lu snapshots for %lu syncs\n",
+		    sls_stub_memsnaps, totalsyncs);
+		return (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		for (j = 0; j < SLOTS; j++) {
+			expected[i][j] = slots[i][j];
+			slots[i][j] = -1;
+		}
+	}
+
+	sls_wal_replay(&wal);
+
+	for (i = 0; i < THREADS; i++) {
+		for (j = 0; j < SLOTS; j++) {
+			if (slots[i][j] == -1)
+				continue;
+
+			if (slots[i][j] != expected[i][j]) {
+				fprintf(stderr, "Slot %ld.%ld is %ld, "
+				    "expected %ld\n", i, j, slots[i][j],
+				    expected[i][j]);
+				return (EXIT_FAILURE);
+			}
+
+			restored += 1;
+		}
+	}
+
+	if (restored == 0) {
+		fprintf(stderr, "Replay restored nothing\n");
+		return (EXIT_FAILURE);
+	}
+
+	printf("%lu syncs, %lu snapshots, %lu segment clears, "
+	       "%d slots replayed\n",
+	    totalsyncs, sls_stub_memsnaps, sls_stub_untilepochs, restored);
+
+	if (sls_wal_close(&wal) != 0) {
+		perror("sls_wal_close()");
+		return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
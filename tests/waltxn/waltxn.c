@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sls_wal.h>
+
+#include "sls_stub.h"
+
+/*
+ * Exercise write-ahead log transactions with the SLS calls stubbed out.
+ * Threads update a node and its parent pointer together, so replay must
+ * never see one without the other.
+ */
+
+#define THREADS (4)
+#define WRITES (50 * 1000)
+#define WALSIZE (64 * 1024)
+
+struct node {
+	long version;
+	char payload[48];
+};
+
+struct sls_wal wal;
+struct node nodes[THREADS];
+long parents[THREADS];
+
+static void *
+waltxn_worker(void *arg)
+{
+	long id = (long)arg;
+	struct sls_wal_txn txn;
+	struct node node;
+	long i;
+
+	for (i = 1; i <= WRITES; i++) {
+		node.version = i;
+		memset(node.payload, (int)i, sizeof(node.payload));
+
+		sls_wal_begin(&wal, &txn);
+		if (sls_wal_append(&txn, &nodes[id], &node, sizeof(node)) != 0)
+			exit(EXIT_FAILURE);
+		if (sls_wal_append(&txn, &parents[id], &i, sizeof(i)) != 0)
+			exit(EXIT_FAILURE);
+		if (sls_wal_commit(&txn) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	return (NULL);
+}
+
+/* Later writes to the same memory are merged in order. */
+static int
+waltxn_merge(void)
+{
+	struct sls_wal_txn txn;
+	char buf[16], x[16], y[8], z[4];
+	char expected[16];
+
+	memset(buf, 0, sizeof(buf));
+	memset(x, 'x', sizeof(x));
+	memset(y, 'y', sizeof(y));
+	memset(z, 'z', sizeof(z));
+
+	sls_wal_begin(&wal, &txn);
+	if (sls_wal_append(&txn, &buf[0], x, sizeof(x)) != 0)
+		return (-1);
+	if (sls_wal_append(&txn, &buf[8], y, sizeof(y)) != 0)
+		return (-1);
+	if (sls_wal_append(&txn, &buf[8], z, sizeof(z)) != 0)
+		return (-1);
+	if (sls_wal_append(&txn, &buf[0], z, sizeof(z)) != 0)
+		return (-1);
+
+	/* Nothing reaches memory before the commit. */
+	if (buf[0] != 0)
+		return (-1);
+
+	if (sls_wal_commit(&txn) != 0)
+		return (-1);
+
+	memcpy(expected, "zzzzxxxxzzzzyyyy", sizeof(expected));
+	if (memcmp(buf, expected, sizeof(buf)) != 0)
+		return (-1);
+
+	memset(buf, 0, sizeof(buf));
+	sls_wal_replay(&wal);
+
+	return (memcmp(buf, expected, sizeof(buf)));
+}
+
+int
+main()
+{
+	pthread_t tids[THREADS];
+	long i;
+	size_t j;
+
+	if (sls_wal_open(&wal, 1, WALSIZE) != 0) {
+		perror("sls_wal_open()");
+		return (EXIT_FAILURE);
+	}
+
+	if (waltxn_merge() != 0) {
+		fprintf(stderr, "Merged writes were applied out of order\n");
+		return (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		if (pthread_create(&tids[i], NULL, waltxn_worker, (void *)i) !=
+		    0) {
+			perror("pthread_create()");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	memset(nodes, 0, sizeof(nodes));
+	memset(parents, 0, sizeof(parents));
+	sls_wal_replay(&wal);
+
+	for (i = 0; i < THREADS; i++) {
+		if (nodes[i].version != parents[i]) {
+			fprintf(stderr, "Node %ld at %ld, parent at %ld\n", i,
+			    nodes[i].version, parents[i]);
+			return (EXIT_FAILURE);
+		}
+
+		for (j = 0; j < sizeof(nodes[i].payload); j++) {
+			if (nodes[i].payload[j] != (char)nodes[i].version) {
+				fprintf(stderr, "Node %ld is torn\n", i);
+				return (EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (sls_wal_close(&wal) != 0) {
+		perror("sls_wal_close()");
+		return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
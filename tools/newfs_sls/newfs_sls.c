@@ -104,6 +104,8 @@ main(int argc, const char *argv[])
 	struct slos_sb *sb = (struct slos_sb *)malloc(ssize);
 	memset(sb, 0, ssize);
 	sb->sb_magic = SLOS_MAGIC;
+	sb->sb_majver = SLOS_MAJOR_VERSION;
+	sb->sb_minver = SLOS_MINOR_VERSION;
 	sb->sb_epoch = EPOCH_INVAL;
 	sb->sb_ssize = ssize;
 	sb->sb_bsize = bsize;
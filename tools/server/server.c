@@ -1,29 +1,32 @@
 #include <sys/types.h>
-#include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifdef __FreeBSD__
+#include <sys/event.h>
+#else
+#include <sys/epoll.h>
+#endif
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 #include <arpa/inet.h>
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "slssrv.h"
+
 #define PORT (5040)
 #define BACKLOG (512)
 #define SLSNETROOT ("/slsnet")
-
-#include <slos_inode.h>
-#include <sls.h>
-#include <sls_ioctl.h>
-#include <sls_message.h>
+#define MAXEVENTS (64)
 
 /* SLS checkpoint server protocol. */
 
@@ -31,55 +34,126 @@
  * XXX Add to the protocol to support bouncing
  * back from a replica/communication failure.
  */
+
 /*
- * SLS server state.
+ * The server multiplexes all clients in a single thread. Each connection is
+ * a state machine driven by its socket becoming readable, so a slow or
+ * misbehaving client only holds up itself.
  */
 
-struct slsmsg_server {
-	int slssrv_listsock;
-	int slssrv_connsock;
+static int
+slssrv_evinit(void)
+{
+#ifdef __FreeBSD__
+	return (kqueue());
+#else
+	return (epoll_create1(0));
+#endif
+}
 
-	int slssrv_rootfd;
-	int slssrv_epochfd;
-	int slssrv_recfd;
-	bool slssrv_done;
+/* Watch the file for input. Closing it removes it from the set. */
+static int
+slssrv_evadd(struct slsmsg_server *srv, int fd, void *udata)
+{
+#ifdef __FreeBSD__
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+	return (kevent(srv->slssrv_evfd, &kev, 1, NULL, 0, NULL));
+#else
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = udata;
+	return (epoll_ctl(srv->slssrv_evfd, EPOLL_CTL_ADD, fd, &ev));
+#endif
+}
 
-	uint64_t slssrv_curoid;
-	char *slssrv_recmapping;
-	size_t slssrv_maplen;
-	char *slssrv_root;
-	char slssrv_buf[PATH_MAX + 1];
-};
+static int
+slssrv_evwait(struct slsmsg_server *srv, void **udata, int max)
+{
+#ifdef __FreeBSD__
+	struct kevent kev[MAXEVENTS];
+	int nev, i;
+
+	nev = kevent(srv->slssrv_evfd, NULL, 0, kev, MIN(max, MAXEVENTS), NULL);
+	for (i = 0; i < nev; i++)
+		udata[i] = kev[i].udata;
+#else
+	struct epoll_event ev[MAXEVENTS];
+	int nev, i;
+
+	nev = epoll_wait(srv->slssrv_evfd, ev, MIN(max, MAXEVENTS), -1);
+	for (i = 0; i < nev; i++)
+		udata[i] = ev[i].data.ptr;
+#endif
+
+	return (nev);
+}
+
+static int
+slssrv_setnonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return (errno);
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return (errno);
+
+	return (0);
+}
 
 void
-slssrv_init(struct slsmsg_server *srv, char *root)
+slssrv_init(struct slsmsg_server *srv, int rootfd, int streamdirfd)
 {
 	memset(srv, 0, sizeof(*srv));
 
 	*srv = (struct slsmsg_server) {
 		.slssrv_listsock = -1,
-		.slssrv_connsock = -1,
-		.slssrv_rootfd = -1,
-		.slssrv_epochfd = -1,
-		.slssrv_recfd = -1,
+		.slssrv_evfd = -1,
+		.slssrv_rootfd = rootfd,
+		.slssrv_streamdirfd = streamdirfd,
 		.slssrv_done = false,
-		.slssrv_root = root,
 	};
+
+	LIST_INIT(&srv->slssrv_parts);
+	LIST_INIT(&srv->slssrv_conns);
+
+	srv->slssrv_evfd = slssrv_evinit();
+	if (srv->slssrv_evfd < 0) {
+		perror("kqueue");
+		exit(EX_OSERR);
+	}
 }
 
 void
 slssrv_fini(struct slsmsg_server *srv)
 {
+	struct slssrv_part *part;
+
+	while (!LIST_EMPTY(&srv->slssrv_conns))
+		slsconn_destroy(LIST_FIRST(&srv->slssrv_conns));
+
+	while (!LIST_EMPTY(&srv->slssrv_parts)) {
+		part = LIST_FIRST(&srv->slssrv_parts);
+		LIST_REMOVE(part, sp_next);
+		slsstore_close(part);
+		close(part->sp_rootfd);
+		free(part);
+	}
+
 	if (srv->slssrv_listsock >= 0)
 		close(srv->slssrv_listsock);
-	if (srv->slssrv_connsock >= 0)
-		close(srv->slssrv_connsock);
+	if (srv->slssrv_evfd >= 0)
+		close(srv->slssrv_evfd);
 	if (srv->slssrv_rootfd >= 0)
 		close(srv->slssrv_rootfd);
-	if (srv->slssrv_epochfd >= 0)
-		close(srv->slssrv_epochfd);
-	if (srv->slssrv_recfd >= 0)
-		close(srv->slssrv_recfd);
+	if (srv->slssrv_streamdirfd >= 0)
+		close(srv->slssrv_streamdirfd);
 
 	memset(srv, 0, sizeof(*srv));
 }
@@ -130,329 +204,292 @@ slssrv_listen(struct slsmsg_server *srv, int port)
 		exit(EX_UNAVAILABLE);
 	}
 
+	error = slssrv_setnonblock(fd);
+	if (error != 0) {
+		perror("fcntl");
+		exit(EX_OSERR);
+	}
+
+	/* The listening socket is the only event without a connection. */
+	error = slssrv_evadd(srv, fd, NULL);
+	if (error != 0) {
+		perror("kevent");
+		exit(EX_OSERR);
+	}
+
 	srv->slssrv_listsock = fd;
 }
 
+/* Accept all pending connections. */
 void
-slssrv_connect(struct slsmsg_server *srv)
+slssrv_accept(struct slsmsg_server *srv)
 {
+	struct slssrv_conn *conn;
 	struct sockaddr_in inaddr;
 	socklen_t addrlen;
-	int error;
 	int fd;
 
-	printf("Waiting for a connection...\n");
-	addrlen = sizeof(inaddr);
-	fd = accept(srv->slssrv_listsock, (struct sockaddr *)&inaddr, &addrlen);
-	if (fd == -1) {
-		perror("accept");
-		exit(EX_USAGE);
-	}
+	for (;;) {
+		addrlen = sizeof(inaddr);
+		fd = accept(
+		    srv->slssrv_listsock, (struct sockaddr *)&inaddr, &addrlen);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != ECONNABORTED && errno != EINTR)
+				perror("accept");
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			return;
+		}
 
-	printf("Connection established. ");
-	printf("Remote Address: %s:%d\n", inet_ntoa(inaddr.sin_addr),
-	    ntohs(inaddr.sin_port));
+		if (slssrv_setnonblock(fd) != 0) {
+			perror("fcntl");
+			close(fd);
+			continue;
+		}
 
-	srv->slssrv_connsock = fd;
-}
+		conn = slsconn_create(srv, fd);
+		if (conn == NULL) {
+			perror("malloc");
+			close(fd);
+			continue;
+		}
 
-void
-slssrv_disconnect(struct slsmsg_server *srv)
-{
-	close(srv->slssrv_connsock);
-	srv->slssrv_connsock = -1;
+		if (slssrv_evadd(srv, fd, conn) != 0) {
+			perror("kevent");
+			slsconn_destroy(conn);
+			continue;
+		}
+	}
 }
 
-int
-slssrv_register(struct slsmsg_server *srv, union slsmsg *msg)
+/*
+ * Find the partition with the given ID. Partitions not yet seen by this
+ * instance of the server may still have a directory from an earlier run.
+ * Registering creates the directory if needed and the local partition.
+ */
+struct slssrv_part *
+slssrv_getpart(struct slsmsg_server *srv, uint64_t oid, bool reg)
 {
-	struct slsmsg_register regmsg = *(struct slsmsg_register *)msg;
-	ssize_t remaining, received;
-	struct sls_attr attr;
+	struct slssrv_part *part;
+	char name[NAME_MAX];
 	int error;
 	int fd;
+#ifdef __FreeBSD__
+	struct sls_attr attr;
+#endif
 
-	memset(&attr, 0, sizeof(attr));
-	attr = (struct sls_attr) {
-		.attr_target = SLS_FILE,
-		.attr_mode = SLS_FULL,
-		.attr_period = 0,
-		.attr_flags = SLSATTR_IGNUNLINKED | SLSATTR_NOCKPT,
-		.attr_amplification = 1,
-	};
-
-	snprintf(srv->slssrv_buf, PATH_MAX, "%s/%ld", srv->slssrv_root,
-	    regmsg.slsmsg_oid);
-	error = mkdir(srv->slssrv_buf, 0660);
-	if (error != 0 && errno != EEXIST) {
-		perror("mkdir");
-		exit(EX_CANTCREAT);
+	LIST_FOREACH(part, &srv->slssrv_parts, sp_next) {
+		if (part->sp_oid == oid)
+			break;
 	}
 
-	fd = open(srv->slssrv_buf, O_RDONLY | O_DIRECTORY);
-	if (fd < 0) {
-		perror("open");
-		exit(EX_OSFILE);
-	}
+	if (part != NULL && !reg)
+		return (part);
 
-	printf("Creating %lx\n", regmsg.slsmsg_oid);
-	sls_partadd(regmsg.slsmsg_oid, attr, fd);
+	if (part == NULL) {
+		snprintf(name, sizeof(name), "%lu", (unsigned long)oid);
+		if (reg) {
+			error = mkdirat(srv->slssrv_rootfd, name, 0770);
+			if (error != 0 && errno != EEXIST)
+				return (NULL);
+		}
 
-	srv->slssrv_rootfd = fd;
+		fd = openat(srv->slssrv_rootfd, name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			return (NULL);
 
-	return (0);
-}
+		part = malloc(sizeof(*part));
+		if (part == NULL) {
+			close(fd);
+			return (NULL);
+		}
 
-int
-slssrv_setupckpt(struct slsmsg_server *srv, union slsmsg *msg)
-{
-	struct slsmsg_ckptstart *setupmsg = (struct slsmsg_ckptstart *)msg;
-	int error;
-	int fd;
+		part->sp_srv = srv;
+		part->sp_oid = oid;
+		part->sp_rootfd = fd;
 
-	snprintf(srv->slssrv_buf, PATH_MAX, "%ld", setupmsg->slsmsg_epoch);
-	error = mkdirat(srv->slssrv_rootfd, srv->slssrv_buf, 0660);
-	if (error != 0) {
-		perror("mkdirat");
-		exit(EX_CANTCREAT);
-	}
+		error = slsstore_open(part);
+		if (error != 0) {
+			fprintf(stderr, "Opening the store of %lu failed: %s\n",
+			    (unsigned long)oid, strerror(error));
+			slsstore_close(part);
+			close(fd);
+			free(part);
+			errno = error;
+			return (NULL);
+		}
 
-	fd = openat(
-	    srv->slssrv_rootfd, srv->slssrv_buf, O_RDONLY | O_DIRECTORY);
-	if (fd < 0) {
-		perror("open");
-		exit(EX_OSFILE);
+		LIST_INSERT_HEAD(&srv->slssrv_parts, part, sp_next);
 	}
 
-	srv->slssrv_epochfd = fd;
+	if (!reg)
+		return (part);
 
-	return (0);
+#ifdef __FreeBSD__
+	attr = (struct sls_attr) {
+		.attr_target = SLS_FILE,
+		.attr_mode = SLS_FULL,
+		.attr_period = 0,
+		.attr_flags = SLSATTR_IGNUNLINKED | SLSATTR_NOCKPT,
+		.attr_amplification = 1,
+	};
+
+	/* The partition may be left over from a previous registration. */
+	error = sls_partadd(oid, attr, part->sp_rootfd);
+	if (error != 0 && errno != EEXIST)
+		perror("sls_partadd");
+#endif
+
+	return (part);
 }
 
-int
-slssrv_storemeta(struct slsmsg_server *srv, union slsmsg *msg)
+void
+server_loop(struct slsmsg_server *srv)
 {
-	struct slsmsg_recmeta *metamsg = (struct slsmsg_recmeta *)msg;
-	ssize_t received;
-	void *addr;
+	void *udata[MAXEVENTS];
+	struct slssrv_conn *conn;
 	int error;
-	int fd;
-
-	if (srv->slssrv_recfd >= 0) {
-		munmap(srv->slssrv_recmapping, srv->slssrv_maplen);
-		close(srv->slssrv_recfd);
-
-		srv->slssrv_recfd = -1;
-		srv->slssrv_recmapping = NULL;
-		srv->slssrv_maplen = 0;
-	}
-
-	snprintf(srv->slssrv_buf, PATH_MAX, "%ld", metamsg->slsmsg_uuid);
-	printf("Opening %s\n", srv->slssrv_buf);
-	fd = openat(
-	    srv->slssrv_epochfd, srv->slssrv_buf, O_RDWR | O_CREAT | O_TRUNC);
-	if (fd < 0) {
-		perror("open");
-		exit(EX_OSFILE);
-	}
-
-	/* For compatibility reasons with the file write path. */
-	if (metamsg->slsmsg_rectype == SLOSREC_MANIFEST)
-		assert(metamsg->slsmsg_totalsize == metamsg->slsmsg_metalen);
-
-	error = ftruncate(fd, metamsg->slsmsg_totalsize);
-	if (error != 0) {
-		perror("ftruncate");
-		exit(EX_OSFILE);
-	}
-
-	addr = mmap(NULL, metamsg->slsmsg_totalsize, PROT_READ | PROT_WRITE,
-	    MAP_SHARED, fd, 0);
-	if (addr == NULL) {
-		perror("mmap");
+	int nev;
+	int i;
+
+	nev = slssrv_evwait(srv, udata, MAXEVENTS);
+	if (nev < 0) {
+		if (errno == EINTR)
+			return;
+		perror("kevent");
 		exit(EX_OSERR);
 	}
 
-	/* Again, for compatibility reasons. */
-	received = recv(
-	    srv->slssrv_connsock, addr, metamsg->slsmsg_metalen, MSG_WAITALL);
-	if (received < 0) {
-		perror("recv");
-		exit(EX_PROTOCOL);
-	}
-
-	assert(received == metamsg->slsmsg_metalen);
+	for (i = 0; i < nev; i++) {
+		conn = udata[i];
+		if (conn == NULL) {
+			slssrv_accept(srv);
+			continue;
+		}
 
-	if (metamsg->slsmsg_rectype != SLOSREC_VMOBJ) {
-		munmap(addr, metamsg->slsmsg_totalsize);
-		error = ftruncate(fd, metamsg->slsmsg_totalsize);
+		/* Errors only ever take down the client that caused them. */
+		error = slsconn_input(conn);
 		if (error != 0) {
-			perror("ftruncate");
-			exit(EX_OSFILE);
+			fprintf(stderr, "Dropping client after %lu bytes: %s\n",
+			    (unsigned long)conn->sc_bytes, strerror(error));
+			slsconn_destroy(conn);
+			continue;
 		}
-		close(fd);
-	} else {
-		srv->slssrv_recfd = fd;
-		srv->slssrv_curoid = metamsg->slsmsg_uuid;
-		srv->slssrv_recmapping = addr;
-		srv->slssrv_maplen = metamsg->slsmsg_totalsize;
-	}
 
-	return (0);
+		if (conn->sc_state == SLSCONN_CLOSED)
+			slsconn_destroy(conn);
+	}
 }
 
-int
-slssrv_storepages(struct slsmsg_server *srv, union slsmsg *msg)
+void
+usage(void)
 {
-	struct slsmsg_recpages *pagemsg = (struct slsmsg_recpages *)msg;
-	size_t offset = pagemsg->slsmsg_offset;
-	size_t received, txsize;
-	char *buf;
-
-	assert(srv->slssrv_recfd >= 0);
-
-	buf = &srv->slssrv_recmapping[offset];
-	txsize = pagemsg->slsmsg_len;
-
-	received = recv(srv->slssrv_connsock, buf, txsize, MSG_WAITALL);
-	if (received < 0) {
-		perror("recv");
-		exit(EX_PROTOCOL);
-	}
-
-	assert(received == txsize);
-
-	return (0);
+	printf("usage: ./server [-k <epochs>] [-r <streamdir>] <basedir>\n");
+	printf("       ./server -m <oid>:<epoch> <basedir>\n");
+	exit(EX_USAGE);
 }
 
+/* Lay out an epoch in the partition directory for the file backend. */
 int
-slssrv_teardownckpt(struct slsmsg_server *srv, union slsmsg *msg)
+slssrv_materialize(struct slsmsg_server *srv, char *spec)
 {
-	struct slsmsg_ckptdone *tearmsg = (struct slsmsg_ckptdone *)msg;
-	size_t received;
+	struct slssrv_part *part;
+	uint64_t oid, epoch;
+	char *end;
+	int error;
 
-	if (srv->slssrv_recfd >= 0) {
-		munmap(srv->slssrv_recmapping, srv->slssrv_maplen);
-		srv->slssrv_recmapping = NULL;
-		srv->slssrv_maplen = 0;
+	oid = strtoull(spec, &end, 10);
+	if (*end != ':')
+		usage();
 
-		close(srv->slssrv_recfd);
-		srv->slssrv_recfd = -1;
+	epoch = strtoull(&end[1], &end, 10);
+	if (*end != '\0')
+		usage();
+
+	part = slssrv_getpart(srv, oid, false);
+	if (part == NULL) {
+		perror("open");
+		return (EX_NOINPUT);
 	}
 
-	if (srv->slssrv_epochfd >= 0) {
-		close(srv->slssrv_epochfd);
-		srv->slssrv_epochfd = -1;
+	error = slsstore_materialize(part, epoch);
+	if (error != 0) {
+		fprintf(stderr, "Materializing epoch %lu failed: %s\n",
+		    (unsigned long)epoch, strerror(error));
+		return (EX_DATAERR);
 	}
 
-	return (0);
+	return (EX_OK);
 }
 
 int
-slssrv_recvmsg(struct slsmsg_server *srv)
+main(int argc, char **argv)
 {
-	enum slsmsgtype msgtype;
-	ssize_t received;
-	union slsmsg msg;
+	struct slsmsg_server srv;
+	char *materialize = NULL;
+	int streamdirfd = -1;
+	uint64_t keep = 0;
+	int rootfd;
 	int error;
+	int opt;
 
-	received = recv(srv->slssrv_connsock, &msg, sizeof(msg), MSG_WAITALL);
-	if (received < 0) {
-		perror("recv");
-		exit(EX_PROTOCOL);
-	}
-
-	printf("The size of the message is %ld, expected %ld\n", received,
-	    sizeof(msg));
-	assert(received == sizeof(msg));
-
-	/* The first member of all message structs is their type. */
-	msgtype = *(enum slsmsgtype *)&msg;
-
-	/*
-	 * If we are doing a checkpoint operation we must
-	 * already have a directory for the partition.
-	 */
-	if ((msgtype != SLSMSG_REGISTER) && (msgtype != SLSMSG_DONE))
-		assert(srv->slssrv_rootfd != -1);
-
-	switch (msgtype) {
-	case SLSMSG_REGISTER:
-		error = slssrv_register(srv, &msg);
-		slssrv_disconnect(srv);
-		break;
-
-	case SLSMSG_CKPTSTART:
-		error = slssrv_setupckpt(srv, &msg);
-		break;
-
-	case SLSMSG_RECMETA:
-		error = slssrv_storemeta(srv, &msg);
-		break;
-
-	case SLSMSG_RECPAGES:
-		error = slssrv_storepages(srv, &msg);
-		break;
-
-	case SLSMSG_CKPTDONE:
-		error = slssrv_teardownckpt(srv, &msg);
-		slssrv_disconnect(srv);
-		break;
-
-	case SLSMSG_DONE:
-		srv->slssrv_done = true;
-		slssrv_disconnect(srv);
-		error = 0;
-		break;
-
-	default:
-		fprintf(stderr, ("invalid message type %d"), msgtype);
-		exit(EX_PROTOCOL);
-	}
-
-	return (error);
-}
-
-void
-server_loop(struct slsmsg_server *srv)
-{
-	int error;
+	while ((opt = getopt(argc, argv, "k:m:r:")) != -1) {
+		switch (opt) {
+		case 'k':
+			keep = strtoull(optarg, NULL, 10);
+			break;
 
-	if (srv->slssrv_connsock == -1)
-		slssrv_connect(srv);
+		case 'm':
+			materialize = optarg;
+			break;
 
-	while (srv->slssrv_connsock != -1) {
-		error = slssrv_recvmsg(srv);
-		if (error != 0) {
-			fprintf(stderr, "Error %d for server\n", error);
+		case 'r':
+			/* Keep a copy of each stream for replaying. */
+			streamdirfd = open(optarg, O_RDONLY | O_DIRECTORY);
+			if (streamdirfd < 0) {
+				perror("open");
+				exit(EX_USAGE);
+			}
 			break;
+
+		default:
+			usage();
 		}
 	}
-}
 
-int
-main(int argc, char **argv)
-{
-	struct slsmsg_server srv;
-	char *root;
-	int error;
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
 
-	if (argc != 2) {
-		printf("usage: ./server <basedir>");
+	rootfd = open(argv[0], O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0) {
+		perror("open");
 		exit(EX_USAGE);
 	}
-	root = argv[1];
 
-	error = chdir(root);
+	slssrv_init(&srv, rootfd, streamdirfd);
+	srv.slssrv_keep = keep;
+
+	if (materialize != NULL) {
+		error = slssrv_materialize(&srv, materialize);
+		slssrv_fini(&srv);
+		return (error);
+	}
+
+	error = slsstore_compactor_start(&srv);
 	if (error != 0) {
-		perror("chdir");
-		exit(EX_USAGE);
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		exit(EX_OSERR);
 	}
 
-	slssrv_init(&srv, root);
 	slssrv_listen(&srv, PORT);
 	while (!srv.slssrv_done)
 		server_loop(&srv);
+
+	slsstore_compactor_stop(&srv);
 	slssrv_fini(&srv);
 
 	return (0);
@@ -0,0 +1,196 @@
+#ifndef _SLSSRV_H_
+#define _SLSSRV_H_
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __FreeBSD__
+#include <slos_inode.h>
+#include <sls.h>
+#include <sls_ioctl.h>
+#else
+#include "slssrv_compat.h"
+#endif
+
+#include <sls_message.h>
+
+/*
+ * The prefix of struct slsvmobject in sls_data.h, which is kernel only. Must
+ * be kept in sync with it.
+ */
+struct slssrv_vmobject {
+	uint64_t magic;
+	uint64_t objptr;
+	uint64_t slsid;
+	uint64_t size; /* In pages */
+	int type;
+	uint64_t backer;     /* ID of the object we shadow, if any */
+	uint64_t backer_off; /* Offset in bytes into the backer */
+};
+
+/*
+ * The page store of a partition. Page data is appended to segment files
+ * as it arrives, and each epoch has an index file describing all of its
+ * records. An object's index entry maps every page it holds to its block
+ * in the segments, including pages received in earlier epochs. Unchanged
+ * pages are thus referenced instead of copied, and any epoch can be read
+ * back without looking at any other. Segments mostly holding pages only
+ * old epochs use are compacted in the background.
+ */
+#define SLSSTORE_SEGPAGES (65536) /* Pages in a store segment */
+#define SLSSTORE_ZEROSEG (UINT64_MAX - 1) /* Segment of zero extents */
+
+/* Where a run of pages of an object lives in the store. */
+struct slsstore_ext {
+	uint64_t ex_pindex; /* First page in the object */
+	uint64_t ex_npages; /* Length of the run */
+	uint64_t ex_seg;    /* Segment holding the data */
+	uint64_t ex_blk;    /* First block in the segment */
+};
+
+/* A record of an epoch: its metadata and, for objects, its page map. */
+struct slsstore_rec {
+	uint64_t sr_uuid;
+	uint64_t sr_rectype;
+	uint64_t sr_metalen;
+	uint64_t sr_totalsize;
+	int sr_refs; /* Epochs holding the record */
+	char *sr_meta;
+	struct slsstore_ext *sr_exts;
+	size_t sr_nexts;
+	size_t sr_extcap;
+};
+
+/* An epoch being received, or the latest one in memory. */
+struct slsstore_epoch {
+	TAILQ_ENTRY(slsstore_epoch) ep_next;
+	uint64_t ep_epoch;
+	uint64_t ep_firstseg; /* Oldest segment we may have written to */
+	struct slsstore_rec **ep_recs;
+	size_t ep_nrecs;
+	size_t ep_reccap;
+};
+
+struct slsstore_seg {
+	LIST_ENTRY(slsstore_seg) sg_next;
+	uint64_t sg_id;
+	uint64_t sg_nblks; /* Blocks written so far */
+	int sg_fd;
+};
+
+/* A partition whose checkpoints we store. */
+struct slssrv_part {
+	LIST_ENTRY(slssrv_part) sp_next;
+	struct slsmsg_server *sp_srv;
+	uint64_t sp_oid; /* Partition ID */
+	int sp_rootfd;	 /* Directory holding the store */
+	int sp_lockfd;	 /* Locked while segments are replaced */
+
+	/*
+	 * The connections and the compactor both use the store, the lock
+	 * protects everything below.
+	 */
+	pthread_mutex_t sp_mtx;
+	LIST_HEAD(, slsstore_seg) sp_segs;
+	struct slsstore_seg *sp_active; /* Segment we are appending to */
+	uint64_t sp_nextseg;
+	struct slsstore_epoch *sp_latest;	   /* Last committed epoch */
+	TAILQ_HEAD(, slsstore_epoch) sp_builds; /* Epochs being received */
+	uint64_t *sp_epochs;			   /* Epochs on disk, sorted */
+	size_t sp_nepochs;
+	size_t sp_epochcap;
+	bool sp_compacting; /* Queued for or under compaction */
+	TAILQ_ENTRY(slssrv_part) sp_compactq;
+};
+
+enum slsconn_state {
+	SLSCONN_HDR,	/* Reading a message */
+	SLSCONN_META,	/* Reading record metadata */
+	SLSCONN_RUNS,	/* Reading page run descriptors */
+	SLSCONN_DATA,	/* Reading page data */
+	SLSCONN_CLOSED, /* The peer is done */
+};
+
+/*
+ * A connection to a client. Sockets are nonblocking, so each connection
+ * keeps the read it is in the middle of and what to do once it completes.
+ */
+struct slssrv_conn {
+	LIST_ENTRY(slssrv_conn) sc_next;
+	struct slsmsg_server *sc_srv;
+	int sc_fd;
+	int sc_streamfd; /* Raw copy of the stream, if recording */
+	uint64_t sc_bytes;
+	enum slsconn_state sc_state;
+
+	/* The read in progress. */
+	char *sc_buf;
+	size_t sc_resid;
+
+	union slsmsg sc_msg;
+	struct slsmsg_pagerun sc_runs[SLSMSG_MAXPAGES];
+	size_t sc_nruns;
+	char *sc_pages; /* Staging for page data on its way to the store */
+
+	/* The checkpoint and record in progress. */
+	struct slssrv_part *sc_part;
+	struct slsstore_epoch *sc_epoch;
+	struct slsstore_rec *sc_rec;
+	uint64_t sc_datapindex; /* Next page of a legacy page message */
+	uint64_t sc_datapages;	/* Pages left in a legacy page message */
+};
+
+/*
+ * SLS server state.
+ */
+struct slsmsg_server {
+	int slssrv_listsock;
+	int slssrv_evfd;
+	int slssrv_rootfd;
+	int slssrv_streamdirfd; /* Where to record streams, or -1 */
+	uint64_t slssrv_streams;
+	bool slssrv_done;
+	uint64_t slssrv_keep; /* Epochs kept per partition, 0 for all */
+
+	/* Background compaction of partition stores. */
+	pthread_t slssrv_compactor;
+	pthread_mutex_t slssrv_cmtx;
+	pthread_cond_t slssrv_ccv;
+	TAILQ_HEAD(, slssrv_part) slssrv_compactq;
+	bool slssrv_cexit;
+
+	LIST_HEAD(, slssrv_part) slssrv_parts;
+	struct slssrv_part *slssrv_lastpart; /* Most recently registered */
+	LIST_HEAD(, slssrv_conn) slssrv_conns;
+};
+
+struct slssrv_part *slssrv_getpart(
+    struct slsmsg_server *srv, uint64_t oid, bool reg);
+
+int slsstore_open(struct slssrv_part *part);
+void slsstore_close(struct slssrv_part *part);
+int slsstore_begin(
+    struct slssrv_part *part, uint64_t epoch, struct slsstore_epoch **epp);
+void slsstore_abort(struct slssrv_part *part, struct slsstore_epoch *ep);
+int slsstore_commit(struct slssrv_part *part, struct slsstore_epoch *ep);
+struct slsstore_rec *slsstore_rec_alloc(uint64_t uuid, uint64_t rectype,
+    uint64_t metalen, uint64_t totalsize);
+void slsstore_rec_release(struct slsstore_rec *rec);
+int slsstore_addrec(struct slsstore_epoch *ep, struct slsstore_rec *rec);
+int slsstore_write(struct slssrv_part *part, struct slsstore_rec *rec,
+    struct slsmsg_pagerun *runs, size_t nruns, char *buf);
+int slsstore_materialize(struct slssrv_part *part, uint64_t epoch);
+int slsstore_compactor_start(struct slsmsg_server *srv);
+void slsstore_compactor_stop(struct slsmsg_server *srv);
+
+struct slssrv_conn *slsconn_create(struct slsmsg_server *srv, int fd);
+void slsconn_destroy(struct slssrv_conn *conn);
+int slsconn_input(struct slssrv_conn *conn);
+
+#endif /* _SLSSRV_H_ */
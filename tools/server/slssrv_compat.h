@@ -0,0 +1,39 @@
+#ifndef _SLSSRV_COMPAT_H_
+#define _SLSSRV_COMPAT_H_
+
+/*
+ * Definitions the server needs from the SLS headers, which only build on
+ * FreeBSD. These must be kept in sync with slos_inode.h and sls_ioctl.h.
+ */
+
+#include <stdint.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE (4096)
+#endif
+
+#define SLOSREC_VMOBJ 0x00000004    /* VM Object */
+#define SLOSREC_MANIFEST 0x0000000a /* Checkpoint Manifest */
+
+#define SLOS_OBJOFF (64)
+
+struct sls_filerun {
+	uint64_t pindex; /* First page of the run */
+	uint64_t npages; /* Length of the run */
+	uint64_t flags;	 /* SLSFILERUN_* */
+};
+
+#define SLSFILERUN_ZERO (0x1)
+
+/* Bump the version whenever the layout of the data files changes. */
+#define SLSFILE_MAGIC (0x534c5346) /* "SLSF" */
+#define SLSFILE_VERSION (2)
+
+struct sls_filehdr {
+	uint32_t magic;	 /* SLSFILE_MAGIC */
+	uint32_t version; /* SLSFILE_VERSION */
+	uint64_t runoff; /* Offset of the run array */
+	uint64_t nruns;	 /* Number of runs in the array */
+};
+
+#endif /* _SLSSRV_COMPAT_H_ */
@@ -0,0 +1,532 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slssrv.h"
+
+/* Reads done for a connection before we let others run. */
+#define SLSCONN_MAXREADS (64)
+
+/* Set up the next read from the client. */
+static void
+slsconn_expect(
+    struct slssrv_conn *conn, enum slsconn_state state, void *buf, size_t len)
+{
+	conn->sc_state = state;
+	conn->sc_buf = buf;
+	conn->sc_resid = len;
+}
+
+static void
+slsconn_expect_msg(struct slssrv_conn *conn)
+{
+	slsconn_expect(conn, SLSCONN_HDR, &conn->sc_msg, sizeof(conn->sc_msg));
+}
+
+struct slssrv_conn *
+slsconn_create(struct slsmsg_server *srv, int fd)
+{
+	struct slssrv_conn *conn;
+	char name[NAME_MAX];
+
+	conn = malloc(sizeof(*conn));
+	if (conn == NULL)
+		return (NULL);
+
+	memset(conn, 0, sizeof(*conn));
+	conn->sc_srv = srv;
+	conn->sc_fd = fd;
+	conn->sc_streamfd = -1;
+
+	if (srv->slssrv_streamdirfd >= 0) {
+		snprintf(name, sizeof(name), "stream-%lu",
+		    (unsigned long)srv->slssrv_streams++);
+		conn->sc_streamfd = openat(srv->slssrv_streamdirfd, name,
+		    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (conn->sc_streamfd < 0)
+			perror("openat");
+	}
+
+	slsconn_expect_msg(conn);
+	LIST_INSERT_HEAD(&srv->slssrv_conns, conn, sc_next);
+
+	return (conn);
+}
+
+void
+slsconn_destroy(struct slssrv_conn *conn)
+{
+	if (conn->sc_rec != NULL)
+		slsstore_rec_release(conn->sc_rec);
+
+	/* Whatever we received of the checkpoint is useless. */
+	if (conn->sc_epoch != NULL)
+		slsstore_abort(conn->sc_part, conn->sc_epoch);
+
+	if (conn->sc_streamfd >= 0)
+		close(conn->sc_streamfd);
+	close(conn->sc_fd);
+
+	LIST_REMOVE(conn, sc_next);
+	free(conn->sc_pages);
+	free(conn);
+}
+
+static int
+slsconn_register(struct slssrv_conn *conn, struct slsmsg_register *regmsg)
+{
+	struct slsmsg_server *srv = conn->sc_srv;
+	struct slssrv_part *part;
+
+	part = slssrv_getpart(srv, regmsg->slsmsg_oid, true);
+	if (part == NULL)
+		return (errno);
+
+	srv->slssrv_lastpart = part;
+
+	/* Registration is all the connection is for. */
+	conn->sc_state = SLSCONN_CLOSED;
+
+	return (0);
+}
+
+static int
+slsconn_ckptstart(struct slssrv_conn *conn, struct slsmsg_ckptstart *msg)
+{
+	struct slsmsg_server *srv = conn->sc_srv;
+	struct slssrv_part *part;
+	int error;
+
+	if (conn->sc_epoch != NULL)
+		return (EINVAL);
+
+	/* Older senders do not say which partition they are. */
+	if (msg->slsmsg_oid != 0)
+		part = slssrv_getpart(srv, msg->slsmsg_oid, false);
+	else
+		part = srv->slssrv_lastpart;
+	if (part == NULL)
+		return (ENOENT);
+
+	error = slsstore_begin(part, msg->slsmsg_epoch, &conn->sc_epoch);
+	if (error != 0)
+		return (error);
+
+	conn->sc_part = part;
+	slsconn_expect_msg(conn);
+
+	return (0);
+}
+
+/* The record is complete, hand it over to the epoch. */
+static int
+slsconn_closerec(struct slssrv_conn *conn)
+{
+	int error;
+
+	if (conn->sc_rec == NULL)
+		return (0);
+
+	error = slsstore_addrec(conn->sc_epoch, conn->sc_rec);
+	if (error != 0)
+		return (error);
+
+	conn->sc_rec = NULL;
+
+	return (0);
+}
+
+static int
+slsconn_recmeta(struct slssrv_conn *conn, struct slsmsg_recmeta *metamsg)
+{
+	struct slsstore_rec *rec;
+	int error;
+
+	if (conn->sc_epoch == NULL)
+		return (EINVAL);
+
+	error = slsconn_closerec(conn);
+	if (error != 0)
+		return (error);
+
+	/* For compatibility reasons with the file write path. */
+	if (metamsg->slsmsg_metalen == 0 ||
+	    metamsg->slsmsg_metalen > metamsg->slsmsg_totalsize)
+		return (EINVAL);
+	if (metamsg->slsmsg_rectype == SLOSREC_MANIFEST &&
+	    metamsg->slsmsg_totalsize != metamsg->slsmsg_metalen)
+		return (EINVAL);
+
+	rec = slsstore_rec_alloc(metamsg->slsmsg_uuid, metamsg->slsmsg_rectype,
+	    metamsg->slsmsg_metalen, metamsg->slsmsg_totalsize);
+	if (rec == NULL)
+		return (errno);
+
+	conn->sc_rec = rec;
+	slsconn_expect(conn, SLSCONN_META, rec->sr_meta, rec->sr_metalen);
+
+	return (0);
+}
+
+static int
+slsconn_metadone(struct slssrv_conn *conn)
+{
+	slsconn_expect_msg(conn);
+
+	/* Only data records have pages following them. */
+	if (conn->sc_rec->sr_rectype != SLOSREC_VMOBJ)
+		return (slsconn_closerec(conn));
+
+	return (0);
+}
+
+/* Check that the pages fit in the record. */
+static bool
+slsconn_inrec(struct slssrv_conn *conn, uint64_t pindex, uint64_t npages)
+{
+	uint64_t maxpages;
+
+	maxpages = conn->sc_rec->sr_totalsize / PAGE_SIZE;
+	if (maxpages < SLOS_OBJOFF)
+		return (false);
+
+	maxpages -= SLOS_OBJOFF;
+
+	return (npages <= maxpages && pindex <= maxpages - npages);
+}
+
+static int
+slsconn_stage(struct slssrv_conn *conn)
+{
+	if (conn->sc_pages != NULL)
+		return (0);
+
+	conn->sc_pages = malloc(SLSMSG_MAXPAGES * PAGE_SIZE);
+	if (conn->sc_pages == NULL)
+		return (ENOMEM);
+
+	return (0);
+}
+
+/* Receive the next chunk of a legacy page message. */
+static void
+slsconn_expect_pages(struct slssrv_conn *conn)
+{
+	uint64_t npages;
+
+	npages = conn->sc_datapages;
+	if (npages > SLSMSG_MAXPAGES)
+		npages = SLSMSG_MAXPAGES;
+
+	conn->sc_runs[0].slsmsg_pindex = conn->sc_datapindex;
+	conn->sc_runs[0].slsmsg_npages = npages;
+	conn->sc_runs[0].slsmsg_flags = 0;
+	conn->sc_nruns = 1;
+
+	conn->sc_datapindex += npages;
+	conn->sc_datapages -= npages;
+
+	slsconn_expect(
+	    conn, SLSCONN_DATA, conn->sc_pages, npages * PAGE_SIZE);
+}
+
+/* Legacy single page run message. */
+static int
+slsconn_recpages(struct slssrv_conn *conn, struct slsmsg_recpages *pagemsg)
+{
+	size_t offset = pagemsg->slsmsg_offset;
+	size_t len = pagemsg->slsmsg_len;
+	int error;
+
+	if (conn->sc_rec == NULL || conn->sc_rec->sr_rectype != SLOSREC_VMOBJ)
+		return (EINVAL);
+
+	if (offset % PAGE_SIZE != 0 || len % PAGE_SIZE != 0 || len == 0 ||
+	    offset < SLOS_OBJOFF * PAGE_SIZE)
+		return (EINVAL);
+
+	if (!slsconn_inrec(conn, (offset / PAGE_SIZE) - SLOS_OBJOFF,
+		len / PAGE_SIZE))
+		return (EINVAL);
+
+	error = slsconn_stage(conn);
+	if (error != 0)
+		return (error);
+
+	conn->sc_datapindex = (offset / PAGE_SIZE) - SLOS_OBJOFF;
+	conn->sc_datapages = len / PAGE_SIZE;
+	slsconn_expect_pages(conn);
+
+	return (0);
+}
+
+static int
+slsconn_recruns(struct slssrv_conn *conn, struct slsmsg_recruns *runmsg)
+{
+	size_t nruns = runmsg->slsmsg_nruns;
+
+	if (conn->sc_rec == NULL || conn->sc_rec->sr_rectype != SLOSREC_VMOBJ)
+		return (EINVAL);
+
+	if (nruns == 0 || nruns > SLSMSG_MAXPAGES)
+		return (EINVAL);
+
+	conn->sc_nruns = nruns;
+	slsconn_expect(conn, SLSCONN_RUNS, conn->sc_runs,
+	    nruns * sizeof(conn->sc_runs[0]));
+
+	return (0);
+}
+
+static int slsconn_datadone(struct slssrv_conn *conn);
+
+/* We have the run descriptors, receive the data into the staging buffer. */
+static int
+slsconn_runsdone(struct slssrv_conn *conn)
+{
+	struct slsmsg_recruns *runmsg = (struct slsmsg_recruns *)&conn->sc_msg;
+	struct slsmsg_pagerun *run;
+	uint64_t next = 0;
+	size_t total;
+	size_t i;
+	int error;
+
+	total = 0;
+	for (i = 0; i < conn->sc_nruns; i++) {
+		run = &conn->sc_runs[i];
+		if (run->slsmsg_npages == 0 ||
+		    (run->slsmsg_flags & ~SLSMSG_RUNZERO) != 0 ||
+		    !slsconn_inrec(
+			conn, run->slsmsg_pindex, run->slsmsg_npages))
+			return (EINVAL);
+
+		/* Runs are sorted and do not overlap. */
+		if (i > 0 && run->slsmsg_pindex < next)
+			return (EINVAL);
+		next = run->slsmsg_pindex + run->slsmsg_npages;
+
+		/* Zero runs have no data. */
+		if ((run->slsmsg_flags & SLSMSG_RUNZERO) == 0) {
+			if (run->slsmsg_npages > SLSMSG_MAXPAGES)
+				return (EINVAL);
+			total += run->slsmsg_npages;
+		}
+	}
+
+	if (total > SLSMSG_MAXPAGES || total * PAGE_SIZE != runmsg->slsmsg_len)
+		return (EINVAL);
+
+	conn->sc_datapages = 0;
+	if (total == 0)
+		return (slsconn_datadone(conn));
+
+	error = slsconn_stage(conn);
+	if (error != 0)
+		return (error);
+
+	slsconn_expect(conn, SLSCONN_DATA, conn->sc_pages, total * PAGE_SIZE);
+
+	return (0);
+}
+
+static int
+slsconn_datadone(struct slssrv_conn *conn)
+{
+	int error;
+
+	error = slsstore_write(conn->sc_part, conn->sc_rec, conn->sc_runs,
+	    conn->sc_nruns, conn->sc_pages);
+	if (error != 0)
+		return (error);
+
+	if (conn->sc_datapages > 0)
+		slsconn_expect_pages(conn);
+	else
+		slsconn_expect_msg(conn);
+
+	return (0);
+}
+
+/*
+ * Tell the client whether we stored the checkpoint. The message is tiny
+ * and the client sends nothing else, so it fits in the socket buffer.
+ */
+static int
+slsconn_ckptack(struct slssrv_conn *conn, uint64_t epoch, int error)
+{
+	struct slsmsg_ckptack *ackmsg;
+	union slsmsg msg;
+	ssize_t written;
+
+	memset(&msg, 0, sizeof(msg));
+	ackmsg = (struct slsmsg_ckptack *)&msg;
+	*ackmsg = (struct slsmsg_ckptack) {
+		.slsmsg_type = SLSMSG_CKPTACK,
+		.slsmsg_epoch = epoch,
+		.slsmsg_error = error,
+	};
+
+	written = send(conn->sc_fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+	if (written < 0)
+		return (errno);
+	if (written != sizeof(msg))
+		return (EAGAIN);
+
+	return (0);
+}
+
+static int
+slsconn_ckptdone(struct slssrv_conn *conn)
+{
+	struct slsstore_epoch *ep = conn->sc_epoch;
+	uint64_t epoch;
+	int error;
+
+	if (ep == NULL)
+		return (EINVAL);
+
+	epoch = ep->ep_epoch;
+	error = slsconn_closerec(conn);
+	if (error == 0) {
+		/* The store consumes the epoch even on failure. */
+		conn->sc_epoch = NULL;
+		error = slsstore_commit(conn->sc_part, ep);
+	}
+
+	/* A client that gets no reply assumes the worst anyway. */
+	(void)slsconn_ckptack(conn, epoch, error);
+	if (error != 0)
+		return (error);
+
+	conn->sc_state = SLSCONN_CLOSED;
+
+	return (0);
+}
+
+static int
+slsconn_dispatch(struct slssrv_conn *conn)
+{
+	union slsmsg *msg = &conn->sc_msg;
+	enum slsmsgtype msgtype;
+
+	/* The first member of all message structs is their type. */
+	msgtype = *(enum slsmsgtype *)msg;
+
+	switch (msgtype) {
+	case SLSMSG_REGISTER:
+		return (slsconn_register(conn, (struct slsmsg_register *)msg));
+
+	case SLSMSG_CKPTSTART:
+		return (
+		    slsconn_ckptstart(conn, (struct slsmsg_ckptstart *)msg));
+
+	case SLSMSG_RECMETA:
+		return (slsconn_recmeta(conn, (struct slsmsg_recmeta *)msg));
+
+	case SLSMSG_RECPAGES:
+		return (slsconn_recpages(conn, (struct slsmsg_recpages *)msg));
+
+	case SLSMSG_RECRUNS:
+		return (slsconn_recruns(conn, (struct slsmsg_recruns *)msg));
+
+	case SLSMSG_CKPTDONE:
+		return (slsconn_ckptdone(conn));
+
+	case SLSMSG_DONE:
+		conn->sc_srv->slssrv_done = true;
+		conn->sc_state = SLSCONN_CLOSED;
+		return (0);
+
+	default:
+		fprintf(stderr, "invalid message type %d\n", msgtype);
+		return (EINVAL);
+	}
+}
+
+/* The pending read is complete, move to the next state. */
+static int
+slsconn_advance(struct slssrv_conn *conn)
+{
+	switch (conn->sc_state) {
+	case SLSCONN_HDR:
+		return (slsconn_dispatch(conn));
+
+	case SLSCONN_META:
+		return (slsconn_metadone(conn));
+
+	case SLSCONN_RUNS:
+		return (slsconn_runsdone(conn));
+
+	case SLSCONN_DATA:
+		return (slsconn_datadone(conn));
+
+	default:
+		return (EINVAL);
+	}
+}
+
+/*
+ * Read whatever the client has sent us, advancing the state machine for
+ * every completed read. Returns nonzero if the connection must be dropped.
+ */
+int
+slsconn_input(struct slssrv_conn *conn)
+{
+	ssize_t received;
+	int error;
+	int i;
+
+	for (i = 0; i < SLSCONN_MAXREADS; i++) {
+		if (conn->sc_state == SLSCONN_CLOSED)
+			return (0);
+
+		received = read(conn->sc_fd, conn->sc_buf, conn->sc_resid);
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (0);
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+
+		/* The client hung up, only fine between checkpoints. */
+		if (received == 0) {
+			if (conn->sc_state != SLSCONN_HDR ||
+			    conn->sc_resid != sizeof(conn->sc_msg) ||
+			    conn->sc_epoch != NULL)
+				return (ECONNRESET);
+
+			conn->sc_state = SLSCONN_CLOSED;
+			return (0);
+		}
+
+		/* Keep a copy of the raw stream if asked to. */
+		if (conn->sc_streamfd >= 0 &&
+		    write(conn->sc_streamfd, conn->sc_buf, received) !=
+			received) {
+			perror("write");
+			close(conn->sc_streamfd);
+			conn->sc_streamfd = -1;
+		}
+
+		conn->sc_bytes += received;
+		conn->sc_buf += received;
+		conn->sc_resid -= received;
+		if (conn->sc_resid > 0)
+			continue;
+
+		error = slsconn_advance(conn);
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
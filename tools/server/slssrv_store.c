@@ -0,0 +1,1778 @@
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slssrv.h"
+
+/*
+ * On disk, a partition's store consists of segment files "seg.<n>" holding
+ * page data, and index files "idx.<epoch>" with the records of each epoch.
+ * Index files are never modified in place, we write out a new version and
+ * rename it over the old one.
+ */
+
+#define SLSSTORE_MAGIC (0x51057043ULL)
+#define SLSSTORE_IOPAGES (64)	   /* Pages per I/O when copying data */
+#define SLSSTORE_MAXMETA (1 << 30) /* Largest record metadata we accept */
+
+struct slsstore_idxhdr {
+	uint64_t ih_magic;
+	uint64_t ih_epoch;
+	uint64_t ih_nrecs;
+};
+
+/* Followed by the metadata, padded to 8 bytes, and then the extents. */
+struct slsstore_idxrec {
+	uint64_t ir_uuid;
+	uint64_t ir_rectype;
+	uint64_t ir_metalen;
+	uint64_t ir_totalsize;
+	uint64_t ir_nexts;
+};
+
+/* Where compaction moved the blocks of a segment. */
+struct slsstore_remap {
+	uint64_t rm_victim;
+	uint64_t rm_nblks;
+	uint64_t rm_live;
+	uint64_t *rm_seg;
+	uint64_t *rm_blk;
+};
+
+#define SLSSTORE_DEAD (UINT64_MAX)
+
+LIST_HEAD(slsstore_seglist, slsstore_seg);
+
+#define ROUNDUP8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct slsstore_rec *
+slsstore_rec_alloc(
+    uint64_t uuid, uint64_t rectype, uint64_t metalen, uint64_t totalsize)
+{
+	struct slsstore_rec *rec;
+
+	if (metalen > SLSSTORE_MAXMETA) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL)
+		return (NULL);
+
+	rec->sr_meta = malloc(metalen > 0 ? metalen : 1);
+	if (rec->sr_meta == NULL) {
+		free(rec);
+		return (NULL);
+	}
+
+	rec->sr_uuid = uuid;
+	rec->sr_rectype = rectype;
+	rec->sr_metalen = metalen;
+	rec->sr_totalsize = totalsize;
+	rec->sr_refs = 1;
+
+	return (rec);
+}
+
+void
+slsstore_rec_release(struct slsstore_rec *rec)
+{
+	if (--rec->sr_refs > 0)
+		return;
+
+	free(rec->sr_meta);
+	free(rec->sr_exts);
+	free(rec);
+}
+
+static struct slsstore_epoch *
+slsstore_epoch_alloc(uint64_t epoch)
+{
+	struct slsstore_epoch *ep;
+
+	ep = calloc(1, sizeof(*ep));
+	if (ep == NULL)
+		return (NULL);
+
+	ep->ep_epoch = epoch;
+
+	return (ep);
+}
+
+static void
+slsstore_epoch_free(struct slsstore_epoch *ep)
+{
+	size_t i;
+
+	if (ep == NULL)
+		return;
+
+	for (i = 0; i < ep->ep_nrecs; i++)
+		slsstore_rec_release(ep->ep_recs[i]);
+	free(ep->ep_recs);
+	free(ep);
+}
+
+int
+slsstore_addrec(struct slsstore_epoch *ep, struct slsstore_rec *rec)
+{
+	struct slsstore_rec **recs;
+	size_t newcap;
+
+	if (ep->ep_nrecs == ep->ep_reccap) {
+		newcap = (ep->ep_reccap > 0) ? 2 * ep->ep_reccap : 64;
+		recs = realloc(ep->ep_recs, newcap * sizeof(*recs));
+		if (recs == NULL)
+			return (ENOMEM);
+
+		ep->ep_recs = recs;
+		ep->ep_reccap = newcap;
+	}
+
+	ep->ep_recs[ep->ep_nrecs++] = rec;
+
+	return (0);
+}
+
+static int
+slsstore_rec_cmp(const void *a, const void *b)
+{
+	const struct slsstore_rec *ra = *(struct slsstore_rec *const *)a;
+	const struct slsstore_rec *rb = *(struct slsstore_rec *const *)b;
+
+	if (ra->sr_uuid != rb->sr_uuid)
+		return ((ra->sr_uuid < rb->sr_uuid) ? -1 : 1);
+
+	return (0);
+}
+
+/* Committed epochs have their records sorted by ID. */
+static struct slsstore_rec *
+slsstore_lookup(struct slsstore_epoch *ep, uint64_t uuid)
+{
+	struct slsstore_rec key = { .sr_uuid = uuid };
+	struct slsstore_rec *keyp = &key;
+	struct slsstore_rec **recp;
+
+	if (ep == NULL || ep->ep_nrecs == 0)
+		return (NULL);
+
+	recp = bsearch(&keyp, ep->ep_recs, ep->ep_nrecs, sizeof(*ep->ep_recs),
+	    slsstore_rec_cmp);
+
+	return ((recp != NULL) ? *recp : NULL);
+}
+
+static int
+slsstore_ext_reserve(struct slsstore_rec *rec, size_t count)
+{
+	struct slsstore_ext *exts;
+	size_t newcap;
+
+	if (rec->sr_nexts + count <= rec->sr_extcap)
+		return (0);
+
+	newcap = (rec->sr_extcap > 0) ? 2 * rec->sr_extcap : 16;
+	while (newcap < rec->sr_nexts + count)
+		newcap *= 2;
+
+	exts = realloc(rec->sr_exts, newcap * sizeof(*exts));
+	if (exts == NULL)
+		return (ENOMEM);
+
+	rec->sr_exts = exts;
+	rec->sr_extcap = newcap;
+
+	return (0);
+}
+
+/* Append an extent, merging it with the last one if possible. */
+static void
+slsstore_extcat(struct slsstore_ext *exts, size_t *nextsp,
+    uint64_t pindex, uint64_t npages, uint64_t seg, uint64_t blk)
+{
+	struct slsstore_ext *last;
+
+	if (npages == 0)
+		return;
+
+	/* Zero extents have no blocks. */
+	if (seg == SLSSTORE_ZEROSEG)
+		blk = 0;
+
+	if (*nextsp > 0) {
+		last = &exts[*nextsp - 1];
+		if (last->ex_pindex + last->ex_npages == pindex &&
+		    last->ex_seg == seg &&
+		    (seg == SLSSTORE_ZEROSEG ||
+			last->ex_blk + last->ex_npages == blk)) {
+			last->ex_npages += npages;
+			return;
+		}
+	}
+
+	exts[(*nextsp)++] = (struct slsstore_ext) {
+		.ex_pindex = pindex,
+		.ex_npages = npages,
+		.ex_seg = seg,
+		.ex_blk = blk,
+	};
+}
+
+/* Seal the active segment and start a new one. */
+static int
+slsstore_newseg(struct slssrv_part *part)
+{
+	struct slsstore_seg *seg;
+	char name[NAME_MAX];
+
+	seg = malloc(sizeof(*seg));
+	if (seg == NULL)
+		return (ENOMEM);
+
+	seg->sg_id = part->sp_nextseg++;
+	seg->sg_nblks = 0;
+
+	snprintf(name, sizeof(name), "seg.%lu", (unsigned long)seg->sg_id);
+	seg->sg_fd = openat(
+	    part->sp_rootfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (seg->sg_fd < 0) {
+		free(seg);
+		return (errno);
+	}
+
+	LIST_INSERT_HEAD(&part->sp_segs, seg, sg_next);
+	part->sp_active = seg;
+
+	return (0);
+}
+
+static int
+slsstore_pwrite(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t written;
+
+	while (len > 0) {
+		written = pwrite(fd, buf, len, off);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+
+		buf += written;
+		off += written;
+		len -= written;
+	}
+
+	return (0);
+}
+
+static int
+slsstore_pread(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t received;
+
+	while (len > 0) {
+		received = pread(fd, buf, len, off);
+		if (received < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+
+		/* Segments never have holes where extents point. */
+		if (received == 0)
+			return (EIO);
+
+		buf += received;
+		off += received;
+		len -= received;
+	}
+
+	return (0);
+}
+
+/*
+ * Append the pages of the runs to the store. The data of the runs is laid
+ * out back to back in the buffer, and the runs must come after any pages
+ * of the record we already have. Zero runs only get an extent.
+ */
+int
+slsstore_write(struct slssrv_part *part, struct slsstore_rec *rec,
+    struct slsmsg_pagerun *runs, size_t nruns, char *buf)
+{
+	uint64_t pindex, left, count, blk;
+	struct slsstore_ext *last;
+	struct slsstore_seg *seg;
+	int error = 0;
+	size_t i;
+
+	if (rec->sr_nexts > 0) {
+		last = &rec->sr_exts[rec->sr_nexts - 1];
+		if (runs[0].slsmsg_pindex < last->ex_pindex + last->ex_npages)
+			return (EINVAL);
+	}
+
+	pthread_mutex_lock(&part->sp_mtx);
+
+	for (i = 0; i < nruns && error == 0; i++) {
+		pindex = runs[i].slsmsg_pindex;
+		left = runs[i].slsmsg_npages;
+
+		if (runs[i].slsmsg_flags & SLSMSG_RUNZERO) {
+			error = slsstore_ext_reserve(rec, 1);
+			if (error == 0)
+				slsstore_extcat(rec->sr_exts, &rec->sr_nexts,
+				    pindex, left, SLSSTORE_ZEROSEG, 0);
+			continue;
+		}
+
+		while (left > 0) {
+			if (part->sp_active == NULL ||
+			    part->sp_active->sg_nblks == SLSSTORE_SEGPAGES) {
+				error = slsstore_newseg(part);
+				if (error != 0)
+					break;
+			}
+
+			seg = part->sp_active;
+			blk = seg->sg_nblks;
+			count = SLSSTORE_SEGPAGES - blk;
+			if (count > left)
+				count = left;
+
+			error = slsstore_ext_reserve(rec, 1);
+			if (error != 0)
+				break;
+
+			error = slsstore_pwrite(seg->sg_fd, buf,
+			    count * PAGE_SIZE, blk * PAGE_SIZE);
+			if (error != 0)
+				break;
+
+			seg->sg_nblks += count;
+			slsstore_extcat(rec->sr_exts, &rec->sr_nexts, pindex,
+			    count, seg->sg_id, blk);
+
+			buf += count * PAGE_SIZE;
+			pindex += count;
+			left -= count;
+		}
+	}
+
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	return (error);
+}
+
+/*
+ * Get the page map of the object backing a shadow, as seen from the shadow.
+ * Shadow pages are at an offset into the backer and only cover part of it.
+ */
+static int
+slsstore_backermap(struct slsstore_rec *backer, uint64_t off, uint64_t size,
+    struct slsstore_ext **extsp, size_t *nextsp)
+{
+	struct slsstore_ext *exts, *ext;
+	uint64_t start, end, skip;
+	size_t nexts = 0;
+	size_t i;
+
+	exts = malloc((backer->sr_nexts + 1) * sizeof(*exts));
+	if (exts == NULL)
+		return (ENOMEM);
+
+	for (i = 0; i < backer->sr_nexts; i++) {
+		ext = &backer->sr_exts[i];
+		start = ext->ex_pindex;
+		end = ext->ex_pindex + ext->ex_npages;
+		if (end <= off || start >= off + size)
+			continue;
+
+		skip = (start < off) ? off - start : 0;
+		if (end > off + size)
+			end = off + size;
+
+		slsstore_extcat(exts, &nexts, start + skip - off,
+		    end - start - skip, ext->ex_seg, ext->ex_blk + skip);
+	}
+
+	*extsp = exts;
+	*nextsp = nexts;
+
+	return (0);
+}
+
+/*
+ * Lay the pages we received for the record over the pages it inherits.
+ * Both arrays are sorted and the received pages win.
+ */
+static int
+slsstore_overlay(
+    struct slsstore_rec *rec, struct slsstore_ext *base, size_t nbase)
+{
+	struct slsstore_ext *new = rec->sr_exts;
+	size_t nnew = rec->sr_nexts;
+	uint64_t bstart, bend, nend;
+	struct slsstore_ext *out;
+	size_t nout = 0;
+	uint64_t off = 0;
+	size_t i = 0, j = 0;
+
+	/* Each received extent can split at most one inherited one. */
+	out = malloc((nbase + 2 * nnew + 1) * sizeof(*out));
+	if (out == NULL)
+		return (ENOMEM);
+
+	for (;;) {
+		if (i < nbase && off >= base[i].ex_npages) {
+			i += 1;
+			off = 0;
+			continue;
+		}
+
+		if (i >= nbase && j >= nnew)
+			break;
+
+		bstart = (i < nbase) ? base[i].ex_pindex + off : 0;
+		if (j < nnew && (i >= nbase || new[j].ex_pindex <= bstart)) {
+			nend = new[j].ex_pindex + new[j].ex_npages;
+			slsstore_extcat(out, &nout, new[j].ex_pindex,
+			    new[j].ex_npages, new[j].ex_seg, new[j].ex_blk);
+			j += 1;
+
+			/* Drop the inherited pages we just replaced. */
+			while (i < nbase &&
+			    base[i].ex_pindex + base[i].ex_npages <= nend) {
+				i += 1;
+				off = 0;
+			}
+
+			if (i < nbase && base[i].ex_pindex + off < nend)
+				off = nend - base[i].ex_pindex;
+			continue;
+		}
+
+		bend = base[i].ex_pindex + base[i].ex_npages;
+		if (j < nnew && new[j].ex_pindex < bend)
+			bend = new[j].ex_pindex;
+
+		slsstore_extcat(out, &nout, bstart, bend - bstart,
+		    base[i].ex_seg, base[i].ex_blk + off);
+		off += bend - bstart;
+	}
+
+	free(rec->sr_exts);
+	rec->sr_exts = out;
+	rec->sr_nexts = nout;
+	rec->sr_extcap = nbase + 2 * nnew + 1;
+
+	return (0);
+}
+
+/*
+ * Shadow objects only hold the pages written since the last checkpoint.
+ * Give them the rest of their pages from the previous version of the
+ * object, or failing that from the object they shadow, so that each epoch
+ * has the full page map of its objects.
+ */
+static int
+slsstore_inherit(struct slsstore_epoch *latest, struct slsstore_rec *rec)
+{
+	struct slssrv_vmobject *vminfo;
+	struct slsstore_ext *base;
+	struct slsstore_rec *backer;
+	uint64_t off = 0;
+	size_t nbase;
+	int error;
+
+	if (rec->sr_rectype != SLOSREC_VMOBJ ||
+	    rec->sr_metalen < sizeof(*vminfo))
+		return (0);
+
+	vminfo = (struct slssrv_vmobject *)rec->sr_meta;
+
+	/* Aurora shadows keep the ID of the object they shadow. */
+	backer = slsstore_lookup(latest, rec->sr_uuid);
+	if (backer == NULL && vminfo->backer != 0) {
+		backer = slsstore_lookup(latest, vminfo->backer);
+		off = vminfo->backer_off / PAGE_SIZE;
+	}
+
+	if (backer == NULL || backer->sr_nexts == 0)
+		return (0);
+
+	error = slsstore_backermap(backer, off, vminfo->size, &base, &nbase);
+	if (error != 0)
+		return (error);
+
+	error = slsstore_overlay(rec, base, nbase);
+	free(base);
+
+	return (error);
+}
+
+/* Find the objects the manifest of the epoch references, if we have it. */
+static struct slsstore_rec *
+slsstore_manifest(struct slsstore_epoch *ep, uint64_t **idsp, size_t *nidsp)
+{
+	struct slsstore_rec *rec;
+	uint64_t nids;
+	size_t i;
+
+	for (i = 0; i < ep->ep_nrecs; i++) {
+		rec = ep->ep_recs[i];
+		if (rec->sr_rectype != SLOSREC_MANIFEST)
+			continue;
+
+		if (rec->sr_metalen < sizeof(nids))
+			return (NULL);
+
+		memcpy(&nids, rec->sr_meta, sizeof(nids));
+		if (nids > (rec->sr_metalen - sizeof(nids)) / sizeof(uint64_t))
+			return (NULL);
+
+		*idsp = (uint64_t *)&rec->sr_meta[sizeof(nids)];
+		*nidsp = nids;
+		return (rec);
+	}
+
+	return (NULL);
+}
+
+static bool
+slsstore_referenced(uint64_t *ids, size_t nids, uint64_t uuid)
+{
+	size_t i;
+
+	for (i = 0; i < nids; i++) {
+		if (ids[i] == uuid)
+			return (true);
+	}
+
+	return (false);
+}
+
+static int
+slsstore_writeidx(int dirfd, struct slsstore_epoch *ep)
+{
+	char name[NAME_MAX], tmpname[NAME_MAX];
+	struct slsstore_idxhdr hdr;
+	struct slsstore_idxrec irec;
+	struct slsstore_rec *rec;
+	uint64_t pad = 0;
+	int error = 0;
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	snprintf(name, sizeof(name), "idx.%lu", (unsigned long)ep->ep_epoch);
+	snprintf(tmpname, sizeof(tmpname), "idx.%lu.tmp",
+	    (unsigned long)ep->ep_epoch);
+
+	fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return (errno);
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		error = errno;
+		close(fd);
+		unlinkat(dirfd, tmpname, 0);
+		return (error);
+	}
+
+	hdr = (struct slsstore_idxhdr) {
+		.ih_magic = SLSSTORE_MAGIC,
+		.ih_epoch = ep->ep_epoch,
+		.ih_nrecs = ep->ep_nrecs,
+	};
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < ep->ep_nrecs; i++) {
+		rec = ep->ep_recs[i];
+		irec = (struct slsstore_idxrec) {
+			.ir_uuid = rec->sr_uuid,
+			.ir_rectype = rec->sr_rectype,
+			.ir_metalen = rec->sr_metalen,
+			.ir_totalsize = rec->sr_totalsize,
+			.ir_nexts = rec->sr_nexts,
+		};
+
+		fwrite(&irec, sizeof(irec), 1, fp);
+		fwrite(rec->sr_meta, 1, rec->sr_metalen, fp);
+		fwrite(&pad, 1, ROUNDUP8(rec->sr_metalen) - rec->sr_metalen,
+		    fp);
+		if (rec->sr_nexts > 0)
+			fwrite(rec->sr_exts, sizeof(*rec->sr_exts),
+			    rec->sr_nexts, fp);
+	}
+
+	if (ferror(fp) || fflush(fp) != 0)
+		error = (errno != 0) ? errno : EIO;
+
+	/* The index is what makes the epoch visible, it must be whole. */
+	if (error == 0 && fsync(fd) != 0)
+		error = errno;
+
+	fclose(fp);
+
+	if (error == 0 && renameat(dirfd, tmpname, dirfd, name) != 0)
+		error = errno;
+
+	if (error == 0 && fsync(dirfd) != 0)
+		error = errno;
+
+	if (error != 0)
+		unlinkat(dirfd, tmpname, 0);
+
+	return (error);
+}
+
+static int
+slsstore_readidx(int dirfd, uint64_t epoch, struct slsstore_epoch **epp)
+{
+	struct slsstore_idxhdr *hdr;
+	struct slsstore_idxrec *irec;
+	struct slsstore_epoch *ep;
+	struct slsstore_rec *rec;
+	char name[NAME_MAX];
+	size_t off, extlen;
+	struct stat st;
+	char *buf;
+	int error;
+	size_t i;
+	int fd;
+
+	snprintf(name, sizeof(name), "idx.%lu", (unsigned long)epoch);
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0)
+		return (errno);
+
+	if (fstat(fd, &st) != 0) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+
+	buf = malloc(st.st_size > 0 ? st.st_size : 1);
+	if (buf == NULL) {
+		close(fd);
+		return (ENOMEM);
+	}
+
+	error = slsstore_pread(fd, buf, st.st_size, 0);
+	close(fd);
+	if (error != 0) {
+		free(buf);
+		return (error);
+	}
+
+	ep = slsstore_epoch_alloc(epoch);
+	if (ep == NULL) {
+		free(buf);
+		return (ENOMEM);
+	}
+
+	error = EINVAL;
+	hdr = (struct slsstore_idxhdr *)buf;
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    hdr->ih_magic != SLSSTORE_MAGIC || hdr->ih_epoch != epoch)
+		goto error;
+
+	off = sizeof(*hdr);
+	for (i = 0; i < hdr->ih_nrecs; i++) {
+		if (st.st_size - off < sizeof(*irec))
+			goto error;
+
+		irec = (struct slsstore_idxrec *)&buf[off];
+		off += sizeof(*irec);
+
+		if (irec->ir_metalen > SLSSTORE_MAXMETA ||
+		    irec->ir_nexts > (st.st_size - off) / sizeof(*rec->sr_exts))
+			goto error;
+
+		extlen = irec->ir_nexts * sizeof(*rec->sr_exts);
+		if (st.st_size - off < ROUNDUP8(irec->ir_metalen) + extlen)
+			goto error;
+
+		rec = slsstore_rec_alloc(irec->ir_uuid, irec->ir_rectype,
+		    irec->ir_metalen, irec->ir_totalsize);
+		if (rec == NULL) {
+			error = ENOMEM;
+			goto error;
+		}
+
+		if (slsstore_addrec(ep, rec) != 0) {
+			slsstore_rec_release(rec);
+			error = ENOMEM;
+			goto error;
+		}
+
+		memcpy(rec->sr_meta, &buf[off], irec->ir_metalen);
+		off += ROUNDUP8(irec->ir_metalen);
+
+		if (irec->ir_nexts == 0)
+			continue;
+
+		rec->sr_exts = malloc(extlen);
+		if (rec->sr_exts == NULL) {
+			error = ENOMEM;
+			goto error;
+		}
+
+		memcpy(rec->sr_exts, &buf[off], extlen);
+		rec->sr_nexts = rec->sr_extcap = irec->ir_nexts;
+		off += extlen;
+	}
+
+	free(buf);
+	*epp = ep;
+
+	return (0);
+
+error:
+	free(buf);
+	slsstore_epoch_free(ep);
+
+	return (error);
+}
+
+static int
+slsstore_u64cmp(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return ((ua < ub) ? -1 : (ua > ub));
+}
+
+static int
+slsstore_addepoch(struct slssrv_part *part, uint64_t epoch)
+{
+	uint64_t *epochs;
+	size_t newcap;
+
+	if (part->sp_nepochs == part->sp_epochcap) {
+		newcap = (part->sp_epochcap > 0) ? 2 * part->sp_epochcap : 16;
+		epochs = realloc(part->sp_epochs, newcap * sizeof(*epochs));
+		if (epochs == NULL)
+			return (ENOMEM);
+
+		part->sp_epochs = epochs;
+		part->sp_epochcap = newcap;
+	}
+
+	part->sp_epochs[part->sp_nepochs++] = epoch;
+
+	return (0);
+}
+
+static bool
+slsstore_hasepoch(struct slssrv_part *part, uint64_t epoch)
+{
+	if (part->sp_nepochs == 0)
+		return (false);
+
+	return (bsearch(&epoch, part->sp_epochs, part->sp_nepochs,
+		    sizeof(*part->sp_epochs), slsstore_u64cmp) != NULL);
+}
+
+/* Pick up the store left by a previous instance of the server. */
+int
+slsstore_open(struct slssrv_part *part)
+{
+	struct slsstore_seg *seg;
+	struct dirent *dp;
+	unsigned long id;
+	struct stat st;
+	char *end;
+	DIR *dir;
+	int error;
+	int fd;
+
+	pthread_mutex_init(&part->sp_mtx, NULL);
+	LIST_INIT(&part->sp_segs);
+	TAILQ_INIT(&part->sp_builds);
+	part->sp_active = NULL;
+	part->sp_nextseg = 0;
+	part->sp_latest = NULL;
+	part->sp_epochs = NULL;
+	part->sp_nepochs = part->sp_epochcap = 0;
+	part->sp_compacting = false;
+
+	part->sp_lockfd = openat(
+	    part->sp_rootfd, "lock", O_RDWR | O_CREAT, 0600);
+	if (part->sp_lockfd < 0)
+		return (errno);
+
+	fd = dup(part->sp_rootfd);
+	if (fd < 0)
+		return (errno);
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+
+	error = 0;
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, "seg.", 4) == 0) {
+			id = strtoul(&dp->d_name[4], &end, 10);
+			if (*end != '\0')
+				continue;
+
+			seg = malloc(sizeof(*seg));
+			if (seg == NULL) {
+				error = ENOMEM;
+				break;
+			}
+
+			seg->sg_id = id;
+			seg->sg_fd = openat(
+			    part->sp_rootfd, dp->d_name, O_RDWR);
+			if (seg->sg_fd < 0 || fstat(seg->sg_fd, &st) != 0) {
+				error = errno;
+				free(seg);
+				break;
+			}
+
+			seg->sg_nblks = st.st_size / PAGE_SIZE;
+			LIST_INSERT_HEAD(&part->sp_segs, seg, sg_next);
+			if (id >= part->sp_nextseg)
+				part->sp_nextseg = id + 1;
+		} else if (strncmp(dp->d_name, "idx.", 4) == 0) {
+			id = strtoul(&dp->d_name[4], &end, 10);
+			/* Leftovers from a crash while writing an index. */
+			if (strcmp(end, ".tmp") == 0) {
+				unlinkat(part->sp_rootfd, dp->d_name, 0);
+				continue;
+			}
+			if (*end != '\0')
+				continue;
+
+			error = slsstore_addepoch(part, id);
+			if (error != 0)
+				break;
+		}
+	}
+
+	closedir(dir);
+	if (error != 0)
+		return (error);
+
+	/* New data always goes to a new segment. */
+	if (part->sp_nepochs > 0) {
+		qsort(part->sp_epochs, part->sp_nepochs,
+		    sizeof(*part->sp_epochs), slsstore_u64cmp);
+
+		error = slsstore_readidx(part->sp_rootfd,
+		    part->sp_epochs[part->sp_nepochs - 1], &part->sp_latest);
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+void
+slsstore_close(struct slssrv_part *part)
+{
+	struct slsstore_epoch *ep;
+	struct slsstore_seg *seg;
+
+	while (!TAILQ_EMPTY(&part->sp_builds)) {
+		ep = TAILQ_FIRST(&part->sp_builds);
+		TAILQ_REMOVE(&part->sp_builds, ep, ep_next);
+		slsstore_epoch_free(ep);
+	}
+
+	while (!LIST_EMPTY(&part->sp_segs)) {
+		seg = LIST_FIRST(&part->sp_segs);
+		LIST_REMOVE(seg, sg_next);
+		close(seg->sg_fd);
+		free(seg);
+	}
+
+	slsstore_epoch_free(part->sp_latest);
+	free(part->sp_epochs);
+	if (part->sp_lockfd >= 0)
+		close(part->sp_lockfd);
+	pthread_mutex_destroy(&part->sp_mtx);
+}
+
+int
+slsstore_begin(
+    struct slssrv_part *part, uint64_t epoch, struct slsstore_epoch **epp)
+{
+	struct slsstore_epoch *ep;
+	int error = 0;
+
+	ep = slsstore_epoch_alloc(epoch);
+	if (ep == NULL)
+		return (ENOMEM);
+
+	pthread_mutex_lock(&part->sp_mtx);
+	if (slsstore_hasepoch(part, epoch)) {
+		error = EEXIST;
+	} else {
+		/* Compaction must leave alone the segments we write to. */
+		ep->ep_firstseg = (part->sp_active != NULL) ?
+		    part->sp_active->sg_id :
+		    part->sp_nextseg;
+		TAILQ_INSERT_TAIL(&part->sp_builds, ep, ep_next);
+	}
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	if (error != 0) {
+		slsstore_epoch_free(ep);
+		return (error);
+	}
+
+	*epp = ep;
+
+	return (0);
+}
+
+/* Drop a partially received epoch. Compaction reclaims its pages. */
+void
+slsstore_abort(struct slssrv_part *part, struct slsstore_epoch *ep)
+{
+	pthread_mutex_lock(&part->sp_mtx);
+	TAILQ_REMOVE(&part->sp_builds, ep, ep_next);
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	slsstore_epoch_free(ep);
+}
+
+static void
+slsstore_compact_enqueue(struct slssrv_part *part)
+{
+	struct slsmsg_server *srv = part->sp_srv;
+
+	if (part->sp_compacting)
+		return;
+
+	part->sp_compacting = true;
+
+	pthread_mutex_lock(&srv->slssrv_cmtx);
+	TAILQ_INSERT_TAIL(&srv->slssrv_compactq, part, sp_compactq);
+	pthread_cond_signal(&srv->slssrv_ccv);
+	pthread_mutex_unlock(&srv->slssrv_cmtx);
+}
+
+/* Forget the oldest epochs if we have more than we should keep. */
+static void
+slsstore_retire(struct slssrv_part *part)
+{
+	uint64_t keep = part->sp_srv->slssrv_keep;
+	char name[NAME_MAX];
+	size_t ndrop, i;
+
+	if (keep == 0 || part->sp_nepochs <= keep)
+		return;
+
+	ndrop = part->sp_nepochs - keep;
+	for (i = 0; i < ndrop; i++) {
+		snprintf(name, sizeof(name), "idx.%lu",
+		    (unsigned long)part->sp_epochs[i]);
+		if (unlinkat(part->sp_rootfd, name, 0) != 0)
+			perror("unlinkat");
+	}
+
+	memmove(part->sp_epochs, &part->sp_epochs[ndrop],
+	    keep * sizeof(*part->sp_epochs));
+	part->sp_nepochs = keep;
+
+	slsstore_compact_enqueue(part);
+}
+
+/* Flush the data of all segments from firstseg onwards to disk. */
+static int
+slsstore_syncsegs(struct slssrv_part *part, uint64_t firstseg)
+{
+	struct slsstore_seg *seg;
+
+	LIST_FOREACH(seg, &part->sp_segs, sg_next) {
+		if (seg->sg_id < firstseg)
+			continue;
+
+		if (fsync(seg->sg_fd) != 0)
+			return (errno);
+	}
+
+	return (0);
+}
+
+/*
+ * Turn a fully received epoch into a self-contained one. Objects get the
+ * pages they inherit, objects the checkpoint still uses but did not resend
+ * are carried over from the latest epoch, and the result goes to disk.
+ */
+int
+slsstore_commit(struct slssrv_part *part, struct slsstore_epoch *ep)
+{
+	struct slsstore_epoch *latest, *old;
+	struct slsstore_rec *rec;
+	uint64_t *ids = NULL;
+	size_t nids = 0;
+	bool manifest;
+	int error = 0;
+	size_t i;
+
+	pthread_mutex_lock(&part->sp_mtx);
+
+	TAILQ_REMOVE(&part->sp_builds, ep, ep_next);
+	latest = part->sp_latest;
+
+	qsort(ep->ep_recs, ep->ep_nrecs, sizeof(*ep->ep_recs),
+	    slsstore_rec_cmp);
+
+	/* A well behaved sender never sends a record twice. */
+	for (i = 1; i < ep->ep_nrecs; i++) {
+		if (ep->ep_recs[i - 1]->sr_uuid == ep->ep_recs[i]->sr_uuid) {
+			error = EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ep->ep_nrecs; i++) {
+		error = slsstore_inherit(latest, ep->ep_recs[i]);
+		if (error != 0)
+			goto out;
+	}
+
+	manifest = (slsstore_manifest(ep, &ids, &nids) != NULL);
+	for (i = 0; latest != NULL && i < latest->ep_nrecs; i++) {
+		rec = latest->ep_recs[i];
+		if (slsstore_lookup(ep, rec->sr_uuid) != NULL)
+			continue;
+
+		if (manifest && !slsstore_referenced(ids, nids, rec->sr_uuid))
+			continue;
+
+		error = slsstore_addrec(ep, rec);
+		if (error != 0)
+			goto out;
+		rec->sr_refs += 1;
+	}
+
+	qsort(ep->ep_recs, ep->ep_nrecs, sizeof(*ep->ep_recs),
+	    slsstore_rec_cmp);
+
+	/* The sender forgets the epoch once we ack, so get it on disk. */
+	error = slsstore_syncsegs(part, ep->ep_firstseg);
+	if (error != 0)
+		goto out;
+
+	error = slsstore_writeidx(part->sp_rootfd, ep);
+	if (error != 0)
+		goto out;
+
+	error = slsstore_addepoch(part, ep->ep_epoch);
+	if (error != 0)
+		goto out;
+
+	qsort(part->sp_epochs, part->sp_nepochs, sizeof(*part->sp_epochs),
+	    slsstore_u64cmp);
+
+	/* Only newer epochs are the base of the next ones. */
+	old = ep;
+	if (latest == NULL || ep->ep_epoch > latest->ep_epoch) {
+		old = latest;
+		part->sp_latest = ep;
+	}
+
+	slsstore_retire(part);
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	slsstore_epoch_free(old);
+
+	return (0);
+
+out:
+	pthread_mutex_unlock(&part->sp_mtx);
+	slsstore_epoch_free(ep);
+
+	return (error);
+}
+
+/* Add the extent to the runs of the file. */
+static void
+slsstore_runcat(struct sls_filerun *runs, size_t *nrunsp,
+    struct slsstore_ext *ext, uint64_t flags)
+{
+	struct sls_filerun *last;
+
+	/* Extents split across segments are one run in the file. */
+	if (*nrunsp > 0) {
+		last = &runs[*nrunsp - 1];
+		if (last->pindex + last->npages == ext->ex_pindex &&
+		    last->flags == flags) {
+			last->npages += ext->ex_npages;
+			return;
+		}
+	}
+
+	runs[(*nrunsp)++] = (struct sls_filerun) {
+		.pindex = ext->ex_pindex,
+		.npages = ext->ex_npages,
+		.flags = flags,
+	};
+}
+
+/*
+ * Recreate the epoch in the layout of the file backend, so that the
+ * partition can be restored from it. Each page is read exactly once from
+ * where the index says it is.
+ */
+static int
+slsstore_materialize_rec(
+    struct slssrv_part *part, int epochfd, struct slsstore_rec *rec)
+{
+	struct sls_filerun *runs = NULL;
+	uint64_t segid = SLSSTORE_DEAD;
+	struct slsstore_ext *ext;
+	struct sls_filehdr hdr;
+	size_t nruns = 0, i;
+	char name[NAME_MAX];
+	uint64_t done, count;
+	int segfd = -1;
+	int error;
+	char *buf;
+	int fd;
+
+	snprintf(name, sizeof(name), "%lu", (unsigned long)rec->sr_uuid);
+	fd = openat(epochfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return (errno);
+
+	buf = malloc(SLSSTORE_IOPAGES * PAGE_SIZE);
+	runs = malloc((rec->sr_nexts + 1) * sizeof(*runs));
+	if (buf == NULL || runs == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	error = slsstore_pwrite(fd, rec->sr_meta, rec->sr_metalen, 0);
+	if (error != 0 || rec->sr_rectype != SLOSREC_VMOBJ)
+		goto out;
+
+	for (i = 0; i < rec->sr_nexts; i++) {
+		ext = &rec->sr_exts[i];
+		if ((ext->ex_pindex + ext->ex_npages + SLOS_OBJOFF) *
+			PAGE_SIZE >
+		    rec->sr_totalsize) {
+			error = EIO;
+			goto out;
+		}
+
+		/* Zero extents have no data, only a run in the file. */
+		if (ext->ex_seg == SLSSTORE_ZEROSEG) {
+			slsstore_runcat(runs, &nruns, ext, SLSFILERUN_ZERO);
+			continue;
+		}
+
+		/*
+		 * The server may have compacted the store since we opened
+		 * it, so go by the segment names instead of our list.
+		 */
+		if (ext->ex_seg != segid) {
+			if (segfd >= 0)
+				close(segfd);
+
+			segid = ext->ex_seg;
+			snprintf(name, sizeof(name), "seg.%lu",
+			    (unsigned long)segid);
+			segfd = openat(part->sp_rootfd, name, O_RDONLY);
+			if (segfd < 0) {
+				error = errno;
+				goto out;
+			}
+		}
+
+		for (done = 0; done < ext->ex_npages; done += count) {
+			count = ext->ex_npages - done;
+			if (count > SLSSTORE_IOPAGES)
+				count = SLSSTORE_IOPAGES;
+
+			error = slsstore_pread(segfd, buf, count * PAGE_SIZE,
+			    (ext->ex_blk + done) * PAGE_SIZE);
+			if (error != 0)
+				goto out;
+
+			error = slsstore_pwrite(fd, buf, count * PAGE_SIZE,
+			    (ext->ex_pindex + done + SLOS_OBJOFF) * PAGE_SIZE);
+			if (error != 0)
+				goto out;
+		}
+
+		slsstore_runcat(runs, &nruns, ext, 0);
+	}
+
+	hdr.magic = SLSFILE_MAGIC;
+	hdr.version = SLSFILE_VERSION;
+	hdr.runoff = rec->sr_totalsize;
+	hdr.nruns = nruns;
+
+	error = slsstore_pwrite(
+	    fd, (char *)runs, nruns * sizeof(*runs), hdr.runoff);
+	if (error != 0)
+		goto out;
+
+	error = slsstore_pwrite(fd, (char *)&hdr, sizeof(hdr), rec->sr_metalen);
+
+out:
+	if (segfd >= 0)
+		close(segfd);
+	free(runs);
+	free(buf);
+	close(fd);
+
+	return (error);
+}
+
+int
+slsstore_materialize(struct slssrv_part *part, uint64_t epoch)
+{
+	struct slsstore_epoch *ep = NULL;
+	char name[NAME_MAX];
+	int epochfd;
+	int error;
+	size_t i;
+
+	/* Keep compaction from moving the pages under us. */
+	if (flock(part->sp_lockfd, LOCK_SH) != 0)
+		return (errno);
+
+	error = slsstore_readidx(part->sp_rootfd, epoch, &ep);
+	if (error != 0)
+		goto out;
+
+	snprintf(name, sizeof(name), "%lu", (unsigned long)epoch);
+	if (mkdirat(part->sp_rootfd, name, 0770) != 0 && errno != EEXIST) {
+		error = errno;
+		goto out;
+	}
+
+	epochfd = openat(part->sp_rootfd, name, O_RDONLY | O_DIRECTORY);
+	if (epochfd < 0) {
+		error = errno;
+		goto out;
+	}
+
+	for (i = 0; i < ep->ep_nrecs; i++) {
+		error = slsstore_materialize_rec(part, epochfd, ep->ep_recs[i]);
+		if (error != 0)
+			break;
+	}
+
+	close(epochfd);
+
+out:
+	slsstore_epoch_free(ep);
+	flock(part->sp_lockfd, LOCK_UN);
+
+	return (error);
+}
+
+/* Find where compaction moved the block, if it did. */
+static struct slsstore_remap *
+slsstore_remap_find(struct slsstore_remap *remaps, size_t nremaps, uint64_t seg)
+{
+	size_t i;
+
+	for (i = 0; i < nremaps; i++) {
+		if (remaps[i].rm_victim == seg)
+			return (&remaps[i]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Point the record to the new location of its pages. Returns whether the
+ * record changed. Blocks that were live are contiguous where we moved
+ * them unless a new segment was started, so extents rarely split.
+ */
+static int
+slsstore_remap_rec(struct slsstore_rec *rec, struct slsstore_remap *remaps,
+    size_t nremaps, bool *changedp)
+{
+	struct slsstore_ext *exts, *ext;
+	struct slsstore_remap *rm;
+	size_t nexts = 0, cap;
+	uint64_t k, blk;
+	size_t i;
+
+	*changedp = false;
+	for (i = 0; i < rec->sr_nexts; i++) {
+		if (slsstore_remap_find(remaps, nremaps,
+			rec->sr_exts[i].ex_seg) != NULL) {
+			*changedp = true;
+			break;
+		}
+	}
+
+	if (!*changedp)
+		return (0);
+
+	/* Worst case every page becomes its own extent. */
+	cap = 0;
+	for (i = 0; i < rec->sr_nexts; i++)
+		cap += rec->sr_exts[i].ex_npages;
+
+	exts = malloc((cap + 1) * sizeof(*exts));
+	if (exts == NULL)
+		return (ENOMEM);
+
+	for (i = 0; i < rec->sr_nexts; i++) {
+		ext = &rec->sr_exts[i];
+		rm = slsstore_remap_find(remaps, nremaps, ext->ex_seg);
+		if (rm == NULL) {
+			slsstore_extcat(exts, &nexts, ext->ex_pindex,
+			    ext->ex_npages, ext->ex_seg, ext->ex_blk);
+			continue;
+		}
+
+		for (k = 0; k < ext->ex_npages; k++) {
+			blk = ext->ex_blk + k;
+			if (blk >= rm->rm_nblks ||
+			    rm->rm_seg[blk] == SLSSTORE_DEAD) {
+				free(exts);
+				return (EIO);
+			}
+
+			slsstore_extcat(exts, &nexts, ext->ex_pindex + k, 1,
+			    rm->rm_seg[blk], rm->rm_blk[blk]);
+		}
+	}
+
+	free(rec->sr_exts);
+	rec->sr_exts = exts;
+	rec->sr_nexts = nexts;
+	rec->sr_extcap = cap + 1;
+
+	return (0);
+}
+
+/* Mark the blocks of the victims that an epoch still uses. */
+static void
+slsstore_markepoch(struct slsstore_epoch *ep, struct slsstore_remap *remaps,
+    size_t nremaps)
+{
+	struct slsstore_remap *rm;
+	struct slsstore_ext *ext;
+	uint64_t k, blk;
+	size_t i, j;
+
+	for (i = 0; i < ep->ep_nrecs; i++) {
+		for (j = 0; j < ep->ep_recs[i]->sr_nexts; j++) {
+			ext = &ep->ep_recs[i]->sr_exts[j];
+			rm = slsstore_remap_find(remaps, nremaps, ext->ex_seg);
+			if (rm == NULL)
+				continue;
+
+			for (k = 0; k < ext->ex_npages; k++) {
+				blk = ext->ex_blk + k;
+				if (blk >= rm->rm_nblks ||
+				    rm->rm_seg[blk] != SLSSTORE_DEAD)
+					continue;
+
+				/* Live, we fill in the location later. */
+				rm->rm_seg[blk] = 0;
+				rm->rm_live += 1;
+			}
+		}
+	}
+}
+
+/* Start a new segment for compaction output. */
+static int
+slsstore_compact_newseg(
+    struct slssrv_part *part, struct slsstore_seglist *outs)
+{
+	struct slsstore_seg *out;
+	char name[NAME_MAX];
+	int error;
+
+	out = malloc(sizeof(*out));
+	if (out == NULL)
+		return (ENOMEM);
+
+	pthread_mutex_lock(&part->sp_mtx);
+	out->sg_id = part->sp_nextseg++;
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	out->sg_nblks = 0;
+	snprintf(name, sizeof(name), "seg.%lu", (unsigned long)out->sg_id);
+	out->sg_fd = openat(
+	    part->sp_rootfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (out->sg_fd < 0) {
+		error = errno;
+		free(out);
+		return (error);
+	}
+
+	LIST_INSERT_HEAD(outs, out, sg_next);
+
+	return (0);
+}
+
+/* Copy the live blocks of a victim to the output segments. */
+static int
+slsstore_compact_copy(struct slssrv_part *part, struct slsstore_remap *rm,
+    struct slsstore_seglist *outs, char *buf)
+{
+	struct slsstore_seg *out;
+	char name[NAME_MAX];
+	uint64_t blk, count, k;
+	int victimfd;
+	int error = 0;
+
+	snprintf(name, sizeof(name), "seg.%lu", (unsigned long)rm->rm_victim);
+	victimfd = openat(part->sp_rootfd, name, O_RDONLY);
+	if (victimfd < 0)
+		return (errno);
+
+	for (blk = 0; blk < rm->rm_nblks; blk += count) {
+		count = 1;
+		if (rm->rm_seg[blk] == SLSSTORE_DEAD)
+			continue;
+
+		out = LIST_FIRST(outs);
+		if (out == NULL || out->sg_nblks == SLSSTORE_SEGPAGES) {
+			error = slsstore_compact_newseg(part, outs);
+			if (error != 0)
+				break;
+			out = LIST_FIRST(outs);
+		}
+
+		/* Copy a run of live blocks that fits the output. */
+		while (blk + count < rm->rm_nblks &&
+		    rm->rm_seg[blk + count] != SLSSTORE_DEAD &&
+		    count < SLSSTORE_IOPAGES &&
+		    out->sg_nblks + count < SLSSTORE_SEGPAGES)
+			count += 1;
+
+		error = slsstore_pread(
+		    victimfd, buf, count * PAGE_SIZE, blk * PAGE_SIZE);
+		if (error != 0)
+			break;
+
+		error = slsstore_pwrite(out->sg_fd, buf, count * PAGE_SIZE,
+		    out->sg_nblks * PAGE_SIZE);
+		if (error != 0)
+			break;
+
+		for (k = 0; k < count; k++) {
+			rm->rm_seg[blk + k] = out->sg_id;
+			rm->rm_blk[blk + k] = out->sg_nblks + k;
+		}
+
+		out->sg_nblks += count;
+	}
+
+	close(victimfd);
+
+	return (error);
+}
+
+/*
+ * Point all epochs we keep to the new copies of the live blocks, then get
+ * rid of the victims. Concurrent materializations hold the lock file, and
+ * nothing else reads segments without the partition lock.
+ */
+static int
+slsstore_compact_swap(struct slssrv_part *part, struct slsstore_remap *remaps,
+    size_t nremaps, struct slsstore_seglist *outs)
+{
+	struct slsstore_epoch *ep;
+	struct slsstore_seg *seg;
+	char name[NAME_MAX];
+	bool changed, dirty;
+	int error = 0;
+	size_t i, j;
+
+	if (flock(part->sp_lockfd, LOCK_EX) != 0)
+		return (errno);
+
+	/* The indices we rewrite must not point to data we can lose. */
+	LIST_FOREACH(seg, outs, sg_next) {
+		if (fsync(seg->sg_fd) != 0) {
+			error = errno;
+			flock(part->sp_lockfd, LOCK_UN);
+			return (error);
+		}
+	}
+
+	pthread_mutex_lock(&part->sp_mtx);
+
+	/* The copies are complete, so they are safe to use even on error. */
+	while (!LIST_EMPTY(outs)) {
+		seg = LIST_FIRST(outs);
+		LIST_REMOVE(seg, sg_next);
+		LIST_INSERT_HEAD(&part->sp_segs, seg, sg_next);
+	}
+
+	for (i = 0; i < part->sp_nepochs && error == 0; i++) {
+		error = slsstore_readidx(
+		    part->sp_rootfd, part->sp_epochs[i], &ep);
+		if (error != 0)
+			break;
+
+		dirty = false;
+		for (j = 0; j < ep->ep_nrecs && error == 0; j++) {
+			error = slsstore_remap_rec(
+			    ep->ep_recs[j], remaps, nremaps, &changed);
+			dirty = dirty || changed;
+		}
+
+		if (error == 0 && dirty)
+			error = slsstore_writeidx(part->sp_rootfd, ep);
+
+		slsstore_epoch_free(ep);
+	}
+
+	ep = part->sp_latest;
+	for (j = 0; ep != NULL && j < ep->ep_nrecs && error == 0; j++)
+		error = slsstore_remap_rec(
+		    ep->ep_recs[j], remaps, nremaps, &changed);
+
+	/* Some epochs may still use the victims, keep them around. */
+	if (error != 0)
+		goto out;
+
+	for (i = 0; i < nremaps; i++) {
+		LIST_FOREACH(seg, &part->sp_segs, sg_next) {
+			if (seg->sg_id == remaps[i].rm_victim)
+				break;
+		}
+
+		if (seg != NULL) {
+			LIST_REMOVE(seg, sg_next);
+			close(seg->sg_fd);
+			free(seg);
+		}
+
+		snprintf(name, sizeof(name), "seg.%lu",
+		    (unsigned long)remaps[i].rm_victim);
+		if (unlinkat(part->sp_rootfd, name, 0) != 0)
+			perror("unlinkat");
+	}
+
+out:
+	pthread_mutex_unlock(&part->sp_mtx);
+	flock(part->sp_lockfd, LOCK_UN);
+
+	return (error);
+}
+
+/*
+ * Reclaim the space of pages no epoch we keep uses anymore. Segments that
+ * are mostly dead have their live blocks copied out and are removed. The
+ * segments being written to are left alone, and neither can new epochs
+ * start using the pages of the victims, because they only inherit pages
+ * from the latest epoch, whose pages we consider live.
+ */
+static int
+slsstore_compact(struct slssrv_part *part)
+{
+	struct slsstore_seglist outs = LIST_HEAD_INITIALIZER(outs);
+	struct slsstore_remap *remaps = NULL, *rm;
+	size_t nremaps = 0, nepochs = 0, i, j;
+	struct slsstore_epoch *ep;
+	struct slsstore_seg *seg;
+	uint64_t *epochs = NULL;
+	char name[NAME_MAX];
+	char *buf = NULL;
+	uint64_t minseg;
+	int error = 0;
+
+	pthread_mutex_lock(&part->sp_mtx);
+
+	minseg = (part->sp_active != NULL) ? part->sp_active->sg_id :
+					     part->sp_nextseg;
+	TAILQ_FOREACH(ep, &part->sp_builds, ep_next) {
+		if (ep->ep_firstseg < minseg)
+			minseg = ep->ep_firstseg;
+	}
+
+	LIST_FOREACH(seg, &part->sp_segs, sg_next)
+		nremaps += 1;
+
+	remaps = calloc(nremaps + 1, sizeof(*remaps));
+	epochs = malloc((part->sp_nepochs + 1) * sizeof(*epochs));
+	if (remaps == NULL || epochs == NULL) {
+		pthread_mutex_unlock(&part->sp_mtx);
+		error = ENOMEM;
+		goto out;
+	}
+
+	nremaps = 0;
+	LIST_FOREACH(seg, &part->sp_segs, sg_next) {
+		if (seg->sg_id >= minseg)
+			continue;
+
+		rm = &remaps[nremaps++];
+		rm->rm_victim = seg->sg_id;
+		rm->rm_nblks = seg->sg_nblks;
+	}
+
+	nepochs = part->sp_nepochs;
+	memcpy(epochs, part->sp_epochs, nepochs * sizeof(*epochs));
+
+	pthread_mutex_unlock(&part->sp_mtx);
+
+	for (i = 0; i < nremaps; i++) {
+		rm = &remaps[i];
+		rm->rm_seg = malloc((rm->rm_nblks + 1) * sizeof(uint64_t));
+		rm->rm_blk = malloc((rm->rm_nblks + 1) * sizeof(uint64_t));
+		if (rm->rm_seg == NULL || rm->rm_blk == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+
+		for (j = 0; j < rm->rm_nblks; j++)
+			rm->rm_seg[j] = SLSSTORE_DEAD;
+	}
+
+	/* Find the blocks the epochs we keep use. */
+	for (i = 0; i < nepochs; i++) {
+		error = slsstore_readidx(part->sp_rootfd, epochs[i], &ep);
+		/* Retired since we looked. */
+		if (error == ENOENT)
+			continue;
+		if (error != 0)
+			goto out;
+
+		slsstore_markepoch(ep, remaps, nremaps);
+		slsstore_epoch_free(ep);
+	}
+
+	/* Only segments at least half dead are worth copying. */
+	for (i = 0, j = 0; i < nremaps; i++) {
+		rm = &remaps[i];
+		if (2 * rm->rm_live > rm->rm_nblks) {
+			free(rm->rm_seg);
+			free(rm->rm_blk);
+			continue;
+		}
+
+		remaps[j++] = *rm;
+	}
+
+	nremaps = j;
+	if (nremaps == 0)
+		goto out;
+
+	buf = malloc(SLSSTORE_IOPAGES * PAGE_SIZE);
+	if (buf == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nremaps; i++) {
+		error = slsstore_compact_copy(part, &remaps[i], &outs, buf);
+		if (error != 0)
+			goto out;
+	}
+
+	error = slsstore_compact_swap(part, remaps, nremaps, &outs);
+
+out:
+	/* Throw away any copies we did not use. */
+	while (!LIST_EMPTY(&outs)) {
+		seg = LIST_FIRST(&outs);
+		LIST_REMOVE(seg, sg_next);
+		close(seg->sg_fd);
+		snprintf(
+		    name, sizeof(name), "seg.%lu", (unsigned long)seg->sg_id);
+		unlinkat(part->sp_rootfd, name, 0);
+		free(seg);
+	}
+
+	for (i = 0; remaps != NULL && i < nremaps; i++) {
+		free(remaps[i].rm_seg);
+		free(remaps[i].rm_blk);
+	}
+
+	free(remaps);
+	free(epochs);
+	free(buf);
+
+	return (error);
+}
+
+static void *
+slsstore_compactor(void *arg)
+{
+	struct slsmsg_server *srv = arg;
+	struct slssrv_part *part;
+	int error;
+
+	pthread_mutex_lock(&srv->slssrv_cmtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&srv->slssrv_compactq) && !srv->slssrv_cexit)
+			pthread_cond_wait(&srv->slssrv_ccv, &srv->slssrv_cmtx);
+
+		if (srv->slssrv_cexit)
+			break;
+
+		part = TAILQ_FIRST(&srv->slssrv_compactq);
+		TAILQ_REMOVE(&srv->slssrv_compactq, part, sp_compactq);
+		pthread_mutex_unlock(&srv->slssrv_cmtx);
+
+		error = slsstore_compact(part);
+		if (error != 0)
+			fprintf(stderr, "Compacting partition %lu failed: %s\n",
+			    (unsigned long)part->sp_oid, strerror(error));
+
+		pthread_mutex_lock(&part->sp_mtx);
+		part->sp_compacting = false;
+		pthread_mutex_unlock(&part->sp_mtx);
+
+		pthread_mutex_lock(&srv->slssrv_cmtx);
+	}
+	pthread_mutex_unlock(&srv->slssrv_cmtx);
+
+	return (NULL);
+}
+
+int
+slsstore_compactor_start(struct slsmsg_server *srv)
+{
+	pthread_mutex_init(&srv->slssrv_cmtx, NULL);
+	pthread_cond_init(&srv->slssrv_ccv, NULL);
+	TAILQ_INIT(&srv->slssrv_compactq);
+	srv->slssrv_cexit = false;
+
+	return (pthread_create(
+	    &srv->slssrv_compactor, NULL, slsstore_compactor, srv));
+}
+
+void
+slsstore_compactor_stop(struct slsmsg_server *srv)
+{
+	pthread_mutex_lock(&srv->slssrv_cmtx);
+	srv->slssrv_cexit = true;
+	pthread_cond_signal(&srv->slssrv_ccv);
+	pthread_mutex_unlock(&srv->slssrv_cmtx);
+
+	pthread_join(srv->slssrv_compactor, NULL);
+
+	pthread_mutex_destroy(&srv->slssrv_cmtx);
+	pthread_cond_destroy(&srv->slssrv_ccv);
+}
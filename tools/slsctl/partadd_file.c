@@ -22,6 +22,7 @@ static struct option partadd_file_longopts[] = {
 	{ "filename", required_argument, NULL, 'f' },
 	{ "ignore unlinked files", required_argument, NULL, 'i' },
 	{ "oid", required_argument, NULL, 'o' },
+	{ "pipeline", no_argument, NULL, 'P' },
 	{ "period", required_argument, NULL, 't' },
 	{ NULL, no_argument, NULL, 0 },
 };
@@ -49,7 +50,7 @@ partadd_file_main(int argc, char *argv[])
 		.attr_amplification = 1,
 	};
 
-	while ((opt = getopt_long(argc, argv, "df:io:t:", partadd_file_longopts,
+	while ((opt = getopt_long(argc, argv, "df:io:Pt:", partadd_file_longopts,
 		    NULL)) != -1) {
 		switch (opt) {
 		case 'd':
@@ -73,6 +74,10 @@ partadd_file_main(int argc, char *argv[])
 			oid = strtol(optarg, NULL, 10);
 			break;
 
+		case 'P':
+			attr.attr_flags |= SLSATTR_PIPELINE;
+			break;
+
 		case 't':
 			attr.attr_period = strtol(optarg, NULL, 10);
 			break;
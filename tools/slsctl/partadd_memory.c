@@ -18,9 +18,12 @@
 #include "partadd.h"
 
 static struct option partadd_memory_longopts[] = {
+	{ "stop time budget", required_argument, NULL, 'b' },
+	{ "minimum period", required_argument, NULL, 'm' },
 	{ "oid", required_argument, NULL, 'o' },
 	{ "period", required_argument, NULL, 't' },
 	{ "ignore unlinked files", required_argument, NULL, 'i' },
+	{ "warm pool", required_argument, NULL, 'w' },
 	{ NULL, no_argument, NULL, 0 },
 };
 
@@ -47,13 +50,23 @@ partadd_memory_main(int argc, char *argv[])
 		.attr_amplification = 1,
 	};
 
-	while ((opt = getopt_long(argc, argv, "io:t:", partadd_memory_longopts,
-		    NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "b:im:o:t:w:",
+		    partadd_memory_longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'b':
+			attr.attr_stopbudget = strtol(optarg, NULL, 10);
+			break;
+
 		case 'i':
 			attr.attr_flags |= SLSATTR_IGNUNLINKED;
 			break;
 
+		case 'm':
+			/* A minimum period makes the period adaptive. */
+			attr.attr_period_min = strtol(optarg, NULL, 10);
+			attr.attr_flags |= SLSATTR_ADAPTIVE;
+			break;
+
 		case 'o':
 			oid = strtol(optarg, NULL, 10);
 			break;
@@ -62,6 +75,11 @@ partadd_memory_main(int argc, char *argv[])
 			attr.attr_period = strtol(optarg, NULL, 10);
 			break;
 
+		case 'w':
+			/* Metropolis instances restored ahead of time. */
+			attr.attr_poolsize = strtol(optarg, NULL, 10);
+			break;
+
 		default:
 			printf("Invalid option '%c'\n", opt);
 			partadd_memory_usage();
@@ -19,14 +19,20 @@
 
 static struct option partadd_slos_longopts[] = {
 	{ "amplification", required_argument, NULL, 'a' },
+	{ "stop time budget", required_argument, NULL, 'b' },
 	{ "cached restore", required_argument, NULL, 'c' },
 	{ "delta", no_argument, NULL, 'd' },
+	{ "dedup", no_argument, NULL, 'D' },
 	{ "precopy", required_argument, NULL, 'e' },
 	{ "ignore unlinked files", required_argument, NULL, 'i' },
 	{ "lazy restore", required_argument, NULL, 'l' },
+	{ "minimum period", required_argument, NULL, 'm' },
 	{ "oid", required_argument, NULL, 'o' },
 	{ "prefault", required_argument, NULL, 'p' },
+	{ "pipeline", no_argument, NULL, 'P' },
 	{ "period", required_argument, NULL, 't' },
+	{ "warm pool", required_argument, NULL, 'w' },
+	{ "compress", no_argument, NULL, 'z' },
 	{ NULL, no_argument, NULL, 0 },
 };
 
@@ -53,13 +59,18 @@ partadd_slos_main(int argc, char *argv[])
 		.attr_amplification = 1,
 	};
 
-	while ((opt = getopt_long(argc, argv,
-		    "a:cdeilo:pt:", partadd_slos_longopts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "a:b:cdDeilm:o:pPt:w:z",
+		    partadd_slos_longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'a':
 			/* Checkpoint amplification factor. */
 			attr.attr_amplification = strtol(optarg, NULL, 10);
 			break;
+
+		case 'b':
+			attr.attr_stopbudget = strtol(optarg, NULL, 10);
+			break;
+
 		case 'c':
 			/* Prefaults only make sense for lazy restores. */
 			attr.attr_flags |= (SLSATTR_CACHEREST |
@@ -70,6 +81,10 @@ partadd_slos_main(int argc, char *argv[])
 			attr.attr_mode = SLS_DELTA;
 			break;
 
+		case 'D':
+			attr.attr_flags |= SLSATTR_DEDUP;
+			break;
+
 		case 'e':
 			/*
 			 * Due to the way we mark the hot set, we need to
@@ -87,6 +102,12 @@ partadd_slos_main(int argc, char *argv[])
 			attr.attr_flags |= SLSATTR_LAZYREST;
 			break;
 
+		case 'm':
+			/* A minimum period makes the period adaptive. */
+			attr.attr_period_min = strtol(optarg, NULL, 10);
+			attr.attr_flags |= SLSATTR_ADAPTIVE;
+			break;
+
 		case 'o':
 			oid = strtol(optarg, NULL, 10);
 			break;
@@ -95,10 +116,23 @@ partadd_slos_main(int argc, char *argv[])
 			attr.attr_flags |= SLSATTR_PREFAULT;
 			break;
 
+		case 'P':
+			attr.attr_flags |= SLSATTR_PIPELINE;
+			break;
+
 		case 't':
 			attr.attr_period = strtol(optarg, NULL, 10);
 			break;
 
+		case 'w':
+			/* Metropolis instances restored ahead of time. */
+			attr.attr_poolsize = strtol(optarg, NULL, 10);
+			break;
+
+		case 'z':
+			attr.attr_flags |= SLSATTR_COMPRESS;
+			break;
+
 		default:
 			printf("Invalid option '%c'\n", opt);
 			partadd_slos_usage();
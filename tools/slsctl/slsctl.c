@@ -38,6 +38,7 @@ struct command {
 	{ "mountsnap", "ms", &mountsnap_usage, &mountsnap_main },
 	{ "spawn", "sp", &spawn_usage, &spawn_main },
 	{ "pgresident", "pg", &pgresident_usage, &pgresident_main },
+	{ "stats", "st", &stats_usage, &stats_main },
 	{ "help", "h", NULL, &cmd_help }, { "exit", "q", NULL, &cmd_exit },
 	{ NULL, NULL, NULL, NULL } };
 
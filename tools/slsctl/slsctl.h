@@ -37,4 +37,7 @@ int spawn_main(int argc, char *argv[]);
 void pgresident_usage(void);
 int pgresident_main(int argc, char *argv[]);
 
+void stats_usage(void);
+int stats_main(int argc, char *argv[]);
+
 #endif /* _SLSCTL_H_ */
@@ -0,0 +1,102 @@
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <sls.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct option stats_longopts[] = {
+	{ "oid", required_argument, NULL, 'o' },
+	{ NULL, no_argument, NULL, 0 },
+};
+
+void
+stats_usage(void)
+{
+	printf("Usage: slsctl stats -o oid\n");
+}
+
+/* Upper bound in ns of the bucket holding the given percentile. */
+static uint64_t
+stats_percentile(struct sls_histogram *hist, int pct)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	target = (hist->hist_count * pct + 99) / 100;
+	if (target == 0)
+		return (0);
+
+	for (i = 0; i < SLSHIST_BUCKETS; i++) {
+		seen += hist->hist_buckets[i];
+		if (seen >= target)
+			return (1ULL << i);
+	}
+
+	return (0);
+}
+
+static void
+stats_print(const char *phase, struct sls_histogram *hist)
+{
+	uint64_t mean;
+
+	mean = (hist->hist_count > 0) ? hist->hist_sum / hist->hist_count : 0;
+
+	printf("%-12s %10lu %12lu %12lu %12lu %12lu\n", phase,
+	    hist->hist_count, mean / 1000, stats_percentile(hist, 50) / 1000,
+	    stats_percentile(hist, 90) / 1000,
+	    stats_percentile(hist, 99) / 1000);
+}
+
+int
+stats_main(int argc, char *argv[])
+{
+	const char *phasenames[] = SLSPHASE_NAMES;
+	struct sls_histogram hist;
+	char name[128];
+	uint64_t oid = 0;
+	size_t len;
+	int opt;
+	int i;
+
+	while ((opt = getopt_long(argc, argv, "o:", stats_longopts, NULL)) !=
+	    -1) {
+		switch (opt) {
+		case 'o':
+			oid = strtol(optarg, NULL, 10);
+			break;
+		default:
+			stats_usage();
+			return (0);
+		}
+	}
+
+	if (optind != argc || oid == 0) {
+		stats_usage();
+		return (0);
+	}
+
+	printf("%-12s %10s %12s %12s %12s %12s\n", "phase", "count",
+	    "mean (us)", "p50 (us)", "p90 (us)", "p99 (us)");
+
+	for (i = 0; i < SLSPHASES; i++) {
+		snprintf(name, sizeof(name), "aurora.partition.%lu.%s.histogram",
+		    oid, phasenames[i]);
+
+		len = sizeof(hist);
+		if (sysctlbyname(name, &hist, &len, NULL, 0) != 0) {
+			fprintf(stderr, "could not read %s: %s\n", name,
+			    strerror(errno));
+			return (1);
+		}
+
+		stats_print(phasenames[i], &hist);
+	}
+
+	return (0);
+}